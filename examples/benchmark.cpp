@@ -0,0 +1,284 @@
+// Measures the row converters of every instruction set and FrameProcessor on synthetic frames,
+// no camera or window is needed:
+//
+//     g++ -std=c++17 -O2 -I../include benchmark.cpp -o benchmark -pthread
+//     ./benchmark [milliseconds per case]
+//
+// Add -DWCCAPI_USE_LIBJPEG -ljpeg to measure MJPEG decoding too
+
+#define WCCAPI_IMPL
+#include "../include/wccapi.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+struct Size
+{
+    uint32_t nWidth;
+    uint32_t nHeight;
+    const char* sName;
+};
+
+static const Size c_Sizes[] = {
+    { 320, 240, "320x240" },
+    { 1280, 720, "720p" },
+    { 1920, 1080, "1080p" },
+    { 3840, 2160, "4K" }
+};
+
+static const wcc::VideoFormat c_Formats[] = {
+    wcc::VideoFormat::Rgb32,
+    wcc::VideoFormat::Rgb24,
+    wcc::VideoFormat::Yuy2,
+    wcc::VideoFormat::Nv12,
+    wcc::VideoFormat::Bgra32,
+    wcc::VideoFormat::Gray8
+};
+
+static int64_t s_nMinTime = 200 * 1000000LL;
+
+const char* GetFormatName(wcc::VideoFormat nFormat)
+{
+    switch (nFormat)
+    {
+    case wcc::VideoFormat::Rgb32: return "RGB32";
+    case wcc::VideoFormat::Rgb24: return "RGB24";
+    case wcc::VideoFormat::Yuy2: return "YUY2";
+    case wcc::VideoFormat::Nv12: return "NV12";
+    case wcc::VideoFormat::Bgra32: return "BGRA";
+    case wcc::VideoFormat::Gray8: return "Gray8";
+    case wcc::VideoFormat::Mjpeg: return "MJPEG";
+    default: return "?";
+    }
+}
+
+const char* GetIsaName(wcc::Isa nIsa)
+{
+    switch (nIsa)
+    {
+    case wcc::Isa::Scalar: return "scalar";
+    case wcc::Isa::Sse2: return "sse2";
+    case wcc::Isa::Avx2: return "avx2";
+    case wcc::Isa::Neon: return "neon";
+    }
+
+    return "?";
+}
+
+const char* GetModeName(wcc::ScaleMode nMode)
+{
+    switch (nMode)
+    {
+    case wcc::ScaleMode::Nearest: return "nearest";
+    case wcc::ScaleMode::Bilinear: return "bilinear";
+    case wcc::ScaleMode::Area: return "area";
+    }
+
+    return "?";
+}
+
+// SSE2 is always there if the CPU has AVX2
+bool IsIsaSupported(wcc::Isa nIsa)
+{
+    wcc::Isa nBest = wcc::GetBestIsa();
+    return nIsa == wcc::Isa::Scalar || nIsa == nBest || (nIsa == wcc::Isa::Sse2 && nBest == wcc::Isa::Avx2);
+}
+
+// A frame with some texture, so the kernels don't run on constant data
+std::vector<uint8_t> MakeFrame(wcc::VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, uint32_t& nStride)
+{
+    nStride = nWidth * wcc::GetBytesPerPixel(nFormat);
+
+    std::vector<uint8_t> vecFrame(wcc::GetFrameSize(nFormat, nHeight, nStride));
+
+    for (size_t i = 0; i < vecFrame.size(); i++)
+        vecFrame[i] = (uint8_t)(i * 7 + (i >> 11) * 13);
+
+    return vecFrame;
+}
+
+// Runs fn until it took at least s_nMinTime, returns nanoseconds per run
+template <class Fn>
+double Measure(Fn&& fn)
+{
+    // Warming up the caches and the worker threads
+    fn();
+
+    uint64_t nRuns = 0;
+    int64_t nStart = wcc::GetMonotonicTime();
+    int64_t nElapsed = 0;
+
+    do
+    {
+        fn();
+        nRuns++;
+        nElapsed = wcc::GetMonotonicTime() - nStart;
+    }
+    while (nElapsed < s_nMinTime || nRuns < 3);
+
+    return (double)nElapsed / (double)nRuns;
+}
+
+void Report(const char* sSize, const char* sFormat, const char* sImpl, double fTime, uint64_t nPixels, uint64_t nBytes)
+{
+    printf("%-8s %-6s %-26s %8.3f ns/px %8.2f GB/s %10.1f fps\n",
+        sSize, sFormat, sImpl,
+        fTime / (double)nPixels,
+        (double)nBytes / fTime,
+        1e9 / fTime);
+}
+
+void BenchConverters(const Size& size)
+{
+    for (wcc::VideoFormat nFormat : c_Formats)
+    {
+        uint32_t nStride;
+        std::vector<uint8_t> vecFrame = MakeFrame(nFormat, size.nWidth, size.nHeight, nStride);
+        wcc::FrameView view = wcc::MakeFrameView(nFormat, size.nWidth, size.nHeight, vecFrame.data(), nStride);
+
+        std::vector<uint8_t> vecRgba((size_t)size.nWidth * size.nHeight * 4);
+        uint64_t nPixels = (uint64_t)size.nWidth * size.nHeight;
+
+        // Kernels that are the same for several instruction sets are measured once
+        const void* pLast = nullptr;
+
+        for (wcc::Isa nIsa : { wcc::Isa::Scalar, wcc::Isa::Sse2, wcc::Isa::Avx2, wcc::Isa::Neon })
+        {
+            if (!IsIsaSupported(nIsa))
+                continue;
+
+            const void* pKernel = nFormat == wcc::VideoFormat::Nv12 ?
+                (const void*)wcc::GetNv12Converter(nIsa) : (const void*)wcc::GetRowConverter(nFormat, nIsa);
+
+            if (!pKernel || pKernel == pLast)
+                continue;
+
+            pLast = pKernel;
+
+            double fTime = Measure([&]() { wcc::ConvertFrame(view, vecRgba.data(), size.nWidth * 4, nIsa); });
+
+            char sImpl[32];
+            snprintf(sImpl, sizeof(sImpl), "convert %s", GetIsaName(nIsa));
+
+            Report(size.sName, GetFormatName(nFormat), sImpl, fTime, nPixels, vecFrame.size() + vecRgba.size());
+        }
+    }
+}
+
+void BenchProcessor(const Size& size, wcc::VideoFormat nFormat, const uint8_t* pData, size_t nDataSize, uint32_t nStride)
+{
+    wcc::FrameView view = wcc::MakeFrameView(nFormat, size.nWidth, size.nHeight, pData, nStride);
+    view.nDataSize = nDataSize;
+
+    uint64_t nPixels = (uint64_t)size.nWidth * size.nHeight;
+
+    // Single threaded and one thread per core
+    std::vector<uint32_t> vecThreads = { 1 };
+
+    if (std::thread::hardware_concurrency() > 1)
+        vecThreads.push_back(std::thread::hardware_concurrency());
+
+    // Integer factor (2x) and a general one (3x)
+    for (uint32_t nDivisor : { 2, 3 })
+    {
+        uint32_t nDstWidth = size.nWidth / nDivisor;
+        uint32_t nDstHeight = size.nHeight / nDivisor;
+
+        for (wcc::ScaleMode nMode : { wcc::ScaleMode::Nearest, wcc::ScaleMode::Bilinear, wcc::ScaleMode::Area })
+        {
+            for (uint32_t nThreads : vecThreads)
+            {
+                wcc::FrameProcessor processor;
+                processor.SetScaleMode(nMode);
+                processor.SetThreadCount(nThreads);
+
+                if (!processor.Configure(nFormat, size.nWidth, size.nHeight, nDstWidth, nDstHeight))
+                    continue;
+
+                std::vector<uint8_t> vecOutput(processor.GetOutputSize());
+
+                double fTime = Measure([&]() { processor.Process(view, vecOutput.data()); });
+
+                char sImpl[32];
+                snprintf(sImpl, sizeof(sImpl), "1/%u %s %ut", nDivisor, GetModeName(nMode), processor.GetThreadCount());
+
+                Report(size.sName, GetFormatName(nFormat), sImpl, fTime, nPixels, nDataSize + vecOutput.size());
+            }
+        }
+    }
+}
+
+#ifdef WCCAPI_USE_LIBJPEG
+std::vector<uint8_t> EncodeJpeg(const uint8_t* pRgb, uint32_t nWidth, uint32_t nHeight)
+{
+    jpeg_compress_struct info;
+    jpeg_error_mgr error;
+
+    info.err = jpeg_std_error(&error);
+    jpeg_create_compress(&info);
+
+    unsigned char* pBuffer = nullptr;
+    unsigned long nSize = 0;
+    jpeg_mem_dest(&info, &pBuffer, &nSize);
+
+    info.image_width = nWidth;
+    info.image_height = nHeight;
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, 85, TRUE);
+    jpeg_start_compress(&info, TRUE);
+
+    while (info.next_scanline < nHeight)
+    {
+        JSAMPROW pRow = (JSAMPROW)(pRgb + (size_t)info.next_scanline * nWidth * 3);
+        jpeg_write_scanlines(&info, &pRow, 1);
+    }
+
+    jpeg_finish_compress(&info);
+
+    std::vector<uint8_t> vecJpeg(pBuffer, pBuffer + nSize);
+
+    jpeg_destroy_compress(&info);
+    free(pBuffer);
+
+    return vecJpeg;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        s_nMinTime = atoll(argv[1]) * 1000000LL;
+
+    printf("Best instruction set: %s, %u cores\n\n", GetIsaName(wcc::GetBestIsa()), std::thread::hardware_concurrency());
+
+    for (const Size& size : c_Sizes)
+    {
+        BenchConverters(size);
+
+        for (wcc::VideoFormat nFormat : { wcc::VideoFormat::Yuy2, wcc::VideoFormat::Nv12 })
+        {
+            uint32_t nStride;
+            std::vector<uint8_t> vecFrame = MakeFrame(nFormat, size.nWidth, size.nHeight, nStride);
+
+            BenchProcessor(size, nFormat, vecFrame.data(), vecFrame.size(), nStride);
+        }
+
+    #ifdef WCCAPI_USE_LIBJPEG
+        {
+            uint32_t nStride;
+            std::vector<uint8_t> vecRgb = MakeFrame(wcc::VideoFormat::Rgb24, size.nWidth, size.nHeight, nStride);
+            std::vector<uint8_t> vecJpeg = EncodeJpeg(vecRgb.data(), size.nWidth, size.nHeight);
+
+            BenchProcessor(size, wcc::VideoFormat::Mjpeg, vecJpeg.data(), vecJpeg.size(), 0);
+        }
+    #endif
+
+        printf("\n");
+    }
+
+    return 0;
+}
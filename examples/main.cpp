@@ -10,6 +10,11 @@
 #define WWCCAPI_IMPL
 #include "../Include/wwccapi.hpp"
 
+#elif defined(__linux__)
+
+#define LWCCAPI_IMPL
+#include "../Include/lwccapi.hpp"
+
 #endif
 
 class Example : public def::GameEngine
@@ -31,6 +36,10 @@ public:
     wwcc::Capturer capturer;
     #endif
 
+    #ifdef __linux__
+    lwcc::Capturer capturer;
+    #endif
+
     #ifdef __APPLE__
     mwcc::CaptureParams capParams;
     #endif
@@ -61,6 +70,14 @@ protected:
         std::list<std::wstring> devices = wwcc::Capturer::EnumerateDevices();
         capturer.SetBuffer(buffer);
 
+        #elif defined(__linux__)
+
+        if (!capturer.Init(0, width, height, 30))
+            return false;
+
+        std::list<std::wstring> devices = lwcc::Capturer::EnumerateDevices();
+        capturer.SetBuffer(buffer);
+
         #endif
 
         std::wcout << L"Devices: " << std::endl;
@@ -69,7 +86,7 @@ protected:
         for (const auto& name : devices)
             std::wcout << i++ << L") " << name << '\n';
 
-        #ifdef _WIN32
+        #if defined(_WIN32) || defined(__linux__)
         std::cout << "\nResolution: " << capturer.GetFrameWidth() << 'x' << capturer.GetFrameHeight() << std::endl;
         #endif
 
@@ -82,7 +99,7 @@ protected:
 
     bool OnUserUpdate(float) override
     {
-        #ifdef _WIN32
+        #if defined(_WIN32) || defined(__linux__)
         capturer.DoCapture();
         #endif
 
@@ -0,0 +1,1261 @@
+/* GENERAL INFO
+
+    lwccapi.hpp
+
+    +----------------------------------+
+    |             WCCAPI               |
+    |       WebCam Capturing API       |
+    +----------------------------------+
+
+
+    Distributed under GPL3 license
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+                    GNU GENERAL PUBLIC LICENSE
+                      Version 3, 29 June 2007
+
+    Copyright (C) 2007 Free Software Foundation, Inc. <https://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies
+    of this license document, but changing it is not allowed.
+
+
+    Author
+    ~~~~~~
+
+    Alex, aka defini7, Copyright (C) 2025
+
+*/
+
+/* VERSION HISTORY
+
+    0.01: Added support for RGB32, RGB24, YUY2 formats on Windows platform
+    0.02: Added support for macOS
+    0.03: Added support for Linux (V4L2)
+    0.04: Moved pixel format conversion into the platform independent core (wccapi.hpp)
+    0.05: Added LeaseFrame to read frames from the mapped buffers without copying
+    0.06: Added MJPEG (WCCAPI_USE_LIBJPEG), a format is picked only if it has a large enough frame size
+    0.07: DoCapture returns FrameInfo with the timestamp and the sequence number of the buffer
+    0.08: Added GetStats and ResetStats (timings need WCCAPI_ENABLE_STATS)
+    0.09: Added SetRegion, cropped by the driver if it supports the selection API
+    0.10: Added SetChangeDetection to skip frames where nothing has changed
+    0.11: Init ranks every size, pixel format and fps of the device by cost, added GetCaptureMode and GetCaptureModes
+    0.12: Modes are taken from wcc::GetModeCache if it's open, the device is asked only on a miss
+    0.13: Added InitAsync that opens the device on a thread of its own
+    0.14: Added SetTensorFormat for wcc::OutputFormat::Tensor
+    0.15: Added SetColorSpace, YUV frames are converted with the matrix and range the driver reports
+    0.16: Added RequestFrame and NextFrame, frames are waited for on wcc::GetFrameLoop instead of a blocked thread
+*/
+
+#ifndef LWCCAPI_HPP
+#define LWCCAPI_HPP
+
+#ifndef __linux__
+#error You cannot use the Linux version of WCCAPI on this platform
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <list>
+#include <vector>
+
+#ifdef LWCCAPI_IMPL
+#define WCCAPI_IMPL
+#endif
+
+#include "wccapi.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+namespace lwcc
+{
+    using wcc::VideoFormat;
+    using wcc::ScaleMode;
+    using wcc::OutputFormat;
+
+    // All system calls made by the capturer go through this table,
+    // so the streaming loop can be run against a fake device
+    // (e.g. in CI where there is no camera). See SetIoOps.
+    struct IoOps
+    {
+        int (*Open)(const char* sPath, int nFlags);
+        int (*Close)(int nFd);
+        int (*Ioctl)(int nFd, unsigned long nRequest, void* pArg);
+        void* (*Mmap)(void* pAddr, size_t nLength, int nProt, int nFlags, int nFd, off_t nOffset);
+        int (*Munmap)(void* pAddr, size_t nLength);
+        int (*Poll)(pollfd* pFds, nfds_t nFds, int nTimeout);
+    };
+
+    // Replaces the system call table, nullptr restores the default one.
+    // Must be called before any Capturer is created.
+    void SetIoOps(const IoOps* pOps);
+    const IoOps& GetIoOps();
+
+    namespace internal
+    {
+        struct DeviceInfo
+        {
+            std::string sPath;
+            std::string sName;
+        };
+
+        int Xioctl(int nFd, unsigned long nRequest, void* pArg);
+
+        // Returns all /dev/video* nodes that can capture video
+        std::vector<DeviceInfo> ListDevices();
+
+        // VideoFormat::None if the pixel format is unknown, MJPEG needs WCCAPI_USE_LIBJPEG to be converted
+        VideoFormat GetVideoFormat(uint32_t nPixelFormat);
+
+        // The YCbCr encoding and the quantization of the format, default ones are mapped from the colorspace.
+        // All fields are Auto if the driver doesn't report a colorspace
+        wcc::ColorSpace GetColorSpace(const v4l2_pix_format& format);
+
+        // Key of the device in the mode cache: the serial and the firmware version of a USB device
+        // (from sysfs) or where it's plugged in and the version of the driver
+        std::string GetDeviceKey(int nFd, const std::string& sPath);
+    }
+
+    class Capturer
+    {
+    public:
+        Capturer() = default;
+        ~Capturer();
+
+        // nDevice is an index of a device from the list of devices from EnumerateDevices method.
+        // FPS = (float)nFpsNumerator / (float)nFpsDenominator.
+        // Calling it again closes the current device first, no lease may be alive then
+        bool Init(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1);
+
+        // Runs Init on a thread of its own and returns at once, see wcc::InitTask.
+        // Several capturers opened this way open their devices at the same time
+        wcc::InitTask InitAsync(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1);
+
+        static std::list<std::wstring> EnumerateDevices();
+
+        // Waits for the next frame from the driver (it stops current thread until done).
+        // The info is invalid if there was no frame
+        wcc::FrameInfo DoCapture();
+
+        // Returns at once and calls fnDone with what DoCapture would have returned once the driver has a frame.
+        // The device is watched by wcc::GetFrameLoop, fnDone runs on its thread. False if a request is pending
+        bool RequestFrame(wcc::FrameCallback fnDone, void* pContext);
+
+    #ifdef WCC_COROUTINES
+        // co_await NextFrame() waits like DoCapture without blocking the thread, see wcc::FrameAwaitable
+        wcc::FrameAwaitable<Capturer> NextFrame(const wcc::Executor& executor = wcc::GetFrameLoop().GetExecutor())
+        {
+            return wcc::FrameAwaitable<Capturer>(*this, executor);
+        }
+    #endif
+
+        // Waits for the next frame and returns it in the native format without copying, see FrameLease::GetInfo.
+        // The lease is empty if there's no frame or GetMaxLeases leases are still alive
+        wcc::FrameLease LeaseFrame();
+
+        // At least one buffer always stays with the driver, 2 by default
+        void SetMaxLeases(uint32_t nLeases);
+        uint32_t GetMaxLeases() const;
+
+        uint32_t GetFrameWidth() const;
+        uint32_t GetFrameHeight() const;
+        uint32_t GetDeviceCount() const;
+
+        VideoFormat GetVideoFormat() const;
+
+        // The mode Init has chosen and all modes of the device from the cheapest one, see wcc::RankModes.
+        // The driver may have adjusted the chosen one, GetFrameWidth and GetFrameHeight return what it sends
+        const wcc::CaptureMode& GetCaptureMode() const;
+        const std::vector<wcc::CaptureMode>& GetCaptureModes() const;
+
+        // pBuffer must be at least GetOutputSize() bytes in size,
+        // sizeof(uint32_t) * m_nDesiredWidth * m_nDesiredHeight for RGBA
+        void SetBuffer(void* pBuffer);
+
+        // RGBA by default, see wcc::OutputFormat
+        void SetOutputFormat(OutputFormat nFormat);
+        VideoFormat GetOutputVideoFormat() const;
+
+        // Layout, type and normalization of wcc::OutputFormat::Tensor, see wcc::TensorDesc
+        void SetTensorFormat(const wcc::TensorDesc& desc);
+
+        // The matrix and range of YUV frames, Auto fields take what the driver reports (BT.601 limited range if nothing).
+        // GetColorSpace returns the one frames are converted with
+        void SetColorSpace(const wcc::ColorSpace& colorSpace);
+        wcc::ColorSpace GetColorSpace() const;
+
+        size_t GetOutputSize() const;
+        uint32_t GetOutputStride() const;
+
+        // Nearest is used by default
+        void SetScaleMode(ScaleMode nMode);
+
+        // Converts and scales only a part of the frame, in the pixels of the whole frame (see wcc::FrameProcessor::SetRegion).
+        // If the driver can crop without scaling (VIDIOC_S_SELECTION) the stream is restarted with the cropped size
+        // once no leases are alive, GetFrameWidth and GetFrameHeight return it then. An empty region is the whole frame.
+        // False if the stream couldn't be restarted with the crop, it runs with the previous crop and region again then
+        bool SetRegion(const wcc::Rect& region);
+        wcc::Rect GetRegion() const;
+
+        // Number of threads converting large frames, 1 by default and 0 means one per CPU core
+        void SetThreadCount(uint32_t nThreads);
+
+        // Skips frames where nothing has changed within the region (see wcc::ChangeDetector), disabled by default.
+        // DoCapture leaves the output buffer as it is and returns an invalid info with bUnchanged set for them,
+        // the next delivered frame counts them in nSkipped
+        void SetChangeDetection(const wcc::ChangeDetector::Settings& settings);
+
+        // Can be called from any thread, all zeros unless WCCAPI_ENABLE_STATS is defined
+        wcc::StatsSnapshot GetStats() const;
+        void ResetStats();
+
+    private:
+        // Init that stops between its steps once the task is cancelled
+        bool Open(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator, const wcc::InitTask& task);
+
+        bool CreateDevice(const uint32_t nDevice);
+
+        // Fails a pending request, stops the stream and closes the device
+        void CloseDevice();
+        bool ConfigureImage(const uint32_t nWidth, const uint32_t nHeight);
+
+        // Lists every frame size and frame rate of every pixel format we can convert into m_vecModes and the cache.
+        // Ranges of sizes and rates are represented by the desired ones clamped to the range, such modes are not cached
+        void EnumerateModes(const uint32_t nWidth, const uint32_t nHeight);
+
+        // Returns false if the rates are a range
+        bool AddFrameRates(wcc::CaptureMode mode, std::vector<wcc::CaptureMode>& vecModes) const;
+
+        // Sets the format of the mode, false if the driver doesn't know it
+        bool ApplyMode(const wcc::CaptureMode& mode);
+
+        bool ConfigureDecoder();
+        bool StartStreaming();
+        void StopStreaming();
+
+        // Checks that the driver crops the sensor 1:1 to the frame
+        void QueryCropBounds();
+
+        // Crops with the driver while the stream is stopped, m_Crop gets the rectangle it picked
+        bool ApplyCrop(const wcc::Rect& region);
+
+        // Restarts the stream with a pending crop if possible and gives the processor the rest of m_Region.
+        // False if the restart failed, the previous crop is restored then
+        bool UpdateRegion();
+
+        // Waits up to nTimeout milliseconds, 0 takes a buffer only if one is ready
+        bool DequeueBuffer(v4l2_buffer& buffer, int nTimeout = 2000);
+        void QueueBuffer(uint32_t nIndex);
+
+        // Timestamps of the driver are used only if they come from CLOCK_MONOTONIC.
+        // An unchanged buffer is skipped instead, it's not counted as a delivered frame
+        wcc::FrameInfo DeliverBuffer(const v4l2_buffer& buffer, bool bChanged = true);
+
+        static void ReleaseBuffer(void* pOwner, uintptr_t nIndex);
+
+        // DoCapture with a timeout for DequeueBuffer
+        wcc::FrameInfo Capture(int nTimeout);
+
+        // Runs on the frame loop once the device can be read or the wait has timed out
+        static void OnReadable(void* pContext);
+
+    private:
+        struct MappedBuffer
+        {
+            void* pStart = nullptr;
+            size_t nLength = 0;
+        };
+
+        int m_nFd = -1;
+        uint32_t m_nDevices = 0;
+        std::string m_sDeviceKey;
+
+        // Init is cancelled between its steps
+        wcc::InitTask m_InitTask;
+        std::thread m_InitThread;
+
+        // Buffers are allocated by the driver and mapped into our address space,
+        // frames are exchanged with VIDIOC_QBUF/VIDIOC_DQBUF without extra copies
+        std::vector<MappedBuffer> m_vecBuffers;
+        bool m_bStreaming = false;
+
+        wcc::LeaseLimit m_Leases;
+        wcc::FrameCounter m_Counter;
+        wcc::FrameRequest m_Request;
+
+        // Converts and scales frames into m_pOutput (or copies them for OutputFormat::Native)
+        wcc::FrameProcessor m_Processor;
+        wcc::ChangeDetector m_Detector;
+        void* m_pOutput = nullptr;
+
+        uint32_t m_nDesiredWidth = 0, m_nDesiredHeight = 0;
+        uint32_t m_nFrameWidth = 0, m_nFrameHeight = 0;
+
+        // Modes of the device from the cheapest one, m_Mode was chosen
+        std::vector<wcc::CaptureMode> m_vecModes;
+        wcc::CaptureMode m_Mode;
+
+        uint32_t m_nPixelFormat = 0;
+        uint32_t m_nFrameSourceStep = 0;
+        uint32_t m_nFrameSourceStride = 0;
+
+        VideoFormat m_nVideoFormat = VideoFormat::None;
+
+        // Asked for by the user and reported by the driver for the current format
+        wcc::ColorSpace m_ColorSpace;
+        wcc::ColorSpace m_DeviceColorSpace;
+
+        uint32_t m_nFpsNumerator = 0;
+        uint32_t m_nFpsDenominator = 0;
+
+        // The driver can crop, m_CropBounds is the whole frame in the coordinates of the sensor
+        bool m_bCanCrop = false;
+        v4l2_rect m_CropBounds{};
+
+        // The part of the whole frame the driver sends, the processor crops the rest of m_Region
+        wcc::Rect m_Crop;
+        wcc::Rect m_Region;
+        bool m_bCropPending = false;
+
+    };
+
+#ifdef LWCCAPI_IMPL
+#undef LWCCAPI_IMPL
+
+    namespace internal
+    {
+        const IoOps s_DefaultIoOps =
+        {
+            [](const char* sPath, int nFlags) { return ::open(sPath, nFlags); },
+            [](int nFd) { return ::close(nFd); },
+            [](int nFd, unsigned long nRequest, void* pArg) { return ::ioctl(nFd, nRequest, pArg); },
+            [](void* pAddr, size_t nLength, int nProt, int nFlags, int nFd, off_t nOffset) { return ::mmap(pAddr, nLength, nProt, nFlags, nFd, nOffset); },
+            [](void* pAddr, size_t nLength) { return ::munmap(pAddr, nLength); },
+            [](pollfd* pFds, nfds_t nFds, int nTimeout) { return ::poll(pFds, nFds, nTimeout); }
+        };
+
+        const IoOps* s_pIoOps = &s_DefaultIoOps;
+    }
+
+    void SetIoOps(const IoOps* pOps) { internal::s_pIoOps = pOps ? pOps : &internal::s_DefaultIoOps; }
+    const IoOps& GetIoOps() { return *internal::s_pIoOps; }
+
+    int internal::Xioctl(int nFd, unsigned long nRequest, void* pArg)
+    {
+        int nResult;
+
+        do nResult = GetIoOps().Ioctl(nFd, nRequest, pArg);
+        while (nResult == -1 && errno == EINTR);
+
+        return nResult;
+    }
+
+    std::vector<internal::DeviceInfo> internal::ListDevices()
+    {
+        std::vector<DeviceInfo> vecDevices;
+
+        for (int i = 0; i < 64; i++)
+        {
+            std::string sPath = "/dev/video" + std::to_string(i);
+
+            int nFd = GetIoOps().Open(sPath.c_str(), O_RDWR | O_NONBLOCK);
+
+            if (nFd == -1)
+                continue;
+
+            v4l2_capability caps{};
+
+            if (Xioctl(nFd, VIDIOC_QUERYCAP, &caps) == 0)
+            {
+                uint32_t nCaps = (caps.capabilities & V4L2_CAP_DEVICE_CAPS) ? caps.device_caps : caps.capabilities;
+
+                // Skip metadata and output nodes that are created next to the capture node
+                if ((nCaps & V4L2_CAP_VIDEO_CAPTURE) && (nCaps & V4L2_CAP_STREAMING))
+                    vecDevices.push_back({ sPath, std::string((const char*)caps.card, strnlen((const char*)caps.card, sizeof(caps.card))) });
+            }
+
+            GetIoOps().Close(nFd);
+        }
+
+        return vecDevices;
+    }
+
+    std::string internal::GetDeviceKey(int nFd, const std::string& sPath)
+    {
+        v4l2_capability caps{};
+
+        if (Xioctl(nFd, VIDIOC_QUERYCAP, &caps) == -1)
+            return {};
+
+        auto ToString = [](const uint8_t* pText, size_t nSize) { return std::string((const char*)pText, strnlen((const char*)pText, nSize)); };
+
+        // The parent of the interface is the USB device, other buses don't have these files
+        auto ReadAttribute = [&sPath](const char* sName)
+        {
+            std::string sFile = "/sys/class/video4linux/" + sPath.substr(sPath.rfind('/') + 1) + "/device/../" + sName;
+            std::string sValue;
+
+            if (FILE* pFile = fopen(sFile.c_str(), "r"))
+            {
+                char sLine[128];
+
+                if (fgets(sLine, sizeof(sLine), pFile))
+                    sValue.assign(sLine, strcspn(sLine, "\r\n"));
+
+                fclose(pFile);
+            }
+
+            return sValue;
+        };
+
+        std::string sSerial = ReadAttribute("serial");
+        std::string sFirmware = ReadAttribute("bcdDevice");
+
+        if (sSerial.empty())
+            sSerial = ToString(caps.bus_info, sizeof(caps.bus_info));
+
+        if (sFirmware.empty())
+            sFirmware = std::to_string(caps.version);
+
+        return ToString(caps.driver, sizeof(caps.driver)) + " " + ToString(caps.card, sizeof(caps.card)) + " " + sSerial + " " + sFirmware;
+    }
+
+    VideoFormat internal::GetVideoFormat(uint32_t nPixelFormat)
+    {
+        switch (nPixelFormat)
+        {
+        case V4L2_PIX_FMT_YUYV: return VideoFormat::Yuy2;
+        case V4L2_PIX_FMT_NV12: return VideoFormat::Nv12;
+        case V4L2_PIX_FMT_RGB24: return VideoFormat::Rgb24;
+        case V4L2_PIX_FMT_MJPEG: return VideoFormat::Mjpeg;
+        default: return VideoFormat::None;
+        }
+    }
+
+    wcc::ColorSpace internal::GetColorSpace(const v4l2_pix_format& format)
+    {
+        wcc::ColorSpace colorSpace;
+
+        if (format.colorspace == V4L2_COLORSPACE_DEFAULT)
+            return colorSpace;
+
+        // The extended fields are valid only if the driver has set priv
+        bool bExtended = format.priv == V4L2_PIX_FMT_PRIV_MAGIC;
+
+        uint32_t nEncoding = bExtended ? format.ycbcr_enc : (uint32_t)V4L2_YCBCR_ENC_DEFAULT;
+        uint32_t nQuantization = bExtended ? format.quantization : (uint32_t)V4L2_QUANTIZATION_DEFAULT;
+
+        if (nEncoding == V4L2_YCBCR_ENC_DEFAULT)
+            nEncoding = V4L2_MAP_YCBCR_ENC_DEFAULT(format.colorspace);
+
+        if (nQuantization == V4L2_QUANTIZATION_DEFAULT)
+            nQuantization = V4L2_MAP_QUANTIZATION_DEFAULT(false, format.colorspace, nEncoding);
+
+        switch (nEncoding)
+        {
+        // SMPTE 240M is close enough to BT.709
+        case V4L2_YCBCR_ENC_709:
+        case V4L2_YCBCR_ENC_XV709:
+        case V4L2_YCBCR_ENC_SMPTE240M:
+            colorSpace.nMatrix = wcc::ColorMatrix::Bt709;
+        break;
+
+        case V4L2_YCBCR_ENC_BT2020:
+        case V4L2_YCBCR_ENC_BT2020_CONST_LUM:
+            colorSpace.nMatrix = wcc::ColorMatrix::Bt2020;
+        break;
+
+        default:
+            colorSpace.nMatrix = wcc::ColorMatrix::Bt601;
+        break;
+        }
+
+        colorSpace.nRange = (nQuantization == V4L2_QUANTIZATION_FULL_RANGE) ? wcc::ColorRange::Full : wcc::ColorRange::Limited;
+
+        return colorSpace;
+    }
+
+    Capturer::~Capturer()
+    {
+        m_InitTask.Cancel();
+
+        if (m_InitThread.joinable())
+            m_InitThread.join();
+
+        CloseDevice();
+    }
+
+    bool Capturer::Init(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    {
+        return Open(nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator, {});
+    }
+
+    bool Capturer::Open(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator, const wcc::InitTask& task)
+    {
+        m_nFpsNumerator = nFpsNumerator;
+        m_nFpsDenominator = nFpsDenominator;
+
+        // Init again opens the device from scratch
+        CloseDevice();
+
+        if (!CreateDevice(nDeviceID) || task.IsCancelled())
+            return false;
+
+        if (!ConfigureImage(nWidth, nHeight) || task.IsCancelled())
+            return false;
+
+        if (!ConfigureDecoder())
+            return false;
+
+        QueryCropBounds();
+
+        if (task.IsCancelled() || !StartStreaming())
+            return false;
+
+        // A region set before Init, the stream runs with the whole frame if the driver fails to crop it
+        if (!m_Region.IsEmpty())
+            SetRegion(m_Region);
+
+        return m_bStreaming;
+    }
+
+    wcc::InitTask Capturer::InitAsync(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    {
+        // Only the last task counts, Open closes what an earlier one has opened
+        m_InitTask.Cancel();
+
+        if (m_InitThread.joinable())
+            m_InitThread.join();
+
+        wcc::InitTask task = wcc::InitTask::Create();
+        m_InitTask = task;
+
+        m_InitThread = std::thread([this, task, nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator]()
+        {
+            task.Finish(Open(nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator, task));
+        });
+
+        return m_InitTask;
+    }
+
+    bool Capturer::CreateDevice(const uint32_t nDeviceID)
+    {
+        std::vector<internal::DeviceInfo> vecDevices = internal::ListDevices();
+        m_nDevices = vecDevices.size();
+
+        if (nDeviceID >= m_nDevices)
+            return false;
+
+        m_nFd = GetIoOps().Open(vecDevices[nDeviceID].sPath.c_str(), O_RDWR | O_NONBLOCK);
+
+        if (m_nFd == -1)
+            return false;
+
+        m_sDeviceKey = internal::GetDeviceKey(m_nFd, vecDevices[nDeviceID].sPath);
+
+        return true;
+    }
+
+    void Capturer::CloseDevice()
+    {
+        // The loop must not watch the descriptor once it's closed
+        wcc::GetFrameLoop().Cancel(this);
+
+        if (m_Request.Claim())
+            m_Request.Finish({});
+
+        StopStreaming();
+
+        if (m_nFd != -1)
+        {
+            GetIoOps().Close(m_nFd);
+            m_nFd = -1;
+        }
+
+        m_bCropPending = false;
+    }
+
+    std::list<std::wstring> Capturer::EnumerateDevices()
+    {
+        std::list<std::wstring> listDevices;
+
+        for (const auto& device : internal::ListDevices())
+            listDevices.push_back(std::wstring(device.sName.begin(), device.sName.end()));
+
+        return listDevices;
+    }
+
+    bool Capturer::ConfigureImage(const uint32_t nWidth, const uint32_t nHeight)
+    {
+        m_nDesiredWidth = nWidth;
+        m_nDesiredHeight = nHeight;
+
+        // Every mode of every format we can convert is ranked, so e.g. NV12 at the smallest sufficient size
+        // wins over RGB24 at a huge one. Cameras usually have large sizes only as MJPEG because of the USB bandwidth
+        wcc::ModeRequest request;
+        request.nWidth = nWidth;
+        request.nHeight = nHeight;
+        request.nFpsNumerator = m_nFpsNumerator;
+        request.nFpsDenominator = m_nFpsDenominator;
+        request.nOutputFormat = m_Processor.GetOutputFormat();
+
+        // Asking a device for all of its sizes and frame rates takes a while, so they are cached
+        bool bCached = wcc::GetModeCache().Find(m_sDeviceKey, m_vecModes);
+
+        if (!bCached)
+            EnumerateModes(nWidth, nHeight);
+
+        wcc::RankModes(m_vecModes, request);
+
+        bool bApplied = !m_vecModes.empty() && ApplyMode(m_vecModes.front());
+
+        // The device has changed since its modes were cached (e.g. a new firmware with the same version)
+        if (!bApplied && bCached)
+        {
+            wcc::GetModeCache().Remove(m_sDeviceKey);
+
+            EnumerateModes(nWidth, nHeight);
+            wcc::RankModes(m_vecModes, request);
+
+            bApplied = !m_vecModes.empty() && ApplyMode(m_vecModes.front());
+        }
+
+        if (!bApplied)
+            return false;
+
+        m_Mode = m_vecModes.front();
+
+        // Set target fps, it's not an error if the driver can't do that
+        v4l2_streamparm parm{};
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (m_nFpsNumerator != 0 && internal::Xioctl(m_nFd, VIDIOC_G_PARM, &parm) == 0 &&
+            (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+        {
+            parm.parm.capture.timeperframe.numerator = m_nFpsDenominator;
+            parm.parm.capture.timeperframe.denominator = m_nFpsNumerator;
+            internal::Xioctl(m_nFd, VIDIOC_S_PARM, &parm);
+        }
+
+        return true;
+    }
+
+    bool Capturer::ApplyMode(const wcc::CaptureMode& mode)
+    {
+        v4l2_format format{};
+        format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        format.fmt.pix.width = mode.nWidth;
+        format.fmt.pix.height = mode.nHeight;
+        format.fmt.pix.pixelformat = mode.nNativeId;
+        format.fmt.pix.field = V4L2_FIELD_NONE;
+
+        if (internal::Xioctl(m_nFd, VIDIOC_S_FMT, &format) == -1 || format.fmt.pix.pixelformat != mode.nNativeId)
+            return false;
+
+        // The driver is free to adjust the size we have asked for
+        m_nFrameWidth = format.fmt.pix.width;
+        m_nFrameHeight = format.fmt.pix.height;
+        m_nPixelFormat = format.fmt.pix.pixelformat;
+        m_nFrameSourceStride = format.fmt.pix.bytesperline;
+        m_DeviceColorSpace = internal::GetColorSpace(format.fmt.pix);
+
+        return true;
+    }
+
+    void Capturer::EnumerateModes(const uint32_t nWidth, const uint32_t nHeight)
+    {
+        std::vector<wcc::CaptureMode> vecModes;
+        bool bCacheable = true;
+
+        v4l2_fmtdesc desc{};
+        desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        for (desc.index = 0; internal::Xioctl(m_nFd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+        {
+            wcc::CaptureMode mode;
+            mode.nFormat = internal::GetVideoFormat(desc.pixelformat);
+            mode.nNativeId = desc.pixelformat;
+
+            if (mode.nFormat == VideoFormat::None)
+                continue;
+
+            bool bSizesListed = false;
+
+            v4l2_frmsizeenum size{};
+            size.pixel_format = desc.pixelformat;
+
+            for (size.index = 0; internal::Xioctl(m_nFd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+            {
+                bSizesListed = true;
+
+                if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+                {
+                    // Any size within the range is allowed so let the driver adjust the desired one
+                    mode.nWidth = std::min(std::max(nWidth, size.stepwise.min_width), size.stepwise.max_width);
+                    mode.nHeight = std::min(std::max(nHeight, size.stepwise.min_height), size.stepwise.max_height);
+                    AddFrameRates(mode, vecModes);
+                    bCacheable = false;
+                    break;
+                }
+
+                mode.nWidth = size.discrete.width;
+                mode.nHeight = size.discrete.height;
+
+                if (!AddFrameRates(mode, vecModes))
+                    bCacheable = false;
+            }
+
+            // Some drivers can't enumerate sizes at all
+            if (!bSizesListed)
+            {
+                mode.nWidth = nWidth;
+                mode.nHeight = nHeight;
+                vecModes.push_back(mode);
+                bCacheable = false;
+            }
+        }
+
+        if (bCacheable)
+            wcc::GetModeCache().Store(m_sDeviceKey, vecModes);
+
+        m_vecModes.swap(vecModes);
+    }
+
+    bool Capturer::AddFrameRates(wcc::CaptureMode mode, std::vector<wcc::CaptureMode>& vecModes) const
+    {
+        bool bRatesListed = false;
+
+        v4l2_frmivalenum interval{};
+        interval.pixel_format = mode.nNativeId;
+        interval.width = mode.nWidth;
+        interval.height = mode.nHeight;
+
+        // Intervals are seconds per frame, so the fraction is flipped
+        for (interval.index = 0; internal::Xioctl(m_nFd, VIDIOC_ENUM_FRAMEINTERVALS, &interval) == 0; interval.index++)
+        {
+            bRatesListed = true;
+
+            if (interval.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+            {
+                const v4l2_fract& fastest = interval.stepwise.min;
+                const v4l2_fract& slowest = interval.stepwise.max;
+
+                mode.nFpsNumerator = m_nFpsNumerator;
+                mode.nFpsDenominator = m_nFpsDenominator;
+
+                // Any rate within the range is allowed, otherwise the closest end of it
+                if (m_nFpsNumerator == 0 || (uint64_t)m_nFpsNumerator * fastest.numerator > (uint64_t)m_nFpsDenominator * fastest.denominator)
+                {
+                    mode.nFpsNumerator = fastest.denominator;
+                    mode.nFpsDenominator = fastest.numerator;
+                }
+                else if ((uint64_t)m_nFpsNumerator * slowest.numerator < (uint64_t)m_nFpsDenominator * slowest.denominator)
+                {
+                    mode.nFpsNumerator = slowest.denominator;
+                    mode.nFpsDenominator = slowest.numerator;
+                }
+
+                vecModes.push_back(mode);
+                return false;
+            }
+
+            mode.nFpsNumerator = interval.discrete.denominator;
+            mode.nFpsDenominator = interval.discrete.numerator;
+            vecModes.push_back(mode);
+        }
+
+        // The frame rate is unknown
+        if (!bRatesListed)
+            vecModes.push_back(mode);
+
+        return true;
+    }
+
+    bool Capturer::ConfigureDecoder()
+    {
+        // RankModes has left MJPEG out if it can't be decoded
+        m_nVideoFormat = internal::GetVideoFormat(m_nPixelFormat);
+
+        if (m_nVideoFormat == VideoFormat::None)
+            return false;
+
+        m_nFrameSourceStep = wcc::GetBytesPerPixel(m_nVideoFormat);
+
+        if (m_nFrameSourceStride == 0)
+            m_nFrameSourceStride = m_nFrameWidth * m_nFrameSourceStep;
+
+        m_Processor.SetColorSpace(wcc::ResolveColorSpace(m_ColorSpace, m_DeviceColorSpace));
+
+        return m_Processor.Configure(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, m_nDesiredWidth, m_nDesiredHeight);
+    }
+
+    bool Capturer::StartStreaming()
+    {
+        v4l2_requestbuffers request{};
+        request.count = 4;
+        request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        request.memory = V4L2_MEMORY_MMAP;
+
+        if (internal::Xioctl(m_nFd, VIDIOC_REQBUFS, &request) == -1)
+            return false;
+
+        // From here on a failed step unmaps and frees what the steps before it got
+        if (request.count < 2)
+        {
+            StopStreaming();
+            return false;
+        }
+
+        m_vecBuffers.resize(request.count);
+
+        for (uint32_t i = 0; i < request.count; i++)
+        {
+            v4l2_buffer buffer{};
+            buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.index = i;
+
+            if (internal::Xioctl(m_nFd, VIDIOC_QUERYBUF, &buffer) == -1)
+            {
+                StopStreaming();
+                return false;
+            }
+
+            void* pStart = GetIoOps().Mmap(nullptr, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFd, buffer.m.offset);
+
+            if (pStart == MAP_FAILED)
+            {
+                StopStreaming();
+                return false;
+            }
+
+            m_vecBuffers[i].pStart = pStart;
+            m_vecBuffers[i].nLength = buffer.length;
+        }
+
+        // Give all buffers to the driver
+        for (uint32_t i = 0; i < request.count; i++)
+        {
+            v4l2_buffer buffer{};
+            buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.index = i;
+
+            if (internal::Xioctl(m_nFd, VIDIOC_QBUF, &buffer) == -1)
+            {
+                StopStreaming();
+                return false;
+            }
+        }
+
+        v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if (internal::Xioctl(m_nFd, VIDIOC_STREAMON, &type) == -1)
+        {
+            StopStreaming();
+            return false;
+        }
+
+        if (m_Leases.GetMax() >= request.count)
+            m_Leases.SetMax(request.count - 1);
+
+        m_Counter.Reset();
+        m_bStreaming = true;
+        return true;
+    }
+
+    void Capturer::StopStreaming()
+    {
+        if (m_bStreaming)
+        {
+            v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            internal::Xioctl(m_nFd, VIDIOC_STREAMOFF, &type);
+            m_bStreaming = false;
+        }
+
+        for (auto& buffer : m_vecBuffers)
+        {
+            if (buffer.pStart)
+                GetIoOps().Munmap(buffer.pStart, buffer.nLength);
+        }
+
+        m_vecBuffers.clear();
+
+        if (m_nFd != -1)
+        {
+            // Release the buffers on the driver side
+            v4l2_requestbuffers request{};
+            request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            request.memory = V4L2_MEMORY_MMAP;
+            internal::Xioctl(m_nFd, VIDIOC_REQBUFS, &request);
+        }
+    }
+
+    void Capturer::QueryCropBounds()
+    {
+        m_bCanCrop = false;
+        m_Crop = { 0, 0, m_nFrameWidth, m_nFrameHeight };
+
+        v4l2_selection bounds{};
+        bounds.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        bounds.target = V4L2_SEL_TGT_CROP_BOUNDS;
+
+        v4l2_selection crop{};
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.target = V4L2_SEL_TGT_CROP;
+
+        if (internal::Xioctl(m_nFd, VIDIOC_G_SELECTION, &bounds) == -1 || internal::Xioctl(m_nFd, VIDIOC_G_SELECTION, &crop) == -1)
+            return;
+
+        // If the sensor is scaled to the frame, a pixel of the frame isn't a pixel of the sensor
+        m_bCanCrop = memcmp(&bounds.r, &crop.r, sizeof(v4l2_rect)) == 0 &&
+            bounds.r.width == m_nFrameWidth && bounds.r.height == m_nFrameHeight;
+
+        m_CropBounds = bounds.r;
+    }
+
+    bool Capturer::ApplyCrop(const wcc::Rect& region)
+    {
+        wcc::Rect full = { 0, 0, m_CropBounds.width, m_CropBounds.height };
+        wcc::Rect aligned = wcc::AlignRegion(m_nVideoFormat, full.nWidth, full.nHeight, region);
+
+        v4l2_selection selection{};
+        selection.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        selection.target = V4L2_SEL_TGT_CROP;
+        selection.r.left = m_CropBounds.left + (int32_t)aligned.nX;
+        selection.r.top = m_CropBounds.top + (int32_t)aligned.nY;
+        selection.r.width = aligned.nWidth;
+        selection.r.height = aligned.nHeight;
+
+        v4l2_format format{};
+        format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        bool bCropped = internal::Xioctl(m_nFd, VIDIOC_S_SELECTION, &selection) == 0 &&
+            internal::Xioctl(m_nFd, VIDIOC_G_FMT, &format) == 0;
+
+        // The driver may grow the rectangle but it must still cover the region and not be scaled
+        bCropped = bCropped &&
+            format.fmt.pix.width == selection.r.width && format.fmt.pix.height == selection.r.height &&
+            selection.r.left - m_CropBounds.left <= (int32_t)aligned.nX && selection.r.top - m_CropBounds.top <= (int32_t)aligned.nY &&
+            selection.r.left - m_CropBounds.left + selection.r.width >= aligned.nX + aligned.nWidth &&
+            selection.r.top - m_CropBounds.top + selection.r.height >= aligned.nY + aligned.nHeight;
+
+        if (!bCropped)
+        {
+            selection.r = m_CropBounds;
+            internal::Xioctl(m_nFd, VIDIOC_S_SELECTION, &selection);
+
+            format = v4l2_format{};
+            format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            internal::Xioctl(m_nFd, VIDIOC_G_FMT, &format);
+        }
+
+        m_nFrameWidth = format.fmt.pix.width;
+        m_nFrameHeight = format.fmt.pix.height;
+        m_nFrameSourceStride = format.fmt.pix.bytesperline;
+
+        if (m_nFrameSourceStride == 0)
+            m_nFrameSourceStride = m_nFrameWidth * m_nFrameSourceStep;
+
+        m_Crop = { (uint32_t)(selection.r.left - m_CropBounds.left), (uint32_t)(selection.r.top - m_CropBounds.top), m_nFrameWidth, m_nFrameHeight };
+
+        return bCropped;
+    }
+
+    bool Capturer::DequeueBuffer(v4l2_buffer& buffer, int nTimeout)
+    {
+        buffer = v4l2_buffer{};
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+
+        while (true)
+        {
+            pollfd fd{ m_nFd, POLLIN, 0 };
+            int nResult = GetIoOps().Poll(&fd, 1, nTimeout);
+
+            if (nResult == -1 && errno == EINTR)
+                continue;
+
+            // An error or the device stopped sending frames
+            if (nResult <= 0)
+                return false;
+
+            if (internal::Xioctl(m_nFd, VIDIOC_DQBUF, &buffer) == 0)
+                return true;
+
+            if (errno != EAGAIN)
+                return false;
+        }
+    }
+
+    void Capturer::QueueBuffer(uint32_t nIndex)
+    {
+        v4l2_buffer buffer{};
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = nIndex;
+
+        internal::Xioctl(m_nFd, VIDIOC_QBUF, &buffer);
+    }
+
+    void Capturer::ReleaseBuffer(void* pOwner, uintptr_t nIndex)
+    {
+        ((Capturer*)pOwner)->QueueBuffer((uint32_t)nIndex);
+    }
+
+    wcc::FrameInfo Capturer::DeliverBuffer(const v4l2_buffer& buffer, bool bChanged)
+    {
+        int64_t nTimestamp = 0;
+
+        if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+            nTimestamp = (int64_t)buffer.timestamp.tv_sec * 1000000000 + (int64_t)buffer.timestamp.tv_usec * 1000;
+
+        if (!bChanged)
+            return m_Counter.Skip(buffer.sequence, nTimestamp);
+
+        // The driver counts all frames, including the ones it had no free buffer for
+        wcc::FrameInfo info = m_Counter.Deliver(buffer.sequence, nTimestamp);
+        WCC_STATS(m_Processor.GetStats().AddFrame(info);)
+
+        return info;
+    }
+
+    wcc::FrameInfo Capturer::DoCapture()
+    {
+        return Capture(2000);
+    }
+
+    bool Capturer::RequestFrame(wcc::FrameCallback fnDone, void* pContext)
+    {
+        if (!m_Request.Set(fnDone, pContext))
+            return false;
+
+        // A stopped device has no frames to wait for, the request fails on the loop.
+        // The loop sleeps in the real poll(2) with its other descriptors, a replaced one is asked on its own
+        if (m_bStreaming)
+        {
+            const IoOps& ops = GetIoOps();
+
+            wcc::GetFrameLoop().WatchOnce(m_nFd, 2000000000LL, &Capturer::OnReadable, this,
+                (&ops == &internal::s_DefaultIoOps) ? nullptr : ops.Poll);
+        }
+        else
+            wcc::GetFrameLoop().Post(&Capturer::OnReadable, this);
+
+        return true;
+    }
+
+    void Capturer::OnReadable(void* pContext)
+    {
+        Capturer* pThis = (Capturer*)pContext;
+
+        if (pThis->m_Request.Claim())
+            pThis->m_Request.Finish(pThis->Capture(0));
+    }
+
+    wcc::FrameInfo Capturer::Capture(int nTimeout)
+    {
+        if (m_bCropPending)
+            UpdateRegion();
+
+        if (!m_bStreaming || !m_pOutput)
+            return {};
+
+        WCC_STATS(int64_t nStart = wcc::GetMonotonicTime();)
+        v4l2_buffer buffer;
+
+        if (!DequeueBuffer(buffer, nTimeout))
+            return {};
+
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Wait, nStart);)
+        wcc::FrameInfo info;
+
+        const uint8_t* pData = (const uint8_t*)m_vecBuffers[buffer.index].pStart;
+
+        if (buffer.bytesused > 0 && buffer.bytesused >= wcc::GetFrameSize(m_nVideoFormat, m_nFrameHeight, m_nFrameSourceStride))
+        {
+            // Converting and scaling down the image straight into the output buffer.
+            // NV12 is stored in one buffer with the UV plane right after the Y plane
+            wcc::FrameView view = wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pData, m_nFrameSourceStride);
+            view.nDataSize = buffer.bytesused;
+
+            // A static frame is not converted at all
+            bool bChanged = m_Detector.Update(wcc::CropFrameView(view, m_Processor.GetRegion()));
+
+            if (bChanged)
+                m_Processor.Process(view, m_pOutput);
+
+            info = DeliverBuffer(buffer, bChanged);
+            m_Detector.Mark(info);
+        }
+
+        // Return the buffer to the driver
+        QueueBuffer(buffer.index);
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Total, nStart);)
+
+        return info;
+    }
+
+    wcc::FrameLease Capturer::LeaseFrame()
+    {
+        if (m_bCropPending)
+            UpdateRegion();
+
+        if (!m_bStreaming || !m_Leases.TryAcquire())
+            return {};
+
+        WCC_STATS(int64_t nStart = wcc::GetMonotonicTime();)
+        v4l2_buffer buffer;
+
+        if (!DequeueBuffer(buffer))
+        {
+            m_Leases.Release();
+            return {};
+        }
+
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Wait, nStart);)
+
+        if (buffer.bytesused == 0 || buffer.bytesused < wcc::GetFrameSize(m_nVideoFormat, m_nFrameHeight, m_nFrameSourceStride))
+        {
+            QueueBuffer(buffer.index);
+            m_Leases.Release();
+            return {};
+        }
+
+        const uint8_t* pData = (const uint8_t*)m_vecBuffers[buffer.index].pStart;
+        wcc::FrameView view = wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pData, m_nFrameSourceStride);
+        view.nDataSize = buffer.bytesused;
+
+        return wcc::FrameLease(view, DeliverBuffer(buffer), &Capturer::ReleaseBuffer, this, buffer.index, &m_Leases);
+    }
+
+    void Capturer::SetMaxLeases(uint32_t nLeases)
+    {
+        // Leaving the driver without buffers would stop the stream
+        if (m_bStreaming && nLeases >= m_vecBuffers.size())
+            nLeases = (uint32_t)m_vecBuffers.size() - 1;
+
+        m_Leases.SetMax(nLeases);
+    }
+
+    uint32_t Capturer::GetMaxLeases() const { return m_Leases.GetMax(); }
+
+    uint32_t Capturer::GetFrameWidth() const { return m_nFrameWidth; }
+    uint32_t Capturer::GetFrameHeight() const { return m_nFrameHeight; }
+    uint32_t Capturer::GetDeviceCount() const { return m_nDevices; }
+
+    VideoFormat Capturer::GetVideoFormat() const { return m_nVideoFormat; }
+
+    const wcc::CaptureMode& Capturer::GetCaptureMode() const { return m_Mode; }
+    const std::vector<wcc::CaptureMode>& Capturer::GetCaptureModes() const { return m_vecModes; }
+
+    void Capturer::SetBuffer(void* pBuffer) { m_pOutput = pBuffer; }
+
+    void Capturer::SetOutputFormat(OutputFormat nFormat) { m_Processor.SetOutputFormat(nFormat); }
+    void Capturer::SetTensorFormat(const wcc::TensorDesc& desc) { m_Processor.SetTensorFormat(desc); }
+
+    void Capturer::SetColorSpace(const wcc::ColorSpace& colorSpace)
+    {
+        m_ColorSpace = colorSpace;
+        m_Processor.SetColorSpace(wcc::ResolveColorSpace(m_ColorSpace, m_DeviceColorSpace));
+    }
+
+    wcc::ColorSpace Capturer::GetColorSpace() const { return m_Processor.GetColorSpace(); }
+    VideoFormat Capturer::GetOutputVideoFormat() const { return m_Processor.GetOutputVideoFormat(); }
+
+    size_t Capturer::GetOutputSize() const { return m_Processor.GetOutputSize(); }
+    uint32_t Capturer::GetOutputStride() const { return m_Processor.GetOutputStride(); }
+
+    void Capturer::SetScaleMode(ScaleMode nMode) { m_Processor.SetScaleMode(nMode); }
+
+    bool Capturer::SetRegion(const wcc::Rect& region)
+    {
+        wcc::Rect previous = m_Region;
+
+        m_Region = region;
+        m_bCropPending = m_bCanCrop;
+
+        if (UpdateRegion())
+            return true;
+
+        // The stream runs with the previous crop, the processor gets the previous region back
+        m_Region = previous;
+        UpdateRegion();
+
+        return false;
+    }
+
+    bool Capturer::UpdateRegion()
+    {
+        bool bUpdated = true;
+
+        // Buffers can't be reallocated while they are leased
+        if (m_bCropPending && m_bStreaming && m_Leases.GetOutstanding() == 0)
+        {
+            m_bCropPending = false;
+            wcc::Rect previous = m_Crop;
+
+            StopStreaming();
+
+            // A region the driver can't crop leaves it at the whole frame, the processor crops all of it then
+            ApplyCrop(m_Region);
+
+            if (!m_Processor.Configure(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, m_nDesiredWidth, m_nDesiredHeight) || !StartStreaming())
+            {
+                ApplyCrop(previous);
+
+                m_Processor.Configure(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, m_nDesiredWidth, m_nDesiredHeight);
+                StartStreaming();
+
+                bUpdated = false;
+            }
+        }
+
+        // The part of the region the driver hasn't cropped away, relative to the frame it sends.
+        // Until a pending crop is applied it may be only a part of the region
+        wcc::Rect rest;
+
+        if (!m_Region.IsEmpty())
+        {
+            uint32_t x0 = std::max(m_Region.nX, m_Crop.nX);
+            uint32_t y0 = std::max(m_Region.nY, m_Crop.nY);
+            uint32_t x1 = std::min(m_Region.nX + m_Region.nWidth, m_Crop.nX + m_Crop.nWidth);
+            uint32_t y1 = std::min(m_Region.nY + m_Region.nHeight, m_Crop.nY + m_Crop.nHeight);
+
+            if (x1 > x0 && y1 > y0)
+                rest = { x0 - m_Crop.nX, y0 - m_Crop.nY, x1 - x0, y1 - y0 };
+        }
+
+        m_Processor.SetRegion(rest);
+        return bUpdated;
+    }
+
+    wcc::Rect Capturer::GetRegion() const
+    {
+        wcc::Rect region = m_Processor.GetRegion();
+
+        region.nX += m_Crop.nX;
+        region.nY += m_Crop.nY;
+
+        return region;
+    }
+
+    void Capturer::SetThreadCount(uint32_t nThreads) { m_Processor.SetThreadCount(nThreads); }
+
+    void Capturer::SetChangeDetection(const wcc::ChangeDetector::Settings& settings) { m_Detector.SetSettings(settings); }
+
+    wcc::StatsSnapshot Capturer::GetStats() const { return m_Processor.GetStats().GetSnapshot(); }
+    void Capturer::ResetStats() { m_Processor.GetStats().Reset(); }
+
+#endif
+
+}
+
+#endif
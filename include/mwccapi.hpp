@@ -30,13 +30,27 @@
 
     0.01: Added support for RGB32, RGB24, YUY2 formats on Windows platform
     0.02: Added support for macOS
+    0.04: Moved pixel format conversion into the platform independent core (wccapi.hpp)
+    0.05: Frames are passed from the capture queue through wcc::FrameExchange,
+          CaptureParams::isFrameReady and CaptureParams::wantCapture were removed
+    0.06: Added LeaseFrame to read pixel buffers without copying
+    0.07: Added SetOutputFormat, CaptureParams::output is void* now
+    0.08: DoCapture returns FrameInfo with the presentation time of the sample buffer
+    0.09: Added GetStats and ResetStats (timings need WCCAPI_ENABLE_STATS)
+    0.10: Added mwcc::Capturer, several devices can be opened at once
+    0.11: Added SetRegion to convert only a part of the frame
+    0.12: Added SetChangeDetection to skip frames where nothing has changed
+    0.13: Init ranks every size, pixel format and fps of the device by cost, added GetCaptureMode and GetCaptureModes
+    0.14: Added Capturer::InitAsync that opens the device on a thread of its own
+    0.15: Added SetTensorFormat for wcc::OutputFormat::Tensor
+    0.16: Added RequestFrame and Capturer::NextFrame, the capture queue delivers the next frame to a callback or coroutine
 */
 
 #ifndef MWCCAPI_H
 #define MWCCAPI_H
 
 #ifndef __APPLE__
-#error You can't use macOS version of WCCAPI
+#error You cannot use the macOS version of WCCAPI on this platform
 #endif
 
 #ifndef __OBJC__
@@ -48,6 +62,12 @@
 #include <string>
 #include <optional>
 
+#ifdef MWCCAPI_IMPL
+#define WCCAPI_IMPL
+#endif
+
+#include "wccapi.hpp"
+
 namespace mwcc
 {
     struct CaptureParams
@@ -62,11 +82,7 @@ namespace mwcc
 
         float fps = 0.0f;
 
-        bool isFrameReady = false;
-        bool wantCapture = false;
-
-        uint8_t* source = nullptr;
-        uint32_t* output = nullptr;
+        void* output = nullptr;
     };
 }
 
@@ -83,9 +99,46 @@ namespace mwcc
     AVCaptureVideoDataOutput* mDataOut;
     AVCaptureDeviceInput* mDataIn;
 
+    // Converts and scales frames on the capture queue into mExchange,
+    // DoCapture copies the newest one into mCapParams.output
+    wcc::FrameProcessor mProcessor;
+    wcc::FrameExchange mExchange;
+
+    // Static frames are neither converted nor published
+    wcc::ChangeDetector mDetector;
+
+    // Frames are not converted until DoCapture is called for the first time
+    std::atomic<bool> mWantCapture;
+
+    // Counts all sample buffers on the capture queue, dropped ones included.
+    // mCounter turns the numbers into drop counts on the side of the application
+    uint64_t mSequence;
+    wcc::FrameCounter mCounter;
+
+    // Static frames skipped on the capture queue so far, every published frame carries the total in nSkipped.
+    // DoCapture keeps the total of the last frame it took, the difference isn't counted as dropped
+    uint64_t mSkipped;
+    uint64_t mDeliveredSkipped;
+
+    // The newest pixel buffer kept for LeaseFrame (retained), frames are
+    // not kept until LeaseFrame is called for the first time
+    std::atomic<CVPixelBufferRef> mLatest;
+    std::atomic<bool> mWantLease;
+    wcc::LeaseLimit mLeases;
+
+    // A pending RequestFrame, finished on the capture queue by the next converted frame
+    wcc::FrameRequest mRequest;
+
 @public
     mwcc::CaptureParams mCapParams;
 
+    // Modes of the device from the cheapest one, mMode was chosen
+    std::vector<wcc::CaptureMode> mModes;
+    wcc::CaptureMode mMode;
+
+    // Set by Capturer::InitAsync, Init stops between its steps once it's cancelled
+    wcc::InitTask mInitTask;
+
 }
 
 - (void)dealloc;
@@ -94,13 +147,26 @@ namespace mwcc
 - (bool)CreateDevice: (uint32_t)deviceID;
 - (NSMutableArray*)EnumerateDevices;
 - (bool)ConfigureImage: (uint32_t)w height:(uint32_t)h;
-- (bool)DoCapture;
+- (wcc::FrameInfo)DoCapture;
+- (bool)RequestFrame: (wcc::FrameCallback)done context:(void*)context;
+- (void)SetScaleMode: (wcc::ScaleMode)mode;
+- (void)SetRegion: (wcc::Rect)region;
+- (wcc::Rect)GetRegion;
+- (void)SetThreadCount: (uint32_t)threads;
+- (void)SetChangeDetection: (wcc::ChangeDetector::Settings)settings;
+- (void)SetOutputFormat: (wcc::OutputFormat)format;
+- (void)SetTensorFormat: (wcc::TensorDesc)desc;
+- (size_t)GetOutputSize;
+- (wcc::FrameLease)LeaseFrame;
+- (void)SetMaxLeases: (uint32_t)leases;
+- (wcc::StatsSnapshot)GetStats;
+- (void)ResetStats;
 
 - (void)Start;
 - (void)Stop;
 
 - (NSArray*)_GetDevices;
-- (void)_SetSourceFromBGRA: (uint8_t*)input;
+- (void)_RunOnCaptureQueue: (dispatch_block_t)block;
 
 @end
 
@@ -118,11 +184,120 @@ namespace mwcc
     // Finds all webcams on your machine and returns their names.
     std::vector<std::wstring> EnumerateDevices();
 
-    // Returns true if the frame is ready.
-    bool DoCapture();
+    // Copies the newest frame into the buffer, the info is invalid (false) if there is no new frame.
+    wcc::FrameInfo DoCapture();
+
+    // Returns at once, done is called on the capture queue with what DoCapture returns for the next converted frame.
+    // False if a request is pending.
+    bool RequestFrame(wcc::FrameCallback done, void* context);
+
+    // buffer must be at least GetOutputSize() bytes in size,
+    // sizeof(uint32_t) * m_nDesiredWidth * m_nDesiredHeight for RGBA
+    void SetBuffer(void* buffer);
+
+    // RGBA by default, see wcc::OutputFormat. Native frames are BGRA.
+    void SetOutputFormat(wcc::OutputFormat format);
+    size_t GetOutputSize();
+
+    // Layout, type and normalization of wcc::OutputFormat::Tensor, see wcc::TensorDesc.
+    void SetTensorFormat(const wcc::TensorDesc& desc);
+
+    // Nearest is used by default.
+    void SetScaleMode(wcc::ScaleMode mode);
+
+    // Converts and scales only a part of the frame, in the pixels of the frame (see wcc::FrameProcessor::SetRegion).
+    // AVFoundation can't crop, the other pixels are just not read. An empty region is the whole frame.
+    void SetRegion(wcc::Rect region);
+    wcc::Rect GetRegion();
+
+    // Number of threads converting large frames, 1 by default and 0 means one per CPU core.
+    void SetThreadCount(uint32_t threads);
+
+    // Skips frames where nothing has changed within the region (see wcc::ChangeDetector), disabled by default.
+    // They are not converted and DoCapture doesn't return them, nSkipped of the next frame counts them.
+    void SetChangeDetection(const wcc::ChangeDetector::Settings& settings);
+
+    // Returns the newest frame as BGRA straight from its pixel buffer without copying, see FrameLease::GetInfo.
+    // The lease is empty if there's no new frame or too many leases are still alive (2 by default).
+    wcc::FrameLease LeaseFrame();
+
+    // The mode Init has chosen and all modes of the device from the cheapest one, see wcc::RankModes.
+    // nNativeId is the index of the device format.
+    wcc::CaptureMode GetCaptureMode();
+    std::vector<wcc::CaptureMode> GetCaptureModes();
+
+    void SetMaxLeases(uint32_t leases);
+
+    // Can be called from any thread, all zeros unless WCCAPI_ENABLE_STATS is defined.
+    // Frames arrive on their own, so there is no time spent waiting for the device.
+    wcc::StatsSnapshot GetStats();
+    void ResetStats();
+
+    // One device, the functions above use a single global one but any number
+    // of these can be opened at once (e.g. for wcc::CaptureGroup)
+    class Capturer
+    {
+    public:
+        Capturer() = default;
+        ~Capturer();
+
+        Capturer(const Capturer&) = delete;
+        Capturer& operator=(const Capturer&) = delete;
+
+        bool Init(uint32_t deviceID, uint32_t frameWidth, uint32_t frameHeight, float framerate);
+
+        // Runs Init on a thread of its own and returns at once, see wcc::InitTask.
+        // Several capturers opened this way lock and configure their devices at the same time
+        wcc::InitTask InitAsync(uint32_t deviceID, uint32_t frameWidth, uint32_t frameHeight, float framerate);
+
+        void Stop();
 
-    // buffer must be at least sizeof(uint32_t) * m_nDesiredWidth * m_nDesiredHeight in size
-    void SetBuffer(uint32_t* buffer);
+        wcc::FrameInfo DoCapture();
+        wcc::FrameLease LeaseFrame();
+
+        // See mwcc::RequestFrame, false if the device isn't open
+        bool RequestFrame(wcc::FrameCallback done, void* context);
+
+    #ifdef WCC_COROUTINES
+        // co_await NextFrame() waits for the next frame without polling DoCapture, see wcc::FrameAwaitable
+        wcc::FrameAwaitable<Capturer> NextFrame(const wcc::Executor& executor = wcc::GetFrameLoop().GetExecutor())
+        {
+            return wcc::FrameAwaitable<Capturer>(*this, executor);
+        }
+    #endif
+
+        void SetBuffer(void* buffer);
+
+        void SetOutputFormat(wcc::OutputFormat format);
+        void SetTensorFormat(const wcc::TensorDesc& desc);
+        size_t GetOutputSize() const;
+
+        void SetScaleMode(wcc::ScaleMode mode);
+        void SetRegion(wcc::Rect region);
+        wcc::Rect GetRegion() const;
+        void SetThreadCount(uint32_t threads);
+        void SetChangeDetection(const wcc::ChangeDetector::Settings& settings);
+        void SetMaxLeases(uint32_t leases);
+
+        uint32_t GetFrameWidth() const;
+        uint32_t GetFrameHeight() const;
+
+        const wcc::CaptureMode& GetCaptureMode() const;
+        const std::vector<wcc::CaptureMode>& GetCaptureModes() const;
+
+        wcc::StatsSnapshot GetStats() const;
+        void ResetStats();
+
+    private:
+        // Init that stops between its steps once the task is cancelled
+        bool Open(uint32_t deviceID, uint32_t frameWidth, uint32_t frameHeight, float framerate, const wcc::InitTask& task);
+
+        _Capturer_MacOS* mCapturer = nil;
+
+        wcc::InitTask mInitTask;
+        std::thread mInitThread;
+
+    };
 }
 
 #ifdef MWCCAPI_IMPL
@@ -151,9 +326,6 @@ namespace mwcc
     if (mDevice)
         [mDevice release];
 
-    if (mCapParams.source)
-        free(mCapParams.source);
-
     [super dealloc];
 }
 
@@ -164,7 +336,7 @@ namespace mwcc
 
     mCapParams.fps = fps;
 
-    if (![self CreateDevice:deviceID])
+    if (![self CreateDevice:deviceID] || mInitTask.IsCancelled())
         return false;
 
     if (![self ConfigureImage:w height:h])
@@ -202,6 +374,29 @@ namespace mwcc
     return names;
 }
 
+// Only used to estimate the cost of a format, AVFoundation converts all of them to BGRA
+static wcc::VideoFormat _GetVideoFormat(FourCharCode subtype)
+{
+    switch (subtype)
+    {
+    case kCVPixelFormatType_420YpCbCr8BiPlanarVideoRange:
+    case kCVPixelFormatType_420YpCbCr8BiPlanarFullRange:
+        return wcc::VideoFormat::Nv12;
+
+    // UYVY takes as much as YUY2
+    case kCVPixelFormatType_422YpCbCr8:
+    case kCVPixelFormatType_422YpCbCr8_yuvs:
+        return wcc::VideoFormat::Yuy2;
+
+    case kCMVideoCodecType_JPEG:
+    case kCMVideoCodecType_JPEG_OpenDML:
+        return wcc::VideoFormat::Mjpeg;
+
+    default:
+        return wcc::VideoFormat::Bgra32;
+    }
+}
+
 - (bool)ConfigureImage: (uint32_t)w height:(uint32_t)h
 {
     NSError* error = nil;
@@ -216,58 +411,66 @@ namespace mwcc
     mCapParams.desiredWidth = w;
     mCapParams.desiredHeight = h;
 
-    AVCaptureDeviceFormat* bestFormat = nil;
-    CMVideoDimensions bestSize;
+    // Every format and frame rate range is ranked, so e.g. NV12 at the smallest sufficient size
+    // wins over a huge one. Frames are converted to BGRA by AVFoundation in any case
+    wcc::ModeRequest request;
+    request.nWidth = w;
+    request.nHeight = h;
+    request.nFpsNumerator = (uint32_t)lround(mCapParams.fps * 1000.0f);
+    request.nFpsDenominator = 1000;
+    request.nOutputFormat = mProcessor.GetOutputFormat();
 
-    uint32_t bestError = -1;
+    NSArray<AVCaptureDeviceFormat*>* formats = [mDevice formats];
 
-    // TODO: If it's guaranteed that all resolutions are sorted then
-    // we can peek the first one that's greater than the desired one
-    // and exit the loop instantly
+    mModes.clear();
 
-    for (AVCaptureDeviceFormat* format in [mDevice formats])
+    for (NSUInteger i = 0; i < [formats count]; i++)
     {
+        AVCaptureDeviceFormat* format = formats[i];
         CMVideoDimensions size = CMVideoFormatDescriptionGetDimensions(format.formatDescription);
 
-        // Does the desired size perfectly fits one of the webcam sizes?
-        if (size.width == mCapParams.desiredWidth && size.height == mCapParams.desiredHeight)
-        {
-            bestFormat = format;
-            bestSize = size;
-            break;
-        }
+        wcc::CaptureMode mode;
+        mode.nFormat = _GetVideoFormat(CMFormatDescriptionGetMediaSubType(format.formatDescription));
+        mode.nWidth = size.width;
+        mode.nHeight = size.height;
+        mode.nNativeId = (uint32_t)i;
 
-        if (size.width > mCapParams.desiredWidth && size.height > mCapParams.desiredHeight)
+        // The requested rate if the range has it, otherwise the closest end of the range
+        for (AVFrameRateRange* range in format.videoSupportedFrameRateRanges)
         {
-            uint32_t widthError = size.width - mCapParams.desiredWidth;
-            uint32_t heightError = size.height - mCapParams.desiredHeight;
-
-            if (widthError < bestError && heightError < bestError)
-            {
-                bestSize = size;
-                bestError = std::max(widthError, heightError);
-                bestFormat = format;
-            }
+            double fps = std::min(std::max((double)mCapParams.fps, [range minFrameRate]), [range maxFrameRate]);
+
+            mode.nFpsNumerator = (uint32_t)lround(fps * 1000.0);
+            mode.nFpsDenominator = 1000;
+            mModes.push_back(mode);
         }
     }
 
-    if (bestFormat)
+    wcc::RankModes(mModes, request);
+
+    if (mModes.empty())
     {
-		[mDevice setActiveFormat:bestFormat];
-        mCapParams.actualWidth = bestSize.width;
-        mCapParams.actualHeight = bestSize.height;
-    }
-    else
+        [mDevice unlockForConfiguration];
         return false;
+    }
+
+    mMode = mModes.front();
+
+    AVCaptureDeviceFormat* bestFormat = formats[mMode.nNativeId];
+    [mDevice setActiveFormat:bestFormat];
+
+    mCapParams.actualWidth = mMode.nWidth;
+    mCapParams.actualHeight = mMode.nHeight;
 
     // For whatever reason the only available FPSs are 15 and 30
 
-    // Searching for the closest available FPS to the requested one
+    // Searching for the range of the chosen frame rate
+    double modeFps = (double)mMode.nFpsNumerator / mMode.nFpsDenominator;
     bool isFpsConfigured = false;
 
-    for(AVFrameRateRange* range in mDevice.activeFormat.videoSupportedFrameRateRanges)
+    for (AVFrameRateRange* range in bestFormat.videoSupportedFrameRateRanges)
     {
-        if (floor([range minFrameRate]) <= mCapParams.fps && mCapParams.fps <= ceil([range maxFrameRate]))
+        if (floor([range minFrameRate]) <= modeFps && modeFps <= ceil([range maxFrameRate]))
         {
             mDevice.activeVideoMinFrameDuration = range.minFrameDuration;
             mDevice.activeVideoMaxFrameDuration = range.maxFrameDuration;
@@ -277,7 +480,10 @@ namespace mwcc
     }
 
     if (!isFpsConfigured)
+    {
+        [mDevice unlockForConfiguration];
         return false;
+    }
 
     [mDevice unlockForConfiguration];
 
@@ -308,24 +514,187 @@ namespace mwcc
 
     [mSession commitConfiguration];
 
-    mCapParams.source = (uint8_t*)malloc(mCapParams.actualWidth * mCapParams.actualHeight * 4);
+    // Frames come as BGRA, see the video settings above
+    if (!mProcessor.Configure(wcc::VideoFormat::Bgra32, mCapParams.actualWidth, mCapParams.actualHeight, mCapParams.desiredWidth, mCapParams.desiredHeight))
+        return false;
 
+    mExchange.Resize(mProcessor.GetOutputSize());
     return true;
 }
 
-- (bool)DoCapture
+- (wcc::FrameInfo)DoCapture
 {
     // Since an image capturing is based on the callbacks
     // we need to notify a callback function that we want to
     // capture an image if it is ready.
 
-    mCapParams.wantCapture = true;
-    bool isFrameReady = mCapParams.isFrameReady;
+    mWantCapture = true;
+
+    WCC_STATS(int64_t start = wcc::GetMonotonicTime();)
+
+    wcc::FrameInfo captured;
+    const uint8_t* frame = mExchange.Acquire(&captured);
+
+    if (!frame)
+        return {};
+
+    if (mCapParams.output)
+        memcpy(mCapParams.output, frame, mExchange.GetFrameSize());
+
+    WCC_STATS(mProcessor.GetStats().AddTimeSince(wcc::Stage::Copy, start);)
+
+    uint64_t skipped = captured.nSkipped - mDeliveredSkipped;
+    mDeliveredSkipped = captured.nSkipped;
+
+    wcc::FrameInfo info = mCounter.Deliver(captured.nSequence, captured.nTimestamp, skipped);
+    info.nChangedTiles = captured.nChangedTiles;
+    WCC_STATS(mProcessor.GetStats().AddFrame(info);)
+
+    return info;
+}
+
+- (bool)RequestFrame: (wcc::FrameCallback)done context:(void*)context
+{
+    if (!mRequest.Set(done, context))
+        return false;
+
+    // Frames are converted from now on, the next one finishes the request
+    mWantCapture = true;
+    return true;
+}
+
+- (void)SetScaleMode: (wcc::ScaleMode)mode
+{
+    [self _RunOnCaptureQueue:^{ mProcessor.SetScaleMode(mode); }];
+}
+
+- (void)SetRegion: (wcc::Rect)region
+{
+    // The size of the native output follows the region
+    [self _RunOnCaptureQueue:^{
+        mProcessor.SetRegion(region);
+        mExchange.Resize(mProcessor.GetOutputSize());
+    }];
+}
 
-    if (isFrameReady)
-        mCapParams.isFrameReady = false;
+- (wcc::Rect)GetRegion
+{
+    __block wcc::Rect region;
+    [self _RunOnCaptureQueue:^{ region = mProcessor.GetRegion(); }];
+    return region;
+}
 
-    return isFrameReady;
+- (void)SetThreadCount: (uint32_t)threads
+{
+    [self _RunOnCaptureQueue:^{ mProcessor.SetThreadCount(threads); }];
+}
+
+- (void)SetChangeDetection: (wcc::ChangeDetector::Settings)settings
+{
+    [self _RunOnCaptureQueue:^{ mDetector.SetSettings(settings); }];
+}
+
+- (void)SetOutputFormat: (wcc::OutputFormat)format
+{
+    // The caller waits in dispatch_sync, so it can't be reading the exchange meanwhile
+    [self _RunOnCaptureQueue:^{
+        mProcessor.SetOutputFormat(format);
+        mExchange.Resize(mProcessor.GetOutputSize());
+    }];
+}
+
+- (void)SetTensorFormat: (wcc::TensorDesc)desc
+{
+    // The layout and the type change the output size
+    [self _RunOnCaptureQueue:^{
+        mProcessor.SetTensorFormat(desc);
+        mExchange.Resize(mProcessor.GetOutputSize());
+    }];
+}
+
+- (size_t)GetOutputSize
+{
+    return mExchange.GetFrameSize();
+}
+
+// The sequence number and the timestamp travel with the pixel buffer kept for LeaseFrame
+static void _SetFrameInfo(CVPixelBufferRef buffer, uint64_t sequence, int64_t timestamp)
+{
+    CVBufferSetAttachment(buffer, CFSTR("WccSequence"), (CFNumberRef)@(sequence), kCVAttachmentMode_ShouldNotPropagate);
+    CVBufferSetAttachment(buffer, CFSTR("WccTimestamp"), (CFNumberRef)@(timestamp), kCVAttachmentMode_ShouldNotPropagate);
+}
+
+static void _GetFrameInfo(CVPixelBufferRef buffer, uint64_t& sequence, int64_t& timestamp)
+{
+    sequence = [(NSNumber*)CVBufferGetAttachment(buffer, CFSTR("WccSequence"), nullptr) unsignedLongLongValue];
+    timestamp = [(NSNumber*)CVBufferGetAttachment(buffer, CFSTR("WccTimestamp"), nullptr) longLongValue];
+}
+
+static void _ReleasePixelBuffer(void*, uintptr_t handle)
+{
+    CVPixelBufferRef buffer = (CVPixelBufferRef)handle;
+
+    CVPixelBufferUnlockBaseAddress(buffer, kCVPixelBufferLock_ReadOnly);
+    CVPixelBufferRelease(buffer);
+}
+
+- (wcc::FrameLease)LeaseFrame
+{
+    mWantLease = true;
+
+    if (!mLeases.TryAcquire())
+        return {};
+
+    // Taking the frame out so it's leased only once
+    CVPixelBufferRef buffer = mLatest.exchange(nullptr);
+
+    if (!buffer)
+    {
+        mLeases.Release();
+        return {};
+    }
+
+    CVPixelBufferLockBaseAddress(buffer, kCVPixelBufferLock_ReadOnly);
+
+    uint64_t sequence;
+    int64_t timestamp;
+    _GetFrameInfo(buffer, sequence, timestamp);
+
+    wcc::FrameView view = wcc::MakeFrameView(
+        wcc::VideoFormat::Bgra32,
+        (uint32_t)CVPixelBufferGetWidth(buffer), (uint32_t)CVPixelBufferGetHeight(buffer),
+        (const uint8_t*)CVPixelBufferGetBaseAddress(buffer), (uint32_t)CVPixelBufferGetBytesPerRow(buffer));
+
+    wcc::FrameInfo info = mCounter.Deliver(sequence, timestamp);
+    WCC_STATS(mProcessor.GetStats().AddFrame(info);)
+
+    return wcc::FrameLease(view, info, &_ReleasePixelBuffer, nullptr, (uintptr_t)buffer, &mLeases);
+}
+
+- (void)SetMaxLeases: (uint32_t)leases
+{
+    mLeases.SetMax(leases);
+}
+
+- (wcc::StatsSnapshot)GetStats
+{
+    return mProcessor.GetStats().GetSnapshot();
+}
+
+- (void)ResetStats
+{
+    mProcessor.GetStats().Reset();
+}
+
+- (void)_RunOnCaptureQueue: (dispatch_block_t)block
+{
+    // The processor is used on the capture queue, so it's changed there
+    dispatch_queue_t queue = mDataOut ? mDataOut.sampleBufferCallbackQueue : nullptr;
+
+    if (queue)
+        dispatch_sync(queue, block);
+    else
+        block();
 }
 
 - (void)Start
@@ -355,35 +724,77 @@ namespace mwcc
 
         [mSession stopRunning];
     }
+
+    if (CVPixelBufferRef latest = mLatest.exchange(nullptr))
+        CVPixelBufferRelease(latest);
+}
+
+- (void)captureOutput:(AVCaptureOutput*)captureOutput didDropSampleBuffer:(CMSampleBufferRef)sampleBuffer fromConnection:(AVCaptureConnection*)connection
+{
+    // Late frames are discarded (alwaysDiscardsLateVideoFrames), they still take a sequence number
+    mSequence++;
 }
 
 - (void)captureOutput:(AVCaptureOutput*)captureOutput didOutputSampleBuffer:(CMSampleBufferRef)sampleBuffer fromConnection:(AVCaptureConnection*)connection
 {
-    if (!mCapParams.wantCapture)
+    uint64_t sequence = mSequence++;
+
+    if (!mWantCapture && !mWantLease)
         return;
 
+    // The session runs on the host time clock (mach_absolute_time), which is the clock of GetMonotonicTime
+    CMTime time = CMSampleBufferGetPresentationTimeStamp(sampleBuffer);
+    int64_t timestamp = CMTIME_IS_NUMERIC(time) ? CMTimeConvertScale(time, 1000000000, kCMTimeRoundingMethod_Default).value : 0;
+
     @autoreleasepool
     {
         CVImageBufferRef buffer = CMSampleBufferGetImageBuffer(sampleBuffer);
-		CVPixelBufferLockBaseAddress(buffer, 0);
-        
-        // Convert from BGRA to RGBA.
-        [self _SetSourceFromBGRA: (uint8_t*)CVPixelBufferGetBaseAddress(buffer)];
 
-        // Downscale a frame
-        uint32_t* dst = mCapParams.output;
-        uint32_t* src = reinterpret_cast<uint32_t*>(mCapParams.source);
+        if (mWantLease)
+        {
+            // Keep only the newest frame, the older one goes back to the pool
+            _SetFrameInfo(buffer, sequence, timestamp);
+            CVPixelBufferRetain(buffer);
+
+            if (CVPixelBufferRef old = mLatest.exchange(buffer))
+                CVPixelBufferRelease(old);
+        }
+
+        if (!mWantCapture)
+            return;
+
+		CVPixelBufferLockBaseAddress(buffer, kCVPixelBufferLock_ReadOnly);
 
-        for (uint32_t y = 0; y < mCapParams.desiredHeight; y++)
-            for (uint32_t x = 0; x < mCapParams.desiredWidth; x++, dst++)
-            {
-                uint32_t i = y * mCapParams.actualHeight / mCapParams.desiredHeight * mCapParams.actualWidth + x * mCapParams.actualWidth / mCapParams.desiredWidth;
-                *dst = src[i];
-            }
+        // Convert from BGRA to RGBA and downscale a frame in one pass, rows of a pixel buffer may be padded
+        wcc::FrameView view = wcc::MakeFrameView(
+            wcc::VideoFormat::Bgra32,
+            (uint32_t)CVPixelBufferGetWidth(buffer), (uint32_t)CVPixelBufferGetHeight(buffer),
+            (const uint8_t*)CVPixelBufferGetBaseAddress(buffer), (uint32_t)CVPixelBufferGetBytesPerRow(buffer));
 
-        mCapParams.isFrameReady = true;
+        wcc::FrameInfo info;
+        info.nSequence = sequence;
+        info.nTimestamp = timestamp;
+
+        // The application keeps the previous frame
+        bool published = false;
+
+        if (mDetector.Update(wcc::CropFrameView(view, mProcessor.GetRegion())))
+        {
+            mDetector.Mark(info);
+            info.nSkipped = mSkipped;
+
+            mProcessor.Process(view, mExchange.GetBackBuffer());
+            mExchange.Publish(info);
+            published = true;
+        }
+        else
+            mSkipped++;
 
 		CVPixelBufferUnlockBaseAddress(buffer, kCVPixelBufferLock_ReadOnly);
+
+        // A pending request takes the frame right here instead of waiting for DoCapture
+        if (published && mRequest.Claim())
+            mRequest.Finish([self DoCapture]);
     }
 }
 
@@ -413,15 +824,6 @@ namespace mwcc
     return devices;
 }
 
-- (void)_SetSourceFromBGRA: (uint8_t*)input
-{
-    uint32_t size = mCapParams.actualWidth * mCapParams.actualHeight * 4;
-    memcpy(mCapParams.source, input, size);
-
-    for (uint32_t i = 0; i < size; i += 4)
-        std::swap(mCapParams.source[i], mCapParams.source[i + 2]);
-}
-
 @end
 
 namespace mwcc
@@ -462,16 +864,182 @@ std::vector<std::wstring> EnumerateDevices()
     return names;
 }
 
-bool DoCapture()
+wcc::FrameInfo DoCapture()
 {
     return [gCapturer DoCapture];
 }
 
-void SetBuffer(uint32_t* buffer)
+bool RequestFrame(wcc::FrameCallback done, void* context)
+{
+    return [gCapturer RequestFrame:done context:context];
+}
+
+void SetBuffer(void* buffer)
 {
     gCapturer->mCapParams.output = buffer;
 }
 
+void SetOutputFormat(wcc::OutputFormat format)
+{
+    [gCapturer SetOutputFormat:format];
+}
+
+void SetTensorFormat(const wcc::TensorDesc& desc)
+{
+    [gCapturer SetTensorFormat:desc];
+}
+
+size_t GetOutputSize()
+{
+    return [gCapturer GetOutputSize];
+}
+
+void SetScaleMode(wcc::ScaleMode mode)
+{
+    [gCapturer SetScaleMode:mode];
+}
+
+void SetRegion(wcc::Rect region)
+{
+    [gCapturer SetRegion:region];
+}
+
+wcc::Rect GetRegion()
+{
+    return [gCapturer GetRegion];
+}
+
+void SetThreadCount(uint32_t threads)
+{
+    [gCapturer SetThreadCount:threads];
+}
+
+void SetChangeDetection(const wcc::ChangeDetector::Settings& settings)
+{
+    [gCapturer SetChangeDetection:settings];
+}
+
+wcc::FrameLease LeaseFrame()
+{
+    return [gCapturer LeaseFrame];
+}
+
+wcc::CaptureMode GetCaptureMode()
+{
+    return gCapturer->mMode;
+}
+
+std::vector<wcc::CaptureMode> GetCaptureModes()
+{
+    return gCapturer->mModes;
+}
+
+void SetMaxLeases(uint32_t leases)
+{
+    [gCapturer SetMaxLeases:leases];
+}
+
+wcc::StatsSnapshot GetStats()
+{
+    return [gCapturer GetStats];
+}
+
+void ResetStats()
+{
+    [gCapturer ResetStats];
+}
+
+Capturer::~Capturer()
+{
+    mInitTask.Cancel();
+
+    if (mInitThread.joinable())
+        mInitThread.join();
+
+    Stop();
+}
+
+bool Capturer::Init(uint32_t deviceID, uint32_t frameWidth, uint32_t frameHeight, float framerate)
+{
+    return Open(deviceID, frameWidth, frameHeight, framerate, {});
+}
+
+bool Capturer::Open(uint32_t deviceID, uint32_t frameWidth, uint32_t frameHeight, float framerate, const wcc::InitTask& task)
+{
+    Stop();
+
+    mCapturer = [_Capturer_MacOS new];
+    mCapturer->mInitTask = task;
+
+    if (![mCapturer Init:deviceID width:frameWidth height:frameHeight framerate:framerate] || task.IsCancelled())
+    {
+        [mCapturer release];
+        mCapturer = nil;
+        return false;
+    }
+
+    [mCapturer Start];
+    return true;
+}
+
+wcc::InitTask Capturer::InitAsync(uint32_t deviceID, uint32_t frameWidth, uint32_t frameHeight, float framerate)
+{
+    // Only the last task counts
+    mInitTask.Cancel();
+
+    if (mInitThread.joinable())
+        mInitThread.join();
+
+    wcc::InitTask task = wcc::InitTask::Create();
+    mInitTask = task;
+
+    mInitThread = std::thread([this, task, deviceID, frameWidth, frameHeight, framerate]()
+    {
+        @autoreleasepool
+        {
+            task.Finish(Open(deviceID, frameWidth, frameHeight, framerate, task));
+        }
+    });
+
+    return task;
+}
+
+void Capturer::Stop()
+{
+    if (!mCapturer)
+        return;
+
+    [mCapturer Stop];
+    [mCapturer release];
+    mCapturer = nil;
+}
+
+wcc::FrameInfo Capturer::DoCapture() { return mCapturer ? [mCapturer DoCapture] : wcc::FrameInfo{}; }
+wcc::FrameLease Capturer::LeaseFrame() { return mCapturer ? [mCapturer LeaseFrame] : wcc::FrameLease{}; }
+bool Capturer::RequestFrame(wcc::FrameCallback done, void* context) { return mCapturer ? [mCapturer RequestFrame:done context:context] : false; }
+
+void Capturer::SetBuffer(void* buffer) { mCapturer->mCapParams.output = buffer; }
+
+void Capturer::SetOutputFormat(wcc::OutputFormat format) { [mCapturer SetOutputFormat:format]; }
+void Capturer::SetTensorFormat(const wcc::TensorDesc& desc) { [mCapturer SetTensorFormat:desc]; }
+size_t Capturer::GetOutputSize() const { return [mCapturer GetOutputSize]; }
+
+void Capturer::SetScaleMode(wcc::ScaleMode mode) { [mCapturer SetScaleMode:mode]; }
+void Capturer::SetRegion(wcc::Rect region) { [mCapturer SetRegion:region]; }
+wcc::Rect Capturer::GetRegion() const { return [mCapturer GetRegion]; }
+void Capturer::SetThreadCount(uint32_t threads) { [mCapturer SetThreadCount:threads]; }
+void Capturer::SetChangeDetection(const wcc::ChangeDetector::Settings& settings) { [mCapturer SetChangeDetection:settings]; }
+void Capturer::SetMaxLeases(uint32_t leases) { [mCapturer SetMaxLeases:leases]; }
+
+uint32_t Capturer::GetFrameWidth() const { return mCapturer->mCapParams.actualWidth; }
+uint32_t Capturer::GetFrameHeight() const { return mCapturer->mCapParams.actualHeight; }
+
+const wcc::CaptureMode& Capturer::GetCaptureMode() const { return mCapturer->mMode; }
+const std::vector<wcc::CaptureMode>& Capturer::GetCaptureModes() const { return mCapturer->mModes; }
+
+wcc::StatsSnapshot Capturer::GetStats() const { return [mCapturer GetStats]; }
+void Capturer::ResetStats() { [mCapturer ResetStats]; }
+
 }
 
 #endif
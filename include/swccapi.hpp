@@ -0,0 +1,1826 @@
+/* GENERAL INFO
+
+    swccapi.hpp
+
+    +----------------------------------+
+    |             WCCAPI               |
+    |       WebCam Capturing API       |
+    +----------------------------------+
+
+
+    Distributed under GPL3 license
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+                    GNU GENERAL PUBLIC LICENSE
+                      Version 3, 29 June 2007
+
+    Copyright (C) 2007 Free Software Foundation, Inc. <https://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies
+    of this license document, but changing it is not allowed.
+
+
+    Author
+    ~~~~~~
+
+    Alex, aka defini7, Copyright (C) 2025
+
+*/
+
+/* VERSION HISTORY
+
+    0.01: Added a source backend that replays raw and Y4M files and generates synthetic patterns
+    0.02: Added a recorder that writes frames to Y4M or raw files on a background thread
+    0.03: Added SetRegion to convert only a part of the frame
+    0.04: Added SetChangeDetection to skip frames where nothing has changed
+    0.05: Added InitAsync that opens the source on a thread of its own
+    0.06: Patterns, Y4M chroma and recorder slots live in buffers of wcc::GetBufferPool()
+    0.07: Added SetTensorFormat for wcc::OutputFormat::Tensor
+    0.08: Added SetColorSpace and SourceDesc::colorSpace, Y4M streams can set the range with XCOLORRANGE
+    0.09: Added RequestFrame and NextFrame, paced frames are waited for with a timer of wcc::GetFrameLoop
+*/
+
+/* NOTES
+
+    swcc::Capturer has the same interface as the capturers of the other backends,
+    but its "devices" are sources registered with swcc::AddSource: raw frames
+    (YUY2, NV12, RGB24, RGB32, BGRA or Gray8) or Y4M streams that are mapped into memory,
+    or synthetic patterns. It runs everywhere, so the pipeline can be load tested
+    without a camera.
+
+    Y4M streams are stored as planar YUV, 4:2:0 is handed over as NV12 and 4:2:2 as YUY2
+    (the chroma is interleaved into a scratch buffer), monochrome streams as Gray8.
+
+    swcc::Recorder writes what the capturers deliver into the same kinds of files, so
+    a recording can be replayed later. io_uring is not used: every write is a few megabytes
+    on a thread of its own, so the submission overhead it saves doesn't matter here.
+*/
+
+#ifndef SWCCAPI_HPP
+#define SWCCAPI_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <list>
+#include <vector>
+
+#ifdef SWCCAPI_IMPL
+#define WCCAPI_IMPL
+#endif
+
+#include "wccapi.hpp"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace swcc
+{
+    using wcc::VideoFormat;
+    using wcc::ScaleMode;
+    using wcc::OutputFormat;
+
+    enum class Pattern
+    {
+        Bars, // Eight color bars moving to the left
+        Gradient,
+        Noise
+    };
+
+    enum class Pacing
+    {
+        RealTime, // Frames come at the frame rate of the source, frames a slow reader misses are dropped
+        Unpaced // Every capture returns the next frame at once, for throughput tests
+    };
+
+    struct SourceDesc
+    {
+        std::string sName;
+
+        // Raw frames or a Y4M stream (*.y4m), a synthetic pattern if it's empty
+        std::string sPath;
+        Pattern nPattern = Pattern::Bars;
+
+        // Format and size of raw files and patterns, Y4M streams have them in the header.
+        // A pattern of 0x0 takes the size passed to Init
+        VideoFormat nFormat = VideoFormat::Yuy2;
+        uint32_t nWidth = 0, nHeight = 0;
+
+        // 0 takes the frame rate passed to Init (Y4M streams have it in the header)
+        uint32_t nFpsNumerator = 0;
+        uint32_t nFpsDenominator = 1;
+
+        // How YUV frames are converted, like what a device reports. Auto fields are taken from the Y4M header
+        // (only the range, XCOLORRANGE) and become BT.601 limited range, which is what the patterns are rendered in
+        wcc::ColorSpace colorSpace;
+    };
+
+    // Registers a source, its index is the device id for Init.
+    // Not thread safe, must be called before any Capturer is created
+    uint32_t AddSource(const SourceDesc& desc);
+    void ClearSources();
+
+    namespace internal
+    {
+        std::vector<SourceDesc>& GetSources();
+
+        // Read-only mapping of a whole file
+        class MappedFile
+        {
+        public:
+            MappedFile() = default;
+            ~MappedFile();
+
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            bool Open(const std::string& sPath);
+            void Close();
+
+            const uint8_t* GetData() const;
+            size_t GetSize() const;
+
+        private:
+            const uint8_t* m_pData = nullptr;
+            size_t m_nSize = 0;
+
+        #ifdef _WIN32
+            HANDLE m_hFile = INVALID_HANDLE_VALUE;
+            HANDLE m_hMapping = nullptr;
+        #endif
+
+        };
+
+        enum class Y4mLayout
+        {
+            None, // Not a Y4M stream
+            Mono,
+            I420,
+            I422
+        };
+
+        struct Y4mHeader
+        {
+            uint32_t nWidth = 0, nHeight = 0;
+            uint32_t nFpsNumerator = 0, nFpsDenominator = 1;
+            Y4mLayout nLayout = Y4mLayout::I420;
+
+            // The range of the XCOLORRANGE extension, the matrix is always Auto
+            wcc::ColorSpace colorSpace;
+
+            // Where the first FRAME marker starts
+            size_t nHeaderSize = 0;
+        };
+
+        bool ParseY4mHeader(const uint8_t* pData, size_t nSize, Y4mHeader& header);
+
+        // Size of the planar frame data that follows every FRAME marker
+        size_t GetY4mFrameSize(const Y4mHeader& header);
+
+        // Interleaves planar chroma into NV12 (UV plane only) and YUY2
+        void PackI420(const uint8_t* pU, const uint8_t* pV, uint8_t* pUV, uint32_t nWidth, uint32_t nHeight);
+        void PackI422(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV, uint8_t* pDst, uint32_t nWidth, uint32_t nHeight);
+
+        // The other way around, writes all planes of a Y4M frame into pDst
+        void UnpackNv12(const wcc::FrameView& src, uint8_t* pDst);
+        void UnpackYuy2(const wcc::FrameView& src, uint8_t* pDst);
+
+        // Write-only file that bypasses the page cache if the file system allows it.
+        // Then the data, its size and the position must be multiples of c_nAlignment, except for the size passed to Close
+        class DirectFile
+        {
+        public:
+            static constexpr size_t c_nAlignment = 4096;
+
+            DirectFile() = default;
+            ~DirectFile();
+
+            DirectFile(const DirectFile&) = delete;
+            DirectFile& operator=(const DirectFile&) = delete;
+
+            bool Open(const std::string& sPath);
+
+            // Cuts the file to nSize bytes, the last write may have been padded
+            void Close(uint64_t nSize);
+
+            bool Write(const uint8_t* pData, size_t nSize);
+            bool IsDirect() const;
+
+        private:
+            // Cleared by Write if the file system refuses unbuffered writes
+            std::atomic<bool> m_bDirect{false};
+            uint64_t m_nPosition = 0;
+
+        #ifdef _WIN32
+            HANDLE m_hFile = INVALID_HANDLE_VALUE;
+        #else
+            int m_nFd = -1;
+        #endif
+
+        };
+
+        // BT.601 studio range, the inverse of wcc::internal::ConvertFromYUV
+        void ConvertToYUV(int r, int g, int b, uint8_t& y, uint8_t& u, uint8_t& v);
+
+        // Renders frame nFrame of the pattern, frames are stored contiguously with rows of nWidth pixels
+        void RenderPattern(Pattern nPattern, VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, uint32_t nFrame, uint8_t* pDst);
+    }
+
+    class Capturer
+    {
+    public:
+        Capturer() = default;
+        ~Capturer();
+
+        // nDevice is an index of a source from AddSource, nWidth and nHeight are the size of the output.
+        // FPS = (float)nFpsNumerator / (float)nFpsDenominator, used by sources that don't have their own.
+        bool Init(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1);
+
+        // Runs Init on a thread of its own and returns at once, see wcc::InitTask
+        wcc::InitTask InitAsync(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1);
+
+        static std::list<std::wstring> EnumerateDevices();
+
+        // Returns the next frame of the source, files start over when they end.
+        // The info is invalid if there's no source or no buffer
+        wcc::FrameInfo DoCapture();
+
+        // Returns at once and calls fnDone with what DoCapture would have returned once the next frame is due.
+        // A timer of wcc::GetFrameLoop waits instead of DoCapture, fnDone runs on its thread. False if a request is pending
+        bool RequestFrame(wcc::FrameCallback fnDone, void* pContext);
+
+    #ifdef WCC_COROUTINES
+        // co_await NextFrame() waits like DoCapture without blocking the thread, see wcc::FrameAwaitable
+        wcc::FrameAwaitable<Capturer> NextFrame(const wcc::Executor& executor = wcc::GetFrameLoop().GetExecutor())
+        {
+            return wcc::FrameAwaitable<Capturer>(*this, executor);
+        }
+    #endif
+
+        // Returns the next frame in the native format without copying (raw files and patterns)
+        wcc::FrameLease LeaseFrame();
+
+        void SetMaxLeases(uint32_t nLeases);
+        uint32_t GetMaxLeases() const;
+
+        // RealTime by default
+        void SetPacing(Pacing nPacing);
+
+        // Replaces the source before the next frame, as if the device changed its format.
+        // Can be called from any thread, it's applied once no leases are alive
+        void SwitchSource(uint32_t nDevice);
+
+        uint32_t GetFrameWidth() const;
+        uint32_t GetFrameHeight() const;
+        uint32_t GetDeviceCount() const;
+
+        VideoFormat GetVideoFormat() const;
+
+        // pBuffer must be at least GetOutputSize() bytes in size,
+        // sizeof(uint32_t) * m_nDesiredWidth * m_nDesiredHeight for RGBA
+        void SetBuffer(void* pBuffer);
+
+        // RGBA by default, see wcc::OutputFormat
+        void SetOutputFormat(OutputFormat nFormat);
+        VideoFormat GetOutputVideoFormat() const;
+
+        // Layout, type and normalization of wcc::OutputFormat::Tensor, see wcc::TensorDesc
+        void SetTensorFormat(const wcc::TensorDesc& desc);
+
+        // The matrix and range of YUV frames, Auto fields take the ones of the source (see SourceDesc::colorSpace).
+        // GetColorSpace returns the one frames are converted with
+        void SetColorSpace(const wcc::ColorSpace& colorSpace);
+        wcc::ColorSpace GetColorSpace() const;
+
+        size_t GetOutputSize() const;
+        uint32_t GetOutputStride() const;
+
+        // Nearest is used by default
+        void SetScaleMode(ScaleMode nMode);
+
+        // Converts and scales only a part of the frame, in the pixels of the frame (see wcc::FrameProcessor::SetRegion).
+        // An empty region is the whole frame
+        void SetRegion(const wcc::Rect& region);
+        wcc::Rect GetRegion() const;
+
+        // Number of threads converting large frames, 1 by default and 0 means one per CPU core
+        void SetThreadCount(uint32_t nThreads);
+
+        // Skips frames where nothing has changed within the region (see wcc::ChangeDetector), disabled by default.
+        // DoCapture leaves the output buffer as it is and returns an invalid info with bUnchanged set for them,
+        // the next delivered frame counts them in nSkipped
+        void SetChangeDetection(const wcc::ChangeDetector::Settings& settings);
+
+        // Can be called from any thread, all zeros unless WCCAPI_ENABLE_STATS is defined
+        wcc::StatsSnapshot GetStats() const;
+        void ResetStats();
+
+    private:
+        // Init that stops between its steps once the task is cancelled
+        bool Open(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator, const wcc::InitTask& task);
+
+        bool OpenSource(const uint32_t nDevice);
+
+        // Applies a pending SwitchSource
+        bool UpdateSource();
+
+        // Waits until the next frame is due and returns its sequence number
+        uint64_t WaitForFrame(int64_t& nTimestamp);
+
+        // The sequence number of the next frame and when it's due, without waiting for it or taking it.
+        // Starts the clock on the first call
+        uint64_t GetNextFrame(int64_t nNow, int64_t& nTimestamp);
+
+        // Runs on the frame loop when the requested frame is due
+        static void OnFrameDue(void* pContext);
+
+        // Describes frame nSequence, pScratch gets the interleaved chroma of Y4M streams
+        wcc::FrameView GetFrame(uint64_t nSequence, uint8_t* pScratch) const;
+
+        // Size of the scratch buffer GetFrame needs, zero if the frames are used in place
+        size_t GetScratchSize() const;
+
+        static void ReleaseBuffer(void* pOwner, uintptr_t nScratch);
+
+    private:
+        static constexpr uint32_t c_nPatternFrames = 8;
+        static constexpr uint32_t c_nNoSource = UINT32_MAX;
+
+        uint32_t m_nDevices = 0;
+        std::atomic<uint32_t> m_nPendingSource{c_nNoSource};
+
+        internal::MappedFile m_File;
+        internal::Y4mLayout m_nLayout = internal::Y4mLayout::None;
+
+        // Offsets of the frames in m_File, patterns are rendered once into m_Pattern
+        std::vector<size_t> m_vecFrameOffsets;
+        wcc::FrameBuffer m_Pattern;
+        size_t m_nPatternFrameSize = 0;
+        uint32_t m_nFrameCount = 0;
+
+        wcc::FrameBuffer m_Scratch;
+
+        Pacing m_nPacing = Pacing::RealTime;
+        bool m_bStarted = false;
+        int64_t m_nStartTime = 0;
+        uint64_t m_nNextSequence = 0;
+
+        wcc::LeaseLimit m_Leases;
+        wcc::FrameCounter m_Counter;
+        wcc::FrameRequest m_Request;
+
+        // Converts and scales frames into m_pOutput (or copies them for OutputFormat::Native)
+        wcc::FrameProcessor m_Processor;
+        wcc::ChangeDetector m_Detector;
+        void* m_pOutput = nullptr;
+
+        // Mapping a large file takes a while, Init is cancelled before that
+        wcc::InitTask m_InitTask;
+        std::thread m_InitThread;
+
+        uint32_t m_nDesiredWidth = 0, m_nDesiredHeight = 0;
+        uint32_t m_nFrameWidth = 0, m_nFrameHeight = 0;
+        uint32_t m_nFrameSourceStride = 0;
+
+        VideoFormat m_nVideoFormat = VideoFormat::None;
+
+        // Asked for by the user and the one of the current source
+        wcc::ColorSpace m_ColorSpace;
+        wcc::ColorSpace m_SourceColorSpace;
+
+        uint32_t m_nFpsNumerator = 0;
+        uint32_t m_nFpsDenominator = 0;
+
+        // Frame rate of the current source
+        uint32_t m_nSourceFpsNumerator = 0;
+        uint32_t m_nSourceFpsDenominator = 0;
+
+    };
+
+    enum class RecordFormat
+    {
+        Y4m, // NV12 as 4:2:0, YUY2 as 4:2:2 and Gray8 as mono, other formats can't be stored
+        Raw // The frames as they are, <path>.idx lists the offset, size, sequence number and timestamp of each one
+    };
+
+    struct RecorderStats
+    {
+        // Frames waiting for the I/O thread
+        uint32_t nQueueDepth = 0;
+        uint32_t nMaxQueueDepth = 0;
+        uint32_t nQueueSize = 0;
+
+        uint64_t nWritten = 0;
+        uint64_t nBytes = 0;
+
+        // Frames pushed while the queue was full
+        uint64_t nDropped = 0;
+
+        // The page cache is bypassed (O_DIRECT or FILE_FLAG_NO_BUFFERING)
+        bool bDirect = false;
+
+        // A write failed, the recorder drops everything after it
+        bool bFailed = false;
+    };
+
+    // Writes frames to disk on its own thread, so a slow disk never stalls the capture.
+    // Frames are copied into a queue of buffers allocated by Open and written in large sequential blocks
+    class Recorder
+    {
+    public:
+        Recorder() = default;
+        ~Recorder();
+
+        Recorder(const Recorder&) = delete;
+        Recorder& operator=(const Recorder&) = delete;
+
+        // Frames must have the format and the size passed here, nQueueSize frames can wait for the disk.
+        // MJPEG frames can only be stored raw and must not be larger than two bytes per pixel
+        bool Open(const std::string& sPath, RecordFormat nRecordFormat, VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight,
+            uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1, uint32_t nQueueSize = 16);
+
+        // Writes all queued frames and closes the files
+        void Close();
+        bool IsOpen() const;
+
+        // Copies the frame into the queue and returns at once, false if it was dropped.
+        // Must be called from one thread only
+        bool Push(const wcc::FrameView& view, const wcc::FrameInfo& info);
+        bool Push(const wcc::FrameLease& lease);
+
+        // A buffer filled by DoCapture, open the recorder with GetOutputVideoFormat and the output size
+        bool Push(const void* pData, const wcc::FrameInfo& info);
+
+        // Can be called from any thread
+        RecorderStats GetStats() const;
+
+    private:
+        struct Slot
+        {
+            wcc::FrameBuffer buffer;
+            size_t nSize = 0;
+            wcc::FrameInfo info;
+        };
+
+        // Serializes the frame into the slot
+        bool Store(const wcc::FrameView& view, Slot& slot) const;
+
+        void WriterMain();
+
+        // Appends to the staging buffer and writes it once it's full
+        bool Append(const uint8_t* pData, size_t nSize);
+
+    private:
+        // Size of one write
+        static constexpr size_t c_nStagingSize = 4 << 20;
+
+        RecordFormat m_nRecordFormat = RecordFormat::Raw;
+        VideoFormat m_nFormat = VideoFormat::None;
+        uint32_t m_nWidth = 0, m_nHeight = 0;
+
+        size_t m_nSlotSize = 0;
+        std::vector<Slot> m_vecSlots;
+
+        std::mutex m_Mutex;
+        std::condition_variable m_cvReady;
+
+        std::vector<uint32_t> m_vecFree;
+
+        // Filled frames from the oldest to the newest
+        std::vector<uint32_t> m_vecReady;
+
+        bool m_bClosing = false;
+        std::thread m_Writer;
+
+        // Used by the I/O thread only
+        internal::DirectFile m_File;
+        FILE* m_pIndex = nullptr;
+        uint8_t* m_pStaging = nullptr;
+        size_t m_nStaged = 0;
+        uint64_t m_nFileSize = 0;
+
+        std::atomic<uint32_t> m_nQueueDepth{0};
+        std::atomic<uint32_t> m_nMaxQueueDepth{0};
+        std::atomic<uint64_t> m_nWritten{0};
+        std::atomic<uint64_t> m_nBytes{0};
+        std::atomic<uint64_t> m_nDropped{0};
+        std::atomic<bool> m_bFailed{false};
+
+    };
+
+#ifdef SWCCAPI_IMPL
+#undef SWCCAPI_IMPL
+
+    std::vector<SourceDesc>& internal::GetSources()
+    {
+        static std::vector<SourceDesc> s_vecSources;
+        return s_vecSources;
+    }
+
+    uint32_t AddSource(const SourceDesc& desc)
+    {
+        internal::GetSources().push_back(desc);
+        return (uint32_t)internal::GetSources().size() - 1;
+    }
+
+    void ClearSources()
+    {
+        internal::GetSources().clear();
+    }
+
+    internal::MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+#ifdef _WIN32
+    bool internal::MappedFile::Open(const std::string& sPath)
+    {
+        Close();
+
+        m_hFile = CreateFileA(sPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER nSize;
+
+        if (!GetFileSizeEx(m_hFile, &nSize) || nSize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+
+        m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+        if (m_hMapping)
+            m_pData = (const uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+
+        if (!m_pData)
+        {
+            Close();
+            return false;
+        }
+
+        m_nSize = (size_t)nSize.QuadPart;
+        return true;
+    }
+
+    void internal::MappedFile::Close()
+    {
+        if (m_pData)
+            UnmapViewOfFile(m_pData);
+
+        if (m_hMapping)
+            CloseHandle(m_hMapping);
+
+        if (m_hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(m_hFile);
+
+        m_pData = nullptr;
+        m_nSize = 0;
+        m_hMapping = nullptr;
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+#else
+    bool internal::MappedFile::Open(const std::string& sPath)
+    {
+        Close();
+
+        int nFd = ::open(sPath.c_str(), O_RDONLY);
+
+        if (nFd == -1)
+            return false;
+
+        struct stat info;
+        void* pData = MAP_FAILED;
+
+        if (fstat(nFd, &info) == 0 && info.st_size > 0)
+            pData = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, nFd, 0);
+
+        // The mapping stays valid after the file is closed
+        ::close(nFd);
+
+        if (pData == MAP_FAILED)
+            return false;
+
+        // Frames are read one after another
+        madvise(pData, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+        m_pData = (const uint8_t*)pData;
+        m_nSize = (size_t)info.st_size;
+
+        return true;
+    }
+
+    void internal::MappedFile::Close()
+    {
+        if (m_pData)
+            munmap((void*)m_pData, m_nSize);
+
+        m_pData = nullptr;
+        m_nSize = 0;
+    }
+#endif
+
+    const uint8_t* internal::MappedFile::GetData() const { return m_pData; }
+    size_t internal::MappedFile::GetSize() const { return m_nSize; }
+
+    bool internal::ParseY4mHeader(const uint8_t* pData, size_t nSize, Y4mHeader& header)
+    {
+        const char c_sMagic[] = "YUV4MPEG2 ";
+        const size_t c_nMagicSize = sizeof(c_sMagic) - 1;
+
+        if (nSize < c_nMagicSize || memcmp(pData, c_sMagic, c_nMagicSize) != 0)
+            return false;
+
+        const uint8_t* pEnd = (const uint8_t*)memchr(pData, '\n', nSize);
+
+        if (!pEnd)
+            return false;
+
+        std::string sHeader((const char*)pData + c_nMagicSize, (const char*)pEnd);
+        header = Y4mHeader{};
+
+        size_t nPos = 0;
+
+        while (nPos < sHeader.size())
+        {
+            size_t nNext = sHeader.find(' ', nPos);
+
+            if (nNext == std::string::npos)
+                nNext = sHeader.size();
+
+            std::string sToken = sHeader.substr(nPos, nNext - nPos);
+            nPos = nNext + 1;
+
+            if (sToken.empty())
+                continue;
+
+            std::string sValue = sToken.substr(1);
+
+            switch (sToken[0])
+            {
+            case 'W': header.nWidth = (uint32_t)strtoul(sValue.c_str(), nullptr, 10); break;
+            case 'H': header.nHeight = (uint32_t)strtoul(sValue.c_str(), nullptr, 10); break;
+
+            case 'F':
+                if (sscanf(sValue.c_str(), "%u:%u", &header.nFpsNumerator, &header.nFpsDenominator) != 2)
+                    return false;
+                break;
+
+            case 'C':
+                // 420jpeg, 420paldv, 420mpeg2 and 420 differ only in the chroma siting
+                if (sValue.compare(0, 3, "420") == 0)
+                    header.nLayout = Y4mLayout::I420;
+                else if (sValue == "422")
+                    header.nLayout = Y4mLayout::I422;
+                else if (sValue == "mono")
+                    header.nLayout = Y4mLayout::Mono;
+                else
+                    return false;
+                break;
+
+            case 'X':
+                if (sValue == "COLORRANGE=FULL")
+                    header.colorSpace.nRange = wcc::ColorRange::Full;
+                else if (sValue == "COLORRANGE=LIMITED")
+                    header.colorSpace.nRange = wcc::ColorRange::Limited;
+                break;
+
+            // Interlacing, aspect ratio and other extensions don't change the layout
+            default:
+                break;
+            }
+        }
+
+        header.nHeaderSize = (size_t)(pEnd - pData) + 1;
+
+        // The chroma is subsampled horizontally, odd widths would need padding
+        return header.nWidth > 0 && header.nHeight > 0 && (header.nLayout == Y4mLayout::Mono || header.nWidth % 2 == 0);
+    }
+
+    size_t internal::GetY4mFrameSize(const Y4mHeader& header)
+    {
+        size_t nLuma = (size_t)header.nWidth * header.nHeight;
+
+        switch (header.nLayout)
+        {
+        case Y4mLayout::Mono: return nLuma;
+        case Y4mLayout::I420: return nLuma + 2 * (size_t)(header.nWidth / 2) * ((header.nHeight + 1) / 2);
+        case Y4mLayout::I422: return nLuma * 2;
+        default: return 0;
+        }
+    }
+
+    void internal::PackI420(const uint8_t* pU, const uint8_t* pV, uint8_t* pUV, uint32_t nWidth, uint32_t nHeight)
+    {
+        size_t nChroma = (size_t)(nWidth / 2) * ((nHeight + 1) / 2);
+
+        for (size_t i = 0; i < nChroma; i++)
+        {
+            pUV[2 * i] = pU[i];
+            pUV[2 * i + 1] = pV[i];
+        }
+    }
+
+    void internal::PackI422(const uint8_t* pY, const uint8_t* pU, const uint8_t* pV, uint8_t* pDst, uint32_t nWidth, uint32_t nHeight)
+    {
+        size_t nPairs = (size_t)(nWidth / 2) * nHeight;
+
+        for (size_t i = 0; i < nPairs; i++)
+        {
+            pDst[4 * i] = pY[2 * i];
+            pDst[4 * i + 1] = pU[i];
+            pDst[4 * i + 2] = pY[2 * i + 1];
+            pDst[4 * i + 3] = pV[i];
+        }
+    }
+
+    void internal::UnpackNv12(const wcc::FrameView& src, uint8_t* pDst)
+    {
+        for (uint32_t y = 0; y < src.nHeight; y++, pDst += src.nWidth)
+            memcpy(pDst, src.pPlanes[0] + (size_t)y * src.nStrides[0], src.nWidth);
+
+        uint32_t nChromaWidth = src.nWidth / 2;
+        uint32_t nChromaHeight = (src.nHeight + 1) / 2;
+
+        uint8_t* pU = pDst;
+        uint8_t* pV = pDst + (size_t)nChromaWidth * nChromaHeight;
+
+        for (uint32_t y = 0; y < nChromaHeight; y++)
+        {
+            const uint8_t* pUV = src.pPlanes[1] + (size_t)y * src.nStrides[1];
+
+            for (uint32_t x = 0; x < nChromaWidth; x++)
+            {
+                *pU++ = pUV[2 * x];
+                *pV++ = pUV[2 * x + 1];
+            }
+        }
+    }
+
+    void internal::UnpackYuy2(const wcc::FrameView& src, uint8_t* pDst)
+    {
+        size_t nPairs = (size_t)(src.nWidth / 2) * src.nHeight;
+
+        uint8_t* pY = pDst;
+        uint8_t* pU = pDst + nPairs * 2;
+        uint8_t* pV = pU + nPairs;
+
+        for (uint32_t y = 0; y < src.nHeight; y++)
+        {
+            const uint8_t* pRow = src.pPlanes[0] + (size_t)y * src.nStrides[0];
+
+            for (uint32_t x = 0; x < src.nWidth / 2; x++, pRow += 4)
+            {
+                *pY++ = pRow[0];
+                *pU++ = pRow[1];
+                *pY++ = pRow[2];
+                *pV++ = pRow[3];
+            }
+        }
+    }
+
+    internal::DirectFile::~DirectFile()
+    {
+        Close(m_nPosition);
+    }
+
+#ifdef _WIN32
+    bool internal::DirectFile::Open(const std::string& sPath)
+    {
+        Close(m_nPosition);
+
+        m_hFile = CreateFileA(sPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_NO_BUFFERING, nullptr);
+
+        m_bDirect = m_hFile != INVALID_HANDLE_VALUE;
+
+        if (!m_bDirect)
+            m_hFile = CreateFileA(sPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+        m_nPosition = 0;
+        return m_hFile != INVALID_HANDLE_VALUE;
+    }
+
+    void internal::DirectFile::Close(uint64_t nSize)
+    {
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return;
+
+        if (nSize != m_nPosition)
+        {
+            FILE_END_OF_FILE_INFO info;
+            info.EndOfFile.QuadPart = (LONGLONG)nSize;
+
+            SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &info, sizeof(info));
+        }
+
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    bool internal::DirectFile::Write(const uint8_t* pData, size_t nSize)
+    {
+        while (nSize > 0)
+        {
+            DWORD nWritten = 0;
+
+            if (!WriteFile(m_hFile, pData, nSize > (1u << 30) ? (1u << 30) : (DWORD)nSize, &nWritten, nullptr) || nWritten == 0)
+                return false;
+
+            pData += nWritten;
+            nSize -= nWritten;
+            m_nPosition += nWritten;
+        }
+
+        return true;
+    }
+#else
+    bool internal::DirectFile::Open(const std::string& sPath)
+    {
+        Close(m_nPosition);
+
+        m_bDirect = false;
+        m_nPosition = 0;
+
+    #ifdef O_DIRECT
+        m_nFd = ::open(sPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        m_bDirect = m_nFd != -1;
+    #endif
+
+        // tmpfs and some other file systems don't support O_DIRECT
+        if (m_nFd == -1)
+            m_nFd = ::open(sPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    #ifdef F_NOCACHE
+        // macOS has no O_DIRECT
+        if (m_nFd != -1)
+            m_bDirect = fcntl(m_nFd, F_NOCACHE, 1) == 0;
+    #endif
+
+        return m_nFd != -1;
+    }
+
+    void internal::DirectFile::Close(uint64_t nSize)
+    {
+        if (m_nFd == -1)
+            return;
+
+        if (nSize != m_nPosition && ftruncate(m_nFd, (off_t)nSize) == 0)
+            m_nPosition = nSize;
+
+        ::close(m_nFd);
+        m_nFd = -1;
+    }
+
+    bool internal::DirectFile::Write(const uint8_t* pData, size_t nSize)
+    {
+        while (nSize > 0)
+        {
+            ssize_t nWritten = ::write(m_nFd, pData, nSize);
+
+            if (nWritten == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+
+            #ifdef O_DIRECT
+                // Some file systems accept O_DIRECT but fail the writes
+                if (errno == EINVAL && m_bDirect)
+                {
+                    m_bDirect = false;
+
+                    if (fcntl(m_nFd, F_SETFL, fcntl(m_nFd, F_GETFL) & ~O_DIRECT) == 0)
+                        continue;
+                }
+            #endif
+
+                return false;
+            }
+
+            pData += nWritten;
+            nSize -= (size_t)nWritten;
+            m_nPosition += (uint64_t)nWritten;
+        }
+
+        return true;
+    }
+#endif
+
+    bool internal::DirectFile::IsDirect() const { return m_bDirect; }
+
+    void internal::ConvertToYUV(int r, int g, int b, uint8_t& y, uint8_t& u, uint8_t& v)
+    {
+        y = wcc::internal::ComputeLuma(r, g, b);
+        u = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        v = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+
+    void internal::RenderPattern(Pattern nPattern, VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, uint32_t nFrame, uint8_t* pDst)
+    {
+        static const uint8_t c_Bars[8][3] =
+        {
+            { 255, 255, 255 }, { 255, 255, 0 }, { 0, 255, 255 }, { 0, 255, 0 },
+            { 255, 0, 255 }, { 255, 0, 0 }, { 0, 0, 255 }, { 0, 0, 0 }
+        };
+
+        // Pixels of the whole frame as RGB first, then stored in the format
+        std::vector<uint8_t> vecRgb((size_t)nWidth * nHeight * 3);
+        uint32_t nNoise = 0x9E3779B9u * (nFrame + 1);
+
+        for (uint32_t y = 0; y < nHeight; y++)
+        {
+            for (uint32_t x = 0; x < nWidth; x++)
+            {
+                uint8_t* pRgb = &vecRgb[((size_t)y * nWidth + x) * 3];
+
+                switch (nPattern)
+                {
+                case Pattern::Bars:
+                {
+                    uint32_t nBar = (uint32_t)(((uint64_t)x * 8 / nWidth + nFrame) % 8);
+                    memcpy(pRgb, c_Bars[nBar], 3);
+                    break;
+                }
+
+                case Pattern::Gradient:
+                    pRgb[0] = (uint8_t)(x * 255 / nWidth + nFrame * 8);
+                    pRgb[1] = (uint8_t)(y * 255 / nHeight);
+                    pRgb[2] = (uint8_t)(nFrame * 32);
+                    break;
+
+                case Pattern::Noise:
+                    // xorshift32
+                    nNoise ^= nNoise << 13;
+                    nNoise ^= nNoise >> 17;
+                    nNoise ^= nNoise << 5;
+                    pRgb[0] = (uint8_t)nNoise;
+                    pRgb[1] = (uint8_t)(nNoise >> 8);
+                    pRgb[2] = (uint8_t)(nNoise >> 16);
+                    break;
+                }
+            }
+        }
+
+        const uint8_t* pRgb = vecRgb.data();
+        size_t nPixels = (size_t)nWidth * nHeight;
+
+        switch (nFormat)
+        {
+        case VideoFormat::Rgb32:
+        case VideoFormat::Bgra32:
+        {
+            bool bSwap = nFormat == VideoFormat::Bgra32;
+
+            for (size_t i = 0; i < nPixels; i++, pRgb += 3, pDst += 4)
+            {
+                pDst[0] = pRgb[bSwap ? 2 : 0];
+                pDst[1] = pRgb[1];
+                pDst[2] = pRgb[bSwap ? 0 : 2];
+                pDst[3] = 255;
+            }
+
+            break;
+        }
+
+        case VideoFormat::Rgb24:
+            memcpy(pDst, pRgb, nPixels * 3);
+            break;
+
+        case VideoFormat::Gray8:
+            for (size_t i = 0; i < nPixels; i++, pRgb += 3)
+                pDst[i] = wcc::internal::ComputeLuma(pRgb[0], pRgb[1], pRgb[2]);
+            break;
+
+        case VideoFormat::Yuy2:
+            // The chroma of a pair comes from its first pixel
+            for (size_t i = 0; i < nPixels; i += 2, pRgb += 6, pDst += 4)
+            {
+                uint8_t u, v, unused;
+
+                ConvertToYUV(pRgb[0], pRgb[1], pRgb[2], pDst[0], u, v);
+                ConvertToYUV(pRgb[3], pRgb[4], pRgb[5], pDst[2], unused, unused);
+
+                pDst[1] = u;
+                pDst[3] = v;
+            }
+            break;
+
+        case VideoFormat::Nv12:
+        {
+            uint8_t* pUV = pDst + nPixels;
+
+            for (uint32_t y = 0; y < nHeight; y++)
+            {
+                for (uint32_t x = 0; x < nWidth; x++, pRgb += 3)
+                {
+                    uint8_t u, v;
+                    ConvertToYUV(pRgb[0], pRgb[1], pRgb[2], pDst[(size_t)y * nWidth + x], u, v);
+
+                    // The chroma of a 2x2 block comes from its top left pixel
+                    if (y % 2 == 0 && x % 2 == 0)
+                    {
+                        pUV[(size_t)(y / 2) * nWidth + x] = u;
+                        pUV[(size_t)(y / 2) * nWidth + x + 1] = v;
+                    }
+                }
+            }
+
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    Capturer::~Capturer()
+    {
+        m_InitTask.Cancel();
+
+        if (m_InitThread.joinable())
+            m_InitThread.join();
+
+        wcc::GetFrameLoop().Cancel(this);
+    }
+
+    bool Capturer::Init(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    {
+        return Open(nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator, {});
+    }
+
+    bool Capturer::Open(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator, const wcc::InitTask& task)
+    {
+        if (nWidth == 0 || nHeight == 0 || nFpsNumerator == 0 || nFpsDenominator == 0)
+            return false;
+
+        m_nFpsNumerator = nFpsNumerator;
+        m_nFpsDenominator = nFpsDenominator;
+
+        m_nDesiredWidth = nWidth;
+        m_nDesiredHeight = nHeight;
+
+        return !task.IsCancelled() && OpenSource(nDeviceID);
+    }
+
+    wcc::InitTask Capturer::InitAsync(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    {
+        // Only the last task counts
+        m_InitTask.Cancel();
+
+        if (m_InitThread.joinable())
+            m_InitThread.join();
+
+        wcc::InitTask task = wcc::InitTask::Create();
+        m_InitTask = task;
+
+        m_InitThread = std::thread([this, task, nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator]()
+        {
+            task.Finish(Open(nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator, task));
+        });
+
+        return m_InitTask;
+    }
+
+    std::list<std::wstring> Capturer::EnumerateDevices()
+    {
+        std::list<std::wstring> listDevices;
+
+        for (const SourceDesc& desc : internal::GetSources())
+            listDevices.push_back(std::wstring(desc.sName.begin(), desc.sName.end()));
+
+        return listDevices;
+    }
+
+    bool Capturer::OpenSource(const uint32_t nDeviceID)
+    {
+        const std::vector<SourceDesc>& vecSources = internal::GetSources();
+        m_nDevices = vecSources.size();
+
+        if (nDeviceID >= m_nDevices)
+            return false;
+
+        const SourceDesc& desc = vecSources[nDeviceID];
+
+        m_File.Close();
+        m_vecFrameOffsets.clear();
+        m_Pattern.Reset();
+        m_nLayout = internal::Y4mLayout::None;
+        m_nFrameCount = 0;
+
+        m_nVideoFormat = desc.nFormat;
+        m_nFrameWidth = desc.nWidth;
+        m_nFrameHeight = desc.nHeight;
+        m_nSourceFpsNumerator = desc.nFpsNumerator;
+        m_nSourceFpsDenominator = desc.nFpsDenominator;
+        m_SourceColorSpace = desc.colorSpace;
+
+        if (desc.sPath.empty())
+        {
+            if (m_nFrameWidth == 0 || m_nFrameHeight == 0)
+            {
+                m_nFrameWidth = m_nDesiredWidth;
+                m_nFrameHeight = m_nDesiredHeight;
+            }
+        }
+        else
+        {
+            if (!m_File.Open(desc.sPath))
+                return false;
+
+            internal::Y4mHeader header;
+
+            if (internal::ParseY4mHeader(m_File.GetData(), m_File.GetSize(), header))
+            {
+                m_nLayout = header.nLayout;
+                m_nFrameWidth = header.nWidth;
+                m_nFrameHeight = header.nHeight;
+                m_SourceColorSpace = wcc::ResolveColorSpace(desc.colorSpace, header.colorSpace);
+
+                if (header.nFpsNumerator > 0 && header.nFpsDenominator > 0)
+                {
+                    m_nSourceFpsNumerator = header.nFpsNumerator;
+                    m_nSourceFpsDenominator = header.nFpsDenominator;
+                }
+
+                switch (header.nLayout)
+                {
+                case internal::Y4mLayout::Mono: m_nVideoFormat = VideoFormat::Gray8; break;
+                case internal::Y4mLayout::I420: m_nVideoFormat = VideoFormat::Nv12; break;
+                default: m_nVideoFormat = VideoFormat::Yuy2; break;
+                }
+
+                // Every frame starts with a FRAME marker that may have parameters
+                size_t nFrameSize = internal::GetY4mFrameSize(header);
+                size_t nPos = header.nHeaderSize;
+
+                while (nPos + 5 <= m_File.GetSize() && memcmp(m_File.GetData() + nPos, "FRAME", 5) == 0)
+                {
+                    const uint8_t* pEnd = (const uint8_t*)memchr(m_File.GetData() + nPos, '\n', m_File.GetSize() - nPos);
+
+                    if (!pEnd)
+                        break;
+
+                    nPos = (size_t)(pEnd - m_File.GetData()) + 1;
+
+                    if (nPos + nFrameSize > m_File.GetSize())
+                        break;
+
+                    m_vecFrameOffsets.push_back(nPos);
+                    nPos += nFrameSize;
+                }
+            }
+        }
+
+        if (m_nFrameWidth == 0 || m_nFrameHeight == 0 || wcc::IsCompressed(m_nVideoFormat) || m_nVideoFormat == VideoFormat::None)
+            return false;
+
+        // Chroma is shared by pairs of pixels
+        if ((m_nVideoFormat == VideoFormat::Yuy2 || m_nVideoFormat == VideoFormat::Nv12) && m_nFrameWidth % 2 != 0)
+            return false;
+
+        m_nFrameSourceStride = m_nFrameWidth * wcc::GetBytesPerPixel(m_nVideoFormat);
+        size_t nFrameSize = wcc::GetFrameSize(m_nVideoFormat, m_nFrameHeight, m_nFrameSourceStride);
+
+        if (desc.sPath.empty())
+        {
+            m_nPatternFrameSize = nFrameSize;
+
+            if (!m_Pattern.Resize(nFrameSize * c_nPatternFrames))
+                return false;
+
+            for (uint32_t i = 0; i < c_nPatternFrames; i++)
+                internal::RenderPattern(desc.nPattern, m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, i, m_Pattern.GetData() + i * nFrameSize);
+
+            m_nFrameCount = c_nPatternFrames;
+        }
+        else if (m_nLayout == internal::Y4mLayout::None)
+        {
+            // Raw frames without any headers
+            for (size_t nPos = 0; nPos + nFrameSize <= m_File.GetSize(); nPos += nFrameSize)
+                m_vecFrameOffsets.push_back(nPos);
+        }
+
+        if (!desc.sPath.empty())
+            m_nFrameCount = (uint32_t)m_vecFrameOffsets.size();
+
+        if (m_nFrameCount == 0 || !m_Scratch.Resize(GetScratchSize()))
+            return false;
+
+        if (m_nSourceFpsNumerator == 0 || m_nSourceFpsDenominator == 0)
+        {
+            m_nSourceFpsNumerator = m_nFpsNumerator;
+            m_nSourceFpsDenominator = m_nFpsDenominator;
+        }
+
+        m_Processor.SetColorSpace(wcc::ResolveColorSpace(m_ColorSpace, m_SourceColorSpace));
+
+        return m_Processor.Configure(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, m_nDesiredWidth, m_nDesiredHeight);
+    }
+
+    bool Capturer::UpdateSource()
+    {
+        // Leased frames may point into the mapped file
+        if (m_nPendingSource.load() == c_nNoSource || m_Leases.GetOutstanding() > 0)
+            return m_nFrameCount > 0;
+
+        return OpenSource(m_nPendingSource.exchange(c_nNoSource));
+    }
+
+    uint64_t Capturer::WaitForFrame(int64_t& nTimestamp)
+    {
+        int64_t nNow = wcc::GetMonotonicTime();
+        uint64_t nSequence = GetNextFrame(nNow, nTimestamp);
+
+        if (nTimestamp > nNow)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(nTimestamp - nNow));
+
+        m_nNextSequence = nSequence + 1;
+        return nSequence;
+    }
+
+    uint64_t Capturer::GetNextFrame(int64_t nNow, int64_t& nTimestamp)
+    {
+        if (!m_bStarted)
+        {
+            m_bStarted = true;
+            m_nStartTime = nNow;
+        }
+
+        if (m_nPacing == Pacing::Unpaced)
+        {
+            nTimestamp = nNow;
+            return m_nNextSequence;
+        }
+
+        int64_t nPeriod = 1000000000LL * m_nSourceFpsDenominator / m_nSourceFpsNumerator;
+
+        // The source keeps going while nobody reads, so a late reader gets the newest frame
+        uint64_t nSequence = (uint64_t)((nNow - m_nStartTime) / nPeriod);
+
+        if (nSequence < m_nNextSequence)
+            nSequence = m_nNextSequence;
+
+        nTimestamp = m_nStartTime + (int64_t)nSequence * nPeriod;
+        return nSequence;
+    }
+
+    void Capturer::OnFrameDue(void* pContext)
+    {
+        Capturer* pThis = (Capturer*)pContext;
+
+        if (pThis->m_Request.Claim())
+            pThis->m_Request.Finish(pThis->DoCapture());
+    }
+
+    wcc::FrameView Capturer::GetFrame(uint64_t nSequence, uint8_t* pScratch) const
+    {
+        uint32_t nFrame = (uint32_t)(nSequence % m_nFrameCount);
+
+        if (!m_Pattern.IsEmpty())
+            return wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, m_Pattern.GetData() + nFrame * m_nPatternFrameSize, m_nFrameSourceStride);
+
+        const uint8_t* pData = m_File.GetData() + m_vecFrameOffsets[nFrame];
+        size_t nLuma = (size_t)m_nFrameWidth * m_nFrameHeight;
+
+        switch (m_nLayout)
+        {
+        case internal::Y4mLayout::I420:
+        {
+            // The Y plane is used in place, only the chroma is interleaved
+            size_t nChroma = (size_t)(m_nFrameWidth / 2) * ((m_nFrameHeight + 1) / 2);
+            internal::PackI420(pData + nLuma, pData + nLuma + nChroma, pScratch, m_nFrameWidth, m_nFrameHeight);
+
+            wcc::FrameView view = wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pData, m_nFrameSourceStride);
+            view.pPlanes[1] = pScratch;
+
+            return view;
+        }
+
+        case internal::Y4mLayout::I422:
+        {
+            size_t nChroma = nLuma / 2;
+            internal::PackI422(pData, pData + nLuma, pData + nLuma + nChroma, pScratch, m_nFrameWidth, m_nFrameHeight);
+
+            return wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pScratch, m_nFrameSourceStride);
+        }
+
+        default:
+            return wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pData, m_nFrameSourceStride);
+        }
+    }
+
+    size_t Capturer::GetScratchSize() const
+    {
+        switch (m_nLayout)
+        {
+        case internal::Y4mLayout::I420: return (size_t)(m_nFrameWidth / 2) * ((m_nFrameHeight + 1) / 2) * 2;
+        case internal::Y4mLayout::I422: return (size_t)m_nFrameWidth * m_nFrameHeight * 2;
+        default: return 0;
+        }
+    }
+
+    void Capturer::ReleaseBuffer(void*, uintptr_t nScratch)
+    {
+        wcc::GetBufferPool().Release((uint8_t*)nScratch);
+    }
+
+    wcc::FrameInfo Capturer::DoCapture()
+    {
+        if (!m_pOutput || !UpdateSource())
+            return {};
+
+        WCC_STATS(int64_t nStart = wcc::GetMonotonicTime();)
+
+        int64_t nTimestamp;
+        uint64_t nSequence = WaitForFrame(nTimestamp);
+
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Wait, nStart);)
+
+        wcc::FrameView view = GetFrame(nSequence, m_Scratch.GetData());
+
+        // A static frame is not converted at all, nor counted as delivered
+        wcc::FrameInfo info;
+
+        if (m_Detector.Update(wcc::CropFrameView(view, m_Processor.GetRegion())))
+        {
+            m_Processor.Process(view, m_pOutput);
+
+            info = m_Counter.Deliver(nSequence, nTimestamp);
+            WCC_STATS(m_Processor.GetStats().AddFrame(info);)
+        }
+        else
+            info = m_Counter.Skip(nSequence, nTimestamp);
+
+        m_Detector.Mark(info);
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Total, nStart);)
+
+        return info;
+    }
+
+    bool Capturer::RequestFrame(wcc::FrameCallback fnDone, void* pContext)
+    {
+        if (!m_Request.Set(fnDone, pContext))
+            return false;
+
+        // A source without frames fails on the loop, DoCapture returns at once then
+        int64_t nNow = wcc::GetMonotonicTime();
+        int64_t nTimestamp = nNow;
+
+        if (m_nFrameCount > 0 && m_nSourceFpsNumerator > 0)
+            GetNextFrame(nNow, nTimestamp);
+
+        wcc::GetFrameLoop().PostAt(nTimestamp, &Capturer::OnFrameDue, this);
+        return true;
+    }
+
+    wcc::FrameLease Capturer::LeaseFrame()
+    {
+        if (!UpdateSource() || !m_Leases.TryAcquire())
+            return {};
+
+        int64_t nTimestamp;
+        uint64_t nSequence = WaitForFrame(nTimestamp);
+
+        // Interleaved chroma of Y4M streams lives as long as the lease, the pool recycles it
+        size_t nScratchSize = GetScratchSize();
+        uint8_t* pScratch = wcc::GetBufferPool().Acquire(nScratchSize);
+
+        if (nScratchSize > 0 && !pScratch)
+        {
+            m_Leases.Release();
+            return {};
+        }
+
+        wcc::FrameView view = GetFrame(nSequence, pScratch);
+
+        wcc::FrameInfo info = m_Counter.Deliver(nSequence, nTimestamp);
+        WCC_STATS(m_Processor.GetStats().AddFrame(info);)
+
+        return wcc::FrameLease(view, info, &Capturer::ReleaseBuffer, this, (uintptr_t)pScratch, &m_Leases);
+    }
+
+    void Capturer::SetMaxLeases(uint32_t nLeases) { m_Leases.SetMax(nLeases); }
+    uint32_t Capturer::GetMaxLeases() const { return m_Leases.GetMax(); }
+
+    void Capturer::SetPacing(Pacing nPacing)
+    {
+        m_nPacing = nPacing;
+
+        // The real-time clock starts over at the next frame
+        m_bStarted = false;
+        m_nNextSequence = 0;
+        m_Counter.Reset();
+    }
+
+    void Capturer::SwitchSource(uint32_t nDevice) { m_nPendingSource.store(nDevice); }
+
+    uint32_t Capturer::GetFrameWidth() const { return m_nFrameWidth; }
+    uint32_t Capturer::GetFrameHeight() const { return m_nFrameHeight; }
+    uint32_t Capturer::GetDeviceCount() const { return m_nDevices; }
+
+    VideoFormat Capturer::GetVideoFormat() const { return m_nVideoFormat; }
+
+    void Capturer::SetBuffer(void* pBuffer) { m_pOutput = pBuffer; }
+
+    void Capturer::SetOutputFormat(OutputFormat nFormat) { m_Processor.SetOutputFormat(nFormat); }
+    void Capturer::SetTensorFormat(const wcc::TensorDesc& desc) { m_Processor.SetTensorFormat(desc); }
+
+    void Capturer::SetColorSpace(const wcc::ColorSpace& colorSpace)
+    {
+        m_ColorSpace = colorSpace;
+        m_Processor.SetColorSpace(wcc::ResolveColorSpace(m_ColorSpace, m_SourceColorSpace));
+    }
+
+    wcc::ColorSpace Capturer::GetColorSpace() const { return m_Processor.GetColorSpace(); }
+    VideoFormat Capturer::GetOutputVideoFormat() const { return m_Processor.GetOutputVideoFormat(); }
+
+    size_t Capturer::GetOutputSize() const { return m_Processor.GetOutputSize(); }
+    uint32_t Capturer::GetOutputStride() const { return m_Processor.GetOutputStride(); }
+
+    void Capturer::SetScaleMode(ScaleMode nMode) { m_Processor.SetScaleMode(nMode); }
+
+    void Capturer::SetRegion(const wcc::Rect& region) { m_Processor.SetRegion(region); }
+    wcc::Rect Capturer::GetRegion() const { return m_Processor.GetRegion(); }
+    void Capturer::SetThreadCount(uint32_t nThreads) { m_Processor.SetThreadCount(nThreads); }
+
+    void Capturer::SetChangeDetection(const wcc::ChangeDetector::Settings& settings) { m_Detector.SetSettings(settings); }
+
+    wcc::StatsSnapshot Capturer::GetStats() const { return m_Processor.GetStats().GetSnapshot(); }
+    void Capturer::ResetStats() { m_Processor.GetStats().Reset(); }
+
+    Recorder::~Recorder()
+    {
+        Close();
+    }
+
+    bool Recorder::Open(const std::string& sPath, RecordFormat nRecordFormat, VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight,
+        uint32_t nFpsNumerator, uint32_t nFpsDenominator, uint32_t nQueueSize)
+    {
+        Close();
+
+        if (nWidth == 0 || nHeight == 0 || nFpsNumerator == 0 || nFpsDenominator == 0 || nQueueSize == 0)
+            return false;
+
+        internal::Y4mHeader header;
+        header.nWidth = nWidth;
+        header.nHeight = nHeight;
+
+        switch (nRecordFormat)
+        {
+        case RecordFormat::Y4m:
+            switch (nFormat)
+            {
+            case VideoFormat::Nv12: header.nLayout = internal::Y4mLayout::I420; break;
+            case VideoFormat::Yuy2: header.nLayout = internal::Y4mLayout::I422; break;
+            case VideoFormat::Gray8: header.nLayout = internal::Y4mLayout::Mono; break;
+            default: return false;
+            }
+
+            if (header.nLayout != internal::Y4mLayout::Mono && nWidth % 2 != 0)
+                return false;
+
+            m_nSlotSize = 6 + internal::GetY4mFrameSize(header);
+            break;
+
+        case RecordFormat::Raw:
+            if (nFormat == VideoFormat::Mjpeg)
+                m_nSlotSize = (size_t)nWidth * nHeight * 2;
+            else if (wcc::GetBytesPerPixel(nFormat) != 0)
+                m_nSlotSize = wcc::GetFrameSize(nFormat, nHeight, nWidth * wcc::GetBytesPerPixel(nFormat));
+            else
+                return false;
+            break;
+        }
+
+        m_nRecordFormat = nRecordFormat;
+        m_nFormat = nFormat;
+        m_nWidth = nWidth;
+        m_nHeight = nHeight;
+
+        m_nQueueDepth = 0;
+        m_nMaxQueueDepth = 0;
+        m_nWritten = 0;
+        m_nBytes = 0;
+        m_nDropped = 0;
+        m_bFailed = false;
+
+        m_nStaged = 0;
+        m_nFileSize = 0;
+        m_bClosing = false;
+
+        m_pStaging = (uint8_t*)wcc::internal::AllocateAligned(c_nStagingSize, internal::DirectFile::c_nAlignment);
+
+        if (!m_pStaging || !m_File.Open(sPath))
+        {
+            Close();
+            return false;
+        }
+
+        m_vecSlots.resize(nQueueSize);
+
+        for (uint32_t i = 0; i < nQueueSize; i++)
+        {
+            if (!m_vecSlots[i].buffer.Resize(m_nSlotSize))
+            {
+                Close();
+                return false;
+            }
+
+            m_vecFree.push_back(i);
+        }
+
+        if (nRecordFormat == RecordFormat::Y4m)
+        {
+            const char* sColor = header.nLayout == internal::Y4mLayout::I420 ? "420jpeg" : header.nLayout == internal::Y4mLayout::I422 ? "422" : "mono";
+
+            char sHeader[128];
+            int nLength = snprintf(sHeader, sizeof(sHeader), "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C%s\n", nWidth, nHeight, nFpsNumerator, nFpsDenominator, sColor);
+
+            Append((const uint8_t*)sHeader, (size_t)nLength);
+        }
+        else
+        {
+            m_pIndex = fopen((sPath + ".idx").c_str(), "w");
+
+            if (!m_pIndex)
+            {
+                Close();
+                return false;
+            }
+
+            fprintf(m_pIndex, "# format %u, %ux%u, %u/%u fps\n# offset size sequence timestamp\n",
+                (uint32_t)nFormat, nWidth, nHeight, nFpsNumerator, nFpsDenominator);
+        }
+
+        m_Writer = std::thread(&Recorder::WriterMain, this);
+        return true;
+    }
+
+    void Recorder::Close()
+    {
+        if (m_Writer.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_bClosing = true;
+            }
+
+            m_cvReady.notify_one();
+            m_Writer.join();
+        }
+
+        if (m_pStaging)
+        {
+            // The last block is padded for unbuffered writes and cut off by Close
+            size_t nSize = m_nStaged;
+
+            if (m_File.IsDirect())
+            {
+                nSize = (nSize + internal::DirectFile::c_nAlignment - 1) / internal::DirectFile::c_nAlignment * internal::DirectFile::c_nAlignment;
+                memset(m_pStaging + m_nStaged, 0, nSize - m_nStaged);
+            }
+
+            if (nSize > 0 && !m_bFailed && !m_File.Write(m_pStaging, nSize))
+                m_bFailed = true;
+
+            m_File.Close(m_nFileSize);
+
+            wcc::internal::FreeAligned(m_pStaging);
+            m_pStaging = nullptr;
+        }
+
+        if (m_pIndex)
+        {
+            fclose(m_pIndex);
+            m_pIndex = nullptr;
+        }
+
+        m_vecSlots.clear();
+        m_vecFree.clear();
+        m_vecReady.clear();
+        m_nQueueDepth = 0;
+    }
+
+    bool Recorder::IsOpen() const
+    {
+        return m_pStaging != nullptr;
+    }
+
+    bool Recorder::Push(const wcc::FrameView& view, const wcc::FrameInfo& info)
+    {
+        if (!IsOpen() || view.nFormat != m_nFormat || view.nWidth != m_nWidth || view.nHeight != m_nHeight)
+            return false;
+
+        uint32_t nSlot;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            if (m_vecFree.empty() || m_bFailed)
+            {
+                m_nDropped++;
+                return false;
+            }
+
+            nSlot = m_vecFree.back();
+            m_vecFree.pop_back();
+        }
+
+        // The slot belongs to this thread until it's queued
+        Slot& slot = m_vecSlots[nSlot];
+        slot.info = info;
+
+        bool bStored = Store(view, slot);
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            if (bStored)
+            {
+                m_vecReady.push_back(nSlot);
+
+                m_nQueueDepth = (uint32_t)m_vecReady.size();
+
+                if (m_nQueueDepth > m_nMaxQueueDepth)
+                    m_nMaxQueueDepth = m_nQueueDepth.load();
+            }
+            else
+            {
+                m_vecFree.push_back(nSlot);
+                m_nDropped++;
+            }
+        }
+
+        if (bStored)
+            m_cvReady.notify_one();
+
+        return bStored;
+    }
+
+    bool Recorder::Push(const wcc::FrameLease& lease)
+    {
+        return Push(lease.GetView(), lease.GetInfo());
+    }
+
+    bool Recorder::Push(const void* pData, const wcc::FrameInfo& info)
+    {
+        if (m_nFormat == VideoFormat::Mjpeg)
+            return false;
+
+        return Push(wcc::MakeFrameView(m_nFormat, m_nWidth, m_nHeight, (const uint8_t*)pData, m_nWidth * wcc::GetBytesPerPixel(m_nFormat)), info);
+    }
+
+    bool Recorder::Store(const wcc::FrameView& view, Slot& slot) const
+    {
+        uint8_t* pDst = slot.buffer.GetData();
+
+        if (m_nRecordFormat == RecordFormat::Y4m)
+        {
+            memcpy(pDst, "FRAME\n", 6);
+            pDst += 6;
+
+            if (m_nFormat == VideoFormat::Nv12)
+                internal::UnpackNv12(view, pDst);
+            else if (m_nFormat == VideoFormat::Yuy2)
+                internal::UnpackYuy2(view, pDst);
+            else
+            {
+                for (uint32_t y = 0; y < m_nHeight; y++)
+                    memcpy(pDst + (size_t)y * m_nWidth, view.pPlanes[0] + (size_t)y * view.nStrides[0], m_nWidth);
+            }
+
+            slot.nSize = m_nSlotSize;
+            return true;
+        }
+
+        if (m_nFormat == VideoFormat::Mjpeg)
+        {
+            if (view.nDataSize == 0 || view.nDataSize > m_nSlotSize)
+                return false;
+
+            memcpy(pDst, view.pPlanes[0], view.nDataSize);
+            slot.nSize = view.nDataSize;
+
+            return true;
+        }
+
+        // Rows without padding, NV12 has a second plane of half the height
+        size_t nRowSize = (size_t)m_nWidth * wcc::GetBytesPerPixel(m_nFormat);
+
+        for (uint32_t y = 0; y < m_nHeight; y++, pDst += nRowSize)
+            memcpy(pDst, view.pPlanes[0] + (size_t)y * view.nStrides[0], nRowSize);
+
+        if (m_nFormat == VideoFormat::Nv12)
+        {
+            for (uint32_t y = 0; y < (m_nHeight + 1) / 2; y++, pDst += nRowSize)
+                memcpy(pDst, view.pPlanes[1] + (size_t)y * view.nStrides[1], nRowSize);
+        }
+
+        slot.nSize = m_nSlotSize;
+        return true;
+    }
+
+    void Recorder::WriterMain()
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        while (true)
+        {
+            m_cvReady.wait(lock, [this]() { return !m_vecReady.empty() || m_bClosing; });
+
+            // Everything that was pushed before Close is written
+            if (m_vecReady.empty())
+                break;
+
+            uint32_t nSlot = m_vecReady.front();
+            m_vecReady.erase(m_vecReady.begin());
+
+            lock.unlock();
+
+            const Slot& slot = m_vecSlots[nSlot];
+
+            if (!m_bFailed)
+            {
+                uint64_t nOffset = m_nFileSize;
+
+                if (Append(slot.buffer.GetData(), slot.nSize))
+                {
+                    if (m_pIndex)
+                        fprintf(m_pIndex, "%llu %zu %llu %lld\n", (unsigned long long)nOffset, slot.nSize,
+                            (unsigned long long)slot.info.nSequence, (long long)slot.info.nTimestamp);
+
+                    m_nWritten++;
+                }
+                else
+                    m_bFailed = true;
+            }
+
+            lock.lock();
+
+            m_vecFree.push_back(nSlot);
+            m_nQueueDepth = (uint32_t)m_vecReady.size();
+        }
+    }
+
+    bool Recorder::Append(const uint8_t* pData, size_t nSize)
+    {
+        m_nFileSize += nSize;
+        m_nBytes += nSize;
+
+        while (nSize > 0)
+        {
+            size_t nCopy = c_nStagingSize - m_nStaged;
+
+            if (nCopy > nSize)
+                nCopy = nSize;
+
+            memcpy(m_pStaging + m_nStaged, pData, nCopy);
+
+            m_nStaged += nCopy;
+            pData += nCopy;
+            nSize -= nCopy;
+
+            if (m_nStaged == c_nStagingSize)
+            {
+                if (!m_File.Write(m_pStaging, c_nStagingSize))
+                    return false;
+
+                m_nStaged = 0;
+            }
+        }
+
+        return true;
+    }
+
+    RecorderStats Recorder::GetStats() const
+    {
+        RecorderStats stats;
+
+        stats.nQueueDepth = m_nQueueDepth;
+        stats.nMaxQueueDepth = m_nMaxQueueDepth;
+        stats.nQueueSize = (uint32_t)m_vecSlots.size();
+        stats.nWritten = m_nWritten;
+        stats.nBytes = m_nBytes;
+        stats.nDropped = m_nDropped;
+        stats.bDirect = m_File.IsDirect();
+        stats.bFailed = m_bFailed;
+
+        return stats;
+    }
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,6279 @@
+/* GENERAL INFO
+
+    wccapi.hpp
+
+    +----------------------------------+
+    |             WCCAPI               |
+    |       WebCam Capturing API       |
+    +----------------------------------+
+
+
+    Distributed under GPL3 license
+    ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+                    GNU GENERAL PUBLIC LICENSE
+                      Version 3, 29 June 2007
+
+    Copyright (C) 2007 Free Software Foundation, Inc. <https://fsf.org/>
+    Everyone is permitted to copy and distribute verbatim copies
+    of this license document, but changing it is not allowed.
+
+
+    Author
+    ~~~~~~
+
+    Alex, aka defini7, Copyright (C) 2025
+
+*/
+
+/* VERSION HISTORY
+
+    0.01: Added support for RGB32, RGB24, YUY2 formats on Windows platform
+    0.02: Added support for macOS
+    0.03: Added support for Linux (V4L2)
+    0.04: Moved pixel format conversion into the platform independent core,
+          added SSE2, AVX2 and NEON conversion kernels
+    0.05: Added support for NV12
+    0.06: Added FrameProcessor that converts and scales a frame in one pass
+    0.07: Added Scaler with nearest, bilinear and area modes, its rows have SSE2, AVX2 and NEON kernels
+    0.08: Added WorkerPool, FrameProcessor can process large frames in row bands
+    0.09: Added FrameExchange to pass frames between threads without locks
+    0.10: Added FrameLease to read frames straight from the buffers of the driver
+    0.11: Added output formats: RGBA, native passthrough and luma only (Gray8)
+    0.12: Added MJPEG decoding with libjpeg (WCCAPI_USE_LIBJPEG)
+    0.13: Added FrameInfo (timestamps, sequence numbers, dropped frames and latency)
+    0.14: Added PipelineStats, per-stage timings recorded if WCCAPI_ENABLE_STATS is defined
+    0.15: Added CaptureGroup that captures from several devices and matches their frames by time
+    0.16: Added regions of interest, FrameProcessor::SetRegion converts only a part of the frame
+    0.17: Added ChangeDetector, capturers can skip frames where nothing has changed
+    0.18: Added CaptureMode and RankModes, capturers choose the size, format and fps of the device by cost
+    0.19: Added ModeCache that keeps the modes of devices in a file between runs
+    0.20: Added InitTask, capturers can open devices on threads of their own (InitAsync)
+    0.21: Added BufferPool and FrameBuffer, frame sized buffers are aligned, recycled and can come from a user allocator
+    0.22: Added OutputFormat::Tensor, normalized float or fp16 NCHW/NHWC tensors written in the same pass as scaling
+    0.23: Added ColorSpace, YUV frames are converted with BT.601, BT.709 or BT.2020 in limited or full range
+    0.24: Added FrameLoop, FrameRequest and FrameAwaitable, capturers deliver frames to callbacks and coroutines (NextFrame)
+*/
+
+/* NOTES
+
+    This header doesn't use any capture API and is included by all backends
+    (wwccapi.hpp, mwccapi.hpp, lwccapi.hpp). It still needs a few system headers:
+    the frame loop sleeps in poll(2) and is woken up through a pipe (POSIX), aligned
+    buffers come from _aligned_malloc on Windows and huge pages from mmap on Linux.
+    Defining the IMPL macro of a backend also defines WCCAPI_IMPL, so usually
+    you don't need to include it directly.
+
+    Row kernels for the available instruction sets are chosen at runtime
+    by GetBestIsa. The scalar kernels are the reference implementation,
+    all other kernels produce exactly the same output.
+
+    MJPEG frames are decoded only if WCCAPI_USE_LIBJPEG is defined before
+    the header is included, link with libjpeg(-turbo) in that case. The decoder
+    scales frames down in the DCT domain (1/2, 1/4 or 1/8) when the output
+    is small enough, so the pixels that would be dropped are never decoded.
+    The chroma of 4:2:2 frames keeps half the width of luma at every scale,
+    those are decoded at least at twice the size so no output pixel loses color.
+
+    Timings of the pipeline stages (waiting for the device, decoding, converting,
+    scaling, copying) are recorded only if WCCAPI_ENABLE_STATS is defined, otherwise
+    the timing code is not compiled at all and GetStats returns zeros. Converting
+    and scaling are timed per row, which costs about a microsecond per 10 rows.
+*/
+
+#ifndef WCCAPI_HPP
+#define WCCAPI_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+// NextFrame of the capturers can be awaited when the compiler supports coroutines (C++20)
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define WCC_COROUTINES
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifdef WCCAPI_USE_LIBJPEG
+#include <cstdio>
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WCC_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define WCC_NEON
+#include <arm_neon.h>
+#endif
+
+// Code that exists only when the stats are enabled
+#ifdef WCCAPI_ENABLE_STATS
+#define WCC_STATS(...) __VA_ARGS__
+#else
+#define WCC_STATS(...)
+#endif
+
+// Allows to compile AVX2 kernels without enabling AVX2 for the whole translation unit
+#if defined(WCC_X86) && (defined(__GNUC__) || defined(__clang__))
+#define WCC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define WCC_TARGET_AVX2
+#endif
+
+namespace wcc
+{
+    enum class VideoFormat
+    {
+        None,
+        Rgb32, // Already in the output byte order, it's copied as is
+        Rgb24,
+        Yuy2,
+        Nv12,
+        Bgra32, // Used on macOS
+        Gray8, // Luma only, produced by OutputFormat::Luma
+        Mjpeg // Compressed, needs WCCAPI_USE_LIBJPEG to be converted
+    };
+
+    // What FrameProcessor writes into the output buffer
+    enum class OutputFormat
+    {
+        Rgba, // Converted and scaled, described as VideoFormat::Rgb32
+        Native, // Rows of the source format without padding, not converted and not scaled
+        Luma, // Y values, scaled, described as VideoFormat::Gray8. YUV sources keep their own range, RGB ones get BT.601 (16..235)
+        Tensor // Three normalized channels of float or fp16 values for neural networks, see TensorDesc
+    };
+
+    enum class TensorLayout
+    {
+        Nchw, // One plane per channel
+        Nhwc // Channels of a pixel next to each other
+    };
+
+    enum class TensorType
+    {
+        Float32,
+        Float16 // IEEE half precision, stored as uint16_t
+    };
+
+    // How OutputFormat::Tensor writes a frame. Each channel value v (0..255) becomes (v / 255 - fMean[c]) / fStd[c],
+    // the defaults give 0..1. fMean and fStd are in the order of the output channels.
+    // A frame takes GetOutputSize() bytes, frame k of a batch of N is written by passing
+    // (uint8_t*)pBatch + k * GetOutputSize() to SetBuffer, for NCHW and NHWC alike
+    struct TensorDesc
+    {
+        TensorLayout nLayout = TensorLayout::Nchw;
+        TensorType nType = TensorType::Float32;
+
+        // BGR instead of RGB channel order
+        bool bBgr = false;
+
+        float fMean[3] = { 0.0f, 0.0f, 0.0f };
+        float fStd[3] = { 1.0f, 1.0f, 1.0f };
+    };
+
+    // The matrix that YUV frames (YUY2, NV12) are converted to RGB with
+    enum class ColorMatrix
+    {
+        Auto, // What the device reports, BT.601 if it reports nothing
+        Bt601,
+        Bt709,
+        Bt2020
+    };
+
+    enum class ColorRange
+    {
+        Auto, // What the device reports, limited if it reports nothing
+        Limited, // Y in 16..235, U and V in 16..240
+        Full // All values in 0..255
+    };
+
+    struct ColorSpace
+    {
+        ColorMatrix nMatrix = ColorMatrix::Auto;
+        ColorRange nRange = ColorRange::Auto;
+    };
+
+    // Replaces the Auto fields of requested with the ones of reported
+    ColorSpace ResolveColorSpace(const ColorSpace& requested, const ColorSpace& reported);
+
+    // Instruction sets that have conversion kernels
+    enum class Isa
+    {
+        Scalar,
+        Sse2,
+        Avx2,
+        Neon
+    };
+
+    // Converts nWidth pixels of one row from pSrc to RGBA (R, G, B, A bytes) in pDst
+    using RowConverter = void(*)(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+
+    // Converts nWidth pixels of two NV12 rows that share one row of UV samples,
+    // so every chroma sample is loaded once. Pass the same row twice to convert one row
+    using Nv12Converter = void(*)(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth);
+
+    // Describes a frame in one of the video formats.
+    // Packed formats use only the first plane, NV12 has a Y plane and an interleaved UV plane
+    struct FrameView
+    {
+        VideoFormat nFormat = VideoFormat::None;
+
+        uint32_t nWidth = 0;
+        uint32_t nHeight = 0;
+
+        const uint8_t* pPlanes[2] = { nullptr, nullptr };
+        uint32_t nStrides[2] = { 0, 0 };
+
+        // Size of the first plane in bytes, required for compressed formats
+        size_t nDataSize = 0;
+    };
+
+    // A rectangle of a frame in pixels, an empty one (zero width or height) means the whole frame
+    struct Rect
+    {
+        uint32_t nX = 0, nY = 0;
+        uint32_t nWidth = 0, nHeight = 0;
+
+        bool IsEmpty() const { return nWidth == 0 || nHeight == 0; }
+    };
+
+    // Describes when a frame was captured and how it got to the application.
+    // All times are nanoseconds of GetMonotonicTime
+    struct FrameInfo
+    {
+        // Counts frames sent by the device, dropped frames included
+        uint64_t nSequence = 0;
+
+        // Frames lost between the previous delivered frame and this one
+        uint64_t nDropped = 0;
+
+        // Frames that came since the previous delivered frame but were skipped because nothing changed,
+        // they are not counted in nDropped
+        uint64_t nSkipped = 0;
+
+        // When the device captured the frame (the delivery time if the device has no timestamps)
+        int64_t nTimestamp = 0;
+
+        // When the frame was handed to the application and how long it took since the capture
+        int64_t nDeliveryTime = 0;
+        int64_t nLatency = 0;
+
+        // Tiles of the ChangeDetector grid that changed since the previous delivered frame,
+        // bit y * nColumns + x. All of them if there's no detector
+        uint64_t nChangedTiles = ~0ull;
+
+        // The frame came but wasn't delivered because nothing changed (bValid is false then)
+        bool bUnchanged = false;
+
+        // False if no frame was delivered
+        bool bValid = false;
+
+        explicit operator bool() const { return bValid; }
+    };
+
+    // Estimated cost of capturing in a mode, lower is better. The parts are nanoseconds of work per second of video,
+    // so they can be added up. The penalties are much larger than any real work,
+    // a mode that is smaller or slower than requested loses to every mode that fits
+    struct ModeCost
+    {
+        double fBus = 0.0; // Moving the frames from the device
+        double fConvert = 0.0; // Decoding and converting them into the output format
+        double fScale = 0.0; // Downscaling them to the output size
+        double fPenalty = 0.0;
+        double fTotal = 0.0;
+    };
+
+    // One combination of frame size, pixel format and frame rate that a device can capture
+    struct CaptureMode
+    {
+        VideoFormat nFormat = VideoFormat::None;
+        uint32_t nWidth = 0, nHeight = 0;
+
+        // Zero if the device doesn't list frame rates
+        uint32_t nFpsNumerator = 0, nFpsDenominator = 1;
+
+        // How the backend selects the mode: the fourcc on Linux,
+        // the index of the native media type on Windows and of the device format on macOS
+        uint32_t nNativeId = 0;
+
+        // Filled by RankModes
+        ModeCost cost;
+    };
+
+    // What the application asked for, zero means any size or frame rate
+    struct ModeRequest
+    {
+        uint32_t nWidth = 0, nHeight = 0;
+        uint32_t nFpsNumerator = 0, nFpsDenominator = 1;
+        OutputFormat nOutputFormat = OutputFormat::Rgba;
+    };
+
+    // All frame sized buffers start at this alignment, so every kernel can use aligned loads on the first row
+    constexpr size_t c_nBufferAlignment = 64;
+
+    // Buffers at least this large are backed by huge pages if the pool is asked to (Linux only)
+    constexpr size_t c_nHugePageSize = 2 * 1024 * 1024;
+
+    // Where the frame sized buffers come from, see SetAllocator. Allocate must return memory aligned
+    // to c_nBufferAlignment or nullptr, bHugePages is only a hint. Free gets the same size and hint
+    struct Allocator
+    {
+        void* (*Allocate)(void* pContext, size_t nSize, bool bHugePages);
+        void (*Free)(void* pContext, void* pData, size_t nSize, bool bHugePages);
+        void* pContext;
+    };
+
+    // Replaces the allocator of new buffers, nullptr restores the default one. Buffers that already exist
+    // are freed by the allocator they came from, so it must stay valid until the pool is trimmed
+    void SetAllocator(const Allocator* pAllocator);
+    Allocator GetAllocator();
+
+    // Owns every frame sized buffer of the capturers and keeps the returned ones for reuse. A buffer is given out again
+    // for any size up to four times smaller than its own, so a running capture allocates nothing and a format change
+    // takes the buffers of the previous format. Thread safe
+    class BufferPool
+    {
+    public:
+        BufferPool() = default;
+        ~BufferPool();
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        // At least nSize bytes aligned to c_nBufferAlignment, nullptr if nSize is zero or the allocator failed.
+        // The contents are whatever the last user left there
+        uint8_t* Acquire(size_t nSize);
+
+        // Gives a buffer back to the pool, nullptr is ignored
+        void Release(uint8_t* pData);
+
+        // Usable size of a buffer returned by Acquire, it may be larger than requested
+        size_t GetCapacity(const uint8_t* pData) const;
+
+        // Buffers of c_nHugePageSize and more are mapped with MAP_HUGETLB, or marked for transparent
+        // huge pages if none are reserved. Off by default, only new buffers are affected
+        void SetHugePages(bool bEnable);
+        bool GetHugePages() const;
+
+        // Idle buffers beyond this many bytes are freed when they're returned, 256 MB by default
+        void SetIdleLimit(size_t nBytes);
+        size_t GetIdleLimit() const;
+
+        // Frees all idle buffers
+        void Trim();
+
+        size_t GetIdleSize() const;
+
+        // How many times the allocator was called, it doesn't change while capturing
+        uint64_t GetAllocationCount() const;
+
+    private:
+        struct Block
+        {
+            uint8_t* pData;
+            size_t nCapacity;
+            bool bHugePages;
+            Allocator allocator;
+        };
+
+        static void FreeBlock(const Block& block);
+
+        // Needs m_Mutex
+        void FreeIdle(size_t nLimit);
+
+    private:
+        mutable std::mutex m_Mutex;
+
+        std::vector<Block> m_vecBusy;
+
+        // From the least to the most recently returned
+        std::vector<Block> m_vecIdle;
+        size_t m_nIdleSize = 0;
+        size_t m_nIdleLimit = 256 * 1024 * 1024;
+
+        bool m_bHugePages = false;
+        uint64_t m_nAllocations = 0;
+
+    };
+
+    // The pool all capturers use. It's never destroyed, so buffers can be returned from static destructors
+    BufferPool& GetBufferPool();
+
+    // A buffer of GetBufferPool() that goes back to the pool when it's destroyed or resized
+    class FrameBuffer
+    {
+    public:
+        FrameBuffer() = default;
+        ~FrameBuffer();
+
+        FrameBuffer(FrameBuffer&& other) noexcept;
+        FrameBuffer& operator=(FrameBuffer&& other) noexcept;
+
+        FrameBuffer(const FrameBuffer&) = delete;
+        FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+        // Keeps the buffer if it's large enough and not four times larger, otherwise swaps it for one
+        // from the pool. The contents are kept only in the first case. Returns false if there's no memory
+        bool Resize(size_t nSize);
+
+        // Resize that also sets the nSize bytes to zero
+        bool Assign(size_t nSize);
+
+        void Reset();
+
+        uint8_t* GetData() { return m_pData; }
+        const uint8_t* GetData() const { return m_pData; }
+        size_t GetSize() const { return m_nSize; }
+        bool IsEmpty() const { return m_nSize == 0; }
+
+    private:
+        uint8_t* m_pData = nullptr;
+        size_t m_nSize = 0;
+        size_t m_nCapacity = 0;
+
+    };
+
+    namespace internal
+    {
+        uint8_t ClampInt32ToUint8(int nValue);
+
+        // Adds the time since nStart to nTotal and returns the current time
+        int64_t AddElapsed(int64_t& nTotal, int64_t nStart);
+
+        // YUV -> RGB matrix in fixed point with 8 fractional bits:
+        // R = Y' + RV * V', G = Y' + GU * U' + GV * V', B = Y' + BU * U'
+        // where Y' = nY * (y - nYOffset), U' = u - 128 and V' = v - 128
+        struct YuvCoefficients
+        {
+            int32_t nY, nYOffset;
+            int32_t nRV, nGU, nGV, nBU;
+        };
+
+        // Every term of YuvCoefficients for all 256 sample values, nY includes the rounding.
+        // A channel is the sum of its terms shifted right by 8
+        struct YuvTable
+        {
+            int32_t nY[256];
+            int32_t nRV[256];
+            int32_t nGU[256];
+            int32_t nGV[256];
+            int32_t nBU[256];
+        };
+
+        // Three matrices in limited and full range, the tables of all of them are built at compile time
+        constexpr uint32_t c_nYuvSpaces = 6;
+
+        // Index of the table of a color space, Auto fields are BT.601 and limited range
+        uint32_t GetYuvSpace(const ColorSpace& colorSpace);
+
+        const YuvCoefficients& GetYuvCoefficients(uint32_t nSpace);
+        const YuvTable& GetYuvTable(uint32_t nSpace);
+
+        // Reference converters of one pixel (two pixels for YUY2)
+        void ConvertFromYUV(int y, int cb, int cr, uint8_t* pDst, const YuvTable& table);
+        void ConvertFromRGB32(const uint8_t* pSrc, uint8_t* pDst);
+        void ConvertFromRGB24(const uint8_t* pSrc, uint8_t* pDst);
+        void ConvertFromYUY2(const uint8_t* pSrc, uint8_t* pDst, const YuvTable& table);
+        void ConvertFromBGRA(const uint8_t* pSrc, uint8_t* pDst);
+
+        // YUV converters have one instance per color space, N is the index returned by GetYuvSpace
+        void ConvertRowRGB32_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void ConvertRowRGB24_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowYUY2_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void ConvertRowBGRA_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void ConvertRowGray8_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowsNV12_Scalar(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth);
+
+        // Luma converters write one byte per pixel
+        uint8_t ComputeLuma(int r, int g, int b);
+
+        void LumaRowCopy(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void LumaRowRGB32_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void LumaRowRGB24_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void LumaRowYUY2_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void LumaRowBGRA_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+
+    #ifdef WCC_X86
+        void LumaRowYUY2_Sse2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void LumaRowYUY2_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+
+        template <uint32_t N> void ConvertRowYUY2_Sse2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void ConvertRowBGRA_Sse2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowsNV12_Sse2(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth);
+
+        void ConvertRowRGB24_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowYUY2_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void ConvertRowBGRA_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowsNV12_Avx2(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth);
+    #endif
+
+    #ifdef WCC_NEON
+        void LumaRowYUY2_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+
+        void ConvertRowRGB24_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowYUY2_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        void ConvertRowBGRA_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth);
+        template <uint32_t N> void ConvertRowsNV12_Neon(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth);
+    #endif
+
+        // Converts only the pixels pColumns of the row sy, so a frame
+        // that's much larger than the output is not converted entirely
+        void GatherRow(const FrameView& src, uint32_t sy, const uint32_t* pColumns, uint8_t* pDst, uint32_t nDstWidth, const YuvTable& table);
+
+        // Horizontal passes of the scaler, pX0, pX1, pCount and pWeight are the column tables of Scaler
+        using BilinearRowKernel = void(*)(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        using AreaRowKernel = void(*)(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+
+        // Vertical passes of the scaler, n is the number of bytes in a row
+        using AverageRowsKernel = void(*)(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n);
+
+        // Averages nFactor x nFactor blocks of pixels with nChannels bytes, nFactor must be 2 or 4
+        using BoxRowsKernel = void(*)(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth);
+
+        // SIMD kernels sum bytes in 16 bits, so they average at most this many pixels or rows
+        constexpr uint32_t c_nMaxSimdSum = 257;
+
+        struct ScaleKernels
+        {
+            BilinearRowKernel fnBilinearRow;
+            AreaRowKernel fnAreaRow;
+            AverageRowsKernel fnAverageRows;
+            BoxRowsKernel fnBoxRows;
+        };
+
+        // The fastest kernels nIsa can run for pixels of nChannels bytes (4 or 1)
+        ScaleKernels GetScaleKernels(Isa nIsa, uint32_t nChannels);
+
+        template <uint32_t C> void BilinearRow_Scalar(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        template <uint32_t C> void AreaRow_Scalar(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+
+        void LerpRows(const uint8_t* pRow0, const uint8_t* pRow1, uint32_t nWeight, uint8_t* pDst, size_t n);
+        void AverageRows_Scalar(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n);
+        void BoxRows_Scalar(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth);
+
+    #ifdef WCC_X86
+        void BilinearRow4_Sse2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void BilinearRow1_Sse2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void AreaRow4_Sse2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void AverageRows_Sse2(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n);
+        void BoxRows_Sse2(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth);
+
+        void BilinearRow4_Avx2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void AverageRows_Avx2(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n);
+        void BoxRows_Avx2(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth);
+    #endif
+
+    #ifdef WCC_NEON
+        void BilinearRow4_Neon(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void BilinearRow1_Neon(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void AreaRow4_Neon(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth);
+        void AverageRows_Neon(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n);
+        void BoxRows_Neon(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth);
+    #endif
+
+        Isa DetectIsa();
+
+        // Rounds to the nearest even half precision value, infinities and NaNs are kept
+        uint16_t FloatToHalf(float fValue);
+
+        // Writes the R, G and B bytes (in the order pOrder) of nWidth RGBA pixels as values of pLut, which has 256 values
+        // per channel. Channels of a pixel are nChannelStep values apart and pixels nPixelStep values
+        template <class T>
+        void WriteTensorRow(const uint8_t* pRgba, const uint8_t* pOrder, const T* pLut, T* pDst, size_t nChannelStep, size_t nPixelStep, uint32_t nWidth)
+        {
+            const T* pLut0 = pLut;
+            const T* pLut1 = pLut + 256;
+            const T* pLut2 = pLut + 512;
+
+            const uint32_t c0 = pOrder[0], c1 = pOrder[1], c2 = pOrder[2];
+
+            for (uint32_t x = 0; x < nWidth; x++, pRgba += 4, pDst += nPixelStep)
+            {
+                pDst[0] = pLut0[pRgba[c0]];
+                pDst[nChannelStep] = pLut1[pRgba[c1]];
+                pDst[nChannelStep * 2] = pLut2[pRgba[c2]];
+            }
+        }
+
+        // Aligned heap memory, nAlignment must be a power of two and a multiple of sizeof(void*)
+        void* AllocateAligned(size_t nSize, size_t nAlignment);
+        void FreeAligned(void* pData);
+
+        // The default Allocator
+        void* AllocateBuffer(void* pContext, size_t nSize, bool bHugePages);
+        void FreeBuffer(void* pContext, void* pData, size_t nSize, bool bHugePages);
+
+    #ifdef WCCAPI_USE_LIBJPEG
+        // Keeps one libjpeg decompressor for all frames of a stream
+        class JpegDecoder
+        {
+        public:
+            JpegDecoder();
+            ~JpegDecoder();
+
+            JpegDecoder(const JpegDecoder&) = delete;
+            JpegDecoder& operator=(const JpegDecoder&) = delete;
+
+            // Reads the header of a frame, returns false if the data is broken
+            bool ReadHeader(const uint8_t* pData, size_t nSize, uint32_t& nWidth, uint32_t& nHeight);
+
+            // How many times narrower the chroma of the frame after ReadHeader stays at every DCT scaling.
+            // libjpeg scales chroma with luma only if it's subsampled the same way in both directions,
+            // so it's 2 for 4:2:2 frames and 1 for 4:2:0 and 4:4:4 ones
+            uint32_t GetChromaDivisor() const { return m_nChromaDivisor; }
+
+            // Decodes the frame after ReadHeader into pixels of nFormat (Rgb32, Rgb24 or Gray8),
+            // the size is divided by nDenominator (1, 2, 4 or 8) rounding up.
+            // Only the region (in the divided size) is returned, with libjpeg-turbo only it is decoded
+            bool Decode(uint32_t nDenominator, VideoFormat nFormat, const Rect& region = {});
+
+            FrameView GetView() const;
+
+        private:
+            struct ErrorManager
+            {
+                jpeg_error_mgr base;
+                jmp_buf jump;
+            };
+
+            // libjpeg calls exit() on errors by default
+            static void OnError(j_common_ptr pInfo);
+
+        private:
+            jpeg_decompress_struct m_Info;
+            ErrorManager m_Error;
+            bool m_bHeader = false;
+            uint32_t m_nChromaDivisor = 1;
+
+            VideoFormat m_nFormat = VideoFormat::None;
+            uint32_t m_nWidth = 0, m_nHeight = 0;
+            FrameBuffer m_Pixels;
+
+            // Where the region starts in m_Pixels
+            size_t m_nOffset = 0;
+            uint32_t m_nStride = 0;
+
+        };
+    #endif
+    }
+
+    // Returns the best instruction set supported by the CPU (detected once)
+    Isa GetBestIsa();
+
+    // Returns the fastest row converter of nFormat that nIsa can run,
+    // nullptr if the format can't be converted to RGBA row by row (e.g. NV12).
+    // YUV formats are converted with the matrix and range of colorSpace
+    RowConverter GetRowConverter(VideoFormat nFormat, Isa nIsa = GetBestIsa(), const ColorSpace& colorSpace = {});
+
+    Nv12Converter GetNv12Converter(Isa nIsa = GetBestIsa(), const ColorSpace& colorSpace = {});
+
+    // Returns a converter that writes the luma of nWidth pixels of one row, one byte per pixel.
+    // YUY2 and NV12 already have it, NV12 rows are taken from the Y plane
+    RowConverter GetLumaConverter(VideoFormat nFormat, Isa nIsa = GetBestIsa());
+
+    // Number of bytes that one pixel of nFormat takes in the first plane, 0 for compressed formats
+    uint32_t GetBytesPerPixel(VideoFormat nFormat);
+
+    bool IsCompressed(VideoFormat nFormat);
+
+    // Describes a frame that is stored contiguously in pData,
+    // nStride is a stride of the first plane (NV12 uses the same stride for both planes)
+    FrameView MakeFrameView(VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, const uint8_t* pData, uint32_t nStride);
+
+    // Minimal size of a contiguous frame in bytes
+    size_t GetFrameSize(VideoFormat nFormat, uint32_t nHeight, uint32_t nStride);
+
+    // Bus, conversion and scaling work of capturing in the mode plus the penalties for not fitting the request
+    ModeCost EstimateModeCost(const CaptureMode& mode, const ModeRequest& request);
+
+    // Estimates the cost of every mode and sorts them from the cheapest one. Modes that can't be converted
+    // (no format, MJPEG without WCCAPI_USE_LIBJPEG) are removed, modes of the same cost keep the order of the device
+    void RankModes(std::vector<CaptureMode>& vecModes, const ModeRequest& request);
+
+    // Keeps the modes of devices in a small text file, so they don't have to be asked for all of them
+    // every time they are opened. A device is identified by a key the backend builds from its bus path
+    // or serial and its driver or firmware version. Entries aren't checked when they are read,
+    // a capturer drops the entry and asks the device again if the cached mode fails to configure
+    class ModeCache
+    {
+    public:
+        ModeCache() = default;
+
+        // Reads the file if it exists, stored entries are written into it
+        bool Open(const std::string& sPath);
+        void Close();
+        bool IsOpen() const;
+
+        // False if the cache isn't open or has no entry of the device
+        bool Find(const std::string& sDevice, std::vector<CaptureMode>& vecModes) const;
+
+        // Both write the whole file again, it takes a few kilobytes per device
+        bool Store(const std::string& sDevice, const std::vector<CaptureMode>& vecModes);
+        bool Remove(const std::string& sDevice);
+
+    private:
+        // The key takes the rest of its line in the file
+        static std::string MakeKey(const std::string& sDevice);
+        bool Save() const;
+
+    private:
+        mutable std::mutex m_Mutex;
+
+        std::string m_sPath;
+        std::map<std::string, std::vector<CaptureMode>> m_mapDevices;
+
+    };
+
+    // The cache all capturers use, it does nothing until it's opened
+    ModeCache& GetModeCache();
+
+    // Returned by InitAsync of the capturers, which open and configure the device on a thread of their own,
+    // so several devices are opened at the same time. Copies share the state. The capturer must not be used
+    // until Wait has returned true, destroying it cancels the task and waits for it
+    class InitTask
+    {
+    public:
+        InitTask() = default;
+
+        // Used by the capturers
+        static InitTask Create();
+        void Finish(bool bResult) const;
+
+        // The result of Init, false if it failed or was cancelled
+        bool Wait() const;
+
+        // Returns false if Init hasn't finished within nTimeout nanoseconds.
+        // An empty task is never done and never succeeds, Wait, WaitFor and IsDone return false at once
+        bool WaitFor(int64_t nTimeout) const;
+        bool IsDone() const;
+
+        // Init stops at the next step (opening, configuring, starting the device) and fails
+        void Cancel() const;
+        bool IsCancelled() const;
+
+        explicit operator bool() const { return m_pState != nullptr; }
+
+    private:
+        struct State
+        {
+            std::mutex mutex;
+            std::condition_variable done;
+            bool bDone = false;
+            bool bResult = false;
+
+            std::atomic<bool> bCancelled{ false };
+        };
+
+        std::shared_ptr<State> m_pState;
+
+    };
+
+    // Called with the info of the frame a capturer has written into its buffer (RequestFrame of the backends)
+    using FrameCallback = void (*)(void* pContext, const FrameInfo& info);
+
+    // Where NextFrame resumes the waiting coroutine. Post runs fnTask(pTask) on the executor, may run it right away.
+    // An executor without Post resumes the coroutine on the thread that got the frame
+    struct Executor
+    {
+        void (*Post)(void* pContext, void (*fnTask)(void*), void* pTask) = nullptr;
+        void* pContext = nullptr;
+    };
+
+    // One thread that runs tasks, timers and (not on Windows) waits for descriptors, so any number
+    // of capturers can wait for frames without a blocked thread each. The thread is started by the first task
+    class FrameLoop
+    {
+    public:
+        using Task = void (*)(void* pContext);
+
+        FrameLoop() = default;
+        ~FrameLoop();
+
+        FrameLoop(const FrameLoop&) = delete;
+        FrameLoop& operator=(const FrameLoop&) = delete;
+
+        // Runs fnTask on the loop thread as soon as possible
+        void Post(Task fnTask, void* pContext);
+
+        // Runs fnTask on the loop thread at nTime (GetMonotonicTime), at once if it has passed
+        void PostAt(int64_t nTime, Task fnTask, void* pContext);
+
+    #ifndef _WIN32
+        // Asks whether descriptors can be read like poll(2), for descriptors poll(2) doesn't know (a fake device)
+        using PollFunc = int (*)(pollfd* pFds, nfds_t nFds, int nTimeout);
+
+        // Runs fnTask once when nFd can be read or after nTimeout nanoseconds, whichever comes first.
+        // With fnPoll the loop asks it about nFd without waiting on every pass and sleeps a millisecond at most
+        // meanwhile, otherwise nFd goes into the poll(2) the loop sleeps in
+        void WatchOnce(int nFd, int64_t nTimeout, Task fnTask, void* pContext, PollFunc fnPoll = nullptr);
+    #endif
+
+        // Drops the tasks of pContext and waits for the one that is running (unless called by the loop thread),
+        // capturers call it when they are destroyed
+        void Cancel(void* pContext);
+
+        // Tasks posted on the loop thread run at once, tasks from other threads are queued
+        Executor GetExecutor();
+        bool IsLoopThread() const;
+
+        // Drops all tasks and joins the thread, must not be called by a task. The next task starts it again
+        void Stop();
+
+    private:
+        // Only the loop removes entries, it keeps indices into them while it polls without the lock
+        struct Entry
+        {
+            int64_t nTime; // INT64_MIN once it's due
+            Task fnTask; // nullptr once it's cancelled
+            void* pContext;
+            int nFd; // -1 if it only waits for nTime
+
+        #ifndef _WIN32
+            PollFunc fnPoll = nullptr; // nullptr if nFd is polled with the others
+        #endif
+        };
+
+        static void PostTask(void* pContext, Task fnTask, void* pTask);
+
+        void Add(const Entry& entry);
+        void Run();
+        void Wake();
+
+    private:
+        std::mutex m_Mutex;
+        std::condition_variable m_Idle;
+
+        std::vector<Entry> m_vecEntries;
+        void* m_pRunning = nullptr;
+
+        std::thread m_Thread;
+        std::atomic<std::thread::id> m_nThreadId{};
+        bool m_bStop = false;
+
+    #ifdef _WIN32
+        std::condition_variable m_Wake;
+    #else
+        int m_nWakeFds[2] = { -1, -1 };
+    #endif
+
+    };
+
+    // The loop NextFrame resumes coroutines on by default
+    FrameLoop& GetFrameLoop();
+
+    // The pending RequestFrame of a capturer, there is one at a time. Whoever gets the frame claims the request,
+    // captures and finishes it, Claim makes sure only one of the threads that might do it does
+    class FrameRequest
+    {
+    public:
+        FrameRequest() = default;
+
+        // False if another request is pending
+        bool Set(FrameCallback fnDone, void* pContext);
+        bool IsPending() const;
+
+        // True if the caller has to capture the frame and call Finish
+        bool Claim();
+
+        // Clears the request and calls its callback with the frame
+        void Finish(const FrameInfo& info);
+
+    private:
+        mutable std::mutex m_Mutex;
+
+        FrameCallback m_fnDone = nullptr;
+        void* m_pContext = nullptr;
+        bool m_bClaimed = false;
+
+    };
+
+#ifdef WCC_COROUTINES
+    // Returned by NextFrame of the capturers: co_await suspends the coroutine until the capturer has written
+    // its next frame into the buffer of SetBuffer and resumes it on the executor with the info DoCapture
+    // would have returned. One await per capturer at a time, a second one returns an invalid info at once
+    template <class Capturer>
+    class FrameAwaitable
+    {
+    public:
+        FrameAwaitable(Capturer& capturer, const Executor& executor) : m_pCapturer(&capturer), m_Executor(executor) {}
+
+        bool await_ready() const { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_Handle = handle;
+            return m_pCapturer->RequestFrame(&FrameAwaitable::OnFrame, this);
+        }
+
+        FrameInfo await_resume() const { return m_Info; }
+
+    private:
+        static void OnFrame(void* pContext, const FrameInfo& info)
+        {
+            FrameAwaitable* pThis = (FrameAwaitable*)pContext;
+            pThis->m_Info = info;
+
+            // The coroutine may be resumed (and the awaitable destroyed) before Post returns
+            if (pThis->m_Executor.Post)
+                pThis->m_Executor.Post(pThis->m_Executor.pContext, &FrameAwaitable::Resume, pThis->m_Handle.address());
+            else
+                pThis->m_Handle.resume();
+        }
+
+        static void Resume(void* pHandle)
+        {
+            std::coroutine_handle<>::from_address(pHandle).resume();
+        }
+
+    private:
+        Capturer* m_pCapturer;
+        Executor m_Executor;
+
+        std::coroutine_handle<> m_Handle;
+        FrameInfo m_Info;
+
+    };
+#endif
+
+    // Clamps the region to a frame of nWidth x nHeight, an empty region becomes the whole frame.
+    // YUY2 and NV12 share chroma between neighbouring pixels, so their regions are widened to even coordinates
+    Rect AlignRegion(VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, const Rect& region);
+
+    // Points a view at a region returned by AlignRegion, no pixels are copied.
+    // Compressed frames have no rows and are returned as they are
+    FrameView CropFrameView(const FrameView& view, const Rect& region);
+
+    // Converts the whole frame into RGBA rows of nDstStride bytes
+    void ConvertFrame(const FrameView& src, uint8_t* pDst, uint32_t nDstStride, Isa nIsa = GetBestIsa(), const ColorSpace& colorSpace = {});
+
+    enum class ScaleMode
+    {
+        Nearest,
+        Bilinear,
+        Area // Averages all source pixels covered by the output pixel
+    };
+
+    // Resamples RGBA (or single channel) rows. All source positions and weights are computed once in Configure,
+    // so there are no divisions per pixel. The work is split in two passes:
+    // ScaleRow resamples one source row horizontally, then BlendRows combines
+    // GetRowCount(y) of such rows starting from GetFirstRow(y) into the output row y
+    class Scaler
+    {
+    public:
+        Scaler() = default;
+
+        // nChannels is the number of bytes per pixel, 4 or 1. The kernels of nIsa do the filtering,
+        // they give exactly the same output as the scalar ones
+        bool Configure(uint32_t nSrcWidth, uint32_t nSrcHeight, uint32_t nDstWidth, uint32_t nDstHeight, ScaleMode nMode, uint32_t nChannels = 4, Isa nIsa = GetBestIsa());
+
+        ScaleMode GetMode() const;
+        uint32_t GetChannels() const;
+
+        uint32_t GetFirstRow(uint32_t y) const;
+        uint32_t GetRowCount(uint32_t y) const;
+        uint32_t GetMaxRowCount() const;
+
+        // Source column of each output column (the first one for filtered modes)
+        const uint32_t* GetColumns() const;
+
+        // 2 or 4 if the Area mode downscales by exactly that factor in both directions, 0 otherwise.
+        // BoxRows handles that case without the horizontal pass
+        uint32_t GetIntegerFactor() const;
+
+        void ScaleRow(const uint8_t* pSrc, uint8_t* pDst) const;
+        void BlendRows(uint32_t y, const uint8_t* const* ppRows, uint8_t* pDst) const;
+
+        // Averages the GetIntegerFactor() source rows of an output row into it
+        void BoxRows(const uint8_t* const* ppRows, uint8_t* pDst) const;
+
+    private:
+        ScaleMode m_nMode = ScaleMode::Nearest;
+        uint32_t m_nChannels = 4;
+
+        internal::ScaleKernels m_Kernels{};
+
+        uint32_t m_nSrcWidth = 0, m_nSrcHeight = 0;
+        uint32_t m_nDstWidth = 0, m_nDstHeight = 0;
+
+        uint32_t m_nMaxRowCount = 0;
+        uint32_t m_nIntegerFactor = 0;
+
+        // Per output column: the first source column, the second source column (Bilinear),
+        // the number of source columns (Area) and a weight (8-bit fraction for Bilinear, 16-bit reciprocal for Area)
+        std::vector<uint32_t> m_vecX0, m_vecX1, m_vecXCount, m_vecXWeight;
+
+        // The same per output row
+        std::vector<uint32_t> m_vecY0, m_vecYCount, m_vecYWeight;
+
+    };
+
+    // A fixed set of threads that run tasks of one job at a time.
+    // The thread that calls Run takes part in the job too
+    class WorkerPool
+    {
+    public:
+        using Task = void(*)(void* pContext, uint32_t nTask);
+
+        WorkerPool() = default;
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        // nThreads includes the calling thread, so 1 means no worker threads at all
+        void Start(uint32_t nThreads);
+        void Stop();
+
+        uint32_t GetThreadCount() const;
+
+        // Runs fnTask(pContext, i) for each i in [0, nTasks) and waits until all of them are done
+        void Run(uint32_t nTasks, Task fnTask, void* pContext);
+
+    private:
+        void WorkerMain(uint64_t nLastJob);
+        void RunTasks();
+
+    private:
+        std::vector<std::thread> m_vecThreads;
+
+        std::mutex m_Mutex;
+        std::condition_variable m_cvStart, m_cvDone;
+
+        // Incremented for every job, a worker sleeps until it changes
+        uint64_t m_nJob = 0;
+        uint32_t m_nBusy = 0;
+        bool m_bQuit = false;
+
+        Task m_fnTask = nullptr;
+        void* m_pContext = nullptr;
+        uint32_t m_nTasks = 0;
+        std::atomic<uint32_t> m_nNextTask{0};
+
+    };
+
+    // Nanoseconds of the steady clock: CLOCK_MONOTONIC on Linux, mach_absolute_time on macOS
+    // and QueryPerformanceCounter on Windows, the backends map device timestamps onto it
+    int64_t GetMonotonicTime();
+
+    // Fills FrameInfo for the frames of one stream, counts the frames lost between two delivered ones
+    class FrameCounter
+    {
+    public:
+        FrameCounter() = default;
+
+        // nTimestamp is the time of the capture (0 if unknown), the delivery time is now.
+        // nSkipped frames were skipped since the previous delivered one without going through Skip
+        FrameInfo Deliver(uint64_t nSequence, int64_t nTimestamp, uint64_t nSkipped = 0);
+
+        // A frame that came but isn't delivered because nothing changed: the info has bUnchanged set
+        // and is not valid, the next delivered frame counts it in nSkipped instead of nDropped
+        FrameInfo Skip(uint64_t nSequence, int64_t nTimestamp);
+
+        // Must be called when the stream is restarted
+        void Reset();
+
+    private:
+        FrameInfo MakeInfo(uint64_t nSequence, int64_t nTimestamp) const;
+
+    private:
+        bool m_bStarted = false;
+        uint64_t m_nLastSequence = 0;
+        uint64_t m_nSkipped = 0;
+
+    };
+
+    // Compares frames with the last delivered one on a grid of tiles. Only the luma of every nStep-th pixel
+    // of every nStep-th row is read, straight from the native frame before it's converted.
+    // Compressed frames can't be compared and always count as changed
+    class ChangeDetector
+    {
+    public:
+        struct Settings
+        {
+            // A tile changed if the mean absolute difference of its luma samples is above it, 0 disables the detector
+            uint32_t nThreshold = 0;
+
+            // At most 64 tiles, so they fit into FrameInfo::nChangedTiles
+            uint32_t nColumns = 8, nRows = 8;
+            uint32_t nStep = 4;
+
+            // How many tiles must change to deliver the frame
+            uint32_t nMinTiles = 1;
+        };
+
+        ChangeDetector() = default;
+
+        // Starts over, the next frame is always delivered
+        void SetSettings(const Settings& settings);
+        const Settings& GetSettings() const;
+
+        bool IsEnabled() const;
+
+        // Returns true if the frame should be delivered, it becomes the frame the next ones are compared with
+        bool Update(const FrameView& view);
+
+        // Marks the info of the last frame passed to Update: the changed tiles and bUnchanged
+        void Mark(FrameInfo& info) const;
+
+        uint64_t GetChangedTiles() const;
+
+        // Mean absolute difference of every tile in the last Update, row by row
+        const std::vector<uint32_t>& GetTileDifferences() const;
+
+        void Reset();
+
+    private:
+        void Prepare(const FrameView& view);
+
+    private:
+        Settings m_Settings;
+
+        // Luma samples of the last delivered frame
+        std::vector<uint8_t> m_vecReference;
+        std::vector<uint8_t> m_vecSamples;
+
+        // Tile of every sampled column and row, number of samples per tile
+        std::vector<uint8_t> m_vecColumnTiles;
+        std::vector<uint8_t> m_vecRowTiles;
+        std::vector<uint32_t> m_vecTileSamples;
+
+        std::vector<uint32_t> m_vecDifferences;
+
+        VideoFormat m_nFormat = VideoFormat::None;
+        uint32_t m_nWidth = 0, m_nHeight = 0;
+
+        bool m_bHasReference = false;
+        bool m_bChanged = true;
+        uint64_t m_nChangedTiles = ~0ull;
+
+    };
+
+    enum class Stage
+    {
+        Wait, // Waiting for the device
+        Decode, // Decompressing MJPEG
+        Convert, // Converting rows to RGBA or luma
+        Scale, // Resampling converted rows
+        Copy, // Copying frames (native output, macOS output buffer)
+        Total // The whole capture call
+    };
+
+    constexpr uint32_t c_nStageCount = 6;
+
+    // Durations in power of two buckets: bucket i counts durations in [2^i, 2^(i+1)) nanoseconds
+    struct HistogramSnapshot
+    {
+        static constexpr uint32_t c_nBuckets = 32;
+
+        uint64_t nBuckets[c_nBuckets] = {};
+        uint64_t nCount = 0;
+        int64_t nTotal = 0;
+        int64_t nMax = 0;
+
+        int64_t GetMean() const;
+
+        // Upper bound of the bucket that holds the percentile (0..100)
+        int64_t GetPercentile(double fPercentile) const;
+    };
+
+    // Can be written by several threads and read by another one without locks
+    class Histogram
+    {
+    public:
+        Histogram() = default;
+
+        void Add(int64_t nDuration);
+
+        HistogramSnapshot GetSnapshot() const;
+        void Reset();
+
+    private:
+        std::atomic<uint64_t> m_nBuckets[HistogramSnapshot::c_nBuckets] = {};
+        std::atomic<int64_t> m_nTotal{0};
+        std::atomic<int64_t> m_nMax{0};
+
+    };
+
+    struct StatsSnapshot
+    {
+        HistogramSnapshot Stages[c_nStageCount];
+
+        // Counted since the last reset, nElapsed is in nanoseconds
+        uint64_t nFrames = 0;
+        uint64_t nDropped = 0;
+        uint64_t nSkipped = 0;
+        uint64_t nBytes = 0;
+        int64_t nElapsed = 0;
+
+        double fFramesPerSecond = 0.0;
+        double fBytesPerSecond = 0.0;
+
+        // Part of the frames sent by the device that were dropped
+        double fDropRate = 0.0;
+    };
+
+    // Timings and throughput of a capture pipeline. The capturer records into it from
+    // its threads and GetSnapshot/Reset can be called from any other thread
+    class PipelineStats
+    {
+    public:
+        PipelineStats();
+
+        void AddTime(Stage nStage, int64_t nDuration);
+        void AddTimeSince(Stage nStage, int64_t nStart);
+
+        // Counts a delivered frame and the frames dropped and skipped before it
+        void AddFrame(const FrameInfo& info);
+
+        // Bytes of the source frames that were converted
+        void AddBytes(size_t nBytes);
+
+        StatsSnapshot GetSnapshot() const;
+        void Reset();
+
+    private:
+        Histogram m_Stages[c_nStageCount];
+
+        std::atomic<uint64_t> m_nFrames{0};
+        std::atomic<uint64_t> m_nDropped{0};
+        std::atomic<uint64_t> m_nSkipped{0};
+        std::atomic<uint64_t> m_nBytes{0};
+        std::atomic<int64_t> m_nStartTime{0};
+
+    };
+
+    // Bounds the number of frames borrowed from a driver at once, if all of its buffers
+    // are held by the application the driver has nowhere to put new frames
+    class LeaseLimit
+    {
+    public:
+        explicit LeaseLimit(uint32_t nMax = 2);
+
+        void SetMax(uint32_t nMax);
+        uint32_t GetMax() const;
+        uint32_t GetOutstanding() const;
+
+        bool TryAcquire();
+        void Release();
+
+    private:
+        std::atomic<uint32_t> m_nMax;
+        std::atomic<uint32_t> m_nOutstanding{0};
+
+    };
+
+    // A frame in its native format pointing straight into a buffer of the driver, nothing is copied.
+    // The buffer is given back to the driver when the lease is destroyed, so it must not outlive the capturer
+    class FrameLease
+    {
+    public:
+        using Release = void(*)(void* pOwner, uintptr_t nHandle);
+
+        FrameLease() = default;
+        FrameLease(const FrameView& view, const FrameInfo& info, Release fnRelease, void* pOwner, uintptr_t nHandle, LeaseLimit* pLimit);
+        ~FrameLease();
+
+        FrameLease(const FrameLease&) = delete;
+        FrameLease& operator=(const FrameLease&) = delete;
+
+        FrameLease(FrameLease&& other) noexcept;
+        FrameLease& operator=(FrameLease&& other) noexcept;
+
+        // Gives the buffer back before the lease is destroyed
+        void Reset();
+
+        explicit operator bool() const;
+
+        const FrameView& GetView() const;
+        const FrameInfo& GetInfo() const;
+
+        VideoFormat GetFormat() const;
+        uint32_t GetWidth() const;
+        uint32_t GetHeight() const;
+
+        const uint8_t* GetData(uint32_t nPlane = 0) const;
+        uint32_t GetStride(uint32_t nPlane = 0) const;
+
+    private:
+        FrameView m_View{};
+        FrameInfo m_Info{};
+
+        Release m_fnRelease = nullptr;
+        void* m_pOwner = nullptr;
+        uintptr_t m_nHandle = 0;
+        LeaseLimit* m_pLimit = nullptr;
+
+    };
+
+    // Triple buffer of frames passed from one producer thread to one consumer thread.
+    // The producer never waits and the consumer always gets the newest complete frame
+    class FrameExchange
+    {
+    public:
+        FrameExchange() = default;
+
+        // Not thread safe, must be called before the threads start using the exchange.
+        // The slots come from GetBufferPool(), returns false if there's no memory
+        bool Resize(size_t nFrameSize);
+        size_t GetFrameSize() const;
+
+        // Producer: the slot for the next frame, Publish makes it the newest one
+        uint8_t* GetBackBuffer();
+        void Publish(const FrameInfo& info = {});
+
+        // Consumer: the newest frame or nullptr if nothing was published since the last call,
+        // the frame stays untouched until the next call. pInfo receives the info passed to Publish
+        const uint8_t* Acquire(FrameInfo* pInfo = nullptr);
+
+    private:
+        // The middle slot index has this bit set if it holds a frame the consumer hasn't seen
+        static constexpr uint32_t c_nFresh = 4;
+
+        size_t m_nFrameSize = 0;
+        FrameBuffer m_Slots[3];
+        FrameInfo m_Infos[3];
+
+        // Each side has its own cache line
+        alignas(64) uint32_t m_nBack = 0;
+        alignas(64) uint32_t m_nFront = 1;
+        alignas(64) std::atomic<uint32_t> m_nMiddle{2};
+
+    };
+
+    // Captures from several streams at once, each one on its own thread, and hands out sets
+    // with one frame of every stream that were captured at about the same time.
+    // Every stream has its own lock, capture threads never wait for each other
+    class CaptureGroup
+    {
+    public:
+        // Writes the next frame into pDst and returns its info, the info is invalid if there was no frame.
+        // Called on the capture thread of the stream
+        using CaptureFn = std::function<FrameInfo(void* pDst)>;
+
+        struct Frame
+        {
+            const uint8_t* pData = nullptr;
+            FrameInfo info;
+        };
+
+        struct FrameSet
+        {
+            // One frame per stream in the order the streams were added
+            std::vector<Frame> vecFrames;
+
+            // The earliest timestamp of the set and the difference to the latest one
+            int64_t nTimestamp = 0;
+            int64_t nSkew = 0;
+        };
+
+        CaptureGroup() = default;
+        ~CaptureGroup();
+
+        CaptureGroup(const CaptureGroup&) = delete;
+        CaptureGroup& operator=(const CaptureGroup&) = delete;
+
+        // Returned by AddStream and AddCapturer while the group is running
+        static constexpr uint32_t c_nInvalidStream = (uint32_t)-1;
+
+        // Must be called before Start (or after Stop), fnCapture gets a buffer of nFrameSize bytes.
+        // Returns the index of the stream, c_nInvalidStream while the capture threads are running
+        uint32_t AddStream(CaptureFn fnCapture, size_t nFrameSize);
+
+        // Works with any capturer that has SetBuffer, DoCapture and GetOutputSize (lwcc, wwcc and mwcc),
+        // the capturer must not be used by anything else while the group is running
+        template <class Capturer>
+        uint32_t AddCapturer(Capturer& capturer)
+        {
+            return AddStream([&capturer](void* pDst) { capturer.SetBuffer(pDst); return capturer.DoCapture(); }, capturer.GetOutputSize());
+        }
+
+        // The largest difference between the timestamps of one set, 10 ms by default
+        void SetSkewTolerance(int64_t nTolerance);
+        int64_t GetSkewTolerance() const;
+
+        void Start();
+        void Stop();
+
+        uint32_t GetStreamCount() const;
+
+        // Frames that were captured but didn't get into any set
+        uint64_t GetDiscardedCount(uint32_t nStream) const;
+
+        // Waits up to nTimeout nanoseconds for the next set, frames of the previous set
+        // are given back to the streams. Must be called from one thread only
+        bool NextFrameSet(FrameSet& set, int64_t nTimeout);
+
+    private:
+        // Frames the consumer can choose from, older ones are discarded
+        static constexpr uint32_t c_nHistory = 3;
+
+        // History, the frame being captured and the frame of the current set
+        static constexpr uint32_t c_nSlots = c_nHistory + 2;
+
+        struct Slot
+        {
+            FrameBuffer data;
+            FrameInfo info;
+        };
+
+        struct Stream
+        {
+            CaptureFn fnCapture;
+            std::thread thread;
+
+            std::mutex mutex;
+            Slot slots[c_nSlots];
+
+            std::vector<uint32_t> vecFree;
+
+            // Ready frames from the oldest to the newest
+            std::vector<uint32_t> vecReady;
+            uint32_t nHeld = -1;
+
+            std::atomic<uint64_t> nDiscarded{0};
+        };
+
+        void CaptureMain(Stream& stream);
+
+        // Needs the locks of all streams
+        bool TryMatch(FrameSet& set);
+
+    private:
+        std::vector<std::unique_ptr<Stream>> m_vecStreams;
+
+        std::atomic<bool> m_bRunning{false};
+        int64_t m_nTolerance = 10000000;
+
+        // Capture threads take m_WaitMutex only to wake up a waiting consumer
+        std::atomic<uint64_t> m_nVersion{0};
+        std::atomic<bool> m_bWaiting{false};
+        std::mutex m_WaitMutex;
+        std::condition_variable m_cvWait;
+
+    };
+
+    // Converts frames to RGBA and scales them to the output size in one pass.
+    // Only the source rows (and for large downscales only the source pixels)
+    // that end up in the output are converted, there is no full size RGBA frame
+    class FrameProcessor
+    {
+    public:
+        FrameProcessor() = default;
+
+        bool Configure(VideoFormat nFormat, uint32_t nSrcWidth, uint32_t nSrcHeight, uint32_t nDstWidth, uint32_t nDstHeight);
+
+        // pDst must be at least GetOutputSize() bytes in size (sizeof(uint32_t) * nDstWidth * nDstHeight for RGBA).
+        // The processor is reconfigured if the format or the size of src has changed
+        void Process(const FrameView& src, void* pDst);
+
+        // RGBA by default, reconfigures the processor if the format has changed
+        void SetOutputFormat(OutputFormat nFormat);
+        OutputFormat GetOutputFormat() const;
+
+        // Used by OutputFormat::Tensor, the normalization is folded into a table of 256 values per channel
+        void SetTensorFormat(const TensorDesc& desc);
+        const TensorDesc& GetTensorFormat() const;
+
+        // The matrix and range of YUV sources, Auto fields are BT.601 and limited range.
+        // Reconfigures the processor if it has changed
+        void SetColorSpace(const ColorSpace& colorSpace);
+        const ColorSpace& GetColorSpace() const;
+
+        // The format of the output buffer: Rgb32, Gray8 or the source format for OutputFormat::Native.
+        // None for OutputFormat::Tensor
+        VideoFormat GetOutputVideoFormat() const;
+
+        // Size of the output in bytes and the stride of its first plane
+        size_t GetOutputSize() const;
+        uint32_t GetOutputStride() const;
+
+        // Rebuilds the scaler tables if the mode has changed
+        void SetScaleMode(ScaleMode nMode);
+        ScaleMode GetScaleMode() const;
+
+        // Only this part of the source frame (in its pixels) is converted and scaled to the output size,
+        // OutputFormat::Native copies just the region so the output size changes with it.
+        // An empty region is the whole frame, the default. See AlignRegion
+        void SetRegion(const Rect& region);
+
+        // The region as it's used, after clamping and alignment
+        Rect GetRegion() const;
+
+        // Splits frames into row bands processed in parallel, 0 means one thread per CPU core.
+        // Small frames are still processed on the calling thread
+        void SetThreadCount(uint32_t nThreads);
+        uint32_t GetThreadCount() const;
+
+        uint32_t GetDstWidth() const;
+        uint32_t GetDstHeight() const;
+
+        // Decode, Convert, Scale and Copy are recorded by the processor, the capturer records the rest
+        PipelineStats& GetStats();
+        const PipelineStats& GetStats() const;
+
+    private:
+        void ConvertRow(const FrameView& src, uint32_t sy, uint8_t* pDst) const;
+
+        // Converts nRows source rows from sy into rows nStride bytes apart.
+        // Two NV12 rows that share a chroma row are converted by one call
+        void ConvertRows(const FrameView& src, uint32_t sy, uint32_t nRows, uint8_t* pDst, size_t nStride) const;
+
+        // Per band buffers
+        struct Scratch
+        {
+            // Converted source rows (a pair, or several for the integer factor path)
+            std::vector<uint8_t> vecRows;
+
+            // Horizontally scaled rows, the source row y is kept in the slot y % GetMaxRowCount()
+            std::vector<uint8_t> vecSlots;
+            std::vector<uint32_t> vecSlotRows;
+
+            std::vector<const uint8_t*> vecRowPtrs;
+
+            // The RGBA output rows (a pair at most) that are written into the tensor
+            std::vector<uint8_t> vecTensorRow;
+
+        #ifdef WCCAPI_ENABLE_STATS
+            // Time spent on the band in the last frame
+            int64_t nConvertTime = 0;
+            int64_t nScaleTime = 0;
+        #endif
+        };
+
+        struct BandJob
+        {
+            FrameProcessor* pProcessor;
+            const FrameView* pSrc;
+            uint8_t* pDst;
+            uint32_t nBandRows;
+        };
+
+        static void ProcessBand(void* pContext, uint32_t nBand);
+
+        uint32_t GetBandCount() const;
+        void ResizeScratch(Scratch& scratch) const;
+
+        void ProcessRows(const FrameView& src, uint8_t* pDst, uint32_t y0, uint32_t y1, Scratch& scratch) const;
+
+    #ifdef WCCAPI_ENABLE_STATS
+        // Records the times collected by the first nBands scratches
+        void AddBandTimes(uint32_t nBands);
+    #endif
+        void ProcessNearest(const FrameView& src, uint8_t* pDst, uint32_t y0, uint32_t y1, Scratch& scratch) const;
+        void ProcessFiltered(const FrameView& src, uint8_t* pDst, uint32_t y0, uint32_t y1, Scratch& scratch) const;
+
+        // Copies the rows of all planes without padding
+        void ProcessNative(const FrameView& src, uint8_t* pDst) const;
+
+        // Normalizes the RGBA output row y into m_pTensor
+        void WriteTensorRow(const uint8_t* pRgba, uint32_t y) const;
+
+    private:
+        VideoFormat m_nFormat = VideoFormat::None;
+
+        uint32_t m_nSrcWidth = 0, m_nSrcHeight = 0;
+        uint32_t m_nDstWidth = 0, m_nDstHeight = 0;
+
+        OutputFormat m_nOutputFormat = OutputFormat::Rgba;
+
+        // The region asked for and the one used (in the decoded frame for compressed sources)
+        Rect m_Region;
+        Rect m_Crop;
+
+        // The frame that goes through conversion and scaling, it's the region of the source frame
+        // unless the source is compressed, then it's the region of the decoded (and maybe downscaled) frame
+        VideoFormat m_nWorkFormat = VideoFormat::None;
+        uint32_t m_nWorkWidth = 0, m_nWorkHeight = 0;
+        uint32_t m_nJpegDenominator = 1;
+
+        // JpegDecoder::GetChromaDivisor of the last frame, 4:2:2 frames can't be scaled down as much
+        uint32_t m_nJpegChromaDivisor = 1;
+
+    #ifdef WCCAPI_USE_LIBJPEG
+        internal::JpegDecoder m_Decoder;
+    #endif
+
+        // Bytes per output pixel and per output row (RGBA rows for tensors)
+        uint32_t m_nChannels = 4;
+        size_t m_nDstRowSize = 0;
+
+        TensorDesc m_Tensor;
+
+        // 256 values per output channel of the type of m_Tensor
+        std::vector<float> m_vecTensorLut;
+        std::vector<uint16_t> m_vecTensorLut16;
+
+        // The frame being processed, set by Process
+        uint8_t* m_pTensor = nullptr;
+
+        ColorSpace m_ColorSpace;
+
+        // Used by GatherRow, the row converters have the color space built in
+        const internal::YuvTable* m_pYuvTable = nullptr;
+
+        bool m_bReady = false;
+
+        // Picking single pixels is slower per pixel than converting
+        // a whole row with SIMD so it's used only for large downscales
+        bool m_bGather = false;
+
+        RowConverter m_fnConvert = nullptr;
+        Nv12Converter m_fnConvertNv12 = nullptr;
+
+        ScaleMode m_nScaleMode = ScaleMode::Nearest;
+        Scaler m_Scaler;
+
+        WorkerPool m_Pool;
+        std::vector<Scratch> m_vecScratch;
+
+        PipelineStats m_Stats;
+
+    };
+}
+
+#endif
+
+#if defined(WCCAPI_IMPL) && !defined(WCCAPI_IMPL_INCLUDED)
+#define WCCAPI_IMPL_INCLUDED
+#undef WCCAPI_IMPL
+
+namespace wcc
+{
+    uint8_t internal::ClampInt32ToUint8(int nValue)
+    {
+        if (nValue < 0) return 0;
+        if (nValue > 255) return 255;
+        return nValue;
+    }
+
+    uint16_t internal::FloatToHalf(float fValue)
+    {
+        uint32_t nBits;
+        memcpy(&nBits, &fValue, sizeof(nBits));
+
+        uint32_t nSign = (nBits >> 16) & 0x8000;
+        uint32_t nAbs = nBits & 0x7fffffff;
+
+        // Infinity and NaN, then values that round to infinity
+        if (nAbs >= 0x7f800000)
+            return (uint16_t)(nSign | 0x7c00 | (nAbs > 0x7f800000 ? 0x200 : 0));
+
+        if (nAbs >= 0x47800000)
+            return (uint16_t)(nSign | 0x7c00);
+
+        // Subnormal halves, the implicit bit becomes part of the mantissa
+        if (nAbs < 0x38800000)
+        {
+            uint32_t nShift = 126 - (nAbs >> 23);
+
+            if (nShift > 24)
+                return (uint16_t)nSign;
+
+            uint32_t nMantissa = (nAbs & 0x7fffff) | 0x800000;
+            uint32_t nHalf = nMantissa >> nShift;
+            uint32_t nRest = nMantissa & ((1u << nShift) - 1);
+            uint32_t nMiddle = 1u << (nShift - 1);
+
+            if (nRest > nMiddle || (nRest == nMiddle && (nHalf & 1)))
+                nHalf++;
+
+            return (uint16_t)(nSign | nHalf);
+        }
+
+        // Rebiases the exponent from 127 to 15, a carry out of the mantissa gives the next exponent
+        uint32_t nHalf = nAbs - 0x38000000;
+        nHalf = (nHalf + 0xfff + ((nHalf >> 13) & 1)) >> 13;
+
+        return (uint16_t)(nSign | nHalf);
+    }
+
+    void internal::ConvertFromRGB32(const uint8_t* pSrc, uint8_t* pDst)
+    {
+        pDst[0] = pSrc[0];
+        pDst[1] = pSrc[1];
+        pDst[2] = pSrc[2];
+        pDst[3] = pSrc[3];
+    }
+
+    void internal::ConvertFromRGB24(const uint8_t* pSrc, uint8_t* pDst)
+    {
+        pDst[0] = pSrc[0];
+        pDst[1] = pSrc[1];
+        pDst[2] = pSrc[2];
+        pDst[3] = 255;
+    }
+
+    namespace internal
+    {
+        constexpr int32_t RoundToInt32(double fValue)
+        {
+            return (int32_t)(fValue < 0.0 ? fValue - 0.5 : fValue + 0.5);
+        }
+
+        // Kr and Kb are the weights of red and blue in Y. Limited range stretches Y by 255 / 219
+        // and chroma by 255 / 224, BT.601 limited gives the usual 298, 409, -100, -208, 516
+        constexpr YuvCoefficients MakeYuvCoefficients(double fKr, double fKb, bool bFull)
+        {
+            const double fKg = 1.0 - fKr - fKb;
+            const double fY = bFull ? 256.0 : 256.0 * 255.0 / 219.0;
+            const double fC = bFull ? 256.0 : 256.0 * 255.0 / 224.0;
+
+            return {
+                RoundToInt32(fY), bFull ? 0 : 16,
+                RoundToInt32(fC * 2.0 * (1.0 - fKr)),
+                RoundToInt32(-fC * 2.0 * (1.0 - fKb) * fKb / fKg),
+                RoundToInt32(-fC * 2.0 * (1.0 - fKr) * fKr / fKg),
+                RoundToInt32(fC * 2.0 * (1.0 - fKb)) };
+        }
+
+        constexpr YuvTable MakeYuvTable(const YuvCoefficients& k)
+        {
+            YuvTable table = {};
+
+            for (int v = 0; v < 256; v++)
+            {
+                table.nY[v] = k.nY * (v - k.nYOffset) + 128;
+                table.nRV[v] = k.nRV * (v - 128);
+                table.nGU[v] = k.nGU * (v - 128);
+                table.nGV[v] = k.nGV * (v - 128);
+                table.nBU[v] = k.nBU * (v - 128);
+            }
+
+            return table;
+        }
+
+        // In the order of GetYuvSpace: (matrix - 1) * 2 + full
+        constexpr YuvCoefficients c_YuvCoefficients[c_nYuvSpaces] =
+        {
+            MakeYuvCoefficients(0.299, 0.114, false),
+            MakeYuvCoefficients(0.299, 0.114, true),
+            MakeYuvCoefficients(0.2126, 0.0722, false),
+            MakeYuvCoefficients(0.2126, 0.0722, true),
+            MakeYuvCoefficients(0.2627, 0.0593, false),
+            MakeYuvCoefficients(0.2627, 0.0593, true)
+        };
+
+        constexpr YuvTable c_YuvTables[c_nYuvSpaces] =
+        {
+            MakeYuvTable(c_YuvCoefficients[0]),
+            MakeYuvTable(c_YuvCoefficients[1]),
+            MakeYuvTable(c_YuvCoefficients[2]),
+            MakeYuvTable(c_YuvCoefficients[3]),
+            MakeYuvTable(c_YuvCoefficients[4]),
+            MakeYuvTable(c_YuvCoefficients[5])
+        };
+
+        static_assert(c_YuvCoefficients[0].nY == 298 && c_YuvCoefficients[0].nRV == 409 && c_YuvCoefficients[0].nGU == -100 &&
+            c_YuvCoefficients[0].nGV == -208 && c_YuvCoefficients[0].nBU == 516, "BT.601 limited range must not change");
+    }
+
+    ColorSpace ResolveColorSpace(const ColorSpace& requested, const ColorSpace& reported)
+    {
+        ColorSpace colorSpace = requested;
+
+        if (colorSpace.nMatrix == ColorMatrix::Auto)
+            colorSpace.nMatrix = reported.nMatrix;
+
+        if (colorSpace.nRange == ColorRange::Auto)
+            colorSpace.nRange = reported.nRange;
+
+        return colorSpace;
+    }
+
+    uint32_t internal::GetYuvSpace(const ColorSpace& colorSpace)
+    {
+        uint32_t nMatrix = 0;
+
+        switch (colorSpace.nMatrix)
+        {
+        case ColorMatrix::Bt709: nMatrix = 1; break;
+        case ColorMatrix::Bt2020: nMatrix = 2; break;
+        default: break;
+        }
+
+        return nMatrix * 2 + (colorSpace.nRange == ColorRange::Full ? 1 : 0);
+    }
+
+    const internal::YuvCoefficients& internal::GetYuvCoefficients(uint32_t nSpace)
+    {
+        return c_YuvCoefficients[nSpace < c_nYuvSpaces ? nSpace : 0];
+    }
+
+    const internal::YuvTable& internal::GetYuvTable(uint32_t nSpace)
+    {
+        return c_YuvTables[nSpace < c_nYuvSpaces ? nSpace : 0];
+    }
+
+    void internal::ConvertFromYUV(int y, int cb, int cr, uint8_t* pDst, const YuvTable& table)
+    {
+        // BT.601 limited range, the table has all products of the matrix:
+        // |R|   |1.164 0.000  1.596  |   |y-16 |
+        // |G| = |1.164 -0.391 -0.813 | * |u-128|
+        // |B|   |1.164 2.018  0.000  |   |v-128|
+
+        int32_t nY = table.nY[y];
+
+        pDst[0] = ClampInt32ToUint8((nY + table.nRV[cr]) >> 8);
+        pDst[1] = ClampInt32ToUint8((nY + table.nGU[cb] + table.nGV[cr]) >> 8);
+        pDst[2] = ClampInt32ToUint8((nY + table.nBU[cb]) >> 8);
+        pDst[3] = 255;
+    }
+
+    void internal::ConvertFromYUY2(const uint8_t* pSrc, uint8_t* pDst, const YuvTable& table)
+    {
+        uint8_t y0 = pSrc[0];
+        uint8_t cb = pSrc[1];
+        uint8_t y1 = pSrc[2];
+        uint8_t cr = pSrc[3];
+
+        ConvertFromYUV(y0, cb, cr, pDst, table);
+        ConvertFromYUV(y1, cb, cr, pDst + 4, table);
+    }
+
+    void internal::ConvertFromBGRA(const uint8_t* pSrc, uint8_t* pDst)
+    {
+        pDst[0] = pSrc[2];
+        pDst[1] = pSrc[1];
+        pDst[2] = pSrc[0];
+        pDst[3] = pSrc[3];
+    }
+
+    void internal::ConvertRowRGB32_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        memcpy(pDst, pSrc, (size_t)nWidth * 4);
+    }
+
+    void internal::ConvertRowRGB24_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++, pSrc += 3, pDst += 4)
+            ConvertFromRGB24(pSrc, pDst);
+    }
+
+    template <uint32_t N>
+    void internal::ConvertRowYUY2_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const YuvTable& table = c_YuvTables[N];
+
+        for (uint32_t x = 0; x + 1 < nWidth; x += 2, pSrc += 4, pDst += 8)
+            ConvertFromYUY2(pSrc, pDst, table);
+
+        // An odd width is not allowed by YUY2 but let's not write past the row
+        if (nWidth & 1)
+        {
+            uint8_t pPair[8];
+            ConvertFromYUY2(pSrc, pPair, table);
+            memcpy(pDst, pPair, 4);
+        }
+    }
+
+    void internal::ConvertRowBGRA_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++, pSrc += 4, pDst += 4)
+            ConvertFromBGRA(pSrc, pDst);
+    }
+
+    template <uint32_t N>
+    void internal::ConvertRowsNV12_Scalar(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth)
+    {
+        const YuvTable& table = c_YuvTables[N];
+
+        for (uint32_t x = 0; x < nWidth; x++)
+        {
+            // Each UV pair covers two pixels
+            uint8_t cb = pUV[x & ~1u];
+            uint8_t cr = pUV[x | 1u];
+
+            ConvertFromYUV(pY0[x], cb, cr, pDst0 + x * 4, table);
+
+            if (pDst1 != pDst0)
+                ConvertFromYUV(pY1[x], cb, cr, pDst1 + x * 4, table);
+        }
+    }
+
+    void internal::ConvertRowGray8_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++, pDst += 4)
+        {
+            pDst[0] = pDst[1] = pDst[2] = pSrc[x];
+            pDst[3] = 255;
+        }
+    }
+
+    uint8_t internal::ComputeLuma(int r, int g, int b)
+    {
+        // Y = 0.257R + 0.504G + 0.098B + 16, the inverse of ConvertFromYUV
+        return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    }
+
+    void internal::LumaRowCopy(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        memcpy(pDst, pSrc, nWidth);
+    }
+
+    void internal::LumaRowRGB32_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++, pSrc += 4)
+            pDst[x] = ComputeLuma(pSrc[0], pSrc[1], pSrc[2]);
+    }
+
+    void internal::LumaRowRGB24_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++, pSrc += 3)
+            pDst[x] = ComputeLuma(pSrc[0], pSrc[1], pSrc[2]);
+    }
+
+    void internal::LumaRowYUY2_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++)
+            pDst[x] = pSrc[x * 2];
+    }
+
+    void internal::LumaRowBGRA_Scalar(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        for (uint32_t x = 0; x < nWidth; x++, pSrc += 4)
+            pDst[x] = ComputeLuma(pSrc[2], pSrc[1], pSrc[0]);
+    }
+
+#ifdef WCC_X86
+
+    namespace internal
+    {
+        // Packs two 16-bit coefficients into one 32-bit lane for _mm_madd_epi16
+        inline int Pair16(int nLow, int nHigh)
+        {
+            return (int)(((uint32_t)(uint16_t)nHigh << 16) | (uint16_t)nLow);
+        }
+
+        struct ChromaTerms_Sse2
+        {
+            __m128i r, g, b;
+        };
+
+        // uv holds U0 V0 U1 V1 U2 V2 U3 V3 as 16-bit values.
+        // All math is done in 32-bit lanes so it's exactly the same as in ConvertFromYUV.
+        // k is a constant of the instance, so the coefficients are immediates like before
+        inline void GetChromaTerms_Sse2(__m128i uv, ChromaTerms_Sse2& chroma, const YuvCoefficients& k)
+        {
+            uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+
+            chroma.r = _mm_madd_epi16(uv, _mm_set1_epi32(Pair16(0, k.nRV)));
+            chroma.g = _mm_madd_epi16(uv, _mm_set1_epi32(Pair16(k.nGU, k.nGV)));
+            chroma.b = _mm_madd_epi16(uv, _mm_set1_epi32(Pair16(k.nBU, 0)));
+        }
+
+        // y holds 8 luma samples as 16-bit values, the pixels 2i and 2i + 1 share the chroma pair i.
+        // Writes 8 RGBA pixels (32 bytes)
+        inline void StoreYUVx8_Sse2(__m128i y, const ChromaTerms_Sse2& chroma, uint8_t* pDst, const YuvCoefficients& k)
+        {
+            y = _mm_sub_epi16(y, _mm_set1_epi16((short)k.nYOffset));
+
+            // nY * c + 128 for each pixel
+            const __m128i coefY = _mm_set1_epi32(Pair16(k.nY, 128));
+            const __m128i one = _mm_set1_epi16(1);
+
+            const __m128i yLo = _mm_madd_epi16(_mm_unpacklo_epi16(y, one), coefY);
+            const __m128i yHi = _mm_madd_epi16(_mm_unpackhi_epi16(y, one), coefY);
+
+            auto channel = [&](__m128i c)
+                {
+                    __m128i lo = _mm_srai_epi32(_mm_add_epi32(yLo, _mm_unpacklo_epi32(c, c)), 8);
+                    __m128i hi = _mm_srai_epi32(_mm_add_epi32(yHi, _mm_unpackhi_epi32(c, c)), 8);
+                    return _mm_packs_epi32(lo, hi);
+                };
+
+            // Saturating packs do the same thing as ClampInt32ToUint8
+            const __m128i rb = _mm_packus_epi16(channel(chroma.r), channel(chroma.b));
+            const __m128i ga = _mm_packus_epi16(channel(chroma.g), _mm_set1_epi16(255));
+
+            const __m128i rg = _mm_unpacklo_epi8(rb, ga);
+            const __m128i ba = _mm_unpackhi_epi8(rb, ga);
+
+            _mm_storeu_si128((__m128i*)pDst, _mm_unpacklo_epi16(rg, ba));
+            _mm_storeu_si128((__m128i*)(pDst + 16), _mm_unpackhi_epi16(rg, ba));
+        }
+
+        // Converts 8 YUY2 pixels (16 bytes) into 8 RGBA pixels (32 bytes)
+        inline void ConvertYUY2x8_Sse2(const uint8_t* pSrc, uint8_t* pDst, const YuvCoefficients& k)
+        {
+            const __m128i raw = _mm_loadu_si128((const __m128i*)pSrc);
+
+            ChromaTerms_Sse2 chroma;
+            GetChromaTerms_Sse2(_mm_srli_epi16(raw, 8), chroma, k);
+
+            StoreYUVx8_Sse2(_mm_and_si128(raw, _mm_set1_epi16(0x00FF)), chroma, pDst, k);
+        }
+
+        // Converts 16 pixels of two NV12 rows
+        inline void ConvertNV12x16_Sse2(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, const YuvCoefficients& k)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i uv = _mm_loadu_si128((const __m128i*)pUV);
+
+            ChromaTerms_Sse2 lo, hi;
+            GetChromaTerms_Sse2(_mm_unpacklo_epi8(uv, zero), lo, k);
+            GetChromaTerms_Sse2(_mm_unpackhi_epi8(uv, zero), hi, k);
+
+            const __m128i y0 = _mm_loadu_si128((const __m128i*)pY0);
+
+            StoreYUVx8_Sse2(_mm_unpacklo_epi8(y0, zero), lo, pDst0, k);
+            StoreYUVx8_Sse2(_mm_unpackhi_epi8(y0, zero), hi, pDst0 + 32, k);
+
+            if (pDst1 != pDst0)
+            {
+                const __m128i y1 = _mm_loadu_si128((const __m128i*)pY1);
+
+                StoreYUVx8_Sse2(_mm_unpacklo_epi8(y1, zero), lo, pDst1, k);
+                StoreYUVx8_Sse2(_mm_unpackhi_epi8(y1, zero), hi, pDst1 + 32, k);
+            }
+        }
+
+        struct ChromaTerms_Avx2
+        {
+            __m256i r, g, b;
+        };
+
+        WCC_TARGET_AVX2 inline void GetChromaTerms_Avx2(__m256i uv, ChromaTerms_Avx2& chroma, const YuvCoefficients& k)
+        {
+            uv = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+
+            chroma.r = _mm256_madd_epi16(uv, _mm256_set1_epi32(Pair16(0, k.nRV)));
+            chroma.g = _mm256_madd_epi16(uv, _mm256_set1_epi32(Pair16(k.nGU, k.nGV)));
+            chroma.b = _mm256_madd_epi16(uv, _mm256_set1_epi32(Pair16(k.nBU, 0)));
+        }
+
+        WCC_TARGET_AVX2 inline __m256i AddChroma_Avx2(__m256i yLo, __m256i yHi, __m256i c)
+        {
+            __m256i lo = _mm256_srai_epi32(_mm256_add_epi32(yLo, _mm256_unpacklo_epi32(c, c)), 8);
+            __m256i hi = _mm256_srai_epi32(_mm256_add_epi32(yHi, _mm256_unpackhi_epi32(c, c)), 8);
+            return _mm256_packs_epi32(lo, hi);
+        }
+
+        // Same as StoreYUVx8_Sse2 but each 128-bit lane holds 8 pixels and their 4 chroma pairs
+        WCC_TARGET_AVX2 inline void StoreYUVx16_Avx2(__m256i y, const ChromaTerms_Avx2& chroma, uint8_t* pDst, const YuvCoefficients& k)
+        {
+            y = _mm256_sub_epi16(y, _mm256_set1_epi16((short)k.nYOffset));
+
+            const __m256i coefY = _mm256_set1_epi32(Pair16(k.nY, 128));
+            const __m256i one = _mm256_set1_epi16(1);
+
+            const __m256i yLo = _mm256_madd_epi16(_mm256_unpacklo_epi16(y, one), coefY);
+            const __m256i yHi = _mm256_madd_epi16(_mm256_unpackhi_epi16(y, one), coefY);
+
+            // Lambdas don't inherit the target attribute so there's a separate function for that
+            const __m256i rb = _mm256_packus_epi16(AddChroma_Avx2(yLo, yHi, chroma.r), AddChroma_Avx2(yLo, yHi, chroma.b));
+            const __m256i ga = _mm256_packus_epi16(AddChroma_Avx2(yLo, yHi, chroma.g), _mm256_set1_epi16(255));
+
+            const __m256i rg = _mm256_unpacklo_epi8(rb, ga);
+            const __m256i ba = _mm256_unpackhi_epi8(rb, ga);
+
+            // Unpacking works within 128-bit lanes, so the pixels are [0..3 8..11] [4..7 12..15]
+            const __m256i lo = _mm256_unpacklo_epi16(rg, ba);
+            const __m256i hi = _mm256_unpackhi_epi16(rg, ba);
+
+            _mm256_storeu_si256((__m256i*)pDst, _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(pDst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+
+        WCC_TARGET_AVX2 inline void ConvertYUY2x16_Avx2(const uint8_t* pSrc, uint8_t* pDst, const YuvCoefficients& k)
+        {
+            const __m256i raw = _mm256_loadu_si256((const __m256i*)pSrc);
+
+            ChromaTerms_Avx2 chroma;
+            GetChromaTerms_Avx2(_mm256_srli_epi16(raw, 8), chroma, k);
+
+            StoreYUVx16_Avx2(_mm256_and_si256(raw, _mm256_set1_epi16(0x00FF)), chroma, pDst, k);
+        }
+
+        // Converts 32 pixels of two NV12 rows
+        WCC_TARGET_AVX2 inline void ConvertNV12x32_Avx2(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, const YuvCoefficients& k)
+        {
+            ChromaTerms_Avx2 lo, hi;
+            GetChromaTerms_Avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)pUV)), lo, k);
+            GetChromaTerms_Avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pUV + 16))), hi, k);
+
+            auto load = [](const uint8_t* p) { return _mm_loadu_si128((const __m128i*)p); };
+
+            StoreYUVx16_Avx2(_mm256_cvtepu8_epi16(load(pY0)), lo, pDst0, k);
+            StoreYUVx16_Avx2(_mm256_cvtepu8_epi16(load(pY0 + 16)), hi, pDst0 + 64, k);
+
+            if (pDst1 != pDst0)
+            {
+                StoreYUVx16_Avx2(_mm256_cvtepu8_epi16(load(pY1)), lo, pDst1, k);
+                StoreYUVx16_Avx2(_mm256_cvtepu8_epi16(load(pY1 + 16)), hi, pDst1 + 64, k);
+            }
+        }
+    }
+
+    template <uint32_t N>
+    void internal::ConvertRowYUY2_Sse2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const YuvCoefficients& k = c_YuvCoefficients[N];
+        uint32_t x = 0;
+
+        for (; x + 16 <= nWidth; x += 16, pSrc += 32, pDst += 64)
+        {
+            ConvertYUY2x8_Sse2(pSrc, pDst, k);
+            ConvertYUY2x8_Sse2(pSrc + 16, pDst + 32, k);
+        }
+
+        for (; x + 8 <= nWidth; x += 8, pSrc += 16, pDst += 32)
+            ConvertYUY2x8_Sse2(pSrc, pDst, k);
+
+        ConvertRowYUY2_Scalar<N>(pSrc, pDst, nWidth - x);
+    }
+
+    template <uint32_t N>
+    void internal::ConvertRowsNV12_Sse2(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth)
+    {
+        const YuvCoefficients& k = c_YuvCoefficients[N];
+        uint32_t x = 0;
+
+        for (; x + 16 <= nWidth; x += 16)
+            ConvertNV12x16_Sse2(pY0 + x, pY1 + x, pUV + x, pDst0 + x * 4, pDst1 + x * 4, k);
+
+        ConvertRowsNV12_Scalar<N>(pY0 + x, pY1 + x, pUV + x, pDst0 + x * 4, pDst1 + x * 4, nWidth - x);
+    }
+
+    void internal::ConvertRowBGRA_Sse2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const __m128i maskGA = _mm_set1_epi32((int)0xFF00FF00);
+        const __m128i maskB = _mm_set1_epi32(0x000000FF);
+
+        uint32_t x = 0;
+
+        for (; x + 4 <= nWidth; x += 4, pSrc += 16, pDst += 16)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i*)pSrc);
+
+            // Swap the bytes 0 and 2 of each pixel
+            __m128i ga = _mm_and_si128(p, maskGA);
+            __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), maskB);
+            __m128i b = _mm_slli_epi32(_mm_and_si128(p, maskB), 16);
+
+            _mm_storeu_si128((__m128i*)pDst, _mm_or_si128(ga, _mm_or_si128(r, b)));
+        }
+
+        ConvertRowBGRA_Scalar(pSrc, pDst, nWidth - x);
+    }
+
+    WCC_TARGET_AVX2 void internal::ConvertRowRGB24_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+
+        uint32_t x = 0;
+
+        // Every load takes 16 bytes but uses only 12 of them,
+        // so the last load must not cross the end of the row
+        for (; x + 18 <= nWidth; x += 16, pSrc += 48, pDst += 64)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                __m128i p = _mm_loadu_si128((const __m128i*)(pSrc + i * 12));
+                _mm_storeu_si128((__m128i*)(pDst + i * 16), _mm_or_si128(_mm_shuffle_epi8(p, shuffle), alpha));
+            }
+        }
+
+        ConvertRowRGB24_Scalar(pSrc, pDst, nWidth - x);
+    }
+
+    template <uint32_t N>
+    WCC_TARGET_AVX2 void internal::ConvertRowYUY2_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const YuvCoefficients& k = c_YuvCoefficients[N];
+        uint32_t x = 0;
+
+        for (; x + 32 <= nWidth; x += 32, pSrc += 64, pDst += 128)
+        {
+            ConvertYUY2x16_Avx2(pSrc, pDst, k);
+            ConvertYUY2x16_Avx2(pSrc + 32, pDst + 64, k);
+        }
+
+        for (; x + 16 <= nWidth; x += 16, pSrc += 32, pDst += 64)
+            ConvertYUY2x16_Avx2(pSrc, pDst, k);
+
+        ConvertRowYUY2_Sse2<N>(pSrc, pDst, nWidth - x);
+    }
+
+    template <uint32_t N>
+    WCC_TARGET_AVX2 void internal::ConvertRowsNV12_Avx2(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth)
+    {
+        const YuvCoefficients& k = c_YuvCoefficients[N];
+        uint32_t x = 0;
+
+        for (; x + 32 <= nWidth; x += 32)
+            ConvertNV12x32_Avx2(pY0 + x, pY1 + x, pUV + x, pDst0 + x * 4, pDst1 + x * 4, k);
+
+        ConvertRowsNV12_Sse2<N>(pY0 + x, pY1 + x, pUV + x, pDst0 + x * 4, pDst1 + x * 4, nWidth - x);
+    }
+
+    WCC_TARGET_AVX2 void internal::ConvertRowBGRA_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const __m256i shuffle = _mm256_setr_epi8(
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+        uint32_t x = 0;
+
+        for (; x + 8 <= nWidth; x += 8, pSrc += 32, pDst += 32)
+        {
+            __m256i p = _mm256_loadu_si256((const __m256i*)pSrc);
+            _mm256_storeu_si256((__m256i*)pDst, _mm256_shuffle_epi8(p, shuffle));
+        }
+
+        ConvertRowBGRA_Sse2(pSrc, pDst, nWidth - x);
+    }
+
+    void internal::LumaRowYUY2_Sse2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const __m128i mask = _mm_set1_epi16(0x00FF);
+        uint32_t x = 0;
+
+        // Y bytes are the even ones
+        for (; x + 16 <= nWidth; x += 16, pSrc += 32, pDst += 16)
+        {
+            __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i*)pSrc), mask);
+            __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pSrc + 16)), mask);
+
+            _mm_storeu_si128((__m128i*)pDst, _mm_packus_epi16(lo, hi));
+        }
+
+        LumaRowYUY2_Scalar(pSrc, pDst, nWidth - x);
+    }
+
+    WCC_TARGET_AVX2 void internal::LumaRowYUY2_Avx2(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const __m256i mask = _mm256_set1_epi16(0x00FF);
+        uint32_t x = 0;
+
+        for (; x + 32 <= nWidth; x += 32, pSrc += 64, pDst += 32)
+        {
+            __m256i lo = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)pSrc), mask);
+            __m256i hi = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(pSrc + 32)), mask);
+
+            // packus works within 128-bit lanes
+            __m256i y = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i*)pDst, y);
+        }
+
+        LumaRowYUY2_Sse2(pSrc, pDst, nWidth - x);
+    }
+
+#endif
+
+#ifdef WCC_NEON
+
+    namespace internal
+    {
+        // Converts 8 pixels that share chroma samples with their neighbours:
+        // c = Y - k.nYOffset, d = U - 128, e = V - 128
+        inline void ConvertYUVx8_Neon(int16x8_t c, int16x8_t d, int16x8_t e, uint8x8_t& r, uint8x8_t& g, uint8x8_t& b, const YuvCoefficients& k)
+        {
+            int32x4_t yLo = vmull_n_s16(vget_low_s16(c), (int16_t)k.nY);
+            int32x4_t yHi = vmull_n_s16(vget_high_s16(c), (int16_t)k.nY);
+
+            int32x4_t rLo = vmlal_n_s16(yLo, vget_low_s16(e), (int16_t)k.nRV);
+            int32x4_t rHi = vmlal_n_s16(yHi, vget_high_s16(e), (int16_t)k.nRV);
+
+            int32x4_t gLo = vmlal_n_s16(vmlal_n_s16(yLo, vget_low_s16(d), (int16_t)k.nGU), vget_low_s16(e), (int16_t)k.nGV);
+            int32x4_t gHi = vmlal_n_s16(vmlal_n_s16(yHi, vget_high_s16(d), (int16_t)k.nGU), vget_high_s16(e), (int16_t)k.nGV);
+
+            int32x4_t bLo = vmlal_n_s16(yLo, vget_low_s16(d), (int16_t)k.nBU);
+            int32x4_t bHi = vmlal_n_s16(yHi, vget_high_s16(d), (int16_t)k.nBU);
+
+            // vqrshrn adds 128 before the shift, vqmovun clamps to [0, 255]
+            r = vqmovun_s16(vcombine_s16(vqrshrn_n_s32(rLo, 8), vqrshrn_n_s32(rHi, 8)));
+            g = vqmovun_s16(vcombine_s16(vqrshrn_n_s32(gLo, 8), vqrshrn_n_s32(gHi, 8)));
+            b = vqmovun_s16(vcombine_s16(vqrshrn_n_s32(bLo, 8), vqrshrn_n_s32(bHi, 8)));
+        }
+
+        inline int16x8_t WidenMinus_Neon(uint8x8_t v, uint8_t nOffset)
+        {
+            return vreinterpretq_s16_u16(vsubl_u8(v, vdup_n_u8(nOffset)));
+        }
+
+        // Converts 16 pixels: 8 even and 8 odd ones that share U and V samples
+        inline void StoreYUVx16_Neon(uint8x8_t yEven, uint8x8_t yOdd, int16x8_t d, int16x8_t e, uint8_t* pDst, const YuvCoefficients& k)
+        {
+            uint8x8_t r0, g0, b0, r1, g1, b1;
+            ConvertYUVx8_Neon(WidenMinus_Neon(yEven, (uint8_t)k.nYOffset), d, e, r0, g0, b0, k);
+            ConvertYUVx8_Neon(WidenMinus_Neon(yOdd, (uint8_t)k.nYOffset), d, e, r1, g1, b1, k);
+
+            // Put even and odd pixels back in order
+            uint8x8x2_t r = vzip_u8(r0, r1);
+            uint8x8x2_t g = vzip_u8(g0, g1);
+            uint8x8x2_t b = vzip_u8(b0, b1);
+
+            uint8x16x4_t out = { {
+                vcombine_u8(r.val[0], r.val[1]),
+                vcombine_u8(g.val[0], g.val[1]),
+                vcombine_u8(b.val[0], b.val[1]),
+                vdupq_n_u8(255) } };
+
+            vst4q_u8(pDst, out);
+        }
+    }
+
+    void internal::ConvertRowRGB24_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        uint32_t x = 0;
+
+        for (; x + 16 <= nWidth; x += 16, pSrc += 48, pDst += 64)
+        {
+            uint8x16x3_t in = vld3q_u8(pSrc);
+            uint8x16x4_t out = { { in.val[0], in.val[1], in.val[2], vdupq_n_u8(255) } };
+            vst4q_u8(pDst, out);
+        }
+
+        ConvertRowRGB24_Scalar(pSrc, pDst, nWidth - x);
+    }
+
+    template <uint32_t N>
+    void internal::ConvertRowYUY2_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        const YuvCoefficients& k = c_YuvCoefficients[N];
+        uint32_t x = 0;
+
+        for (; x + 32 <= nWidth; x += 32, pSrc += 64, pDst += 128)
+        {
+            // Even Y, U, odd Y, V
+            uint8x16x4_t in = vld4q_u8(pSrc);
+
+            for (int h = 0; h < 2; h++)
+            {
+                uint8x8_t y0 = h ? vget_high_u8(in.val[0]) : vget_low_u8(in.val[0]);
+                uint8x8_t u = h ? vget_high_u8(in.val[1]) : vget_low_u8(in.val[1]);
+                uint8x8_t y1 = h ? vget_high_u8(in.val[2]) : vget_low_u8(in.val[2]);
+                uint8x8_t v = h ? vget_high_u8(in.val[3]) : vget_low_u8(in.val[3]);
+
+                StoreYUVx16_Neon(y0, y1, WidenMinus_Neon(u, 128), WidenMinus_Neon(v, 128), pDst + h * 64, k);
+            }
+        }
+
+        ConvertRowYUY2_Scalar<N>(pSrc, pDst, nWidth - x);
+    }
+
+    template <uint32_t N>
+    void internal::ConvertRowsNV12_Neon(const uint8_t* pY0, const uint8_t* pY1, const uint8_t* pUV, uint8_t* pDst0, uint8_t* pDst1, uint32_t nWidth)
+    {
+        const YuvCoefficients& k = c_YuvCoefficients[N];
+        uint32_t x = 0;
+
+        for (; x + 16 <= nWidth; x += 16)
+        {
+            uint8x8x2_t uv = vld2_u8(pUV + x);
+
+            int16x8_t d = WidenMinus_Neon(uv.val[0], 128);
+            int16x8_t e = WidenMinus_Neon(uv.val[1], 128);
+
+            uint8x8x2_t y0 = vld2_u8(pY0 + x);
+            StoreYUVx16_Neon(y0.val[0], y0.val[1], d, e, pDst0 + x * 4, k);
+
+            if (pDst1 != pDst0)
+            {
+                uint8x8x2_t y1 = vld2_u8(pY1 + x);
+                StoreYUVx16_Neon(y1.val[0], y1.val[1], d, e, pDst1 + x * 4, k);
+            }
+        }
+
+        ConvertRowsNV12_Scalar<N>(pY0 + x, pY1 + x, pUV + x, pDst0 + x * 4, pDst1 + x * 4, nWidth - x);
+    }
+
+    void internal::ConvertRowBGRA_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        uint32_t x = 0;
+
+        for (; x + 16 <= nWidth; x += 16, pSrc += 64, pDst += 64)
+        {
+            uint8x16x4_t in = vld4q_u8(pSrc);
+            uint8x16x4_t out = { { in.val[2], in.val[1], in.val[0], in.val[3] } };
+            vst4q_u8(pDst, out);
+        }
+
+        ConvertRowBGRA_Scalar(pSrc, pDst, nWidth - x);
+    }
+
+    void internal::LumaRowYUY2_Neon(const uint8_t* pSrc, uint8_t* pDst, uint32_t nWidth)
+    {
+        uint32_t x = 0;
+
+        for (; x + 16 <= nWidth; x += 16, pSrc += 32, pDst += 16)
+            vst1q_u8(pDst, vld2q_u8(pSrc).val[0]);
+
+        LumaRowYUY2_Scalar(pSrc, pDst, nWidth - x);
+    }
+
+#endif
+
+    Isa internal::DetectIsa()
+    {
+    #if defined(WCC_X86)
+
+    #ifdef _MSC_VER
+        int nInfo[4];
+        __cpuid(nInfo, 0);
+
+        if (nInfo[0] >= 7)
+        {
+            __cpuid(nInfo, 1);
+
+            bool bOsxsave = (nInfo[2] & (1 << 27)) != 0;
+            bool bAvx = (nInfo[2] & (1 << 28)) != 0;
+
+            // The OS must save the YMM registers
+            if (bOsxsave && bAvx && (_xgetbv(0) & 6) == 6)
+            {
+                __cpuidex(nInfo, 7, 0);
+
+                if (nInfo[1] & (1 << 5))
+                    return Isa::Avx2;
+            }
+        }
+    #else
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+            return Isa::Avx2;
+    #endif
+
+        return Isa::Sse2;
+
+    #elif defined(WCC_NEON)
+        return Isa::Neon;
+    #else
+        return Isa::Scalar;
+    #endif
+    }
+
+    Isa GetBestIsa()
+    {
+        static const Isa s_nIsa = internal::DetectIsa();
+        return s_nIsa;
+    }
+
+    namespace internal
+    {
+        template <uint32_t N>
+        RowConverter SelectYuy2Converter(Isa nIsa)
+        {
+        #ifdef WCC_X86
+            if (nIsa == Isa::Avx2) return ConvertRowYUY2_Avx2<N>;
+            if (nIsa == Isa::Sse2) return ConvertRowYUY2_Sse2<N>;
+        #endif
+        #ifdef WCC_NEON
+            if (nIsa == Isa::Neon) return ConvertRowYUY2_Neon<N>;
+        #endif
+            return ConvertRowYUY2_Scalar<N>;
+        }
+
+        template <uint32_t N>
+        Nv12Converter SelectNv12Converter(Isa nIsa)
+        {
+        #ifdef WCC_X86
+            if (nIsa == Isa::Avx2) return ConvertRowsNV12_Avx2<N>;
+            if (nIsa == Isa::Sse2) return ConvertRowsNV12_Sse2<N>;
+        #endif
+        #ifdef WCC_NEON
+            if (nIsa == Isa::Neon) return ConvertRowsNV12_Neon<N>;
+        #endif
+            return ConvertRowsNV12_Scalar<N>;
+        }
+    }
+
+    RowConverter GetRowConverter(VideoFormat nFormat, Isa nIsa, const ColorSpace& colorSpace)
+    {
+        switch (nFormat)
+        {
+        case VideoFormat::Rgb32:
+            return internal::ConvertRowRGB32_Scalar;
+
+        case VideoFormat::Rgb24:
+        #ifdef WCC_X86
+            if (nIsa == Isa::Avx2) return internal::ConvertRowRGB24_Avx2;
+        #endif
+        #ifdef WCC_NEON
+            if (nIsa == Isa::Neon) return internal::ConvertRowRGB24_Neon;
+        #endif
+            return internal::ConvertRowRGB24_Scalar;
+
+        case VideoFormat::Yuy2:
+        {
+            // One instance of the kernels per color space, in the order of GetYuvSpace
+            static RowConverter (*const s_fnGetters[internal::c_nYuvSpaces])(Isa) =
+            {
+                internal::SelectYuy2Converter<0>, internal::SelectYuy2Converter<1>, internal::SelectYuy2Converter<2>,
+                internal::SelectYuy2Converter<3>, internal::SelectYuy2Converter<4>, internal::SelectYuy2Converter<5>
+            };
+
+            return s_fnGetters[internal::GetYuvSpace(colorSpace)](nIsa);
+        }
+
+        case VideoFormat::Bgra32:
+        #ifdef WCC_X86
+            if (nIsa == Isa::Avx2) return internal::ConvertRowBGRA_Avx2;
+            if (nIsa == Isa::Sse2) return internal::ConvertRowBGRA_Sse2;
+        #endif
+        #ifdef WCC_NEON
+            if (nIsa == Isa::Neon) return internal::ConvertRowBGRA_Neon;
+        #endif
+            return internal::ConvertRowBGRA_Scalar;
+
+        case VideoFormat::Gray8:
+            return internal::ConvertRowGray8_Scalar;
+
+        default:
+            return nullptr;
+        }
+    }
+
+    RowConverter GetLumaConverter(VideoFormat nFormat, Isa nIsa)
+    {
+        switch (nFormat)
+        {
+        case VideoFormat::Rgb32:
+            return internal::LumaRowRGB32_Scalar;
+
+        case VideoFormat::Rgb24:
+            return internal::LumaRowRGB24_Scalar;
+
+        case VideoFormat::Yuy2:
+        #ifdef WCC_X86
+            if (nIsa == Isa::Avx2) return internal::LumaRowYUY2_Avx2;
+            if (nIsa == Isa::Sse2) return internal::LumaRowYUY2_Sse2;
+        #endif
+        #ifdef WCC_NEON
+            if (nIsa == Isa::Neon) return internal::LumaRowYUY2_Neon;
+        #endif
+            return internal::LumaRowYUY2_Scalar;
+
+        case VideoFormat::Bgra32:
+            return internal::LumaRowBGRA_Scalar;
+
+        case VideoFormat::Nv12:
+        case VideoFormat::Gray8:
+            return internal::LumaRowCopy;
+
+        default:
+            return nullptr;
+        }
+    }
+
+    Nv12Converter GetNv12Converter(Isa nIsa, const ColorSpace& colorSpace)
+    {
+        static Nv12Converter (*const s_fnGetters[internal::c_nYuvSpaces])(Isa) =
+        {
+            internal::SelectNv12Converter<0>, internal::SelectNv12Converter<1>, internal::SelectNv12Converter<2>,
+            internal::SelectNv12Converter<3>, internal::SelectNv12Converter<4>, internal::SelectNv12Converter<5>
+        };
+
+        return s_fnGetters[internal::GetYuvSpace(colorSpace)](nIsa);
+    }
+
+    uint32_t GetBytesPerPixel(VideoFormat nFormat)
+    {
+        switch (nFormat)
+        {
+        case VideoFormat::Rgb32: return 4;
+        case VideoFormat::Rgb24: return 3;
+        case VideoFormat::Yuy2: return 2;
+        case VideoFormat::Nv12: return 1;
+        case VideoFormat::Bgra32: return 4;
+        case VideoFormat::Gray8: return 1;
+        default: return 0;
+        }
+    }
+
+    bool IsCompressed(VideoFormat nFormat)
+    {
+        return nFormat == VideoFormat::Mjpeg;
+    }
+
+    FrameView MakeFrameView(VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, const uint8_t* pData, uint32_t nStride)
+    {
+        FrameView view;
+        view.nFormat = nFormat;
+        view.nWidth = nWidth;
+        view.nHeight = nHeight;
+        view.pPlanes[0] = pData;
+        view.nStrides[0] = nStride;
+        view.nDataSize = GetFrameSize(nFormat, nHeight, nStride);
+
+        // The UV plane follows the Y plane
+        if (nFormat == VideoFormat::Nv12)
+        {
+            view.pPlanes[1] = pData + (size_t)nStride * nHeight;
+            view.nStrides[1] = nStride;
+        }
+
+        return view;
+    }
+
+    Rect AlignRegion(VideoFormat nFormat, uint32_t nWidth, uint32_t nHeight, const Rect& region)
+    {
+        if (region.IsEmpty() || nWidth == 0 || nHeight == 0)
+            return { 0, 0, nWidth, nHeight };
+
+        uint32_t x0 = region.nX < nWidth ? region.nX : nWidth - 1;
+        uint32_t y0 = region.nY < nHeight ? region.nY : nHeight - 1;
+        uint32_t x1 = (uint64_t)x0 + region.nWidth < nWidth ? x0 + region.nWidth : nWidth;
+        uint32_t y1 = (uint64_t)y0 + region.nHeight < nHeight ? y0 + region.nHeight : nHeight;
+
+        if (nFormat == VideoFormat::Yuy2 || nFormat == VideoFormat::Nv12)
+        {
+            x0 &= ~1u;
+            x1 = (x1 + 1) & ~1u;
+
+            if (x1 > nWidth)
+                x1 = nWidth;
+        }
+
+        if (nFormat == VideoFormat::Nv12)
+        {
+            y0 &= ~1u;
+            y1 = (y1 + 1) & ~1u;
+
+            if (y1 > nHeight)
+                y1 = nHeight;
+        }
+
+        return { x0, y0, x1 - x0, y1 - y0 };
+    }
+
+    FrameView CropFrameView(const FrameView& view, const Rect& region)
+    {
+        uint32_t nBytes = GetBytesPerPixel(view.nFormat);
+
+        if (nBytes == 0)
+            return view;
+
+        FrameView crop = view;
+        crop.nWidth = region.nWidth;
+        crop.nHeight = region.nHeight;
+        crop.pPlanes[0] = view.pPlanes[0] + (size_t)region.nY * view.nStrides[0] + (size_t)region.nX * nBytes;
+
+        // One UV pair covers two pixels of two rows, so the offset in bytes is the same as in pixels
+        if (view.nFormat == VideoFormat::Nv12)
+            crop.pPlanes[1] = view.pPlanes[1] + (size_t)(region.nY / 2) * view.nStrides[1] + region.nX;
+
+        return crop;
+    }
+
+    size_t GetFrameSize(VideoFormat nFormat, uint32_t nHeight, uint32_t nStride)
+    {
+        size_t nSize = (size_t)nStride * nHeight;
+
+        if (nFormat == VideoFormat::Nv12)
+            nSize += (size_t)nStride * ((nHeight + 1) / 2);
+
+        return nSize;
+    }
+
+    namespace internal
+    {
+        // Rough ns per pixel of the SIMD kernels (see examples/benchmark.cpp), MJPEG has to be decoded first
+        double GetConvertCost(VideoFormat nFormat, OutputFormat nOutputFormat)
+        {
+            if (nOutputFormat == OutputFormat::Native)
+                return nFormat == VideoFormat::Mjpeg ? 0.02 : 0.05 * GetBytesPerPixel(nFormat);
+
+            bool bLuma = nOutputFormat == OutputFormat::Luma;
+
+            switch (nFormat)
+            {
+            case VideoFormat::Rgb32: return bLuma ? 0.5 : 0.3;
+            case VideoFormat::Rgb24: return bLuma ? 0.5 : 0.6;
+            case VideoFormat::Yuy2: return bLuma ? 0.15 : 0.6;
+            case VideoFormat::Nv12: return bLuma ? 0.1 : 0.5;
+            case VideoFormat::Bgra32: return bLuma ? 0.5 : 0.4;
+            case VideoFormat::Gray8: return bLuma ? 0.1 : 0.3;
+            case VideoFormat::Mjpeg: return bLuma ? 3.0 : 5.0;
+            default: return 0.0;
+            }
+        }
+    }
+
+    ModeCost EstimateModeCost(const CaptureMode& mode, const ModeRequest& request)
+    {
+        // Moving a byte from a USB camera costs about as much as converting a pixel
+        const double c_fBusCost = 0.5;
+        const double c_fScaleCost = 0.3;
+
+        // MJPEG at usual qualities takes about 2 bits per pixel
+        const double c_fJpegBytesPerPixel = 0.25;
+
+        const double c_fSizePenalty = 1e12;
+        const double c_fFpsPenalty = 1e11;
+
+        ModeCost cost;
+
+        double fModeFps = mode.nFpsDenominator ? (double)mode.nFpsNumerator / mode.nFpsDenominator : 0.0;
+        double fRequestFps = request.nFpsDenominator ? (double)request.nFpsNumerator / request.nFpsDenominator : 0.0;
+
+        // The device sends frames at the rate of the mode
+        double fRate = fModeFps > 0.0 ? fModeFps : (fRequestFps > 0.0 ? fRequestFps : 30.0);
+
+        uint32_t nDstWidth = request.nWidth ? request.nWidth : mode.nWidth;
+        uint32_t nDstHeight = request.nHeight ? request.nHeight : mode.nHeight;
+
+        double fPixels = (double)mode.nWidth * mode.nHeight;
+        double fDstPixels = (double)nDstWidth * nDstHeight;
+
+        double fBytes = IsCompressed(mode.nFormat) ? fPixels * c_fJpegBytesPerPixel :
+            (double)GetFrameSize(mode.nFormat, mode.nHeight, mode.nWidth * GetBytesPerPixel(mode.nFormat));
+
+        cost.fBus = fBytes * c_fBusCost * fRate;
+        cost.fConvert = fPixels * internal::GetConvertCost(mode.nFormat, request.nOutputFormat) * fRate;
+
+        // Native frames are never scaled
+        if (request.nOutputFormat != OutputFormat::Native && fPixels > fDstPixels)
+            cost.fScale = (fPixels - fDstPixels) * c_fScaleCost * fRate;
+
+        if (mode.nWidth < nDstWidth || mode.nHeight < nDstHeight)
+        {
+            uint32_t nCoveredWidth = mode.nWidth < nDstWidth ? mode.nWidth : nDstWidth;
+            uint32_t nCoveredHeight = mode.nHeight < nDstHeight ? mode.nHeight : nDstHeight;
+
+            double fCovered = (double)nCoveredWidth * nCoveredHeight;
+            cost.fPenalty += c_fSizePenalty * (2.0 - fCovered / fDstPixels);
+        }
+
+        // 29.97 is as good as 30
+        if (fModeFps > 0.0 && fRequestFps > 0.0 && fModeFps < fRequestFps * 0.99)
+            cost.fPenalty += c_fFpsPenalty * (2.0 - fModeFps / fRequestFps);
+
+        cost.fTotal = cost.fBus + cost.fConvert + cost.fScale + cost.fPenalty;
+
+        return cost;
+    }
+
+    void RankModes(std::vector<CaptureMode>& vecModes, const ModeRequest& request)
+    {
+        auto IsUnusable = [](const CaptureMode& mode)
+        {
+        #ifndef WCCAPI_USE_LIBJPEG
+            if (mode.nFormat == VideoFormat::Mjpeg)
+                return true;
+        #endif
+            return mode.nFormat == VideoFormat::None || mode.nWidth == 0 || mode.nHeight == 0;
+        };
+
+        vecModes.erase(std::remove_if(vecModes.begin(), vecModes.end(), IsUnusable), vecModes.end());
+
+        for (CaptureMode& mode : vecModes)
+            mode.cost = EstimateModeCost(mode, request);
+
+        std::stable_sort(vecModes.begin(), vecModes.end(),
+            [](const CaptureMode& a, const CaptureMode& b) { return a.cost.fTotal < b.cost.fTotal; });
+    }
+
+    bool ModeCache::Open(const std::string& sPath)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_sPath = sPath;
+        m_mapDevices.clear();
+
+        FILE* pFile = fopen(sPath.c_str(), "r");
+
+        // Nothing is cached yet
+        if (!pFile)
+            return true;
+
+        // A line with the key of a device is followed by lines of its modes:
+        // format, width, height, fps numerator and denominator, native id
+        std::string sLine;
+        std::vector<CaptureMode>* pModes = nullptr;
+
+        // Whole lines, however long the keys are
+        auto ReadLine = [&]()
+        {
+            char sChunk[256];
+            sLine.clear();
+
+            while (fgets(sChunk, sizeof(sChunk), pFile))
+            {
+                sLine += sChunk;
+
+                if (sLine.back() == '\n')
+                    break;
+            }
+
+            if (sLine.empty())
+                return false;
+
+            sLine.resize(strcspn(sLine.c_str(), "\r\n"));
+            return true;
+        };
+
+        bool bValid = ReadLine() && sLine == "wcc-modes 1";
+
+        while (bValid && ReadLine())
+        {
+            if (sLine.compare(0, 7, "device ") == 0)
+            {
+                pModes = &m_mapDevices[sLine.substr(7)];
+                continue;
+            }
+
+            CaptureMode mode;
+            uint32_t nFormat;
+
+            if (!pModes || sscanf(sLine.c_str(), "%u %u %u %u %u %u", &nFormat, &mode.nWidth, &mode.nHeight,
+                &mode.nFpsNumerator, &mode.nFpsDenominator, &mode.nNativeId) != 6 || nFormat > (uint32_t)VideoFormat::Mjpeg)
+            {
+                bValid = false;
+                break;
+            }
+
+            mode.nFormat = (VideoFormat)nFormat;
+            pModes->push_back(mode);
+        }
+
+        fclose(pFile);
+
+        // A broken file is rewritten with the next entry
+        if (!bValid)
+            m_mapDevices.clear();
+
+        return true;
+    }
+
+    void ModeCache::Close()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_sPath.clear();
+        m_mapDevices.clear();
+    }
+
+    bool ModeCache::IsOpen() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return !m_sPath.empty();
+    }
+
+    bool ModeCache::Find(const std::string& sDevice, std::vector<CaptureMode>& vecModes) const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        auto it = m_mapDevices.find(MakeKey(sDevice));
+
+        if (m_sPath.empty() || it == m_mapDevices.end())
+            return false;
+
+        vecModes = it->second;
+        return true;
+    }
+
+    bool ModeCache::Store(const std::string& sDevice, const std::vector<CaptureMode>& vecModes)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (m_sPath.empty() || sDevice.empty())
+            return false;
+
+        m_mapDevices[MakeKey(sDevice)] = vecModes;
+
+        return Save();
+    }
+
+    bool ModeCache::Remove(const std::string& sDevice)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (m_sPath.empty() || m_mapDevices.erase(MakeKey(sDevice)) == 0)
+            return false;
+
+        return Save();
+    }
+
+    std::string ModeCache::MakeKey(const std::string& sDevice)
+    {
+        std::string sKey = sDevice;
+
+        for (char& c : sKey)
+        {
+            if (c == '\n' || c == '\r')
+                c = ' ';
+        }
+
+        return sKey;
+    }
+
+    bool ModeCache::Save() const
+    {
+        // Written next to the file and renamed, so a crash never leaves half of it
+        std::string sTemp = m_sPath + ".tmp";
+
+        FILE* pFile = fopen(sTemp.c_str(), "w");
+
+        if (!pFile)
+            return false;
+
+        fprintf(pFile, "wcc-modes 1\n");
+
+        for (const auto& device : m_mapDevices)
+        {
+            fprintf(pFile, "device %s\n", device.first.c_str());
+
+            for (const CaptureMode& mode : device.second)
+            {
+                fprintf(pFile, "%u %u %u %u %u %u\n", (uint32_t)mode.nFormat, mode.nWidth, mode.nHeight,
+                    mode.nFpsNumerator, mode.nFpsDenominator, mode.nNativeId);
+            }
+        }
+
+        bool bResult = fclose(pFile) == 0;
+
+    #ifdef _WIN32
+        // rename doesn't replace files on Windows
+        if (bResult)
+            remove(m_sPath.c_str());
+    #endif
+
+        return bResult && rename(sTemp.c_str(), m_sPath.c_str()) == 0;
+    }
+
+    ModeCache& GetModeCache()
+    {
+        static ModeCache s_Cache;
+        return s_Cache;
+    }
+
+    InitTask InitTask::Create()
+    {
+        InitTask task;
+        task.m_pState = std::make_shared<State>();
+
+        return task;
+    }
+
+    void InitTask::Finish(bool bResult) const
+    {
+        if (!m_pState)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(m_pState->mutex);
+            m_pState->bResult = bResult && !m_pState->bCancelled;
+            m_pState->bDone = true;
+        }
+
+        m_pState->done.notify_all();
+    }
+
+    bool InitTask::Wait() const
+    {
+        if (!m_pState)
+            return false;
+
+        std::unique_lock<std::mutex> lock(m_pState->mutex);
+        m_pState->done.wait(lock, [this]() { return m_pState->bDone; });
+
+        return m_pState->bResult;
+    }
+
+    bool InitTask::WaitFor(int64_t nTimeout) const
+    {
+        if (!m_pState)
+            return false;
+
+        std::unique_lock<std::mutex> lock(m_pState->mutex);
+        return m_pState->done.wait_for(lock, std::chrono::nanoseconds(nTimeout), [this]() { return m_pState->bDone; });
+    }
+
+    bool InitTask::IsDone() const
+    {
+        if (!m_pState)
+            return false;
+
+        std::lock_guard<std::mutex> lock(m_pState->mutex);
+        return m_pState->bDone;
+    }
+
+    void InitTask::Cancel() const
+    {
+        if (m_pState)
+            m_pState->bCancelled = true;
+    }
+
+    bool InitTask::IsCancelled() const
+    {
+        return m_pState && m_pState->bCancelled;
+    }
+
+    FrameLoop::~FrameLoop()
+    {
+        Stop();
+    }
+
+    void FrameLoop::Post(Task fnTask, void* pContext)
+    {
+        Add({ INT64_MIN, fnTask, pContext, -1 });
+    }
+
+    void FrameLoop::PostAt(int64_t nTime, Task fnTask, void* pContext)
+    {
+        Add({ nTime, fnTask, pContext, -1 });
+    }
+
+#ifndef _WIN32
+    void FrameLoop::WatchOnce(int nFd, int64_t nTimeout, Task fnTask, void* pContext, PollFunc fnPoll)
+    {
+        Add({ GetMonotonicTime() + nTimeout, fnTask, pContext, nFd, fnPoll });
+    }
+#endif
+
+    void FrameLoop::Cancel(void* pContext)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        for (Entry& entry : m_vecEntries)
+        {
+            if (entry.pContext == pContext)
+                entry.fnTask = nullptr;
+        }
+
+        if (IsLoopThread())
+            return;
+
+        // The loop stops polling the descriptors of the cancelled entries, their owner may close them
+        if (m_Thread.joinable())
+            Wake();
+
+        m_Idle.wait(lock, [this, pContext]() { return m_pRunning != pContext; });
+    }
+
+    Executor FrameLoop::GetExecutor()
+    {
+        Executor executor;
+        executor.Post = &FrameLoop::PostTask;
+        executor.pContext = this;
+
+        return executor;
+    }
+
+    bool FrameLoop::IsLoopThread() const
+    {
+        return m_nThreadId.load() == std::this_thread::get_id();
+    }
+
+    void FrameLoop::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            if (!m_Thread.joinable())
+                return;
+
+            m_bStop = true;
+            Wake();
+        }
+
+        m_Thread.join();
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_vecEntries.clear();
+        m_nThreadId = std::thread::id();
+
+    #ifndef _WIN32
+        close(m_nWakeFds[0]);
+        close(m_nWakeFds[1]);
+        m_nWakeFds[0] = m_nWakeFds[1] = -1;
+    #endif
+    }
+
+    void FrameLoop::PostTask(void* pContext, Task fnTask, void* pTask)
+    {
+        FrameLoop* pThis = (FrameLoop*)pContext;
+
+        if (pThis->IsLoopThread())
+            fnTask(pTask);
+        else
+            pThis->Post(fnTask, pTask);
+    }
+
+    void FrameLoop::Add(const Entry& entry)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (!m_Thread.joinable())
+        {
+        #ifndef _WIN32
+            // The loop sleeps in poll, other threads wake it up by writing into the pipe
+            if (pipe(m_nWakeFds) != 0)
+                return;
+
+            for (int nFd : m_nWakeFds)
+            {
+                fcntl(nFd, F_SETFL, fcntl(nFd, F_GETFL) | O_NONBLOCK);
+                fcntl(nFd, F_SETFD, FD_CLOEXEC);
+            }
+        #endif
+
+            m_bStop = false;
+            m_Thread = std::thread(&FrameLoop::Run, this);
+            m_nThreadId = m_Thread.get_id();
+        }
+
+        m_vecEntries.push_back(entry);
+
+        // The loop looks at its entries again before it sleeps
+        if (!IsLoopThread())
+            Wake();
+    }
+
+    void FrameLoop::Wake()
+    {
+    #ifdef _WIN32
+        m_Wake.notify_one();
+    #else
+        char nByte = 0;
+        (void)!write(m_nWakeFds[1], &nByte, 1);
+    #endif
+    }
+
+    void FrameLoop::Run()
+    {
+    #ifndef _WIN32
+        std::vector<pollfd> vecFds;
+        std::vector<size_t> vecWatched;
+    #endif
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        while (!m_bStop)
+        {
+            m_vecEntries.erase(std::remove_if(m_vecEntries.begin(), m_vecEntries.end(),
+                [](const Entry& entry) { return !entry.fnTask; }), m_vecEntries.end());
+
+        #ifndef _WIN32
+            // Descriptors with a poll function of their own can't be waited for, they are asked on every pass
+            bool bAsking = false;
+
+            for (Entry& entry : m_vecEntries)
+            {
+                if (!entry.fnPoll || entry.nTime == INT64_MIN)
+                    continue;
+
+                pollfd fd{ entry.nFd, POLLIN, 0 };
+
+                if (entry.fnPoll(&fd, 1, 0) > 0 && fd.revents)
+                    entry.nTime = INT64_MIN;
+                else
+                    bAsking = true;
+            }
+        #endif
+
+            int64_t nNow = GetMonotonicTime();
+            int64_t nNext = INT64_MAX;
+
+            // Tasks run one by one, so Cancel can drop the ones that haven't run yet
+            auto itDue = std::find_if(m_vecEntries.begin(), m_vecEntries.end(),
+                [nNow](const Entry& entry) { return entry.nTime <= nNow; });
+
+            if (itDue != m_vecEntries.end())
+            {
+                Entry entry = *itDue;
+                m_vecEntries.erase(itDue);
+
+                m_pRunning = entry.pContext;
+                lock.unlock();
+
+                entry.fnTask(entry.pContext);
+
+                lock.lock();
+                m_pRunning = nullptr;
+                m_Idle.notify_all();
+
+                continue;
+            }
+
+            for (const Entry& entry : m_vecEntries)
+                nNext = std::min(nNext, entry.nTime);
+
+        #ifdef _WIN32
+            if (nNext == INT64_MAX)
+                m_Wake.wait(lock);
+            else
+                m_Wake.wait_for(lock, std::chrono::nanoseconds(nNext - nNow));
+        #else
+            vecFds.assign(1, { m_nWakeFds[0], POLLIN, 0 });
+            vecWatched.clear();
+
+            for (size_t i = 0; i < m_vecEntries.size(); i++)
+            {
+                if (m_vecEntries[i].nFd >= 0 && !m_vecEntries[i].fnPoll)
+                {
+                    vecFds.push_back({ m_vecEntries[i].nFd, POLLIN, 0 });
+                    vecWatched.push_back(i);
+                }
+            }
+
+            // Rounded up, so a timer never fires early
+            int nTimeout = -1;
+
+            if (nNext != INT64_MAX)
+                nTimeout = (int)std::min<int64_t>((nNext - nNow + 999999) / 1000000, 1 << 30);
+
+            if (bAsking && (nTimeout < 0 || nTimeout > 1))
+                nTimeout = 1;
+
+            lock.unlock();
+            int nResult = poll(vecFds.data(), (nfds_t)vecFds.size(), nTimeout);
+            lock.lock();
+
+            if (nResult <= 0)
+                continue;
+
+            if (vecFds[0].revents)
+            {
+                char vBytes[64];
+                while (read(m_nWakeFds[0], vBytes, sizeof(vBytes)) > 0);
+            }
+
+            // The indices still hold, new entries were appended and cancelled ones only marked while polling
+            for (size_t i = 1; i < vecFds.size(); i++)
+            {
+                if (vecFds[i].revents)
+                    m_vecEntries[vecWatched[i - 1]].nTime = INT64_MIN;
+            }
+        #endif
+        }
+    }
+
+    FrameLoop& GetFrameLoop()
+    {
+        static FrameLoop* s_pLoop = new FrameLoop;
+        return *s_pLoop;
+    }
+
+    bool FrameRequest::Set(FrameCallback fnDone, void* pContext)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (m_fnDone)
+            return false;
+
+        m_fnDone = fnDone;
+        m_pContext = pContext;
+        m_bClaimed = false;
+
+        return true;
+    }
+
+    bool FrameRequest::IsPending() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_fnDone && !m_bClaimed;
+    }
+
+    bool FrameRequest::Claim()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (!m_fnDone || m_bClaimed)
+            return false;
+
+        m_bClaimed = true;
+        return true;
+    }
+
+    void FrameRequest::Finish(const FrameInfo& info)
+    {
+        FrameCallback fnDone;
+        void* pContext;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            fnDone = m_fnDone;
+            pContext = m_pContext;
+
+            m_fnDone = nullptr;
+            m_pContext = nullptr;
+            m_bClaimed = false;
+        }
+
+        // The callback may request the next frame
+        if (fnDone)
+            fnDone(pContext, info);
+    }
+
+    void* internal::AllocateAligned(size_t nSize, size_t nAlignment)
+    {
+    #ifdef _WIN32
+        return _aligned_malloc(nSize, nAlignment);
+    #else
+        void* pData = nullptr;
+        return posix_memalign(&pData, nAlignment, nSize) == 0 ? pData : nullptr;
+    #endif
+    }
+
+    void internal::FreeAligned(void* pData)
+    {
+    #ifdef _WIN32
+        _aligned_free(pData);
+    #else
+        free(pData);
+    #endif
+    }
+
+    void* internal::AllocateBuffer(void*, size_t nSize, bool bHugePages)
+    {
+    #ifdef __linux__
+        if (bHugePages)
+        {
+            // Reserved huge pages first, then transparent ones
+            void* pData = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+            if (pData != MAP_FAILED)
+                return pData;
+
+            pData = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (pData == MAP_FAILED)
+                return nullptr;
+
+        #ifdef MADV_HUGEPAGE
+            madvise(pData, nSize, MADV_HUGEPAGE);
+        #endif
+
+            return pData;
+        }
+    #else
+        (void)bHugePages;
+    #endif
+
+        return AllocateAligned(nSize, c_nBufferAlignment);
+    }
+
+    void internal::FreeBuffer(void*, void* pData, size_t nSize, bool bHugePages)
+    {
+    #ifdef __linux__
+        if (bHugePages)
+        {
+            munmap(pData, nSize);
+            return;
+        }
+    #else
+        (void)nSize;
+        (void)bHugePages;
+    #endif
+
+        FreeAligned(pData);
+    }
+
+    namespace internal
+    {
+        const Allocator s_DefaultAllocator = { AllocateBuffer, FreeBuffer, nullptr };
+
+        std::mutex s_AllocatorMutex;
+        Allocator s_Allocator = s_DefaultAllocator;
+    }
+
+    void SetAllocator(const Allocator* pAllocator)
+    {
+        std::lock_guard<std::mutex> lock(internal::s_AllocatorMutex);
+        internal::s_Allocator = pAllocator ? *pAllocator : internal::s_DefaultAllocator;
+    }
+
+    Allocator GetAllocator()
+    {
+        std::lock_guard<std::mutex> lock(internal::s_AllocatorMutex);
+        return internal::s_Allocator;
+    }
+
+    BufferPool::~BufferPool()
+    {
+        // Busy buffers belong to objects that outlive the pool, they are left alone
+        Trim();
+    }
+
+    uint8_t* BufferPool::Acquire(size_t nSize)
+    {
+        if (nSize == 0)
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        // The smallest idle buffer that fits
+        size_t nBest = m_vecIdle.size();
+
+        for (size_t i = 0; i < m_vecIdle.size(); i++)
+        {
+            size_t nCapacity = m_vecIdle[i].nCapacity;
+
+            if (nCapacity >= nSize && nCapacity / 4 <= nSize && (nBest == m_vecIdle.size() || nCapacity < m_vecIdle[nBest].nCapacity))
+                nBest = i;
+        }
+
+        if (nBest < m_vecIdle.size())
+        {
+            Block block = m_vecIdle[nBest];
+
+            m_vecIdle.erase(m_vecIdle.begin() + nBest);
+            m_nIdleSize -= block.nCapacity;
+
+            m_vecBusy.push_back(block);
+            return block.pData;
+        }
+
+        Block block;
+        block.bHugePages = m_bHugePages && nSize >= c_nHugePageSize;
+        block.allocator = GetAllocator();
+
+        // Rounded up to whole pages, so sizes that differ a little (e.g. regions) share buffers
+        size_t nPage = block.bHugePages ? c_nHugePageSize : 4096;
+        block.nCapacity = (nSize + nPage - 1) / nPage * nPage;
+
+        block.pData = (uint8_t*)block.allocator.Allocate(block.allocator.pContext, block.nCapacity, block.bHugePages);
+        m_nAllocations++;
+
+        if (!block.pData)
+            return nullptr;
+
+        m_vecBusy.push_back(block);
+        return block.pData;
+    }
+
+    void BufferPool::Release(uint8_t* pData)
+    {
+        if (!pData)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        for (size_t i = 0; i < m_vecBusy.size(); i++)
+        {
+            if (m_vecBusy[i].pData == pData)
+            {
+                m_vecIdle.push_back(m_vecBusy[i]);
+                m_nIdleSize += m_vecBusy[i].nCapacity;
+
+                m_vecBusy.erase(m_vecBusy.begin() + i);
+                break;
+            }
+        }
+
+        FreeIdle(m_nIdleLimit);
+    }
+
+    size_t BufferPool::GetCapacity(const uint8_t* pData) const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        for (const Block& block : m_vecBusy)
+        {
+            if (block.pData == pData)
+                return block.nCapacity;
+        }
+
+        return 0;
+    }
+
+    void BufferPool::SetHugePages(bool bEnable)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_bHugePages = bEnable;
+    }
+
+    bool BufferPool::GetHugePages() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_bHugePages;
+    }
+
+    void BufferPool::SetIdleLimit(size_t nBytes)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_nIdleLimit = nBytes;
+        FreeIdle(m_nIdleLimit);
+    }
+
+    size_t BufferPool::GetIdleLimit() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_nIdleLimit;
+    }
+
+    void BufferPool::Trim()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        FreeIdle(0);
+    }
+
+    size_t BufferPool::GetIdleSize() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_nIdleSize;
+    }
+
+    uint64_t BufferPool::GetAllocationCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_nAllocations;
+    }
+
+    void BufferPool::FreeBlock(const Block& block)
+    {
+        block.allocator.Free(block.allocator.pContext, block.pData, block.nCapacity, block.bHugePages);
+    }
+
+    void BufferPool::FreeIdle(size_t nLimit)
+    {
+        // The least recently used buffers go first
+        size_t nFreed = 0;
+
+        while (nFreed < m_vecIdle.size() && m_nIdleSize > nLimit)
+        {
+            m_nIdleSize -= m_vecIdle[nFreed].nCapacity;
+            FreeBlock(m_vecIdle[nFreed++]);
+        }
+
+        m_vecIdle.erase(m_vecIdle.begin(), m_vecIdle.begin() + nFreed);
+    }
+
+    BufferPool& GetBufferPool()
+    {
+        static BufferPool* s_pPool = new BufferPool;
+        return *s_pPool;
+    }
+
+    FrameBuffer::~FrameBuffer()
+    {
+        Reset();
+    }
+
+    FrameBuffer::FrameBuffer(FrameBuffer&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    FrameBuffer& FrameBuffer::operator=(FrameBuffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+
+            std::swap(m_pData, other.m_pData);
+            std::swap(m_nSize, other.m_nSize);
+            std::swap(m_nCapacity, other.m_nCapacity);
+        }
+
+        return *this;
+    }
+
+    bool FrameBuffer::Resize(size_t nSize)
+    {
+        if (nSize <= m_nCapacity && m_nCapacity / 4 <= nSize)
+        {
+            m_nSize = nSize;
+            return true;
+        }
+
+        Reset();
+
+        m_pData = GetBufferPool().Acquire(nSize);
+
+        if (!m_pData)
+            return nSize == 0;
+
+        m_nSize = nSize;
+        m_nCapacity = GetBufferPool().GetCapacity(m_pData);
+
+        return true;
+    }
+
+    bool FrameBuffer::Assign(size_t nSize)
+    {
+        if (!Resize(nSize))
+            return false;
+
+        if (m_pData)
+            memset(m_pData, 0, m_nSize);
+
+        return true;
+    }
+
+    void FrameBuffer::Reset()
+    {
+        GetBufferPool().Release(m_pData);
+
+        m_pData = nullptr;
+        m_nSize = 0;
+        m_nCapacity = 0;
+    }
+
+    void ConvertFrame(const FrameView& src, uint8_t* pDst, uint32_t nDstStride, Isa nIsa, const ColorSpace& colorSpace)
+    {
+        if (src.nFormat == VideoFormat::Nv12)
+        {
+            Nv12Converter fnConvert = GetNv12Converter(nIsa, colorSpace);
+
+            for (uint32_t y = 0; y < src.nHeight; y += 2)
+            {
+                // The last row of an odd height has no pair, so it's converted twice
+                uint32_t y1 = (y + 1 < src.nHeight) ? y + 1 : y;
+
+                fnConvert(
+                    src.pPlanes[0] + (size_t)y * src.nStrides[0],
+                    src.pPlanes[0] + (size_t)y1 * src.nStrides[0],
+                    src.pPlanes[1] + (size_t)(y / 2) * src.nStrides[1],
+                    pDst + (size_t)y * nDstStride,
+                    pDst + (size_t)y1 * nDstStride,
+                    src.nWidth);
+            }
+
+            return;
+        }
+
+        RowConverter fnConvert = GetRowConverter(src.nFormat, nIsa, colorSpace);
+
+        if (!fnConvert)
+            return;
+
+        for (uint32_t y = 0; y < src.nHeight; y++)
+            fnConvert(src.pPlanes[0] + (size_t)y * src.nStrides[0], pDst + (size_t)y * nDstStride, src.nWidth);
+    }
+
+    void internal::GatherRow(const FrameView& src, uint32_t sy, const uint32_t* pColumns, uint8_t* pDst, uint32_t nDstWidth, const YuvTable& table)
+    {
+        const uint8_t* pRow = src.pPlanes[0] + (size_t)sy * src.nStrides[0];
+
+        switch (src.nFormat)
+        {
+        case VideoFormat::Rgb32:
+            for (uint32_t x = 0; x < nDstWidth; x++, pDst += 4)
+                ConvertFromRGB32(pRow + pColumns[x] * 4, pDst);
+        break;
+
+        case VideoFormat::Rgb24:
+            for (uint32_t x = 0; x < nDstWidth; x++, pDst += 4)
+                ConvertFromRGB24(pRow + pColumns[x] * 3, pDst);
+        break;
+
+        case VideoFormat::Bgra32:
+            for (uint32_t x = 0; x < nDstWidth; x++, pDst += 4)
+                ConvertFromBGRA(pRow + pColumns[x] * 4, pDst);
+        break;
+
+        case VideoFormat::Gray8:
+            for (uint32_t x = 0; x < nDstWidth; x++, pDst += 4)
+                ConvertRowGray8_Scalar(pRow + pColumns[x], pDst, 1);
+        break;
+
+        case VideoFormat::Yuy2:
+            for (uint32_t x = 0; x < nDstWidth; x++, pDst += 4)
+            {
+                uint32_t sx = pColumns[x];
+                const uint8_t* pPair = pRow + (sx & ~1u) * 2;
+
+                ConvertFromYUV(pRow[sx * 2], pPair[1], pPair[3], pDst, table);
+            }
+        break;
+
+        case VideoFormat::Nv12:
+        {
+            const uint8_t* pUV = src.pPlanes[1] + (size_t)(sy / 2) * src.nStrides[1];
+
+            for (uint32_t x = 0; x < nDstWidth; x++, pDst += 4)
+            {
+                uint32_t sx = pColumns[x];
+                ConvertFromYUV(pRow[sx], pUV[sx & ~1u], pUV[sx | 1u], pDst, table);
+            }
+        }
+        break;
+
+        default: break;
+        }
+    }
+
+    void internal::LerpRows(const uint8_t* pRow0, const uint8_t* pRow1, uint32_t nWeight, uint8_t* pDst, size_t n)
+    {
+        size_t i = 0;
+
+    #if defined(WCC_X86)
+        // (a * (256 - w) + b * w + 128) >> 8 fits into 16 bits
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i w0 = _mm_set1_epi16((short)(256 - nWeight));
+        const __m128i w1 = _mm_set1_epi16((short)nWeight);
+        const __m128i half = _mm_set1_epi16(128);
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(pRow0 + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(pRow1 + i));
+
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 8);
+
+            _mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(lo, hi));
+        }
+    #elif defined(WCC_NEON)
+        // 256 - nWeight doesn't fit into 8 bits if nWeight is 0
+        if (nWeight != 0)
+        {
+            const uint8x8_t w0 = vdup_n_u8((uint8_t)(256 - nWeight));
+            const uint8x8_t w1 = vdup_n_u8((uint8_t)nWeight);
+
+            for (; i + 8 <= n; i += 8)
+            {
+                uint16x8_t v = vmlal_u8(vmull_u8(vld1_u8(pRow0 + i), w0), vld1_u8(pRow1 + i), w1);
+                vst1_u8(pDst + i, vrshrn_n_u16(v, 8));
+            }
+        }
+    #endif
+
+        for (; i < n; i++)
+            pDst[i] = (uint8_t)((pRow0[i] * (256 - nWeight) + pRow1[i] * nWeight + 128) >> 8);
+    }
+
+    template <uint32_t C>
+    void internal::BilinearRow_Scalar(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        for (uint32_t x = 0; x < nDstWidth; x++, pDst += C)
+        {
+            const uint8_t* a = pSrc + pX0[x] * C;
+            const uint8_t* b = pSrc + pX1[x] * C;
+            uint32_t w = pWeight[x];
+
+            for (uint32_t c = 0; c < C; c++)
+                pDst[c] = (uint8_t)((a[c] * (256 - w) + b[c] * w + 128) >> 8);
+        }
+    }
+
+    template <uint32_t C>
+    void internal::AreaRow_Scalar(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        for (uint32_t x = 0; x < nDstWidth; x++, pDst += C)
+        {
+            const uint8_t* p = pSrc + pX0[x] * C;
+            uint32_t nSum[C] = {};
+
+            for (uint32_t i = 0; i < pCount[x]; i++, p += C)
+            {
+                for (uint32_t c = 0; c < C; c++)
+                    nSum[c] += p[c];
+            }
+
+            for (uint32_t c = 0; c < C; c++)
+                pDst[c] = (uint8_t)((nSum[c] * pWeight[x] + 0x8000) >> 16);
+        }
+    }
+
+    void internal::AverageRows_Scalar(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n)
+    {
+        // Summing in small chunks keeps the accumulator on the stack and lets the compiler vectorize the loops
+        uint32_t nSum[256];
+
+        for (size_t i = 0; i < n; i += 256)
+        {
+            size_t nChunk = (n - i < 256) ? n - i : 256;
+
+            for (size_t j = 0; j < nChunk; j++)
+                nSum[j] = ppRows[0][i + j];
+
+            for (uint32_t r = 1; r < nRows; r++)
+                for (size_t j = 0; j < nChunk; j++)
+                    nSum[j] += ppRows[r][i + j];
+
+            for (size_t j = 0; j < nChunk; j++)
+                pDst[i + j] = (uint8_t)((nSum[j] * nRecip + 0x8000) >> 16);
+        }
+    }
+
+    void internal::BoxRows_Scalar(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        uint32_t nShift = (nFactor == 4) ? 4 : 2;
+        uint32_t nHalf = 1u << (nShift - 1);
+
+        // Vertical sums of 64 output pixels at most: 64 * 4 * 4 channels
+        uint16_t nSum[1024];
+
+        for (uint32_t x0 = 0; x0 < nDstWidth; x0 += 64)
+        {
+            uint32_t nPixels = (nDstWidth - x0 < 64) ? nDstWidth - x0 : 64;
+            size_t nBytes = (size_t)nPixels * nFactor * nChannels;
+            size_t nOffset = (size_t)x0 * nFactor * nChannels;
+
+            for (size_t j = 0; j < nBytes; j++)
+                nSum[j] = ppRows[0][nOffset + j];
+
+            for (uint32_t r = 1; r < nFactor; r++)
+                for (size_t j = 0; j < nBytes; j++)
+                    nSum[j] += ppRows[r][nOffset + j];
+
+            for (uint32_t x = 0; x < nPixels; x++, pDst += nChannels)
+            {
+                const uint16_t* pSum = nSum + x * nFactor * nChannels;
+
+                for (uint32_t c = 0; c < nChannels; c++)
+                {
+                    uint32_t nTotal = 0;
+
+                    for (uint32_t k = 0; k < nFactor; k++)
+                        nTotal += pSum[k * nChannels + c];
+
+                    pDst[c] = (uint8_t)((nTotal + nHalf) >> nShift);
+                }
+            }
+        }
+    }
+
+    namespace internal
+    {
+        // The last nDstWidth - x output pixels of a box row, for the tails of the SIMD kernels
+        inline void BoxRowsTail(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth, uint32_t x)
+        {
+            const uint8_t* pRows[4];
+            size_t nOffset = (size_t)x * nFactor * nChannels;
+
+            for (uint32_t r = 0; r < nFactor; r++)
+                pRows[r] = ppRows[r] + nOffset;
+
+            BoxRows_Scalar(pRows, nFactor, nChannels, pDst + (size_t)x * nChannels, nDstWidth - x);
+        }
+
+    #ifdef WCC_X86
+        // Sums of the 16 bytes at j of nRows rows, bytes 0-7 in lo and 8-15 in hi
+        inline void SumColumns_Sse2(const uint8_t* const* ppRows, uint32_t nRows, size_t j, __m128i& lo, __m128i& hi)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            lo = hi = zero;
+
+            for (uint32_t r = 0; r < nRows; r++)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(ppRows[r] + j));
+                lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+            }
+        }
+
+        // (nSum * nWeight + 0x8000) >> 16 for sums and weights below 65536, the rounding bit is the top bit of the low half
+        inline __m128i MulRound16_Sse2(__m128i sum, __m128i weight)
+        {
+            return _mm_add_epi16(_mm_mulhi_epu16(sum, weight), _mm_srli_epi16(_mm_mullo_epi16(sum, weight), 15));
+        }
+
+        // Reduces the sums of 16 source bytes (one block of SumColumns_Sse2) to the sums of the output pixels:
+        // 8 lanes for 2 RGBA or 8 gray pixels of factor 2, 4 lanes for 1 RGBA or 4 gray pixels of factor 4
+        inline __m128i ReduceBox_Sse2(__m128i lo, __m128i hi, uint32_t nFactor, uint32_t nChannels)
+        {
+            const __m128i ones = _mm_set1_epi16(1);
+
+            if (nChannels == 4)
+            {
+                if (nFactor == 2)
+                    return _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)), _mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+
+                __m128i sum = _mm_add_epi16(lo, hi);
+                return _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+            }
+
+            // Neighbouring gray pixels are added in 32 bits and packed back, the sums are far below 32768
+            __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+
+            if (nFactor == 2)
+                return pairs;
+
+            __m128i quads = _mm_madd_epi16(pairs, ones);
+            return _mm_packs_epi32(quads, quads);
+        }
+
+        // 16 output bytes of a box row from the sums of nFactor blocks of 16 source bytes
+        inline __m128i BoxBlock_Sse2(const __m128i* pLo, const __m128i* pHi, uint32_t nFactor, uint32_t nChannels)
+        {
+            // Factor 2 gives 8 lanes per source block (two blocks), factor 4 gives 4 lanes (four blocks)
+            __m128i sum0 = ReduceBox_Sse2(pLo[0], pHi[0], nFactor, nChannels);
+            __m128i sum1 = ReduceBox_Sse2(pLo[1], pHi[1], nFactor, nChannels);
+
+            if (nFactor == 4)
+            {
+                sum0 = _mm_unpacklo_epi64(sum0, sum1);
+                sum1 = _mm_unpacklo_epi64(ReduceBox_Sse2(pLo[2], pHi[2], nFactor, nChannels), ReduceBox_Sse2(pLo[3], pHi[3], nFactor, nChannels));
+            }
+
+            int nShift = (nFactor == 4) ? 4 : 2;
+            const __m128i half = _mm_set1_epi16((short)(1 << (nShift - 1)));
+
+            sum0 = _mm_srl_epi16(_mm_add_epi16(sum0, half), _mm_cvtsi32_si128(nShift));
+            sum1 = _mm_srl_epi16(_mm_add_epi16(sum1, half), _mm_cvtsi32_si128(nShift));
+
+            return _mm_packus_epi16(sum0, sum1);
+        }
+    #endif
+    }
+
+#ifdef WCC_X86
+    void internal::BilinearRow4_Sse2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        const uint32_t* pPixels = (const uint32_t*)pSrc;
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i full = _mm_set1_epi16(256);
+        const __m128i half = _mm_set1_epi16(128);
+
+        uint32_t x = 0;
+
+        for (; x + 4 <= nDstWidth; x += 4, pDst += 16)
+        {
+            __m128i a = _mm_setr_epi32((int)pPixels[pX0[x]], (int)pPixels[pX0[x + 1]], (int)pPixels[pX0[x + 2]], (int)pPixels[pX0[x + 3]]);
+            __m128i b = _mm_setr_epi32((int)pPixels[pX1[x]], (int)pPixels[pX1[x + 1]], (int)pPixels[pX1[x + 2]], (int)pPixels[pX1[x + 3]]);
+
+            // Every weight is spread over the 4 channels of its pixel
+            __m128i w = _mm_loadu_si128((const __m128i*)(pWeight + x));
+            w = _mm_or_si128(w, _mm_slli_epi32(w, 16));
+
+            __m128i wLo = _mm_unpacklo_epi32(w, w);
+            __m128i wHi = _mm_unpackhi_epi32(w, w);
+
+            // The same math as LerpRows, a * (256 - w) + b * w + 128 fits into 16 bits
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_sub_epi16(full, wLo)), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), wLo));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_sub_epi16(full, wHi)), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), wHi));
+
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, half), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, half), 8);
+
+            _mm_storeu_si128((__m128i*)pDst, _mm_packus_epi16(lo, hi));
+        }
+
+        BilinearRow_Scalar<4>(pSrc, pX0 + x, pX1 + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    void internal::BilinearRow1_Sse2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        const __m128i full = _mm_set1_epi16(256);
+        const __m128i half = _mm_set1_epi16(128);
+
+        uint32_t x = 0;
+
+        for (; x + 8 <= nDstWidth; x += 8, pDst += 8)
+        {
+            __m128i a = _mm_setr_epi16(pSrc[pX0[x]], pSrc[pX0[x + 1]], pSrc[pX0[x + 2]], pSrc[pX0[x + 3]],
+                pSrc[pX0[x + 4]], pSrc[pX0[x + 5]], pSrc[pX0[x + 6]], pSrc[pX0[x + 7]]);
+
+            __m128i b = _mm_setr_epi16(pSrc[pX1[x]], pSrc[pX1[x + 1]], pSrc[pX1[x + 2]], pSrc[pX1[x + 3]],
+                pSrc[pX1[x + 4]], pSrc[pX1[x + 5]], pSrc[pX1[x + 6]], pSrc[pX1[x + 7]]);
+
+            // Weights are below 256, so packing them with signed saturation keeps them
+            __m128i w = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(pWeight + x)), _mm_loadu_si128((const __m128i*)(pWeight + x + 4)));
+            __m128i v = _mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(full, w)), _mm_mullo_epi16(b, w));
+
+            v = _mm_srli_epi16(_mm_add_epi16(v, half), 8);
+            _mm_storel_epi64((__m128i*)pDst, _mm_packus_epi16(v, v));
+        }
+
+        BilinearRow_Scalar<1>(pSrc, pX0 + x, pX1 + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    void internal::AreaRow4_Sse2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        // Sum of the channels of the pixels covered by output pixel x in the low 4 lanes, two pixels per load
+        auto sum = [&](uint32_t x)
+        {
+            const uint8_t* p = pSrc + (size_t)pX0[x] * 4;
+            uint32_t nCount = pCount[x];
+            __m128i acc = zero;
+
+            for (uint32_t i = 0; i + 2 <= nCount; i += 2, p += 8)
+                acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero));
+
+            acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+
+            if (nCount & 1)
+                acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int32_t*)p), zero));
+
+            return acc;
+        };
+
+        uint32_t x = 0;
+
+        for (; x + 2 <= nDstWidth; x += 2, pDst += 8)
+        {
+            // A single pixel has the weight 65536, 65535 rounds it to the same value
+            short w0 = (short)((pWeight[x] < 65535) ? pWeight[x] : 65535);
+            short w1 = (short)((pWeight[x + 1] < 65535) ? pWeight[x + 1] : 65535);
+
+            __m128i w = _mm_setr_epi16(w0, w0, w0, w0, w1, w1, w1, w1);
+            __m128i v = MulRound16_Sse2(_mm_unpacklo_epi64(sum(x), sum(x + 1)), w);
+
+            _mm_storel_epi64((__m128i*)pDst, _mm_packus_epi16(v, v));
+        }
+
+        AreaRow_Scalar<4>(pSrc, pX0 + x, pCount + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    void internal::AverageRows_Sse2(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n)
+    {
+        const __m128i recip = _mm_set1_epi16((short)((nRecip < 65535) ? nRecip : 65535));
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i lo, hi;
+            SumColumns_Sse2(ppRows, nRows, i, lo, hi);
+
+            _mm_storeu_si128((__m128i*)(pDst + i), _mm_packus_epi16(MulRound16_Sse2(lo, recip), MulRound16_Sse2(hi, recip)));
+        }
+
+        for (; i < n; i++)
+        {
+            uint32_t nSum = 0;
+
+            for (uint32_t r = 0; r < nRows; r++)
+                nSum += ppRows[r][i];
+
+            pDst[i] = (uint8_t)((nSum * nRecip + 0x8000) >> 16);
+        }
+    }
+
+    void internal::BoxRows_Sse2(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        // 16 output bytes per block
+        uint32_t nStep = 16 / nChannels;
+        uint32_t x = 0;
+
+        for (; x + nStep <= nDstWidth; x += nStep)
+        {
+            size_t j = (size_t)x * nFactor * nChannels;
+            __m128i lo[4], hi[4];
+
+            // Two blocks of 16 source bytes for factor 2, four for factor 4
+            for (uint32_t k = 0; k < 4; k++)
+            {
+                if (k < 2 || nFactor == 4)
+                    SumColumns_Sse2(ppRows, nFactor, j + k * 16, lo[k], hi[k]);
+            }
+
+            _mm_storeu_si128((__m128i*)(pDst + (size_t)x * nChannels), BoxBlock_Sse2(lo, hi, nFactor, nChannels));
+        }
+
+        BoxRowsTail(ppRows, nFactor, nChannels, pDst, nDstWidth, x);
+    }
+
+    WCC_TARGET_AVX2 void internal::BilinearRow4_Avx2(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i full = _mm256_set1_epi16(256);
+        const __m256i half = _mm256_set1_epi16(128);
+
+        uint32_t x = 0;
+
+        // Unpacking and packing work within 128-bit lanes, so the pixels stay in order
+        for (; x + 8 <= nDstWidth; x += 8, pDst += 32)
+        {
+            __m256i a = _mm256_i32gather_epi32((const int*)pSrc, _mm256_loadu_si256((const __m256i*)(pX0 + x)), 4);
+            __m256i b = _mm256_i32gather_epi32((const int*)pSrc, _mm256_loadu_si256((const __m256i*)(pX1 + x)), 4);
+
+            __m256i w = _mm256_loadu_si256((const __m256i*)(pWeight + x));
+            w = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+
+            __m256i wLo = _mm256_unpacklo_epi32(w, w);
+            __m256i wHi = _mm256_unpackhi_epi32(w, w);
+
+            __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_sub_epi16(full, wLo)), _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), wLo));
+            __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_sub_epi16(full, wHi)), _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), wHi));
+
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, half), 8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, half), 8);
+
+            _mm256_storeu_si256((__m256i*)pDst, _mm256_packus_epi16(lo, hi));
+        }
+
+        BilinearRow4_Sse2(pSrc, pX0 + x, pX1 + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    namespace internal
+    {
+        // SumColumns_Sse2 with one 256-bit accumulator, the bytes are widened in order
+        WCC_TARGET_AVX2 inline void SumColumns_Avx2(const uint8_t* const* ppRows, uint32_t nRows, size_t j, __m128i& lo, __m128i& hi)
+        {
+            __m256i acc = _mm256_setzero_si256();
+
+            for (uint32_t r = 0; r < nRows; r++)
+                acc = _mm256_add_epi16(acc, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(ppRows[r] + j))));
+
+            lo = _mm256_castsi256_si128(acc);
+            hi = _mm256_extracti128_si256(acc, 1);
+        }
+    }
+
+    WCC_TARGET_AVX2 void internal::AverageRows_Avx2(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n)
+    {
+        const __m256i recip = _mm256_set1_epi16((short)((nRecip < 65535) ? nRecip : 65535));
+        size_t i = 0;
+
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i lo = _mm256_setzero_si256();
+            __m256i hi = _mm256_setzero_si256();
+
+            for (uint32_t r = 0; r < nRows; r++)
+            {
+                lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(ppRows[r] + i))));
+                hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(ppRows[r] + i + 16))));
+            }
+
+            lo = _mm256_add_epi16(_mm256_mulhi_epu16(lo, recip), _mm256_srli_epi16(_mm256_mullo_epi16(lo, recip), 15));
+            hi = _mm256_add_epi16(_mm256_mulhi_epu16(hi, recip), _mm256_srli_epi16(_mm256_mullo_epi16(hi, recip), 15));
+
+            // packus interleaves the 128-bit lanes of both, the permute puts them back in order
+            _mm256_storeu_si256((__m256i*)(pDst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+        }
+
+        const uint8_t* pRows[c_nMaxSimdSum];
+
+        for (uint32_t r = 0; r < nRows; r++)
+            pRows[r] = ppRows[r] + i;
+
+        AverageRows_Sse2(pRows, nRows, nRecip, pDst + i, n - i);
+    }
+
+    WCC_TARGET_AVX2 void internal::BoxRows_Avx2(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        uint32_t nStep = 16 / nChannels;
+        uint32_t x = 0;
+
+        for (; x + nStep <= nDstWidth; x += nStep)
+        {
+            size_t j = (size_t)x * nFactor * nChannels;
+            __m128i lo[4], hi[4];
+
+            // Two blocks of 16 source bytes for factor 2, four for factor 4
+            for (uint32_t k = 0; k < 4; k++)
+            {
+                if (k < 2 || nFactor == 4)
+                    SumColumns_Avx2(ppRows, nFactor, j + k * 16, lo[k], hi[k]);
+            }
+
+            _mm_storeu_si128((__m128i*)(pDst + (size_t)x * nChannels), BoxBlock_Sse2(lo, hi, nFactor, nChannels));
+        }
+
+        BoxRowsTail(ppRows, nFactor, nChannels, pDst, nDstWidth, x);
+    }
+#endif
+
+#ifdef WCC_NEON
+    void internal::BilinearRow4_Neon(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        const uint32_t* pPixels = (const uint32_t*)pSrc;
+        const uint16x8_t full = vdupq_n_u16(256);
+
+        uint32_t x = 0;
+
+        for (; x + 4 <= nDstWidth; x += 4, pDst += 16)
+        {
+            uint32_t nA[4] = { pPixels[pX0[x]], pPixels[pX0[x + 1]], pPixels[pX0[x + 2]], pPixels[pX0[x + 3]] };
+            uint32_t nB[4] = { pPixels[pX1[x]], pPixels[pX1[x + 1]], pPixels[pX1[x + 2]], pPixels[pX1[x + 3]] };
+
+            uint8x16_t a = vreinterpretq_u8_u32(vld1q_u32(nA));
+            uint8x16_t b = vreinterpretq_u8_u32(vld1q_u32(nB));
+
+            // Every weight is spread over the 4 channels of its pixel
+            uint16x8_t wLo = vcombine_u16(vdup_n_u16((uint16_t)pWeight[x]), vdup_n_u16((uint16_t)pWeight[x + 1]));
+            uint16x8_t wHi = vcombine_u16(vdup_n_u16((uint16_t)pWeight[x + 2]), vdup_n_u16((uint16_t)pWeight[x + 3]));
+
+            uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(a)), vsubq_u16(full, wLo)), vmovl_u8(vget_low_u8(b)), wLo);
+            uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(a)), vsubq_u16(full, wHi)), vmovl_u8(vget_high_u8(b)), wHi);
+
+            vst1q_u8(pDst, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+        }
+
+        BilinearRow_Scalar<4>(pSrc, pX0 + x, pX1 + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    void internal::BilinearRow1_Neon(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pX1, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        const uint16x8_t full = vdupq_n_u16(256);
+        uint32_t x = 0;
+
+        for (; x + 8 <= nDstWidth; x += 8, pDst += 8)
+        {
+            uint8_t nA[8], nB[8];
+
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                nA[i] = pSrc[pX0[x + i]];
+                nB[i] = pSrc[pX1[x + i]];
+            }
+
+            uint16x8_t w = vcombine_u16(vmovn_u32(vld1q_u32(pWeight + x)), vmovn_u32(vld1q_u32(pWeight + x + 4)));
+            uint16x8_t v = vmlaq_u16(vmulq_u16(vmovl_u8(vld1_u8(nA)), vsubq_u16(full, w)), vmovl_u8(vld1_u8(nB)), w);
+
+            vst1_u8(pDst, vrshrn_n_u16(v, 8));
+        }
+
+        BilinearRow_Scalar<1>(pSrc, pX0 + x, pX1 + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    void internal::AreaRow4_Neon(const uint8_t* pSrc, const uint32_t* pX0, const uint32_t* pCount, const uint32_t* pWeight, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        // (sum * weight + 0x8000) >> 16 of the channels of output pixel x, two source pixels per load
+        auto average = [&](uint32_t x)
+        {
+            const uint8_t* p = pSrc + (size_t)pX0[x] * 4;
+            uint32_t nCount = pCount[x];
+            uint16x8_t acc = vdupq_n_u16(0);
+
+            for (uint32_t i = 0; i + 2 <= nCount; i += 2, p += 8)
+                acc = vaddw_u8(acc, vld1_u8(p));
+
+            if (nCount & 1)
+            {
+                uint32_t nPixel;
+                memcpy(&nPixel, p, 4);
+                acc = vaddw_u8(acc, vcreate_u8(nPixel));
+            }
+
+            uint16x4_t sum = vadd_u16(vget_low_u16(acc), vget_high_u16(acc));
+            return vrshrn_n_u32(vmulq_n_u32(vmovl_u16(sum), pWeight[x]), 16);
+        };
+
+        uint32_t x = 0;
+
+        for (; x + 2 <= nDstWidth; x += 2, pDst += 8)
+            vst1_u8(pDst, vmovn_u16(vcombine_u16(average(x), average(x + 1))));
+
+        AreaRow_Scalar<4>(pSrc, pX0 + x, pCount + x, pWeight + x, pDst, nDstWidth - x);
+    }
+
+    void internal::AverageRows_Neon(const uint8_t* const* ppRows, uint32_t nRows, uint32_t nRecip, uint8_t* pDst, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            uint16x8_t lo = vdupq_n_u16(0);
+            uint16x8_t hi = vdupq_n_u16(0);
+
+            for (uint32_t r = 0; r < nRows; r++)
+            {
+                uint8x16_t v = vld1q_u8(ppRows[r] + i);
+                lo = vaddw_u8(lo, vget_low_u8(v));
+                hi = vaddw_u8(hi, vget_high_u8(v));
+            }
+
+            // The products are 32 bits wide, vrshrn adds the 0x8000
+            uint16x4_t r0 = vrshrn_n_u32(vmulq_n_u32(vmovl_u16(vget_low_u16(lo)), nRecip), 16);
+            uint16x4_t r1 = vrshrn_n_u32(vmulq_n_u32(vmovl_u16(vget_high_u16(lo)), nRecip), 16);
+            uint16x4_t r2 = vrshrn_n_u32(vmulq_n_u32(vmovl_u16(vget_low_u16(hi)), nRecip), 16);
+            uint16x4_t r3 = vrshrn_n_u32(vmulq_n_u32(vmovl_u16(vget_high_u16(hi)), nRecip), 16);
+
+            vst1q_u8(pDst + i, vcombine_u8(vmovn_u16(vcombine_u16(r0, r1)), vmovn_u16(vcombine_u16(r2, r3))));
+        }
+
+        for (; i < n; i++)
+        {
+            uint32_t nSum = 0;
+
+            for (uint32_t r = 0; r < nRows; r++)
+                nSum += ppRows[r][i];
+
+            pDst[i] = (uint8_t)((nSum * nRecip + 0x8000) >> 16);
+        }
+    }
+
+    void internal::BoxRows_Neon(const uint8_t* const* ppRows, uint32_t nFactor, uint32_t nChannels, uint8_t* pDst, uint32_t nDstWidth)
+    {
+        // Sums of the 16 bytes at j of the rows, bytes 0-7 in lo and 8-15 in hi
+        auto sum = [ppRows, nFactor](size_t j, uint16x8_t& lo, uint16x8_t& hi)
+        {
+            lo = hi = vdupq_n_u16(0);
+
+            for (uint32_t r = 0; r < nFactor; r++)
+            {
+                uint8x16_t v = vld1q_u8(ppRows[r] + j);
+                lo = vaddw_u8(lo, vget_low_u8(v));
+                hi = vaddw_u8(hi, vget_high_u8(v));
+            }
+        };
+
+        // Neighbouring lanes are added pairwise, 8 lanes from 16
+        auto pairs = [](uint16x8_t lo, uint16x8_t hi)
+        {
+            return vcombine_u16(vpadd_u16(vget_low_u16(lo), vget_high_u16(lo)), vpadd_u16(vget_low_u16(hi), vget_high_u16(hi)));
+        };
+
+        // 8 output bytes per block from 8 * nFactor source bytes
+        uint32_t nStep = 8 / nChannels;
+        uint32_t x = 0;
+
+        for (; x + nStep <= nDstWidth; x += nStep)
+        {
+            size_t j = (size_t)x * nFactor * nChannels;
+            uint16x8_t lo, hi, total;
+
+            if (nChannels == 1)
+            {
+                sum(j, lo, hi);
+                total = pairs(lo, hi);
+
+                if (nFactor == 4)
+                {
+                    uint16x8_t lo1, hi1;
+                    sum(j + 16, lo1, hi1);
+                    total = pairs(total, pairs(lo1, hi1));
+                }
+            }
+            else if (nFactor == 2)
+            {
+                // Two RGBA pixels in lo and two in hi
+                sum(j, lo, hi);
+                total = vcombine_u16(vadd_u16(vget_low_u16(lo), vget_high_u16(lo)), vadd_u16(vget_low_u16(hi), vget_high_u16(hi)));
+            }
+            else
+            {
+                uint16x8_t lo1, hi1;
+                sum(j, lo, hi);
+                sum(j + 16, lo1, hi1);
+
+                uint16x8_t sum0 = vaddq_u16(lo, hi);
+                uint16x8_t sum1 = vaddq_u16(lo1, hi1);
+                total = vcombine_u16(vadd_u16(vget_low_u16(sum0), vget_high_u16(sum0)), vadd_u16(vget_low_u16(sum1), vget_high_u16(sum1)));
+            }
+
+            vst1_u8(pDst + (size_t)x * nChannels, (nFactor == 4) ? vrshrn_n_u16(total, 4) : vrshrn_n_u16(total, 2));
+        }
+
+        BoxRowsTail(ppRows, nFactor, nChannels, pDst, nDstWidth, x);
+    }
+#endif
+
+    internal::ScaleKernels internal::GetScaleKernels(Isa nIsa, uint32_t nChannels)
+    {
+        ScaleKernels kernels;
+        kernels.fnBilinearRow = (nChannels == 4) ? BilinearRow_Scalar<4> : BilinearRow_Scalar<1>;
+        kernels.fnAreaRow = (nChannels == 4) ? AreaRow_Scalar<4> : AreaRow_Scalar<1>;
+        kernels.fnAverageRows = AverageRows_Scalar;
+        kernels.fnBoxRows = BoxRows_Scalar;
+
+        // Gray area rows are sums of a few bytes each, they stay scalar. AVX2 has no wider
+        // load for the runs of pixels of the area rows and for gray bilinear rows, they use SSE2
+    #ifdef WCC_X86
+        if (nIsa == Isa::Sse2 || nIsa == Isa::Avx2)
+        {
+            kernels.fnBilinearRow = (nChannels == 4) ? BilinearRow4_Sse2 : BilinearRow1_Sse2;
+            kernels.fnAverageRows = AverageRows_Sse2;
+            kernels.fnBoxRows = BoxRows_Sse2;
+
+            if (nChannels == 4)
+                kernels.fnAreaRow = AreaRow4_Sse2;
+        }
+
+        if (nIsa == Isa::Avx2)
+        {
+            if (nChannels == 4)
+                kernels.fnBilinearRow = BilinearRow4_Avx2;
+
+            kernels.fnAverageRows = AverageRows_Avx2;
+            kernels.fnBoxRows = BoxRows_Avx2;
+        }
+    #endif
+
+    #ifdef WCC_NEON
+        if (nIsa == Isa::Neon)
+        {
+            kernels.fnBilinearRow = (nChannels == 4) ? BilinearRow4_Neon : BilinearRow1_Neon;
+            kernels.fnAverageRows = AverageRows_Neon;
+            kernels.fnBoxRows = BoxRows_Neon;
+
+            if (nChannels == 4)
+                kernels.fnAreaRow = AreaRow4_Neon;
+        }
+    #endif
+
+        (void)nIsa;
+        return kernels;
+    }
+
+    bool Scaler::Configure(uint32_t nSrcWidth, uint32_t nSrcHeight, uint32_t nDstWidth, uint32_t nDstHeight, ScaleMode nMode, uint32_t nChannels, Isa nIsa)
+    {
+        if (nSrcWidth == 0 || nSrcHeight == 0 || nDstWidth == 0 || nDstHeight == 0)
+            return false;
+
+        if (nChannels != 1 && nChannels != 4)
+            return false;
+
+        m_nMode = nMode;
+        m_nChannels = nChannels;
+        m_nSrcWidth = nSrcWidth;
+        m_nSrcHeight = nSrcHeight;
+        m_nDstWidth = nDstWidth;
+        m_nDstHeight = nDstHeight;
+
+        // Builds the table of one direction
+        auto build = [nMode](uint32_t nSrc, uint32_t nDst, std::vector<uint32_t>& vec0, std::vector<uint32_t>* pVec1, std::vector<uint32_t>& vecCount, std::vector<uint32_t>& vecWeight)
+            {
+                vec0.resize(nDst);
+                vecCount.resize(nDst);
+                vecWeight.resize(nDst);
+
+                if (pVec1)
+                    pVec1->resize(nDst);
+
+                for (uint32_t i = 0; i < nDst; i++)
+                {
+                    uint32_t i0 = (uint64_t)i * nSrc / nDst;
+                    uint32_t nCount = 1, nWeight = 0;
+
+                    if (nMode == ScaleMode::Bilinear)
+                    {
+                        // Centers of the pixels are aligned, the position has 8 fractional bits
+                        int64_t nPos = (int64_t)(2 * i + 1) * nSrc * 128 / nDst - 128;
+
+                        if (nPos < 0)
+                            nPos = 0;
+
+                        i0 = (uint32_t)(nPos >> 8);
+                        nWeight = (uint32_t)(nPos & 255);
+
+                        if (i0 >= nSrc - 1)
+                        {
+                            i0 = nSrc - 1;
+                            nWeight = 0;
+                        }
+
+                        nCount = 2;
+                    }
+                    else if (nMode == ScaleMode::Area)
+                    {
+                        uint32_t i1 = (uint64_t)(i + 1) * nSrc / nDst;
+                        nCount = (i1 > i0) ? i1 - i0 : 1;
+                        nWeight = 65536 / nCount;
+                    }
+
+                    vec0[i] = i0;
+                    vecCount[i] = nCount;
+                    vecWeight[i] = nWeight;
+
+                    if (pVec1)
+                        (*pVec1)[i] = (i0 + 1 < nSrc) ? i0 + 1 : i0;
+                }
+            };
+
+        build(nSrcWidth, nDstWidth, m_vecX0, &m_vecX1, m_vecXCount, m_vecXWeight);
+        build(nSrcHeight, nDstHeight, m_vecY0, nullptr, m_vecYCount, m_vecYWeight);
+
+        m_nMaxRowCount = 1;
+
+        for (uint32_t y = 0; y < nDstHeight; y++)
+        {
+            // The second row of the last bilinear rows is clamped
+            if (m_vecY0[y] + m_vecYCount[y] > nSrcHeight)
+                m_vecYCount[y] = nSrcHeight - m_vecY0[y];
+
+            if (m_vecYCount[y] > m_nMaxRowCount)
+                m_nMaxRowCount = m_vecYCount[y];
+        }
+
+        m_nIntegerFactor = 0;
+
+        if (nMode == ScaleMode::Area)
+        {
+            for (uint32_t nFactor : { 2u, 4u })
+            {
+                if (nSrcWidth == nDstWidth * nFactor && nSrcHeight == nDstHeight * nFactor)
+                    m_nIntegerFactor = nFactor;
+            }
+        }
+
+        m_Kernels = internal::GetScaleKernels(nIsa, nChannels);
+
+        // Huge downscales overflow the 16-bit sums of the SIMD kernels
+        uint32_t nMaxColumnCount = 1;
+
+        for (uint32_t nCount : m_vecXCount)
+        {
+            if (nCount > nMaxColumnCount)
+                nMaxColumnCount = nCount;
+        }
+
+        if (nMaxColumnCount > internal::c_nMaxSimdSum)
+            m_Kernels.fnAreaRow = (nChannels == 4) ? internal::AreaRow_Scalar<4> : internal::AreaRow_Scalar<1>;
+
+        if (m_nMaxRowCount > internal::c_nMaxSimdSum)
+            m_Kernels.fnAverageRows = internal::AverageRows_Scalar;
+
+        return true;
+    }
+
+    ScaleMode Scaler::GetMode() const { return m_nMode; }
+    uint32_t Scaler::GetChannels() const { return m_nChannels; }
+
+    uint32_t Scaler::GetFirstRow(uint32_t y) const { return m_vecY0[y]; }
+    uint32_t Scaler::GetRowCount(uint32_t y) const { return m_vecYCount[y]; }
+    uint32_t Scaler::GetMaxRowCount() const { return m_nMaxRowCount; }
+
+    const uint32_t* Scaler::GetColumns() const { return m_vecX0.data(); }
+
+    uint32_t Scaler::GetIntegerFactor() const { return m_nIntegerFactor; }
+
+    void Scaler::ScaleRow(const uint8_t* pSrc, uint8_t* pDst) const
+    {
+        const uint32_t n = m_nChannels;
+
+        switch (m_nMode)
+        {
+        case ScaleMode::Nearest:
+        {
+            if (n == 1)
+            {
+                for (uint32_t x = 0; x < m_nDstWidth; x++)
+                    pDst[x] = pSrc[m_vecX0[x]];
+
+                break;
+            }
+
+            const uint32_t* pSrcPixels = (const uint32_t*)pSrc;
+            uint32_t* pDstPixels = (uint32_t*)pDst;
+
+            for (uint32_t x = 0; x < m_nDstWidth; x++)
+                pDstPixels[x] = pSrcPixels[m_vecX0[x]];
+        }
+        break;
+
+        case ScaleMode::Bilinear:
+            m_Kernels.fnBilinearRow(pSrc, m_vecX0.data(), m_vecX1.data(), m_vecXWeight.data(), pDst, m_nDstWidth);
+        break;
+
+        case ScaleMode::Area:
+            m_Kernels.fnAreaRow(pSrc, m_vecX0.data(), m_vecXCount.data(), m_vecXWeight.data(), pDst, m_nDstWidth);
+        break;
+
+        }
+    }
+
+    void Scaler::BlendRows(uint32_t y, const uint8_t* const* ppRows, uint8_t* pDst) const
+    {
+        size_t nBytes = (size_t)m_nDstWidth * m_nChannels;
+
+        if (m_vecYCount[y] == 1)
+            memcpy(pDst, ppRows[0], nBytes);
+        else if (m_nMode == ScaleMode::Bilinear)
+            internal::LerpRows(ppRows[0], ppRows[1], m_vecYWeight[y], pDst, nBytes);
+        else
+            m_Kernels.fnAverageRows(ppRows, m_vecYCount[y], m_vecYWeight[y], pDst, nBytes);
+    }
+
+    void Scaler::BoxRows(const uint8_t* const* ppRows, uint8_t* pDst) const
+    {
+        m_Kernels.fnBoxRows(ppRows, m_nIntegerFactor, m_nChannels, pDst, m_nDstWidth);
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        Stop();
+    }
+
+    void WorkerPool::Start(uint32_t nThreads)
+    {
+        Stop();
+
+        m_bQuit = false;
+
+        for (uint32_t i = 1; i < nThreads; i++)
+            m_vecThreads.emplace_back(&WorkerPool::WorkerMain, this, m_nJob);
+    }
+
+    void WorkerPool::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bQuit = true;
+        }
+
+        m_cvStart.notify_all();
+
+        for (std::thread& thread : m_vecThreads)
+            thread.join();
+
+        m_vecThreads.clear();
+    }
+
+    uint32_t WorkerPool::GetThreadCount() const
+    {
+        return (uint32_t)m_vecThreads.size() + 1;
+    }
+
+    void WorkerPool::Run(uint32_t nTasks, Task fnTask, void* pContext)
+    {
+        if (m_vecThreads.empty() || nTasks == 1)
+        {
+            for (uint32_t i = 0; i < nTasks; i++)
+                fnTask(pContext, i);
+
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            m_fnTask = fnTask;
+            m_pContext = pContext;
+            m_nTasks = nTasks;
+            m_nNextTask = 0;
+
+            // Every worker wakes up for the job, so the job can't be replaced
+            // while one of them is still looking at it
+            m_nBusy = (uint32_t)m_vecThreads.size();
+            m_nJob++;
+        }
+
+        m_cvStart.notify_all();
+
+        RunTasks();
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_cvDone.wait(lock, [this] { return m_nBusy == 0; });
+    }
+
+    void WorkerPool::WorkerMain(uint64_t nLastJob)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+
+        while (true)
+        {
+            m_cvStart.wait(lock, [&] { return m_bQuit || m_nJob != nLastJob; });
+
+            if (m_bQuit)
+                break;
+
+            nLastJob = m_nJob;
+
+            lock.unlock();
+            RunTasks();
+            lock.lock();
+
+            if (--m_nBusy == 0)
+                m_cvDone.notify_one();
+        }
+    }
+
+    void WorkerPool::RunTasks()
+    {
+        uint32_t nTask;
+
+        while ((nTask = m_nNextTask.fetch_add(1)) < m_nTasks)
+            m_fnTask(m_pContext, nTask);
+    }
+
+#ifdef WCCAPI_USE_LIBJPEG
+
+    internal::JpegDecoder::JpegDecoder()
+    {
+        m_Info.err = jpeg_std_error(&m_Error.base);
+        m_Error.base.error_exit = &JpegDecoder::OnError;
+
+        jpeg_create_decompress(&m_Info);
+    }
+
+    internal::JpegDecoder::~JpegDecoder()
+    {
+        jpeg_destroy_decompress(&m_Info);
+    }
+
+    void internal::JpegDecoder::OnError(j_common_ptr pInfo)
+    {
+        ErrorManager* pError = (ErrorManager*)pInfo->err;
+        longjmp(pError->jump, 1);
+    }
+
+    bool internal::JpegDecoder::ReadHeader(const uint8_t* pData, size_t nSize, uint32_t& nWidth, uint32_t& nHeight)
+    {
+        if (m_bHeader)
+        {
+            jpeg_abort_decompress(&m_Info);
+            m_bHeader = false;
+        }
+
+        if (!pData || nSize == 0)
+            return false;
+
+        if (setjmp(m_Error.jump))
+        {
+            jpeg_abort_decompress(&m_Info);
+            return false;
+        }
+
+        // Frames of many webcams have no Huffman tables, libjpeg-turbo uses the standard ones then
+        jpeg_mem_src(&m_Info, (unsigned char*)pData, (unsigned long)nSize);
+
+        if (jpeg_read_header(&m_Info, TRUE) != JPEG_HEADER_OK)
+        {
+            jpeg_abort_decompress(&m_Info);
+            return false;
+        }
+
+        nWidth = m_Info.image_width;
+        nHeight = m_Info.image_height;
+
+        // The sampling factors are checked by libjpeg, none of them is 0
+        m_nChromaDivisor = 1;
+
+        if (m_Info.num_components == 3)
+        {
+            int nHorizontal = m_Info.max_h_samp_factor / m_Info.comp_info[1].h_samp_factor;
+            int nVertical = m_Info.max_v_samp_factor / m_Info.comp_info[1].v_samp_factor;
+
+            if (nHorizontal > nVertical)
+                m_nChromaDivisor = (uint32_t)(nHorizontal / nVertical);
+        }
+
+        m_bHeader = true;
+        return true;
+    }
+
+    bool internal::JpegDecoder::Decode(uint32_t nDenominator, VideoFormat nFormat, const Rect& region)
+    {
+        if (!m_bHeader)
+            return false;
+
+        m_bHeader = false;
+
+        if (setjmp(m_Error.jump))
+        {
+            jpeg_abort_decompress(&m_Info);
+            return false;
+        }
+
+        m_Info.scale_num = 1;
+        m_Info.scale_denom = nDenominator;
+
+        // Chroma narrower than luma is interpolated between its samples by default. A scaled frame like that
+        // is only decoded to be averaged again (see FrameProcessor::Configure), repeating the samples keeps
+        // the chroma of every output pixel to itself
+        m_Info.do_fancy_upsampling = (nDenominator == 1 || m_nChromaDivisor == 1) ? TRUE : FALSE;
+
+        switch (nFormat)
+        {
+        case VideoFormat::Gray8: m_Info.out_color_space = JCS_GRAYSCALE; break;
+    #ifdef JCS_EXTENSIONS
+        case VideoFormat::Rgb32: m_Info.out_color_space = JCS_EXT_RGBA; break;
+    #endif
+        case VideoFormat::Rgb24: m_Info.out_color_space = JCS_RGB; break;
+        default: jpeg_abort_decompress(&m_Info); return false;
+        }
+
+        jpeg_start_decompress(&m_Info);
+
+        Rect crop = AlignRegion(nFormat, m_Info.output_width, m_Info.output_height, region);
+        uint32_t nBytes = GetBytesPerPixel(nFormat);
+
+        m_nFormat = nFormat;
+        m_nWidth = crop.nWidth;
+        m_nHeight = crop.nHeight;
+
+        // Skipped columns are not decoded, but the decoder starts at the iMCU before the region
+        JDIMENSION nColumn = crop.nX;
+        JDIMENSION nColumns = crop.nWidth;
+
+    #ifdef LIBJPEG_TURBO_VERSION
+        if (crop.nWidth < m_Info.output_width)
+            jpeg_crop_scanline(&m_Info, &nColumn, &nColumns);
+
+        if (crop.nY > 0)
+            jpeg_skip_scanlines(&m_Info, crop.nY);
+    #else
+        nColumn = 0;
+    #endif
+
+        m_nStride = m_Info.output_width * nBytes;
+        m_nOffset = (size_t)(crop.nX - nColumn) * nBytes;
+
+        if (!m_Pixels.Resize((size_t)m_nStride * m_Info.output_height))
+        {
+            jpeg_abort_decompress(&m_Info);
+            return false;
+        }
+
+        uint32_t nEnd = crop.nY + crop.nHeight;
+
+        while (m_Info.output_scanline < nEnd)
+        {
+            JSAMPROW pRows[4];
+            uint32_t nRows = nEnd - m_Info.output_scanline < 4 ? nEnd - m_Info.output_scanline : 4;
+
+            // Rows above the region are only stored without libjpeg-turbo
+            for (uint32_t i = 0; i < nRows; i++)
+                pRows[i] = m_Pixels.GetData() + (size_t)(m_Info.output_scanline + i) * m_nStride;
+
+            jpeg_read_scanlines(&m_Info, pRows, nRows);
+        }
+
+        m_nOffset += (size_t)crop.nY * m_nStride;
+
+        // The rows below the region are not needed
+        if (m_Info.output_scanline < m_Info.output_height)
+            jpeg_abort_decompress(&m_Info);
+        else
+            jpeg_finish_decompress(&m_Info);
+
+        return true;
+    }
+
+    FrameView internal::JpegDecoder::GetView() const
+    {
+        return MakeFrameView(m_nFormat, m_nWidth, m_nHeight, m_Pixels.GetData() + m_nOffset, m_nStride);
+    }
+
+#endif
+
+    int64_t GetMonotonicTime()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    FrameInfo FrameCounter::MakeInfo(uint64_t nSequence, int64_t nTimestamp) const
+    {
+        FrameInfo info;
+
+        info.nSequence = nSequence;
+        info.nDeliveryTime = GetMonotonicTime();
+
+        // A timestamp from the future means the clocks of the device and the host are not related
+        info.nTimestamp = (nTimestamp > 0 && nTimestamp <= info.nDeliveryTime) ? nTimestamp : info.nDeliveryTime;
+        info.nLatency = info.nDeliveryTime - info.nTimestamp;
+
+        return info;
+    }
+
+    FrameInfo FrameCounter::Deliver(uint64_t nSequence, int64_t nTimestamp, uint64_t nSkipped)
+    {
+        FrameInfo info = MakeInfo(nSequence, nTimestamp);
+
+        info.bValid = true;
+        info.nSkipped = m_nSkipped + nSkipped;
+
+        // Some drivers don't count frames at all, the sequence never goes back then.
+        // The skipped frames are in the gap too
+        if (m_bStarted && nSequence > m_nLastSequence)
+        {
+            uint64_t nMissing = nSequence - m_nLastSequence - 1;
+            info.nDropped = (nMissing > info.nSkipped) ? nMissing - info.nSkipped : 0;
+        }
+
+        m_bStarted = true;
+        m_nLastSequence = nSequence;
+        m_nSkipped = 0;
+
+        return info;
+    }
+
+    FrameInfo FrameCounter::Skip(uint64_t nSequence, int64_t nTimestamp)
+    {
+        FrameInfo info = MakeInfo(nSequence, nTimestamp);
+        info.bUnchanged = true;
+
+        m_nSkipped++;
+
+        return info;
+    }
+
+    void ChangeDetector::SetSettings(const Settings& settings)
+    {
+        m_Settings = settings;
+
+        if (m_Settings.nColumns == 0) m_Settings.nColumns = 1;
+        if (m_Settings.nRows == 0) m_Settings.nRows = 1;
+        if (m_Settings.nStep == 0) m_Settings.nStep = 1;
+
+        if (m_Settings.nColumns > 64) m_Settings.nColumns = 64;
+
+        if (m_Settings.nColumns * m_Settings.nRows > 64)
+            m_Settings.nRows = 64 / m_Settings.nColumns;
+
+        m_nFormat = VideoFormat::None;
+        Reset();
+    }
+
+    const ChangeDetector::Settings& ChangeDetector::GetSettings() const { return m_Settings; }
+
+    bool ChangeDetector::IsEnabled() const { return m_Settings.nThreshold > 0; }
+
+    void ChangeDetector::Prepare(const FrameView& view)
+    {
+        m_nFormat = view.nFormat;
+        m_nWidth = view.nWidth;
+        m_nHeight = view.nHeight;
+
+        uint32_t nStep = m_Settings.nStep;
+        uint32_t nColumns = (view.nWidth + nStep - 1) / nStep;
+        uint32_t nRows = (view.nHeight + nStep - 1) / nStep;
+
+        m_vecColumnTiles.resize(nColumns);
+        m_vecRowTiles.resize(nRows);
+
+        for (uint32_t x = 0; x < nColumns; x++)
+            m_vecColumnTiles[x] = (uint8_t)((uint64_t)x * nStep * m_Settings.nColumns / view.nWidth);
+
+        for (uint32_t y = 0; y < nRows; y++)
+            m_vecRowTiles[y] = (uint8_t)((uint64_t)y * nStep * m_Settings.nRows / view.nHeight);
+
+        m_vecTileSamples.assign(m_Settings.nColumns * m_Settings.nRows, 0);
+
+        for (uint32_t y = 0; y < nRows; y++)
+        {
+            for (uint32_t x = 0; x < nColumns; x++)
+                m_vecTileSamples[m_vecRowTiles[y] * m_Settings.nColumns + m_vecColumnTiles[x]]++;
+        }
+
+        m_vecSamples.resize((size_t)nColumns * nRows);
+        m_vecDifferences.assign(m_vecTileSamples.size(), 0);
+        m_bHasReference = false;
+    }
+
+    bool ChangeDetector::Update(const FrameView& view)
+    {
+        m_bChanged = true;
+        m_nChangedTiles = ~0ull;
+
+        if (!IsEnabled() || IsCompressed(view.nFormat) || view.nWidth == 0 || view.nHeight == 0)
+            return true;
+
+        if (view.nFormat != m_nFormat || view.nWidth != m_nWidth || view.nHeight != m_nHeight)
+            Prepare(view);
+
+        uint32_t nStep = m_Settings.nStep;
+        uint32_t nColumns = (uint32_t)m_vecColumnTiles.size();
+        uint32_t nBytes = GetBytesPerPixel(view.nFormat);
+
+        uint8_t* pSample = m_vecSamples.data();
+
+        // YUY2 and NV12 store luma as it is, the other formats are converted pixel by pixel
+        for (uint32_t sy = 0; sy < (uint32_t)m_vecRowTiles.size(); sy++)
+        {
+            const uint8_t* pRow = view.pPlanes[0] + (size_t)sy * nStep * view.nStrides[0];
+            size_t nOffset = 0;
+
+            for (uint32_t sx = 0; sx < nColumns; sx++, nOffset += (size_t)nStep * nBytes)
+            {
+                const uint8_t* pPixel = pRow + nOffset;
+
+                switch (view.nFormat)
+                {
+                case VideoFormat::Rgb32:
+                case VideoFormat::Rgb24: *pSample++ = internal::ComputeLuma(pPixel[0], pPixel[1], pPixel[2]); break;
+                case VideoFormat::Bgra32: *pSample++ = internal::ComputeLuma(pPixel[2], pPixel[1], pPixel[0]); break;
+                default: *pSample++ = pPixel[0]; break;
+                }
+            }
+        }
+
+        if (!m_bHasReference)
+        {
+            m_vecReference = m_vecSamples;
+            m_bHasReference = true;
+            return true;
+        }
+
+        m_vecDifferences.assign(m_vecDifferences.size(), 0);
+
+        const uint8_t* pCurrent = m_vecSamples.data();
+        const uint8_t* pReference = m_vecReference.data();
+
+        for (uint32_t sy = 0; sy < (uint32_t)m_vecRowTiles.size(); sy++)
+        {
+            uint32_t* pTiles = m_vecDifferences.data() + m_vecRowTiles[sy] * m_Settings.nColumns;
+
+            for (uint32_t sx = 0; sx < nColumns; sx++)
+            {
+                int nDifference = (int)*pCurrent++ - (int)*pReference++;
+                pTiles[m_vecColumnTiles[sx]] += (uint32_t)(nDifference < 0 ? -nDifference : nDifference);
+            }
+        }
+
+        m_nChangedTiles = 0;
+        uint32_t nChanged = 0;
+
+        for (uint32_t i = 0; i < (uint32_t)m_vecDifferences.size(); i++)
+        {
+            if (m_vecTileSamples[i] > 0)
+                m_vecDifferences[i] /= m_vecTileSamples[i];
+
+            if (m_vecDifferences[i] > m_Settings.nThreshold)
+            {
+                m_nChangedTiles |= 1ull << i;
+                nChanged++;
+            }
+        }
+
+        // Slow changes add up, the reference stays until the frame is delivered
+        m_bChanged = nChanged >= m_Settings.nMinTiles;
+
+        if (m_bChanged)
+            m_vecReference.swap(m_vecSamples);
+
+        return m_bChanged;
+    }
+
+    void ChangeDetector::Mark(FrameInfo& info) const
+    {
+        info.nChangedTiles = m_nChangedTiles;
+
+        if (!m_bChanged)
+        {
+            info.bUnchanged = true;
+            info.bValid = false;
+        }
+    }
+
+    uint64_t ChangeDetector::GetChangedTiles() const { return m_nChangedTiles; }
+
+    const std::vector<uint32_t>& ChangeDetector::GetTileDifferences() const { return m_vecDifferences; }
+
+    void ChangeDetector::Reset()
+    {
+        m_bHasReference = false;
+        m_bChanged = true;
+        m_nChangedTiles = ~0ull;
+    }
+
+    void FrameCounter::Reset()
+    {
+        m_bStarted = false;
+        m_nLastSequence = 0;
+        m_nSkipped = 0;
+    }
+
+    int64_t internal::AddElapsed(int64_t& nTotal, int64_t nStart)
+    {
+        int64_t nNow = GetMonotonicTime();
+        nTotal += nNow - nStart;
+        return nNow;
+    }
+
+    int64_t HistogramSnapshot::GetMean() const
+    {
+        return nCount > 0 ? nTotal / (int64_t)nCount : 0;
+    }
+
+    int64_t HistogramSnapshot::GetPercentile(double fPercentile) const
+    {
+        uint64_t nRank = (uint64_t)((double)nCount * fPercentile / 100.0);
+        uint64_t nSeen = 0;
+
+        for (uint32_t i = 0; i < c_nBuckets; i++)
+        {
+            nSeen += nBuckets[i];
+
+            if (nSeen > nRank || (nSeen == nCount && nSeen > 0))
+                return (int64_t)1 << (i + 1);
+        }
+
+        return 0;
+    }
+
+    void Histogram::Add(int64_t nDuration)
+    {
+        if (nDuration < 0)
+            nDuration = 0;
+
+        uint32_t nBucket = 0;
+
+        for (uint64_t n = (uint64_t)nDuration >> 1; n > 0 && nBucket < HistogramSnapshot::c_nBuckets - 1; n >>= 1)
+            nBucket++;
+
+        m_nBuckets[nBucket].fetch_add(1, std::memory_order_relaxed);
+        m_nTotal.fetch_add(nDuration, std::memory_order_relaxed);
+
+        int64_t nMax = m_nMax.load(std::memory_order_relaxed);
+
+        while (nDuration > nMax && !m_nMax.compare_exchange_weak(nMax, nDuration, std::memory_order_relaxed))
+            ;
+    }
+
+    HistogramSnapshot Histogram::GetSnapshot() const
+    {
+        HistogramSnapshot snapshot;
+
+        for (uint32_t i = 0; i < HistogramSnapshot::c_nBuckets; i++)
+        {
+            snapshot.nBuckets[i] = m_nBuckets[i].load(std::memory_order_relaxed);
+            snapshot.nCount += snapshot.nBuckets[i];
+        }
+
+        snapshot.nTotal = m_nTotal.load(std::memory_order_relaxed);
+        snapshot.nMax = m_nMax.load(std::memory_order_relaxed);
+
+        return snapshot;
+    }
+
+    void Histogram::Reset()
+    {
+        for (std::atomic<uint64_t>& nBucket : m_nBuckets)
+            nBucket.store(0, std::memory_order_relaxed);
+
+        m_nTotal.store(0, std::memory_order_relaxed);
+        m_nMax.store(0, std::memory_order_relaxed);
+    }
+
+    PipelineStats::PipelineStats()
+    {
+        Reset();
+    }
+
+    void PipelineStats::AddTime(Stage nStage, int64_t nDuration)
+    {
+        m_Stages[(uint32_t)nStage].Add(nDuration);
+    }
+
+    void PipelineStats::AddTimeSince(Stage nStage, int64_t nStart)
+    {
+        m_Stages[(uint32_t)nStage].Add(GetMonotonicTime() - nStart);
+    }
+
+    void PipelineStats::AddFrame(const FrameInfo& info)
+    {
+        m_nFrames.fetch_add(1, std::memory_order_relaxed);
+        m_nDropped.fetch_add(info.nDropped, std::memory_order_relaxed);
+        m_nSkipped.fetch_add(info.nSkipped, std::memory_order_relaxed);
+    }
+
+    void PipelineStats::AddBytes(size_t nBytes)
+    {
+        m_nBytes.fetch_add(nBytes, std::memory_order_relaxed);
+    }
+
+    StatsSnapshot PipelineStats::GetSnapshot() const
+    {
+        StatsSnapshot snapshot;
+
+        for (uint32_t i = 0; i < c_nStageCount; i++)
+            snapshot.Stages[i] = m_Stages[i].GetSnapshot();
+
+        snapshot.nFrames = m_nFrames.load(std::memory_order_relaxed);
+        snapshot.nDropped = m_nDropped.load(std::memory_order_relaxed);
+        snapshot.nSkipped = m_nSkipped.load(std::memory_order_relaxed);
+        snapshot.nBytes = m_nBytes.load(std::memory_order_relaxed);
+        snapshot.nElapsed = GetMonotonicTime() - m_nStartTime.load(std::memory_order_relaxed);
+
+        if (snapshot.nElapsed > 0)
+        {
+            double fSeconds = (double)snapshot.nElapsed / 1e9;
+
+            snapshot.fFramesPerSecond = (double)snapshot.nFrames / fSeconds;
+            snapshot.fBytesPerSecond = (double)snapshot.nBytes / fSeconds;
+        }
+
+        // Skipped frames came from the device too
+        uint64_t nSent = snapshot.nFrames + snapshot.nDropped + snapshot.nSkipped;
+
+        if (nSent > 0)
+            snapshot.fDropRate = (double)snapshot.nDropped / (double)nSent;
+
+        return snapshot;
+    }
+
+    void PipelineStats::Reset()
+    {
+        for (Histogram& histogram : m_Stages)
+            histogram.Reset();
+
+        m_nFrames.store(0, std::memory_order_relaxed);
+        m_nDropped.store(0, std::memory_order_relaxed);
+        m_nSkipped.store(0, std::memory_order_relaxed);
+        m_nBytes.store(0, std::memory_order_relaxed);
+        m_nStartTime.store(GetMonotonicTime(), std::memory_order_relaxed);
+    }
+
+    LeaseLimit::LeaseLimit(uint32_t nMax) : m_nMax(nMax)
+    {
+    }
+
+    void LeaseLimit::SetMax(uint32_t nMax) { m_nMax = nMax; }
+    uint32_t LeaseLimit::GetMax() const { return m_nMax; }
+    uint32_t LeaseLimit::GetOutstanding() const { return m_nOutstanding; }
+
+    bool LeaseLimit::TryAcquire()
+    {
+        uint32_t nOutstanding = m_nOutstanding.load();
+
+        while (nOutstanding < m_nMax.load())
+        {
+            if (m_nOutstanding.compare_exchange_weak(nOutstanding, nOutstanding + 1))
+                return true;
+        }
+
+        return false;
+    }
+
+    void LeaseLimit::Release()
+    {
+        m_nOutstanding.fetch_sub(1);
+    }
+
+    FrameLease::FrameLease(const FrameView& view, const FrameInfo& info, Release fnRelease, void* pOwner, uintptr_t nHandle, LeaseLimit* pLimit)
+        : m_View(view), m_Info(info), m_fnRelease(fnRelease), m_pOwner(pOwner), m_nHandle(nHandle), m_pLimit(pLimit)
+    {
+    }
+
+    FrameLease::~FrameLease()
+    {
+        Reset();
+    }
+
+    FrameLease::FrameLease(FrameLease&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    FrameLease& FrameLease::operator=(FrameLease&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Reset();
+
+            m_View = other.m_View;
+            m_Info = other.m_Info;
+            m_fnRelease = other.m_fnRelease;
+            m_pOwner = other.m_pOwner;
+            m_nHandle = other.m_nHandle;
+            m_pLimit = other.m_pLimit;
+
+            other.m_fnRelease = nullptr;
+            other.m_pLimit = nullptr;
+            other.m_View = FrameView{};
+            other.m_Info = FrameInfo{};
+        }
+
+        return *this;
+    }
+
+    void FrameLease::Reset()
+    {
+        if (m_fnRelease)
+            m_fnRelease(m_pOwner, m_nHandle);
+
+        if (m_pLimit)
+            m_pLimit->Release();
+
+        m_fnRelease = nullptr;
+        m_pLimit = nullptr;
+        m_View = FrameView{};
+        m_Info = FrameInfo{};
+    }
+
+    FrameLease::operator bool() const { return m_View.pPlanes[0] != nullptr; }
+
+    const FrameView& FrameLease::GetView() const { return m_View; }
+    const FrameInfo& FrameLease::GetInfo() const { return m_Info; }
+
+    VideoFormat FrameLease::GetFormat() const { return m_View.nFormat; }
+    uint32_t FrameLease::GetWidth() const { return m_View.nWidth; }
+    uint32_t FrameLease::GetHeight() const { return m_View.nHeight; }
+
+    const uint8_t* FrameLease::GetData(uint32_t nPlane) const { return m_View.pPlanes[nPlane]; }
+    uint32_t FrameLease::GetStride(uint32_t nPlane) const { return m_View.nStrides[nPlane]; }
+
+    bool FrameExchange::Resize(size_t nFrameSize)
+    {
+        bool bResult = true;
+
+        for (FrameBuffer& slot : m_Slots)
+            bResult = slot.Assign(nFrameSize) && bResult;
+
+        m_nFrameSize = bResult ? nFrameSize : 0;
+
+        for (FrameInfo& info : m_Infos)
+            info = FrameInfo{};
+
+        m_nBack = 0;
+        m_nFront = 1;
+        m_nMiddle.store(2);
+
+        return bResult;
+    }
+
+    size_t FrameExchange::GetFrameSize() const { return m_nFrameSize; }
+
+    uint8_t* FrameExchange::GetBackBuffer()
+    {
+        return m_Slots[m_nBack].GetData();
+    }
+
+    void FrameExchange::Publish(const FrameInfo& info)
+    {
+        m_Infos[m_nBack] = info;
+
+        // The written slot becomes the middle one and the producer gets the old middle slot,
+        // which is either stale or was never taken by the consumer
+        m_nBack = m_nMiddle.exchange(m_nBack | c_nFresh, std::memory_order_acq_rel) & ~c_nFresh;
+    }
+
+    const uint8_t* FrameExchange::Acquire(FrameInfo* pInfo)
+    {
+        if (!(m_nMiddle.load(std::memory_order_relaxed) & c_nFresh))
+            return nullptr;
+
+        m_nFront = m_nMiddle.exchange(m_nFront, std::memory_order_acq_rel) & ~c_nFresh;
+
+        if (pInfo)
+            *pInfo = m_Infos[m_nFront];
+
+        return m_Slots[m_nFront].GetData();
+    }
+
+    CaptureGroup::~CaptureGroup()
+    {
+        Stop();
+    }
+
+    uint32_t CaptureGroup::AddStream(CaptureFn fnCapture, size_t nFrameSize)
+    {
+        // The threads and NextFrameSet walk the streams without a lock
+        if (m_bRunning.load())
+            return c_nInvalidStream;
+
+        std::unique_ptr<Stream> pStream(new Stream);
+        pStream->fnCapture = std::move(fnCapture);
+
+        for (uint32_t i = 0; i < c_nSlots; i++)
+        {
+            pStream->slots[i].data.Resize(nFrameSize);
+            pStream->vecFree.push_back(i);
+        }
+
+        m_vecStreams.push_back(std::move(pStream));
+        return (uint32_t)m_vecStreams.size() - 1;
+    }
+
+    void CaptureGroup::SetSkewTolerance(int64_t nTolerance) { m_nTolerance = nTolerance; }
+    int64_t CaptureGroup::GetSkewTolerance() const { return m_nTolerance; }
+
+    void CaptureGroup::Start()
+    {
+        if (m_bRunning.exchange(true))
+            return;
+
+        for (std::unique_ptr<Stream>& pStream : m_vecStreams)
+            pStream->thread = std::thread(&CaptureGroup::CaptureMain, this, std::ref(*pStream));
+    }
+
+    void CaptureGroup::Stop()
+    {
+        if (!m_bRunning.exchange(false))
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(m_WaitMutex);
+            m_cvWait.notify_all();
+        }
+
+        // A capture thread finishes its current DoCapture first
+        for (std::unique_ptr<Stream>& pStream : m_vecStreams)
+        {
+            if (pStream->thread.joinable())
+                pStream->thread.join();
+        }
+    }
+
+    uint32_t CaptureGroup::GetStreamCount() const { return (uint32_t)m_vecStreams.size(); }
+
+    uint64_t CaptureGroup::GetDiscardedCount(uint32_t nStream) const
+    {
+        return m_vecStreams[nStream]->nDiscarded.load(std::memory_order_relaxed);
+    }
+
+    void CaptureGroup::CaptureMain(Stream& stream)
+    {
+        while (m_bRunning.load(std::memory_order_relaxed))
+        {
+            uint32_t nSlot;
+
+            {
+                // There's always a free slot: the history is trimmed on every publish
+                std::lock_guard<std::mutex> lock(stream.mutex);
+                nSlot = stream.vecFree.back();
+                stream.vecFree.pop_back();
+            }
+
+            FrameInfo info = stream.fnCapture(stream.slots[nSlot].data.GetData());
+
+            {
+                std::lock_guard<std::mutex> lock(stream.mutex);
+
+                if (!info)
+                {
+                    stream.vecFree.push_back(nSlot);
+                    continue;
+                }
+
+                stream.slots[nSlot].info = info;
+                stream.vecReady.push_back(nSlot);
+
+                if (stream.vecReady.size() > c_nHistory)
+                {
+                    stream.vecFree.push_back(stream.vecReady.front());
+                    stream.vecReady.erase(stream.vecReady.begin());
+                    stream.nDiscarded.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            m_nVersion.fetch_add(1);
+
+            if (m_bWaiting.load())
+            {
+                std::lock_guard<std::mutex> lock(m_WaitMutex);
+                m_cvWait.notify_one();
+            }
+        }
+    }
+
+    bool CaptureGroup::TryMatch(FrameSet& set)
+    {
+        // The newest frame of the stream that lags behind the most is matched
+        // against the closest frames of all other streams
+        int64_t nTarget = INT64_MAX;
+        uint32_t nReference = 0;
+
+        for (uint32_t i = 0; i < m_vecStreams.size(); i++)
+        {
+            Stream& stream = *m_vecStreams[i];
+
+            if (stream.vecReady.empty())
+                return false;
+
+            int64_t nNewest = stream.slots[stream.vecReady.back()].info.nTimestamp;
+
+            if (nNewest < nTarget)
+            {
+                nTarget = nNewest;
+                nReference = i;
+            }
+        }
+
+        std::vector<uint32_t> vecPicked(m_vecStreams.size());
+        int64_t nMin = INT64_MAX, nMax = INT64_MIN;
+
+        for (uint32_t i = 0; i < m_vecStreams.size(); i++)
+        {
+            Stream& stream = *m_vecStreams[i];
+            int64_t nBestDistance = INT64_MAX;
+
+            for (uint32_t j = 0; j < stream.vecReady.size(); j++)
+            {
+                int64_t nTimestamp = stream.slots[stream.vecReady[j]].info.nTimestamp;
+                int64_t nDistance = nTimestamp > nTarget ? nTimestamp - nTarget : nTarget - nTimestamp;
+
+                if (nDistance < nBestDistance)
+                {
+                    nBestDistance = nDistance;
+                    vecPicked[i] = j;
+                }
+            }
+
+            int64_t nTimestamp = stream.slots[stream.vecReady[vecPicked[i]]].info.nTimestamp;
+            nMin = nTimestamp < nMin ? nTimestamp : nMin;
+            nMax = nTimestamp > nMax ? nTimestamp : nMax;
+        }
+
+        if (nMax - nMin > m_nTolerance)
+        {
+            // Some stream has no frame close to the reference one and never will,
+            // its next frames are newer. Wait for the next frame of the reference stream
+            Stream& stream = *m_vecStreams[nReference];
+
+            for (uint32_t nSlot : stream.vecReady)
+                stream.vecFree.push_back(nSlot);
+
+            stream.nDiscarded.fetch_add(stream.vecReady.size(), std::memory_order_relaxed);
+            stream.vecReady.clear();
+
+            return false;
+        }
+
+        set.vecFrames.resize(m_vecStreams.size());
+        set.nTimestamp = nMin;
+        set.nSkew = nMax - nMin;
+
+        for (uint32_t i = 0; i < m_vecStreams.size(); i++)
+        {
+            Stream& stream = *m_vecStreams[i];
+
+            // Older frames can't get into any of the next sets
+            for (uint32_t j = 0; j < vecPicked[i]; j++)
+                stream.vecFree.push_back(stream.vecReady[j]);
+
+            stream.nDiscarded.fetch_add(vecPicked[i], std::memory_order_relaxed);
+
+            stream.nHeld = stream.vecReady[vecPicked[i]];
+            stream.vecReady.erase(stream.vecReady.begin(), stream.vecReady.begin() + vecPicked[i] + 1);
+
+            set.vecFrames[i].pData = stream.slots[stream.nHeld].data.GetData();
+            set.vecFrames[i].info = stream.slots[stream.nHeld].info;
+        }
+
+        return true;
+    }
+
+    bool CaptureGroup::NextFrameSet(FrameSet& set, int64_t nTimeout)
+    {
+        if (m_vecStreams.empty())
+            return false;
+
+        int64_t nDeadline = GetMonotonicTime() + nTimeout;
+
+        // The frames of the previous set go back to their streams
+        for (std::unique_ptr<Stream>& pStream : m_vecStreams)
+        {
+            std::lock_guard<std::mutex> lock(pStream->mutex);
+
+            if (pStream->nHeld != (uint32_t)-1)
+            {
+                pStream->vecFree.push_back(pStream->nHeld);
+                pStream->nHeld = -1;
+            }
+        }
+
+        while (m_bRunning.load())
+        {
+            uint64_t nVersion = m_nVersion.load();
+
+            {
+                // Streams are locked in order only for the time of matching,
+                // a capture thread waits for it at most once per frame
+                std::vector<std::unique_lock<std::mutex>> vecLocks;
+                vecLocks.reserve(m_vecStreams.size());
+
+                for (std::unique_ptr<Stream>& pStream : m_vecStreams)
+                    vecLocks.emplace_back(pStream->mutex);
+
+                if (TryMatch(set))
+                    return true;
+            }
+
+            int64_t nNow = GetMonotonicTime();
+
+            if (nNow >= nDeadline)
+                return false;
+
+            m_bWaiting.store(true);
+
+            {
+                std::unique_lock<std::mutex> lock(m_WaitMutex);
+
+                m_cvWait.wait_for(lock, std::chrono::nanoseconds(nDeadline - nNow), [&]()
+                    {
+                        return m_nVersion.load() != nVersion || !m_bRunning.load();
+                    });
+            }
+
+            m_bWaiting.store(false);
+        }
+
+        return false;
+    }
+
+    bool FrameProcessor::Configure(VideoFormat nFormat, uint32_t nSrcWidth, uint32_t nSrcHeight, uint32_t nDstWidth, uint32_t nDstHeight)
+    {
+        m_nFormat = nFormat;
+        m_nSrcWidth = nSrcWidth;
+        m_nSrcHeight = nSrcHeight;
+        m_nDstWidth = nDstWidth;
+        m_nDstHeight = nDstHeight;
+
+        m_fnConvert = nullptr;
+        m_fnConvertNv12 = nullptr;
+        m_bReady = false;
+
+        m_Crop = AlignRegion(nFormat, nSrcWidth, nSrcHeight, m_Region);
+        m_nJpegDenominator = 1;
+
+        // Nothing to convert, the rows are only copied.
+        // Compressed frames have no rows, take them with a FrameLease instead
+        if (m_nOutputFormat == OutputFormat::Native)
+        {
+            m_bReady = GetBytesPerPixel(nFormat) != 0;
+            return m_bReady;
+        }
+
+        m_nChannels = (m_nOutputFormat == OutputFormat::Luma) ? 1 : 4;
+        m_nDstRowSize = (size_t)nDstWidth * m_nChannels;
+
+        m_nWorkFormat = nFormat;
+        m_nWorkWidth = m_Crop.nWidth;
+        m_nWorkHeight = m_Crop.nHeight;
+
+        if (nFormat == VideoFormat::Mjpeg)
+        {
+        #ifdef WCCAPI_USE_LIBJPEG
+            // The largest DCT scaling that still gives at least the output size. Chroma that stays narrower
+            // than luma must still have a whole column for every output column, 4:2:2 frames are decoded
+            // at most at 1/4 of their size for a 1/8 output
+            uint32_t nChroma = (m_nOutputFormat == OutputFormat::Luma) ? 1 : m_nJpegChromaDivisor;
+
+            for (uint32_t nDenominator : { 8u, 4u, 2u })
+            {
+                uint32_t nColumns = (nChroma == 1) ? (m_Crop.nWidth + nDenominator - 1) / nDenominator : m_Crop.nWidth / (nDenominator * nChroma);
+
+                if (nColumns >= nDstWidth && (m_Crop.nHeight + nDenominator - 1) / nDenominator >= nDstHeight)
+                {
+                    m_nJpegDenominator = nDenominator;
+                    break;
+                }
+            }
+
+            // The region in the decoded frame, which is divided rounding up
+            uint32_t d = m_nJpegDenominator;
+            uint32_t x1 = (m_Crop.nX + m_Crop.nWidth + d - 1) / d;
+            uint32_t y1 = (m_Crop.nY + m_Crop.nHeight + d - 1) / d;
+
+            m_Crop = { m_Crop.nX / d, m_Crop.nY / d, x1 - m_Crop.nX / d, y1 - m_Crop.nY / d };
+
+            m_nWorkWidth = m_Crop.nWidth;
+            m_nWorkHeight = m_Crop.nHeight;
+
+            // Chroma is not decoded at all for the luma output
+            if (m_nOutputFormat == OutputFormat::Luma)
+                m_nWorkFormat = VideoFormat::Gray8;
+            else
+            {
+            #ifdef JCS_EXTENSIONS
+                m_nWorkFormat = VideoFormat::Rgb32;
+            #else
+                m_nWorkFormat = VideoFormat::Rgb24;
+            #endif
+            }
+        #else
+            return false;
+        #endif
+        }
+
+        if (m_nOutputFormat == OutputFormat::Luma)
+            m_fnConvert = GetLumaConverter(m_nWorkFormat);
+        else if (m_nWorkFormat == VideoFormat::Nv12)
+            m_fnConvertNv12 = GetNv12Converter(GetBestIsa(), m_ColorSpace);
+        else
+            m_fnConvert = GetRowConverter(m_nWorkFormat, GetBestIsa(), m_ColorSpace);
+
+        m_pYuvTable = &internal::GetYuvTable(internal::GetYuvSpace(m_ColorSpace));
+
+        if (!m_fnConvert && !m_fnConvertNv12)
+            return false;
+
+        if (!m_Scaler.Configure(m_nWorkWidth, m_nWorkHeight, nDstWidth, nDstHeight, m_nScaleMode, m_nChannels))
+            return false;
+
+        // The default normalization if SetTensorFormat wasn't called
+        if (m_nOutputFormat == OutputFormat::Tensor && m_vecTensorLut.empty())
+            SetTensorFormat(m_Tensor);
+
+        m_bGather = (m_nOutputFormat == OutputFormat::Rgba || m_nOutputFormat == OutputFormat::Tensor) && m_nScaleMode == ScaleMode::Nearest && nDstWidth * 4 <= m_nWorkWidth;
+
+        m_vecScratch.resize(m_Pool.GetThreadCount());
+
+        for (Scratch& scratch : m_vecScratch)
+            ResizeScratch(scratch);
+
+        m_bReady = true;
+        return true;
+    }
+
+    void FrameProcessor::ResizeScratch(Scratch& scratch) const
+    {
+        uint32_t nSlots = m_Scaler.GetMaxRowCount();
+        uint32_t nRows = m_Scaler.GetIntegerFactor() > 2 ? m_Scaler.GetIntegerFactor() : 2;
+
+        scratch.vecRows.resize((size_t)m_nWorkWidth * m_nChannels * nRows);
+        scratch.vecSlots.resize(m_nDstRowSize * nSlots);
+        scratch.vecSlotRows.resize(nSlots);
+        scratch.vecRowPtrs.resize(nSlots > nRows ? nSlots : nRows);
+        scratch.vecTensorRow.resize(m_nOutputFormat == OutputFormat::Tensor ? m_nDstRowSize * 2 : 0);
+    }
+
+    void FrameProcessor::ConvertRow(const FrameView& src, uint32_t sy, uint8_t* pDst) const
+    {
+        const uint8_t* pRow = src.pPlanes[0] + (size_t)sy * src.nStrides[0];
+
+        if (m_fnConvertNv12)
+            m_fnConvertNv12(pRow, pRow, src.pPlanes[1] + (size_t)(sy / 2) * src.nStrides[1], pDst, pDst, src.nWidth);
+        else
+            m_fnConvert(pRow, pDst, src.nWidth);
+    }
+
+    void FrameProcessor::ConvertRows(const FrameView& src, uint32_t sy, uint32_t nRows, uint8_t* pDst, size_t nStride) const
+    {
+        for (uint32_t i = 0; i < nRows; )
+        {
+            uint32_t y = sy + i;
+
+            if (m_fnConvertNv12 && y % 2 == 0 && i + 1 < nRows)
+            {
+                const uint8_t* pRow = src.pPlanes[0] + (size_t)y * src.nStrides[0];
+
+                m_fnConvertNv12(pRow, pRow + src.nStrides[0], src.pPlanes[1] + (size_t)(y / 2) * src.nStrides[1],
+                    pDst + i * nStride, pDst + (i + 1) * nStride, src.nWidth);
+                i += 2;
+            }
+            else
+            {
+                ConvertRow(src, y, pDst + i * nStride);
+                i++;
+            }
+        }
+    }
+
+    uint32_t FrameProcessor::GetBandCount() const
+    {
+        // Waking up the workers costs about as much as converting
+        // this many pixels, smaller bands are not worth it
+        const uint64_t c_nMinBandPixels = 256 * 1024;
+
+        uint64_t nPixels = (uint64_t)m_nWorkWidth * m_nWorkHeight;
+
+        // Bilinear and area filters read more than one source row per output row
+        if (m_nScaleMode != ScaleMode::Nearest)
+            nPixels += (uint64_t)m_nDstWidth * m_nDstHeight;
+
+        uint64_t nBands = nPixels / c_nMinBandPixels;
+
+        if (nBands > m_vecScratch.size())
+            nBands = m_vecScratch.size();
+
+        if (nBands > m_nDstHeight)
+            nBands = m_nDstHeight;
+
+        return nBands > 1 ? (uint32_t)nBands : 1;
+    }
+
+    void FrameProcessor::Process(const FrameView& src, void* pOutput)
+    {
+        if (src.nFormat != m_nFormat || src.nWidth != m_nSrcWidth || src.nHeight != m_nSrcHeight)
+        {
+            if (!Configure(src.nFormat, src.nWidth, src.nHeight, m_nDstWidth, m_nDstHeight))
+                return;
+        }
+
+        // The last Configure has failed
+        if (!m_bReady)
+            return;
+
+        uint8_t* pDst = (uint8_t*)pOutput;
+        WCC_STATS(int64_t nStart = GetMonotonicTime();)
+        WCC_STATS(m_Stats.AddBytes(src.nDataSize);)
+
+        // Nothing outside of the region is read
+        FrameView crop = CropFrameView(src, m_Crop);
+
+        if (m_nOutputFormat == OutputFormat::Native)
+        {
+            ProcessNative(crop, pDst);
+            WCC_STATS(m_Stats.AddTimeSince(Stage::Copy, nStart);)
+            return;
+        }
+
+        const FrameView* pWork = &crop;
+
+    #ifdef WCCAPI_USE_LIBJPEG
+        FrameView decoded;
+
+        if (m_nFormat == VideoFormat::Mjpeg)
+        {
+            uint32_t nWidth, nHeight;
+
+            if (!m_Decoder.ReadHeader(src.pPlanes[0], src.nDataSize, nWidth, nHeight))
+                return;
+
+            // The stream may disagree with the negotiated size, the chroma subsampling is only known now
+            if (nWidth != m_nSrcWidth || nHeight != m_nSrcHeight || m_Decoder.GetChromaDivisor() != m_nJpegChromaDivisor)
+            {
+                m_nJpegChromaDivisor = m_Decoder.GetChromaDivisor();
+
+                if (!Configure(m_nFormat, nWidth, nHeight, m_nDstWidth, m_nDstHeight))
+                    return;
+            }
+
+            if (!m_Decoder.Decode(m_nJpegDenominator, m_nWorkFormat, m_Crop))
+                return;
+
+            decoded = m_Decoder.GetView();
+
+            if (decoded.nWidth != m_nWorkWidth || decoded.nHeight != m_nWorkHeight)
+                return;
+
+            pWork = &decoded;
+            WCC_STATS(m_Stats.AddTimeSince(Stage::Decode, nStart);)
+        }
+    #endif
+
+        const FrameView& work = *pWork;
+        uint32_t nBands = GetBandCount();
+
+        m_pTensor = m_nOutputFormat == OutputFormat::Tensor ? pDst : nullptr;
+
+        if (nBands == 1)
+        {
+            ProcessRows(work, pDst, 0, m_nDstHeight, m_vecScratch[0]);
+            WCC_STATS(AddBandTimes(1);)
+            return;
+        }
+
+        // Bands start at a multiple of 64 bytes of the output, so two threads
+        // never write to the same cache line if pDst is aligned
+        uint32_t nAlign = 1;
+
+        while ((nAlign * m_nDstRowSize) % 64 != 0)
+            nAlign *= 2;
+
+        uint32_t nBandRows = (m_nDstHeight + nBands - 1) / nBands;
+        nBandRows = (nBandRows + nAlign - 1) / nAlign * nAlign;
+
+        BandJob job = { this, &work, pDst, nBandRows };
+        m_Pool.Run((m_nDstHeight + nBandRows - 1) / nBandRows, &FrameProcessor::ProcessBand, &job);
+
+        WCC_STATS(AddBandTimes((m_nDstHeight + nBandRows - 1) / nBandRows);)
+    }
+
+#ifdef WCCAPI_ENABLE_STATS
+    void FrameProcessor::AddBandTimes(uint32_t nBands)
+    {
+        // CPU time of all bands, not the wall time of the frame
+        int64_t nConvertTime = 0, nScaleTime = 0;
+
+        for (uint32_t i = 0; i < nBands; i++)
+        {
+            nConvertTime += m_vecScratch[i].nConvertTime;
+            nScaleTime += m_vecScratch[i].nScaleTime;
+        }
+
+        m_Stats.AddTime(Stage::Convert, nConvertTime);
+        m_Stats.AddTime(Stage::Scale, nScaleTime);
+    }
+#endif
+
+    void FrameProcessor::ProcessBand(void* pContext, uint32_t nBand)
+    {
+        const BandJob& job = *(const BandJob*)pContext;
+        const FrameProcessor& fp = *job.pProcessor;
+
+        uint32_t y0 = nBand * job.nBandRows;
+        uint32_t y1 = y0 + job.nBandRows;
+
+        if (y1 > fp.m_nDstHeight)
+            y1 = fp.m_nDstHeight;
+
+        fp.ProcessRows(*job.pSrc, job.pDst + y0 * fp.m_nDstRowSize, y0, y1, job.pProcessor->m_vecScratch[nBand]);
+    }
+
+    void FrameProcessor::ProcessRows(const FrameView& src, uint8_t* pDst, uint32_t y0, uint32_t y1, Scratch& scratch) const
+    {
+        WCC_STATS(scratch.nConvertTime = 0;)
+        WCC_STATS(scratch.nScaleTime = 0;)
+
+        if (m_nScaleMode == ScaleMode::Nearest)
+            ProcessNearest(src, pDst, y0, y1, scratch);
+        else
+            ProcessFiltered(src, pDst, y0, y1, scratch);
+    }
+
+    void FrameProcessor::ProcessNearest(const FrameView& src, uint8_t* pDst, uint32_t y0, uint32_t y1, Scratch& scratch) const
+    {
+        const uint32_t* pColumns = m_Scaler.GetColumns();
+        uint32_t nLastRow = -1;
+
+        WCC_STATS(int64_t nTime = GetMonotonicTime();)
+
+        // Tensor rows go through one RGBA row, which still holds the previous row when upscaling
+        uint8_t* pTensorRow = m_pTensor ? scratch.vecTensorRow.data() : nullptr;
+
+        // Every output row is the next source row, they are converted in pairs
+        if (!m_bGather && m_nWorkHeight == m_nDstHeight)
+        {
+            bool bScale = m_nWorkWidth != m_nDstWidth;
+            size_t nSrcBytes = (size_t)m_nWorkWidth * m_nChannels;
+
+            for (uint32_t y = y0; y < y1; )
+            {
+                // Pairs start at even rows, which share the chroma row of NV12
+                uint32_t nRows = (y % 2 == 0 && y + 1 < y1) ? 2 : 1;
+
+                if (bScale)
+                    ConvertRows(src, y, nRows, scratch.vecRows.data(), nSrcBytes);
+                else
+                    ConvertRows(src, y, nRows, pTensorRow ? pTensorRow : pDst, m_nDstRowSize);
+
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+
+                for (uint32_t i = 0; i < nRows; i++, y++, pDst += m_nDstRowSize)
+                {
+                    uint8_t* pRow = pTensorRow ? pTensorRow + i * m_nDstRowSize : pDst;
+
+                    if (bScale)
+                    {
+                        m_Scaler.ScaleRow(scratch.vecRows.data() + i * nSrcBytes, pRow);
+                        WCC_STATS(nTime = internal::AddElapsed(scratch.nScaleTime, nTime);)
+                    }
+
+                    if (pTensorRow)
+                    {
+                        WriteTensorRow(pRow, y);
+                        WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+                    }
+                }
+            }
+
+            return;
+        }
+
+        for (uint32_t y = y0; y < y1; y++, pDst += m_nDstRowSize)
+        {
+            uint32_t sy = m_Scaler.GetFirstRow(y);
+            uint8_t* pRow = pTensorRow ? pTensorRow : pDst;
+
+            // Upscaling, the row is the same as the previous one
+            if (sy == nLastRow)
+            {
+                if (pTensorRow)
+                    WriteTensorRow(pRow, y);
+                else
+                    memcpy(pDst, pDst - m_nDstRowSize, m_nDstRowSize);
+
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nScaleTime, nTime);)
+                continue;
+            }
+
+            nLastRow = sy;
+
+            if (m_bGather)
+            {
+                // Picking pixels converts and scales at once, it's counted as converting
+                internal::GatherRow(src, sy, pColumns, pRow, m_nDstWidth, *m_pYuvTable);
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+            }
+            else if (m_nWorkWidth == m_nDstWidth)
+            {
+                ConvertRow(src, sy, pRow);
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+            }
+            else
+            {
+                ConvertRow(src, sy, scratch.vecRows.data());
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+
+                m_Scaler.ScaleRow(scratch.vecRows.data(), pRow);
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nScaleTime, nTime);)
+            }
+
+            // Normalizing is counted as converting
+            if (pTensorRow)
+            {
+                WriteTensorRow(pRow, y);
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+            }
+        }
+    }
+
+    void FrameProcessor::ProcessFiltered(const FrameView& src, uint8_t* pDst, uint32_t y0, uint32_t y1, Scratch& scratch) const
+    {
+        size_t nSrcBytes = (size_t)m_nWorkWidth * m_nChannels;
+        size_t nDstBytes = m_nDstRowSize;
+
+        // Tensor rows are blended into one RGBA row first
+        uint8_t* pTensorRow = m_pTensor ? scratch.vecTensorRow.data() : nullptr;
+
+        WCC_STATS(int64_t nTime = GetMonotonicTime();)
+
+        // Every source row is used by one output row only, so there's nothing to cache
+        if (uint32_t nFactor = m_Scaler.GetIntegerFactor())
+        {
+            for (uint32_t y = y0; y < y1; y++, pDst += nDstBytes)
+            {
+                ConvertRows(src, m_Scaler.GetFirstRow(y), nFactor, scratch.vecRows.data(), nSrcBytes);
+
+                for (uint32_t i = 0; i < nFactor; i++)
+                    scratch.vecRowPtrs[i] = scratch.vecRows.data() + i * nSrcBytes;
+
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+
+                m_Scaler.BoxRows(scratch.vecRowPtrs.data(), pTensorRow ? pTensorRow : pDst);
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nScaleTime, nTime);)
+
+                if (pTensorRow)
+                {
+                    WriteTensorRow(pTensorRow, y);
+                    WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+                }
+            }
+
+            return;
+        }
+
+        uint32_t nSlots = (uint32_t)scratch.vecSlotRows.size();
+        scratch.vecSlotRows.assign(nSlots, -1);
+
+        for (uint32_t y = y0; y < y1; y++, pDst += nDstBytes)
+        {
+            uint32_t nFirst = m_Scaler.GetFirstRow(y);
+            uint32_t nCount = m_Scaler.GetRowCount(y);
+
+            for (uint32_t i = 0; i < nCount; i++)
+            {
+                // Neighbouring output rows share source rows when upscaling or with bilinear filtering
+                uint32_t sy = nFirst + i;
+                uint32_t nSlot = sy % nSlots;
+                uint8_t* pSlot = scratch.vecSlots.data() + nSlot * nDstBytes;
+
+                if (scratch.vecSlotRows[nSlot] != sy)
+                {
+                    // The next row is converted along if this output row needs it and it's not cached either
+                    uint32_t nNextSlot = (sy + 1) % nSlots;
+                    uint32_t nRows = (i + 1 < nCount && scratch.vecSlotRows[nNextSlot] != sy + 1) ? 2 : 1;
+
+                    ConvertRows(src, sy, nRows, scratch.vecRows.data(), nSrcBytes);
+                    WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+
+                    m_Scaler.ScaleRow(scratch.vecRows.data(), pSlot);
+                    scratch.vecSlotRows[nSlot] = sy;
+
+                    if (nRows == 2)
+                    {
+                        m_Scaler.ScaleRow(scratch.vecRows.data() + nSrcBytes, scratch.vecSlots.data() + nNextSlot * nDstBytes);
+                        scratch.vecSlotRows[nNextSlot] = sy + 1;
+                    }
+                }
+
+                scratch.vecRowPtrs[i] = pSlot;
+            }
+
+            m_Scaler.BlendRows(y, scratch.vecRowPtrs.data(), pTensorRow ? pTensorRow : pDst);
+            WCC_STATS(nTime = internal::AddElapsed(scratch.nScaleTime, nTime);)
+
+            if (pTensorRow)
+            {
+                WriteTensorRow(pTensorRow, y);
+                WCC_STATS(nTime = internal::AddElapsed(scratch.nConvertTime, nTime);)
+            }
+        }
+    }
+
+    void FrameProcessor::ProcessNative(const FrameView& src, uint8_t* pDst) const
+    {
+        size_t nRowSize = (size_t)src.nWidth * GetBytesPerPixel(m_nFormat);
+
+        for (uint32_t y = 0; y < src.nHeight; y++, pDst += nRowSize)
+            memcpy(pDst, src.pPlanes[0] + (size_t)y * src.nStrides[0], nRowSize);
+
+        if (m_nFormat == VideoFormat::Nv12)
+        {
+            for (uint32_t y = 0; y < (src.nHeight + 1) / 2; y++, pDst += nRowSize)
+                memcpy(pDst, src.pPlanes[1] + (size_t)y * src.nStrides[1], nRowSize);
+        }
+    }
+
+    void FrameProcessor::WriteTensorRow(const uint8_t* pRgba, uint32_t y) const
+    {
+        static const uint8_t c_Rgb[3] = { 0, 1, 2 };
+        static const uint8_t c_Bgr[3] = { 2, 1, 0 };
+
+        const uint8_t* pOrder = m_Tensor.bBgr ? c_Bgr : c_Rgb;
+        size_t nPlane = (size_t)m_nDstWidth * m_nDstHeight;
+
+        // In values, not bytes
+        size_t nOffset = m_Tensor.nLayout == TensorLayout::Nchw ? (size_t)y * m_nDstWidth : (size_t)y * m_nDstWidth * 3;
+        size_t nChannelStep = m_Tensor.nLayout == TensorLayout::Nchw ? nPlane : 1;
+        size_t nPixelStep = m_Tensor.nLayout == TensorLayout::Nchw ? 1 : 3;
+
+        if (m_Tensor.nType == TensorType::Float16)
+            internal::WriteTensorRow(pRgba, pOrder, m_vecTensorLut16.data(), (uint16_t*)m_pTensor + nOffset, nChannelStep, nPixelStep, m_nDstWidth);
+        else
+            internal::WriteTensorRow(pRgba, pOrder, m_vecTensorLut.data(), (float*)m_pTensor + nOffset, nChannelStep, nPixelStep, m_nDstWidth);
+    }
+
+    void FrameProcessor::SetScaleMode(ScaleMode nMode)
+    {
+        if (m_nScaleMode == nMode)
+            return;
+
+        m_nScaleMode = nMode;
+
+        if (m_nFormat != VideoFormat::None)
+            Configure(m_nFormat, m_nSrcWidth, m_nSrcHeight, m_nDstWidth, m_nDstHeight);
+    }
+
+    ScaleMode FrameProcessor::GetScaleMode() const { return m_nScaleMode; }
+
+    void FrameProcessor::SetRegion(const Rect& region)
+    {
+        if (m_Region.nX == region.nX && m_Region.nY == region.nY && m_Region.nWidth == region.nWidth && m_Region.nHeight == region.nHeight)
+            return;
+
+        m_Region = region;
+
+        if (m_nFormat != VideoFormat::None)
+            Configure(m_nFormat, m_nSrcWidth, m_nSrcHeight, m_nDstWidth, m_nDstHeight);
+    }
+
+    Rect FrameProcessor::GetRegion() const
+    {
+        // Compressed frames are cropped after decoding at 1 / m_nJpegDenominator of the size
+        uint32_t d = m_nJpegDenominator;
+        Rect region = { m_Crop.nX * d, m_Crop.nY * d, m_Crop.nWidth * d, m_Crop.nHeight * d };
+
+        if (region.nX + region.nWidth > m_nSrcWidth)
+            region.nWidth = m_nSrcWidth - region.nX;
+
+        if (region.nY + region.nHeight > m_nSrcHeight)
+            region.nHeight = m_nSrcHeight - region.nY;
+
+        return region;
+    }
+
+    void FrameProcessor::SetOutputFormat(OutputFormat nFormat)
+    {
+        if (m_nOutputFormat == nFormat)
+            return;
+
+        m_nOutputFormat = nFormat;
+
+        if (m_nFormat != VideoFormat::None)
+            Configure(m_nFormat, m_nSrcWidth, m_nSrcHeight, m_nDstWidth, m_nDstHeight);
+    }
+
+    OutputFormat FrameProcessor::GetOutputFormat() const { return m_nOutputFormat; }
+
+    void FrameProcessor::SetTensorFormat(const TensorDesc& desc)
+    {
+        m_Tensor = desc;
+
+        m_vecTensorLut.resize(3 * 256);
+        m_vecTensorLut16.resize(3 * 256);
+
+        for (uint32_t c = 0; c < 3; c++)
+        {
+            float fScale = 1.0f / (255.0f * desc.fStd[c]);
+            float fBias = -desc.fMean[c] / desc.fStd[c];
+
+            for (uint32_t v = 0; v < 256; v++)
+            {
+                m_vecTensorLut[c * 256 + v] = v * fScale + fBias;
+                m_vecTensorLut16[c * 256 + v] = internal::FloatToHalf(m_vecTensorLut[c * 256 + v]);
+            }
+        }
+    }
+
+    const TensorDesc& FrameProcessor::GetTensorFormat() const { return m_Tensor; }
+
+    void FrameProcessor::SetColorSpace(const ColorSpace& colorSpace)
+    {
+        if (m_ColorSpace.nMatrix == colorSpace.nMatrix && m_ColorSpace.nRange == colorSpace.nRange)
+            return;
+
+        m_ColorSpace = colorSpace;
+
+        if (m_nFormat != VideoFormat::None)
+            Configure(m_nFormat, m_nSrcWidth, m_nSrcHeight, m_nDstWidth, m_nDstHeight);
+    }
+
+    const ColorSpace& FrameProcessor::GetColorSpace() const { return m_ColorSpace; }
+
+    VideoFormat FrameProcessor::GetOutputVideoFormat() const
+    {
+        switch (m_nOutputFormat)
+        {
+        case OutputFormat::Native: return m_nFormat;
+        case OutputFormat::Luma: return VideoFormat::Gray8;
+        case OutputFormat::Tensor: return VideoFormat::None;
+        default: return VideoFormat::Rgb32;
+        }
+    }
+
+    size_t FrameProcessor::GetOutputSize() const
+    {
+        if (m_nOutputFormat == OutputFormat::Native)
+            return GetFrameSize(m_nFormat, m_Crop.nHeight, GetOutputStride());
+
+        // All three planes of NCHW
+        if (m_nOutputFormat == OutputFormat::Tensor && m_Tensor.nLayout == TensorLayout::Nchw)
+            return (size_t)GetOutputStride() * m_nDstHeight * 3;
+
+        return (size_t)GetOutputStride() * m_nDstHeight;
+    }
+
+    uint32_t FrameProcessor::GetOutputStride() const
+    {
+        if (m_nOutputFormat == OutputFormat::Native)
+            return m_Crop.nWidth * GetBytesPerPixel(m_nFormat);
+
+        // A row of one plane for NCHW
+        if (m_nOutputFormat == OutputFormat::Tensor)
+        {
+            uint32_t nValueSize = m_Tensor.nType == TensorType::Float16 ? 2 : 4;
+            return m_nDstWidth * nValueSize * (m_Tensor.nLayout == TensorLayout::Nhwc ? 3 : 1);
+        }
+
+        return m_nDstWidth * GetBytesPerPixel(GetOutputVideoFormat());
+    }
+
+    void FrameProcessor::SetThreadCount(uint32_t nThreads)
+    {
+        if (nThreads == 0)
+            nThreads = std::thread::hardware_concurrency();
+
+        if (nThreads == 0)
+            nThreads = 1;
+
+        if (nThreads == m_Pool.GetThreadCount())
+            return;
+
+        m_Pool.Start(nThreads);
+        m_vecScratch.resize(nThreads);
+
+        if (m_nFormat != VideoFormat::None)
+        {
+            for (Scratch& scratch : m_vecScratch)
+                ResizeScratch(scratch);
+        }
+    }
+
+    uint32_t FrameProcessor::GetThreadCount() const { return m_Pool.GetThreadCount(); }
+
+    uint32_t FrameProcessor::GetDstWidth() const { return m_nDstWidth; }
+    uint32_t FrameProcessor::GetDstHeight() const { return m_nDstHeight; }
+
+    PipelineStats& FrameProcessor::GetStats() { return m_Stats; }
+    const PipelineStats& FrameProcessor::GetStats() const { return m_Stats; }
+}
+
+#endif
@@ -30,18 +30,37 @@
 
     0.01: Added support for RGB32, RGB24, YUY2 formats on Windows platform
     0.02: Added support for macOS
+    0.04: Moved pixel format conversion into the platform independent core (wccapi.hpp)
+    0.05: Added LeaseFrame to read frames from the media buffers without copying
+    0.06: Added MJPEG (WCCAPI_USE_LIBJPEG)
+    0.07: DoCapture returns FrameInfo built from the sample times
+    0.08: Added GetStats and ResetStats (timings need WCCAPI_ENABLE_STATS)
+    0.09: Added SetRegion to convert only a part of the frame
+    0.10: Added SetChangeDetection to skip frames where nothing has changed
+    0.11: Init ranks every size, pixel format and fps of the device by cost, added GetCaptureMode and GetCaptureModes
+    0.12: Native media types are taken from wcc::GetModeCache if it's open, the reader is asked only on a miss
+    0.13: Added InitAsync that opens the device on a thread of its own
+    0.14: Added SetTensorFormat for wcc::OutputFormat::Tensor
+    0.15: Added SetColorSpace, YUV frames are converted with the matrix and range of the media type
+    0.16: The source reader runs in the async mode, added RequestFrame and NextFrame
 */
 
 #ifndef WWCCAPI_HPP
 #define WWCCAPI_HPP
 
 #ifndef _WIN32
-#error You can't use Windows version of WCCAPI
+#error You cannot use the Windows version of WCCAPI on this platform
 #endif
 
 #include <string>
 #include <list>
 
+#ifdef WWCCAPI_IMPL
+#define WCCAPI_IMPL
+#endif
+
+#include "wccapi.hpp"
+
 #include <Windows.h>
 #include <mfapi.h>
 #include <mfidl.h>
@@ -55,22 +74,48 @@
 
 namespace wwcc
 {
-    enum class VideoFormat
-    {
-        None,
-        Rgb32,
-        Rgb24, // Not needed on macOS
-        Yuy2, // Not needed on macOS
-        Nv12 // Not needed on macOS
-    };
+    using wcc::VideoFormat;
+    using wcc::ScaleMode;
+    using wcc::OutputFormat;
+
+    class Capturer;
 
     namespace internal
     {
-        uint8_t ClampInt32ToUint8(int nValue);
+        // VideoFormat::None if the subtype is unknown, MJPEG needs WCCAPI_USE_LIBJPEG to be converted
+        VideoFormat GetVideoFormat(const GUID& guid);
+
+        // MF_MT_YUV_MATRIX and MF_MT_VIDEO_NOMINAL_RANGE of the type, the fields it doesn't have are Auto
+        wcc::ColorSpace GetColorSpace(IMFMediaType* pType);
+
+        // Passes the samples of a reader in the async mode to its capturer until it's detached.
+        // The reader holds a reference, so the callback can outlive the capturer
+        class ReaderCallback : public IMFSourceReaderCallback
+        {
+        public:
+            explicit ReaderCallback(Capturer* pOwner) : m_pOwner(pOwner) {}
 
-        void ConvertFromRGB32(uint8_t* pSrc, uint8_t* pDst, uint32_t x);
-        void ConvertFromRGB24(uint8_t* pSrc, uint8_t* pDst, uint32_t x);
-        void ConvertFromYUY2(uint8_t* pSrc, uint8_t* pDst, uint32_t x);
+            STDMETHODIMP QueryInterface(REFIID iid, void** ppObject) override;
+            STDMETHODIMP_(ULONG) AddRef() override;
+            STDMETHODIMP_(ULONG) Release() override;
+
+            STDMETHODIMP OnReadSample(HRESULT hStatus, DWORD dwStreamIndex, DWORD dwStreamFlags, LONGLONG llTimestamp, IMFSample* pSample) override;
+            STDMETHODIMP OnFlush(DWORD) override { return S_OK; }
+            STDMETHODIMP OnEvent(DWORD, IMFMediaEvent*) override { return S_OK; }
+
+            // Waits for a sample that is being delivered, the ones after it are dropped
+            void Detach();
+
+        private:
+            virtual ~ReaderCallback() = default;
+
+        private:
+            std::atomic<ULONG> m_nRefs{ 1 };
+
+            std::mutex m_Mutex;
+            Capturer* m_pOwner;
+
+        };
     }
 
     class Capturer
@@ -81,11 +126,39 @@ namespace wwcc
 
         // nDevice is an index of a device from the list of devices from EnumerateDevices method.
         // FPS = (float)nFpsNumerator / (float)nFpsDenominator.
+        // Calling it again closes the current device first, no lease may be alive then
         bool Init(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1);
 
+        // Runs Init on a thread of its own and returns at once, see wcc::InitTask.
+        // Several capturers opened this way activate their devices and read their media types at the same time
+        wcc::InitTask InitAsync(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator = 1);
+
         static std::list<std::wstring> EnumerateDevices();
 
-        void DoCapture();
+        // Reads the next frame (it stops current thread until done), the info is invalid if there was no frame.
+        // Sample times are relative to the start of the stream, so they are anchored to the clock
+        // at the first frame and the latency doesn't include the latency of the first frame
+        wcc::FrameInfo DoCapture();
+
+        // Returns at once and calls fnDone with what DoCapture would have returned once the reader has a sample.
+        // fnDone runs on the thread of Media Foundation that delivered it. False if a request is pending
+        bool RequestFrame(wcc::FrameCallback fnDone, void* pContext);
+
+    #ifdef WCC_COROUTINES
+        // co_await NextFrame() waits like DoCapture without blocking the thread, see wcc::FrameAwaitable
+        wcc::FrameAwaitable<Capturer> NextFrame(const wcc::Executor& executor = wcc::GetFrameLoop().GetExecutor())
+        {
+            return wcc::FrameAwaitable<Capturer>(*this, executor);
+        }
+    #endif
+
+        // Reads the next frame and returns it in the native format without copying, the media buffer
+        // stays locked while the lease is alive, see FrameLease::GetInfo. The lease is empty if there's no frame or GetMaxLeases leases are still alive
+        wcc::FrameLease LeaseFrame();
+
+        // The source reader allocates samples from a small pool, 2 by default
+        void SetMaxLeases(uint32_t nLeases);
+        uint32_t GetMaxLeases() const;
 
         uint32_t GetFrameWidth() const;
         uint32_t GetFrameHeight() const;
@@ -93,127 +166,340 @@ namespace wwcc
         
         VideoFormat GetVideoFormat() const;
 
-        // pBuffer must be at least sizeof(uint32_t) * m_nDesiredWidth * m_nDesiredHeight in size
-        void SetBuffer(uint32_t* pBuffer);
+        // The native media type Init has chosen and all types of the device from the cheapest one, see wcc::RankModes
+        const wcc::CaptureMode& GetCaptureMode() const;
+        const std::vector<wcc::CaptureMode>& GetCaptureModes() const;
+
+        // pBuffer must be at least GetOutputSize() bytes in size,
+        // sizeof(uint32_t) * m_nDesiredWidth * m_nDesiredHeight for RGBA
+        void SetBuffer(void* pBuffer);
+
+        // RGBA by default, see wcc::OutputFormat
+        void SetOutputFormat(OutputFormat nFormat);
+        VideoFormat GetOutputVideoFormat() const;
+
+        // Layout, type and normalization of wcc::OutputFormat::Tensor, see wcc::TensorDesc
+        void SetTensorFormat(const wcc::TensorDesc& desc);
+
+        // The matrix and range of YUV frames, Auto fields take what the media type says (BT.601 limited range if nothing).
+        // GetColorSpace returns the one frames are converted with
+        void SetColorSpace(const wcc::ColorSpace& colorSpace);
+        wcc::ColorSpace GetColorSpace() const;
+
+        size_t GetOutputSize() const;
+        uint32_t GetOutputStride() const;
+
+        // Nearest is used by default
+        void SetScaleMode(ScaleMode nMode);
+
+        // Converts and scales only a part of the frame, in the pixels of the frame (see wcc::FrameProcessor::SetRegion).
+        // An empty region is the whole frame
+        void SetRegion(const wcc::Rect& region);
+        wcc::Rect GetRegion() const;
+
+        // Number of threads converting large frames, 1 by default and 0 means one per CPU core
+        void SetThreadCount(uint32_t nThreads);
+
+        // Skips frames where nothing has changed within the region (see wcc::ChangeDetector), disabled by default.
+        // DoCapture leaves the output buffer as it is and returns an invalid info with bUnchanged set for them,
+        // the next delivered frame counts them in nSkipped
+        void SetChangeDetection(const wcc::ChangeDetector::Settings& settings);
+
+        // Can be called from any thread, all zeros unless WCCAPI_ENABLE_STATS is defined
+        wcc::StatsSnapshot GetStats() const;
+        void ResetStats();
 
     private:
+        // Init without COM, which is initialized by the thread that calls it. It stops between its steps once the task is cancelled
+        bool Open(unsigned long nDevice, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator, const wcc::InitTask& task);
+
         bool CreateDevice(const uint32_t nDevice);
         bool ConfigureImage(const uint32_t nWidth, const uint32_t nHeight);
+
+        // Fails a pending request, releases the reader, its callback and the device
+        void CloseDevice();
+
+        // Lists the native media types of the stream into m_vecModes and the cache, nNativeId is the index of the type
+        void EnumerateModes();
+
+        // Makes the native type of the mode current, false if the reader doesn't have it at that index
+        bool ApplyMode(const wcc::CaptureMode& mode);
+
         bool ConfigureDecoder();
 
+        // Waits for the next sample and returns its buffer or nullptr
+        IMFMediaBuffer* ReadBuffer(LONGLONG& llTimestamp);
+
+        // Asks the reader for a sample unless it's reading one, m_SampleMutex must be locked
+        HRESULT RequestSample();
+
+        // Called by the reader with every sample, stream ticks are read again
+        void OnSample(HRESULT hStatus, DWORD nFlags, LONGLONG llTimestamp, IMFSample* pSample);
+
+        // Runs on the frame loop when RequestFrame found a sample that was read before
+        static void OnSampleReady(void* pContext);
+
+        friend class internal::ReaderCallback;
+
+        // Maps the sample time (100 ns units) onto the monotonic clock.
+        // An unchanged sample is skipped instead, it's not counted as a delivered frame
+        wcc::FrameInfo DeliverSample(LONGLONG llTimestamp, bool bChanged = true);
+
+        static void ReleaseBuffer(void* pOwner, uintptr_t nBuffer);
+
     private:
         IMFSourceReader* m_pReader = nullptr;
         DWORD m_dwStreamIndex = -1;
 
+        // The reader runs in the async mode, one sample is read at a time. ReadBuffer waits for it,
+        // a pending RequestFrame takes it on the thread that delivered it
+        internal::ReaderCallback* m_pCallback = nullptr;
+        wcc::FrameRequest m_Request;
+
+        std::mutex m_SampleMutex;
+        std::condition_variable m_SampleReady;
+        bool m_bReadPending = false;
+        bool m_bSampleReady = false;
+
+        HRESULT m_hSampleStatus = S_OK;
+        DWORD m_nSampleFlags = 0;
+        LONGLONG m_llSampleTime = 0;
+        IMFSample* m_pSample = nullptr;
+
         IMFMediaSource* m_pDevice = nullptr;
         uint32_t m_nDevices = 0;
 
-        uint8_t* m_pFrame = nullptr;
-        uint32_t* m_pOutput = nullptr;
+        // The symbolic link of the device, it has the vendor, the product, the revision and the instance of a USB camera
+        std::string m_sDeviceKey;
+
+        bool m_bComInitialized = false;
+        bool m_bStarted = false;
+
+        // Init is cancelled between its steps
+        wcc::InitTask m_InitTask;
+        std::thread m_InitThread;
+
+        wcc::LeaseLimit m_Leases;
+
+        wcc::FrameCounter m_Counter;
+        uint64_t m_nSamples = 0;
+        bool m_bClockStarted = false;
+        LONGLONG m_llFirstTimestamp = 0;
+        int64_t m_nClockOffset = 0;
+
+        // Converts and scales frames into m_pOutput (or copies them for OutputFormat::Native)
+        wcc::FrameProcessor m_Processor;
+        wcc::ChangeDetector m_Detector;
+        void* m_pOutput = nullptr;
 
         uint32_t m_nDesiredWidth = 0, m_nDesiredHeight = 0;
         uint32_t m_nFrameWidth = 0, m_nFrameHeight = 0;
 
+        // Native types from the cheapest one, m_Mode was chosen
+        std::vector<wcc::CaptureMode> m_vecModes;
+        wcc::CaptureMode m_Mode;
+
         uint32_t m_nFrameSourceStep = 0;
         uint32_t m_nFrameSourceStride = 0;
-        uint32_t m_nFrameStrideRGB32 = 0;
 
         VideoFormat m_nVideoFormat = VideoFormat::None;
 
+        // Asked for by the user and set in the native media type
+        wcc::ColorSpace m_ColorSpace;
+        wcc::ColorSpace m_DeviceColorSpace;
+
         uint32_t m_nFpsNumerator = 0;
         uint32_t m_nFpsDenominator = 0;
 
-        void (*m_fnConvert)(uint8_t*, uint8_t*, uint32_t) = nullptr;
 
     };
 
 #ifdef WWCCAPI_IMPL
 #undef WWCCAPI_IMPL
 
-    uint8_t internal::ClampInt32ToUint8(int nValue)
+    VideoFormat internal::GetVideoFormat(const GUID& guid)
     {
-        if (nValue < 0) return 0;
-        if (nValue > 255) return 255;
-        return nValue;
+        if (guid == MFVideoFormat_RGB32)
+            return VideoFormat::Rgb32;
+
+        if (guid == MFVideoFormat_RGB24)
+            return VideoFormat::Rgb24;
+
+        if (guid == MFVideoFormat_YUY2)
+            return VideoFormat::Yuy2;
+
+        if (guid == MFVideoFormat_NV12)
+            return VideoFormat::Nv12;
+
+        if (guid == MFVideoFormat_MJPG)
+            return VideoFormat::Mjpeg;
+
+        return VideoFormat::None;
     }
 
-    void internal::ConvertFromRGB32(uint8_t* pSrc, uint8_t* pDst, uint32_t x)
+    wcc::ColorSpace internal::GetColorSpace(IMFMediaType* pType)
     {
-        pDst[x] = pSrc[0];
-        pDst[x + 1] = pSrc[1];
-        pDst[x + 2] = pSrc[2];
-        pDst[x + 3] = pSrc[3];
+        wcc::ColorSpace colorSpace;
+        UINT32 nValue = 0;
+
+        if (SUCCEEDED(pType->GetUINT32(MF_MT_YUV_MATRIX, &nValue)))
+        {
+            switch (nValue)
+            {
+            case MFVideoTransferMatrix_BT601: colorSpace.nMatrix = wcc::ColorMatrix::Bt601; break;
+
+            // SMPTE 240M is close enough to BT.709
+            case MFVideoTransferMatrix_BT709:
+            case MFVideoTransferMatrix_SMPTE240M:
+                colorSpace.nMatrix = wcc::ColorMatrix::Bt709;
+            break;
+
+            case MFVideoTransferMatrix_BT2020_10:
+            case MFVideoTransferMatrix_BT2020_12:
+                colorSpace.nMatrix = wcc::ColorMatrix::Bt2020;
+            break;
+
+            default: break;
+            }
+        }
+
+        if (SUCCEEDED(pType->GetUINT32(MF_MT_VIDEO_NOMINAL_RANGE, &nValue)))
+        {
+            if (nValue == MFNominalRange_0_255)
+                colorSpace.nRange = wcc::ColorRange::Full;
+            else if (nValue == MFNominalRange_16_235)
+                colorSpace.nRange = wcc::ColorRange::Limited;
+        }
+
+        return colorSpace;
     }
 
-    void internal::ConvertFromRGB24(uint8_t* pSrc, uint8_t* pDst, uint32_t x)
+    STDMETHODIMP internal::ReaderCallback::QueryInterface(REFIID iid, void** ppObject)
     {
-        pDst[x] = pSrc[0];
-        pDst[x + 1] = pSrc[1];
-        pDst[x + 2] = pSrc[2];
-        pDst[x + 3] = 255;
+        if (!ppObject)
+            return E_POINTER;
+
+        if (iid == IID_IUnknown || iid == __uuidof(IMFSourceReaderCallback))
+        {
+            *ppObject = static_cast<IMFSourceReaderCallback*>(this);
+            AddRef();
+
+            return S_OK;
+        }
+
+        *ppObject = nullptr;
+        return E_NOINTERFACE;
     }
 
-    void internal::ConvertFromYUY2(uint8_t* pSrc, uint8_t* pDst, uint32_t x)
+    STDMETHODIMP_(ULONG) internal::ReaderCallback::AddRef()
     {
-        auto yuv_to_rgb = [](int y, int cb, int cr, uint8_t* pBuffer)
-            {
-                int c = y - 16;
-                int d = cb - 128;
-                int e = cr - 128;
-
-                // |R|   |1.164 0.000  1.596  |   |y-16 |
-                // |G| = |1.164 -0.391 -0.813 | * |u-128|
-                // |B|   |1.164 2.018  0.000  |   |v-128|
-
-                pBuffer[0] = ClampInt32ToUint8((298 * c + 409 * e + 128) >> 8);
-                pBuffer[1] = ClampInt32ToUint8((298 * c - 100 * d - 208 * e + 128) >> 8);
-                pBuffer[2] = ClampInt32ToUint8((298 * c + 516 * d + 128) >> 8);
-                pBuffer[3] = 255;
-            };
-
-        uint8_t y0 = pSrc[0];
-        uint8_t cb = pSrc[1];
-        uint8_t y1 = pSrc[2];
-        uint8_t cr = pSrc[3];
-
-        yuv_to_rgb(y0, cb, cr, pDst + x * 4);
-        yuv_to_rgb(y1, cb, cr, pDst + x * 4 + 4);
+        return ++m_nRefs;
+    }
+
+    STDMETHODIMP_(ULONG) internal::ReaderCallback::Release()
+    {
+        ULONG nRefs = --m_nRefs;
+
+        if (nRefs == 0)
+            delete this;
+
+        return nRefs;
+    }
+
+    STDMETHODIMP internal::ReaderCallback::OnReadSample(HRESULT hStatus, DWORD, DWORD dwStreamFlags, LONGLONG llTimestamp, IMFSample* pSample)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (m_pOwner)
+            m_pOwner->OnSample(hStatus, dwStreamFlags, llTimestamp, pSample);
+
+        return S_OK;
+    }
+
+    void internal::ReaderCallback::Detach()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_pOwner = nullptr;
     }
 
     Capturer::~Capturer()
     {
-        if (!m_pFrame)
-            delete[] m_pFrame;
+        m_InitTask.Cancel();
 
-        if (m_pDevice)
+        if (m_InitThread.joinable())
+            m_InitThread.join();
+
+        CloseDevice();
+
+        if (m_bStarted)
+            MFShutdown();
+
+        if (m_bComInitialized)
+            CoUninitialize();
+    }
+
+    bool Capturer::Init(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    {
+        // Every CoInitialize needs its CoUninitialize, the destructor calls it once
+        if (!m_bComInitialized)
         {
-            m_pDevice->Shutdown();
-            m_pDevice->Release();
+            if (FAILED(CoInitialize(nullptr)))
+                return false;
+
+            m_bComInitialized = true;
         }
 
-        MFShutdown();
-        CoUninitialize();
+        return Open(nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator, {});
     }
 
-    bool Capturer::Init(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    wcc::InitTask Capturer::InitAsync(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator)
+    {
+        // Only the last task counts, Open closes what an earlier one has opened
+        m_InitTask.Cancel();
+
+        if (m_InitThread.joinable())
+            m_InitThread.join();
+
+        wcc::InitTask task = wcc::InitTask::Create();
+        m_InitTask = task;
+
+        m_InitThread = std::thread([this, task, nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator]()
+        {
+            // Media Foundation objects are free threaded, so the thread joins the multithreaded apartment
+            // only while it opens the device. The work queues of Media Foundation keep the apartment alive
+            HRESULT hResult = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+            bool bResult = SUCCEEDED(hResult) && Open(nDeviceID, nWidth, nHeight, nFpsNumerator, nFpsDenominator, task);
+
+            if (SUCCEEDED(hResult))
+                CoUninitialize();
+
+            task.Finish(bResult);
+        });
+
+        return m_InitTask;
+    }
+
+    bool Capturer::Open(unsigned long nDeviceID, uint32_t nWidth, uint32_t nHeight, uint32_t nFpsNumerator, uint32_t nFpsDenominator, const wcc::InitTask& task)
     {
         m_nFpsNumerator = nFpsNumerator;
         m_nFpsDenominator = nFpsDenominator;
 
-        HRESULT hResult = CoInitialize(nullptr);
-
-        if (FAILED(hResult))
-            return false;
+        // Init again opens the device from scratch
+        CloseDevice();
 
-        hResult = MFStartup(MF_VERSION);
+        if (!m_bStarted)
+        {
+            if (FAILED(MFStartup(MF_VERSION)))
+                return false;
 
-        if (FAILED(hResult))
-            return false;
+            m_bStarted = true;
+        }
 
-        if (!CreateDevice(nDeviceID))
+        if (!CreateDevice(nDeviceID) || task.IsCancelled())
             return false;
 
-        if (!ConfigureImage(nWidth, nHeight))
+        if (!ConfigureImage(nWidth, nHeight) || task.IsCancelled())
             return false;
 
         if (!ConfigureDecoder())
@@ -245,6 +531,18 @@ namespace wwcc
         if (FAILED(hResult) || m_nDevices == 0)
             return false;
 
+        WCHAR* sLink = nullptr;
+        m_sDeviceKey.clear();
+
+        if (SUCCEEDED(ppDevices[nDeviceID]->GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_VIDCAP_SYMBOLIC_LINK, &sLink, nullptr)))
+        {
+            // Links are plain ASCII
+            for (WCHAR* p = sLink; *p; p++)
+                m_sDeviceKey += *p < 128 ? (char)*p : '?';
+
+            CoTaskMemFree(sLink);
+        }
+
         hResult = ppDevices[nDeviceID]->ActivateObject(IID_PPV_ARGS(&m_pDevice));
 
         if (SUCCEEDED(hResult))
@@ -260,6 +558,49 @@ namespace wwcc
         return true;
     }
 
+    void Capturer::CloseDevice()
+    {
+        wcc::GetFrameLoop().Cancel(this);
+
+        if (m_Request.Claim())
+            m_Request.Finish({});
+
+        // A sample that is still being read is dropped by the callback
+        if (m_pCallback)
+        {
+            m_pCallback->Detach();
+            m_pCallback->Release();
+            m_pCallback = nullptr;
+        }
+
+        if (m_pSample)
+        {
+            m_pSample->Release();
+            m_pSample = nullptr;
+        }
+
+        m_bReadPending = false;
+        m_bSampleReady = false;
+
+        if (m_pReader)
+        {
+            m_pReader->Release();
+            m_pReader = nullptr;
+        }
+
+        if (m_pDevice)
+        {
+            m_pDevice->Shutdown();
+            m_pDevice->Release();
+            m_pDevice = nullptr;
+        }
+
+        // Sample times of the next stream start at zero again
+        m_Counter.Reset();
+        m_nSamples = 0;
+        m_bClockStarted = false;
+    }
+
     std::list<std::wstring> Capturer::EnumerateDevices()
     {
         IMFAttributes* pConfig = nullptr;
@@ -310,59 +651,127 @@ namespace wwcc
 
     bool Capturer::ConfigureImage(const uint32_t nWidth, const uint32_t nHeight)
     {
-        if (FAILED(MFCreateSourceReaderFromMediaSource(m_pDevice, nullptr, &m_pReader)))
+        IMFAttributes* pAttributes = nullptr;
+
+        // Samples come to the callback, so waiting for them doesn't need a thread of its own
+        m_pCallback = new internal::ReaderCallback(this);
+
+        bool bCreated = SUCCEEDED(MFCreateAttributes(&pAttributes, 1)) &&
+            SUCCEEDED(pAttributes->SetUnknown(MF_SOURCE_READER_ASYNC_CALLBACK, m_pCallback)) &&
+            SUCCEEDED(MFCreateSourceReaderFromMediaSource(m_pDevice, pAttributes, &m_pReader));
+
+        if (pAttributes)
+            pAttributes->Release();
+
+        if (!bCreated)
             return false;
 
         m_nDesiredWidth = nWidth;
         m_nDesiredHeight = nHeight;
 
-        DWORD nIndex = 0;
-        uint32_t nBestError = -1; // std::numeric_limits<uint32_t>::max()
+        // Every native type is ranked, so e.g. NV12 at the smallest sufficient size wins over RGB24 at a huge one
+        wcc::ModeRequest request;
+        request.nWidth = nWidth;
+        request.nHeight = nHeight;
+        request.nFpsNumerator = m_nFpsNumerator;
+        request.nFpsDenominator = m_nFpsDenominator;
+        request.nOutputFormat = m_Processor.GetOutputFormat();
+
+        // Asking the reader for every native type takes a while, so they are cached
+        bool bCached = wcc::GetModeCache().Find(m_sDeviceKey, m_vecModes);
 
+        if (!bCached)
+            EnumerateModes();
+
+        wcc::RankModes(m_vecModes, request);
+
+        bool bApplied = !m_vecModes.empty() && ApplyMode(m_vecModes.front());
+
+        // The device has changed since its types were cached (e.g. a new driver)
+        if (!bApplied && bCached)
+        {
+            wcc::GetModeCache().Remove(m_sDeviceKey);
+
+            EnumerateModes();
+            wcc::RankModes(m_vecModes, request);
+
+            bApplied = !m_vecModes.empty() && ApplyMode(m_vecModes.front());
+        }
+
+        if (!bApplied)
+            return false;
+
+        m_Mode = m_vecModes.front();
+
+        m_nFrameWidth = m_Mode.nWidth;
+        m_nFrameHeight = m_Mode.nHeight;
+
+        // The device surely supports the rate of its own type
+        if (m_Mode.nFpsNumerator != 0)
+        {
+            m_nFpsNumerator = m_Mode.nFpsNumerator;
+            m_nFpsDenominator = m_Mode.nFpsDenominator;
+        }
+
+        return true;
+    }
+
+    bool Capturer::ApplyMode(const wcc::CaptureMode& mode)
+    {
         IMFMediaType* pNativeType = nullptr;
 
-        // TODO: If it's guaranteed that all resolutions are sorted then
-        // we can peek the first one that's greater than the desired one
-        // and exit the loop instantly
+        if (FAILED(m_pReader->GetNativeMediaType(m_dwStreamIndex, mode.nNativeId, &pNativeType)))
+            return false;
+
+        GUID guid;
+        uint32_t nFrameWidth = 0, nFrameHeight = 0;
+
+        // A cached index may point to another type now
+        bool bResult = SUCCEEDED(pNativeType->GetGUID(MF_MT_SUBTYPE, &guid)) && internal::GetVideoFormat(guid) == mode.nFormat &&
+            SUCCEEDED(MFGetAttributeSize(pNativeType, MF_MT_FRAME_SIZE, &nFrameWidth, &nFrameHeight)) &&
+            nFrameWidth == mode.nWidth && nFrameHeight == mode.nHeight;
+
+        // ConfigureDecoder takes the format from the current type
+        if (bResult)
+            bResult = SUCCEEDED(m_pReader->SetCurrentMediaType(m_dwStreamIndex, nullptr, pNativeType));
 
-        while (SUCCEEDED(m_pReader->GetNativeMediaType(m_dwStreamIndex, nIndex, &pNativeType)))
+        pNativeType->Release();
+
+        return bResult;
+    }
+
+    void Capturer::EnumerateModes()
+    {
+        std::vector<wcc::CaptureMode> vecModes;
+
+        IMFMediaType* pNativeType = nullptr;
+
+        for (DWORD nIndex = 0; SUCCEEDED(m_pReader->GetNativeMediaType(m_dwStreamIndex, nIndex, &pNativeType)); nIndex++)
         {
-            uint32_t nFrameWidth, nFrameHeight;
-            MFGetAttributeSize(pNativeType, MF_MT_FRAME_SIZE, &nFrameWidth, &nFrameHeight);
+            wcc::CaptureMode mode;
+            mode.nNativeId = nIndex;
 
-            // Does the desired size perfectly fits one of the webcam sizes?
-            if (nWidth == nFrameWidth && nHeight == nFrameHeight)
-            {
-                m_nFrameWidth = nFrameWidth;
-                m_nFrameHeight = nFrameHeight;
-                break;
-            }
+            GUID guid;
+
+            if (SUCCEEDED(pNativeType->GetGUID(MF_MT_SUBTYPE, &guid)))
+                mode.nFormat = internal::GetVideoFormat(guid);
 
-            // Pick one of the available sizes that's less than the desired size
-            // and then choose the closest one
+            MFGetAttributeSize(pNativeType, MF_MT_FRAME_SIZE, &mode.nWidth, &mode.nHeight);
 
-            if (nWidth <= nFrameWidth && nHeight <= nFrameHeight)
+            if (FAILED(MFGetAttributeRatio(pNativeType, MF_MT_FRAME_RATE, &mode.nFpsNumerator, &mode.nFpsDenominator)))
             {
-                int nWidthError = (int)nFrameWidth - (int)nWidth;
-                int nHeightError = (int)nFrameHeight - (int)nHeight;
-
-                if (nWidthError < nBestError && nFrameHeight < nBestError)
-                {
-                    m_nFrameWidth = nFrameWidth;
-                    m_nFrameHeight = nFrameHeight;
-                    nBestError = max(nWidthError, nHeightError);
-                }
+                mode.nFpsNumerator = 0;
+                mode.nFpsDenominator = 1;
             }
 
-            nIndex++;
-        }
+            pNativeType->Release();
 
-        if (m_nFrameWidth == 0 || m_nFrameHeight == 0)
-            return false;
+            vecModes.push_back(mode);
+        }
 
-        m_nFrameStrideRGB32 = m_nFrameWidth * 4;
+        wcc::GetModeCache().Store(m_sDeviceKey, vecModes);
 
-        return true;
+        m_vecModes.swap(vecModes);
     }
 
 #define DIE_IF(fail) do { if (fail) { bResult = false; goto end; } } while (false)
@@ -387,22 +796,11 @@ namespace wwcc
         DIE_IF(guid != MFMediaType_Video);
         DIE_IF(FAILED(pNativeType->GetGUID(MF_MT_SUBTYPE, &guid)));
         
-    #define SET(fss, vf, fnc) { m_nFrameSourceStep = fss; m_nVideoFormat = vf; m_fnConvert = fnc; }
+        m_nVideoFormat = internal::GetVideoFormat(guid);
 
-        if (guid == MFVideoFormat_RGB32)
-            SET(4, VideoFormat::Rgb32, internal::ConvertFromRGB32)
-        else if (guid == MFVideoFormat_RGB24)
-            SET(3, VideoFormat::Rgb24, internal::ConvertFromRGB24)
-        else if (guid == MFVideoFormat_YUY2)
-            SET(2, VideoFormat::Yuy2, internal::ConvertFromYUY2)
-        else
-        {
-            // TODO: Support NV12
-            bResult = false;
-            goto end;
-        }
+        DIE_IF(m_nVideoFormat == VideoFormat::None);
 
-    #undef set
+        m_nFrameSourceStep = wcc::GetBytesPerPixel(m_nVideoFormat);
 
         DIE_IF(FAILED(pType->SetGUID(MF_MT_SUBTYPE, guid)));
 
@@ -415,9 +813,20 @@ namespace wwcc
         // Send everything to the reader
         DIE_IF(FAILED(m_pReader->SetCurrentMediaType(m_dwStreamIndex, nullptr, pType)));
 
-        // Allocate memory for the raw image
+        // Rows may be padded, a negative stride means a bottom-up image which we don't handle
         m_nFrameSourceStride = m_nFrameWidth * m_nFrameSourceStep;
-        m_pFrame = new uint8_t[m_nFrameStrideRGB32 * m_nFrameHeight];
+
+        {
+            UINT32 nStride = 0;
+
+            if (SUCCEEDED(pNativeType->GetUINT32(MF_MT_DEFAULT_STRIDE, &nStride)) && (int32_t)nStride > 0)
+                m_nFrameSourceStride = nStride;
+        }
+
+        m_DeviceColorSpace = internal::GetColorSpace(pNativeType);
+        m_Processor.SetColorSpace(wcc::ResolveColorSpace(m_ColorSpace, m_DeviceColorSpace));
+
+        DIE_IF(!m_Processor.Configure(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, m_nDesiredWidth, m_nDesiredHeight));
 
     end:
         pNativeType->Release();
@@ -430,87 +839,290 @@ namespace wwcc
 
 #define DIE_IF(fail) do { if (fail) goto end; } while (false)
 
-    void Capturer::DoCapture()
+    IMFMediaBuffer* Capturer::ReadBuffer(LONGLONG& llTimestamp)
     {
         IMFSample* pSample = nullptr;
+        IMFMediaBuffer* pBuffer = nullptr;
+        HRESULT hResult;
+        DWORD nFlags;
 
-        while (true)
         {
-            DWORD nFlags;
+            std::unique_lock<std::mutex> lock(m_SampleMutex);
 
-            while (1)
-            {
-                // Reading a sample in a sync mode
-                HRESULT hResult = m_pReader->ReadSample(
-                    m_dwStreamIndex, 0, nullptr,
-                    &nFlags, nullptr, &pSample
-                );
+            // The sample comes to OnSample on a thread of Media Foundation
+            if (!m_bSampleReady && FAILED(RequestSample()))
+                return nullptr;
 
-                DIE_IF(FAILED(hResult));
+            m_SampleReady.wait(lock, [this]() { return m_bSampleReady; });
 
-                // Check if the sample is ready
-                if ((nFlags & MF_SOURCE_READERF_STREAMTICK) == 0 && pSample)
-                    break;
-            }
+            hResult = m_hSampleStatus;
+            nFlags = m_nSampleFlags;
+            llTimestamp = m_llSampleTime;
+            pSample = m_pSample;
 
-            DIE_IF(nFlags & MF_SOURCE_READERF_ENDOFSTREAM);
+            m_pSample = nullptr;
+            m_bSampleReady = false;
+        }
 
-            if (nFlags & MF_SOURCE_READERF_NATIVEMEDIATYPECHANGED)
-            {
-                // The format has changed
-                DIE_IF(!ConfigureDecoder());
-            }
+        DIE_IF(FAILED(hResult) || !pSample);
+        DIE_IF(nFlags & MF_SOURCE_READERF_ENDOFSTREAM);
 
-            IMFMediaBuffer* pBuffer = nullptr;
-            DIE_IF(!pSample || FAILED(pSample->ConvertToContiguousBuffer(&pBuffer)));
+        if (nFlags & MF_SOURCE_READERF_NATIVEMEDIATYPECHANGED)
+        {
+            // The format has changed
+            DIE_IF(!ConfigureDecoder());
+        }
 
-            uint8_t* pData = nullptr;
+        // The buffer keeps the memory of the sample alive
+        if (FAILED(pSample->ConvertToContiguousBuffer(&pBuffer)))
+            pBuffer = nullptr;
 
-            if (FAILED(pBuffer->Lock(&pData, nullptr, nullptr)))
-            {
-                pBuffer->Release();
-                goto end;
-            }
+    end:
+        if (pSample)
+            pSample->Release();
+
+        return pBuffer;
+    }
+
+    HRESULT Capturer::RequestSample()
+    {
+        if (m_bReadPending)
+            return S_OK;
+
+        if (!m_pReader)
+            return E_POINTER;
+
+        // All outputs are null in the async mode
+        HRESULT hResult = m_pReader->ReadSample(m_dwStreamIndex, 0, nullptr, nullptr, nullptr, nullptr);
+        m_bReadPending = SUCCEEDED(hResult);
+
+        return hResult;
+    }
+
+    void Capturer::OnSample(HRESULT hStatus, DWORD nFlags, LONGLONG llTimestamp, IMFSample* pSample)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_SampleMutex);
+            m_bReadPending = false;
+
+            // Stream ticks mark gaps in the stream and have no frame
+            bool bTick = SUCCEEDED(hStatus) && (nFlags & (MF_SOURCE_READERF_ENDOFSTREAM | MF_SOURCE_READERF_ERROR)) == 0 &&
+                (!pSample || (nFlags & MF_SOURCE_READERF_STREAMTICK));
+
+            if (bTick && SUCCEEDED(RequestSample()))
+                return;
+
+            if (m_pSample)
+                m_pSample->Release();
+
+            if (pSample)
+                pSample->AddRef();
+
+            m_hSampleStatus = hStatus;
+            m_nSampleFlags = nFlags;
+            m_llSampleTime = llTimestamp;
+            m_pSample = pSample;
+            m_bSampleReady = true;
+        }
+
+        m_SampleReady.notify_all();
+
+        // A pending request converts the frame right here
+        if (m_Request.Claim())
+            m_Request.Finish(DoCapture());
+    }
+
+    void Capturer::OnSampleReady(void* pContext)
+    {
+        Capturer* pThis = (Capturer*)pContext;
+
+        if (pThis->m_Request.Claim())
+            pThis->m_Request.Finish(pThis->DoCapture());
+    }
+
+    wcc::FrameInfo Capturer::DeliverSample(LONGLONG llTimestamp, bool bChanged)
+    {
+        int64_t nNow = wcc::GetMonotonicTime();
+
+        if (!m_bClockStarted)
+        {
+            m_bClockStarted = true;
+            m_llFirstTimestamp = llTimestamp;
+            m_nClockOffset = nNow - llTimestamp * 100;
+        }
+
+        // Samples are not numbered, so a gap between the sample times means lost frames
+        uint64_t nSequence = m_nSamples++;
+
+        if (m_nFpsNumerator > 0 && llTimestamp >= m_llFirstTimestamp)
+        {
+            LONGLONG llDuration = 10000000LL * m_nFpsDenominator / m_nFpsNumerator;
+
+            if (llDuration > 0)
+                nSequence = (uint64_t)((llTimestamp - m_llFirstTimestamp + llDuration / 2) / llDuration);
+        }
+
+        if (!bChanged)
+            return m_Counter.Skip(nSequence, llTimestamp * 100 + m_nClockOffset);
+
+        wcc::FrameInfo info = m_Counter.Deliver(nSequence, llTimestamp * 100 + m_nClockOffset);
+        WCC_STATS(m_Processor.GetStats().AddFrame(info);)
+
+        return info;
+    }
+
+    wcc::FrameInfo Capturer::DoCapture()
+    {
+        WCC_STATS(int64_t nStart = wcc::GetMonotonicTime();)
+
+        LONGLONG llTimestamp = 0;
+        IMFMediaBuffer* pBuffer = ReadBuffer(llTimestamp);
 
-            for (uint32_t y = 0; y < m_nFrameHeight; y++)
+        if (!pBuffer)
+            return {};
+
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Wait, nStart);)
+
+        wcc::FrameInfo info;
+        uint8_t* pData = nullptr;
+        DWORD nLength = 0;
+
+        if (SUCCEEDED(pBuffer->Lock(&pData, nullptr, &nLength)))
+        {
+            // Converting and scaling down the image straight into the output buffer.
+            // NV12 is stored in one buffer with the UV plane right after the Y plane
+            if (m_pOutput && nLength > 0 && nLength >= wcc::GetFrameSize(m_nVideoFormat, m_nFrameHeight, m_nFrameSourceStride))
             {
-                uint8_t* pSrcRow = pData + y * m_nFrameSourceStride;
-                uint8_t* pDstRow = m_pFrame + y * m_nFrameStrideRGB32;
+                wcc::FrameView view = wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pData, m_nFrameSourceStride);
+                view.nDataSize = nLength;
 
-                for (uint32_t x = 0; x < m_nFrameWidth; x += m_nFrameSourceStep, pSrcRow += 4)
-                    m_fnConvert(pSrcRow, pDstRow, x);
+                // A static frame is not converted at all
+                bool bChanged = m_Detector.Update(wcc::CropFrameView(view, m_Processor.GetRegion()));
+
+                if (bChanged)
+                    m_Processor.Process(view, m_pOutput);
+
+                info = DeliverSample(llTimestamp, bChanged);
+                m_Detector.Mark(info);
             }
 
-            // Scaling down the image and storing each pixel as one uint32_t instead of four uint8_t
+            pBuffer->Unlock();
+        }
 
-            uint32_t* pDst = m_pOutput;
-            uint32_t* pSrc = reinterpret_cast<uint32_t*>(m_pFrame);
+        pBuffer->Release();
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Total, nStart);)
 
-            for (uint32_t y = 0; y < m_nDesiredHeight; y++)
-                for (uint32_t x = 0; x < m_nDesiredWidth; x++, pDst++)
-                {
-                    size_t i = y * m_nFrameHeight / m_nDesiredHeight * m_nFrameWidth + x * m_nFrameWidth / m_nDesiredWidth;
-                    *pDst = pSrc[i];
-                }
+        return info;
+    }
 
-            pBuffer->Release();
-            break;
+    bool Capturer::RequestFrame(wcc::FrameCallback fnDone, void* pContext)
+    {
+        if (!m_Request.Set(fnDone, pContext))
+            return false;
+
+        bool bReady;
+
+        {
+            std::lock_guard<std::mutex> lock(m_SampleMutex);
+
+            // A read that fails finishes the request with an invalid frame
+            bReady = m_bSampleReady || FAILED(RequestSample());
         }
 
-    end:
-        if (pSample)
-            pSample->Release();
+        // Finishing it right here would resume the caller inside of this call
+        if (bReady)
+            wcc::GetFrameLoop().Post(&Capturer::OnSampleReady, this);
+
+        return true;
+    }
+
+    wcc::FrameLease Capturer::LeaseFrame()
+    {
+        if (!m_Leases.TryAcquire())
+            return {};
+
+        WCC_STATS(int64_t nStart = wcc::GetMonotonicTime();)
+
+        LONGLONG llTimestamp = 0;
+        IMFMediaBuffer* pBuffer = ReadBuffer(llTimestamp);
+        WCC_STATS(m_Processor.GetStats().AddTimeSince(wcc::Stage::Wait, nStart);)
+
+        uint8_t* pData = nullptr;
+        DWORD nLength = 0;
+
+        if (!pBuffer || FAILED(pBuffer->Lock(&pData, nullptr, &nLength)))
+        {
+            if (pBuffer)
+                pBuffer->Release();
+
+            m_Leases.Release();
+            return {};
+        }
+
+        if (nLength == 0 || nLength < wcc::GetFrameSize(m_nVideoFormat, m_nFrameHeight, m_nFrameSourceStride))
+        {
+            ReleaseBuffer(this, (uintptr_t)pBuffer);
+            m_Leases.Release();
+            return {};
+        }
+
+        // The buffer stays locked until the lease is destroyed
+        wcc::FrameView view = wcc::MakeFrameView(m_nVideoFormat, m_nFrameWidth, m_nFrameHeight, pData, m_nFrameSourceStride);
+        view.nDataSize = nLength;
+
+        return wcc::FrameLease(view, DeliverSample(llTimestamp), &Capturer::ReleaseBuffer, this, (uintptr_t)pBuffer, &m_Leases);
     }
 
+    void Capturer::ReleaseBuffer(void*, uintptr_t nBuffer)
+    {
+        IMFMediaBuffer* pBuffer = (IMFMediaBuffer*)nBuffer;
+
+        pBuffer->Unlock();
+        pBuffer->Release();
+    }
+
+    void Capturer::SetMaxLeases(uint32_t nLeases) { m_Leases.SetMax(nLeases); }
+    uint32_t Capturer::GetMaxLeases() const { return m_Leases.GetMax(); }
+
     uint32_t Capturer::GetFrameWidth() const { return m_nFrameWidth; }
     uint32_t Capturer::GetFrameHeight() const { return m_nFrameHeight; }
     uint32_t Capturer::GetDeviceCount() const { return m_nDevices; }
 
     VideoFormat Capturer::GetVideoFormat() const { return m_nVideoFormat; }
 
-    void Capturer::SetBuffer(uint32_t* pBuffer) { m_pOutput = pBuffer; }
-}
+    const wcc::CaptureMode& Capturer::GetCaptureMode() const { return m_Mode; }
+    const std::vector<wcc::CaptureMode>& Capturer::GetCaptureModes() const { return m_vecModes; }
+
+    void Capturer::SetBuffer(void* pBuffer) { m_pOutput = pBuffer; }
+
+    void Capturer::SetOutputFormat(OutputFormat nFormat) { m_Processor.SetOutputFormat(nFormat); }
+    void Capturer::SetTensorFormat(const wcc::TensorDesc& desc) { m_Processor.SetTensorFormat(desc); }
+
+    void Capturer::SetColorSpace(const wcc::ColorSpace& colorSpace)
+    {
+        m_ColorSpace = colorSpace;
+        m_Processor.SetColorSpace(wcc::ResolveColorSpace(m_ColorSpace, m_DeviceColorSpace));
+    }
+
+    wcc::ColorSpace Capturer::GetColorSpace() const { return m_Processor.GetColorSpace(); }
+    VideoFormat Capturer::GetOutputVideoFormat() const { return m_Processor.GetOutputVideoFormat(); }
+
+    size_t Capturer::GetOutputSize() const { return m_Processor.GetOutputSize(); }
+    uint32_t Capturer::GetOutputStride() const { return m_Processor.GetOutputStride(); }
+
+    void Capturer::SetScaleMode(ScaleMode nMode) { m_Processor.SetScaleMode(nMode); }
+
+    void Capturer::SetRegion(const wcc::Rect& region) { m_Processor.SetRegion(region); }
+    wcc::Rect Capturer::GetRegion() const { return m_Processor.GetRegion(); }
+    void Capturer::SetThreadCount(uint32_t nThreads) { m_Processor.SetThreadCount(nThreads); }
+
+    void Capturer::SetChangeDetection(const wcc::ChangeDetector::Settings& settings) { m_Detector.SetSettings(settings); }
+
+    wcc::StatsSnapshot Capturer::GetStats() const { return m_Processor.GetStats().GetSnapshot(); }
+    void Capturer::ResetStats() { m_Processor.GetStats().Reset(); }
 
 #endif
 
+}
+
 #endif
\ No newline at end of file
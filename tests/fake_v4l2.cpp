@@ -0,0 +1,663 @@
+// Runs lwcc::Capturer against a fake V4L2 device (lwcc::SetIoOps), so the streaming loop
+// is tested without a camera: REQBUFS, QUERYBUF, mmap, QBUF, STREAMON, DQBUF and the requeue,
+// the counting of skipped and dropped frames with the change detector, RequestFrame on the frame loop,
+// failed starts, Init and InitAsync again, the crop of SetRegion and the keys of wcc::ModeCache.
+//
+//     g++ -std=c++17 -O2 -Iinclude tests/fake_v4l2.cpp -o fake_v4l2 -pthread
+//     ./fake_v4l2
+//
+// Prints every failed check and returns the number of them
+
+#define WCCAPI_ENABLE_STATS
+#define LWCCAPI_IMPL
+#include "../include/lwccapi.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <thread>
+#include <vector>
+
+static int s_nFailed = 0;
+
+#define CHECK(x) do { if (!(x)) { std::printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); s_nFailed++; } } while (0)
+
+// A YUYV camera of 64x48 at 30 fps with one node, /dev/video0.
+// Every frame is gray, its luma comes from the sequence number (see GetLuma) and changes every nRepeat frames
+namespace fake
+{
+    constexpr int c_nFd = 1000;
+    constexpr uint32_t c_nWidth = 64;
+    constexpr uint32_t c_nHeight = 48;
+    constexpr uint32_t c_nFrameSize = c_nWidth * c_nHeight * 2;
+
+    struct Buffer
+    {
+        std::vector<uint8_t> vecData;
+        bool bQueued = false;
+        bool bMapped = false;
+    };
+
+    struct Device
+    {
+        uint32_t nOpen = 0;
+        bool bStreaming = false;
+
+        // The sensor is cropped to the frame without scaling
+        v4l2_rect crop{ 0, 0, c_nWidth, c_nHeight };
+
+        std::vector<Buffer> vecBuffers;
+        std::deque<uint32_t> dequeQueued;
+
+        uint32_t nSequence = 0;
+        uint32_t nRepeat = 1;
+
+        // Calls the capturer made
+        uint32_t nQueued = 0;
+        uint32_t nDequeued = 0;
+        uint32_t nErrors = 0;
+
+        // The next call of this request fails with EIO
+        unsigned long nFailRequest = 0;
+    };
+
+    Device s_Device;
+
+    // While it's set the sensor is between two frames: no buffer can be read
+    std::atomic<bool> s_bHold{ false };
+
+    uint8_t GetLuma(uint32_t nSequence)
+    {
+        return (uint8_t)(16 + (nSequence * 37) % 200);
+    }
+
+    int Fail(int nError)
+    {
+        errno = nError;
+        return -1;
+    }
+
+    int Open(const char* sPath, int)
+    {
+        if (strcmp(sPath, "/dev/video0") != 0)
+            return Fail(ENOENT);
+
+        s_Device.nOpen++;
+        return c_nFd;
+    }
+
+    int Close(int nFd)
+    {
+        if (nFd != c_nFd || s_Device.nOpen == 0)
+            return Fail(EBADF);
+
+        s_Device.nOpen--;
+        return 0;
+    }
+
+    int Ioctl(int nFd, unsigned long nRequest, void* pArg)
+    {
+        if (nFd != c_nFd)
+            return Fail(EBADF);
+
+        Device& device = s_Device;
+
+        if (nRequest == device.nFailRequest)
+        {
+            device.nFailRequest = 0;
+            return Fail(EIO);
+        }
+
+        switch (nRequest)
+        {
+        case VIDIOC_QUERYCAP:
+        {
+            v4l2_capability* pCaps = (v4l2_capability*)pArg;
+            strcpy((char*)pCaps->driver, "fake");
+            strcpy((char*)pCaps->card, "Fake Camera");
+            strcpy((char*)pCaps->bus_info, "platform:fake");
+            pCaps->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+            return 0;
+        }
+
+        case VIDIOC_ENUM_FMT:
+        {
+            v4l2_fmtdesc* pDesc = (v4l2_fmtdesc*)pArg;
+
+            if (pDesc->index > 0)
+                return Fail(EINVAL);
+
+            pDesc->pixelformat = V4L2_PIX_FMT_YUYV;
+            return 0;
+        }
+
+        case VIDIOC_ENUM_FRAMESIZES:
+        {
+            v4l2_frmsizeenum* pSize = (v4l2_frmsizeenum*)pArg;
+
+            if (pSize->index > 0 || pSize->pixel_format != V4L2_PIX_FMT_YUYV)
+                return Fail(EINVAL);
+
+            pSize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+            pSize->discrete.width = c_nWidth;
+            pSize->discrete.height = c_nHeight;
+            return 0;
+        }
+
+        case VIDIOC_ENUM_FRAMEINTERVALS:
+        {
+            v4l2_frmivalenum* pInterval = (v4l2_frmivalenum*)pArg;
+
+            if (pInterval->index > 0)
+                return Fail(EINVAL);
+
+            pInterval->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+            pInterval->discrete.numerator = 1;
+            pInterval->discrete.denominator = 30;
+            return 0;
+        }
+
+        case VIDIOC_S_FMT:
+        case VIDIOC_G_FMT:
+        {
+            v4l2_format* pFormat = (v4l2_format*)pArg;
+            pFormat->fmt.pix.width = device.crop.width;
+            pFormat->fmt.pix.height = device.crop.height;
+            pFormat->fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+            pFormat->fmt.pix.bytesperline = device.crop.width * 2;
+            pFormat->fmt.pix.sizeimage = device.crop.width * device.crop.height * 2;
+            return 0;
+        }
+
+        case VIDIOC_G_SELECTION:
+        {
+            v4l2_selection* pSelection = (v4l2_selection*)pArg;
+
+            if (pSelection->target == V4L2_SEL_TGT_CROP_BOUNDS)
+                pSelection->r = { 0, 0, c_nWidth, c_nHeight };
+            else
+                pSelection->r = device.crop;
+
+            return 0;
+        }
+
+        case VIDIOC_S_SELECTION:
+        {
+            if (device.bStreaming)
+                return Fail(EBUSY);
+
+            device.crop = ((v4l2_selection*)pArg)->r;
+            return 0;
+        }
+
+        case VIDIOC_REQBUFS:
+        {
+            v4l2_requestbuffers* pRequest = (v4l2_requestbuffers*)pArg;
+
+            if (device.bStreaming || pRequest->memory != V4L2_MEMORY_MMAP)
+                return Fail(EBUSY);
+
+            // Count 0 frees the buffers, they must not be mapped anymore
+            for (const Buffer& buffer : device.vecBuffers)
+                device.nErrors += buffer.bMapped;
+
+            device.vecBuffers.assign(pRequest->count, Buffer());
+            device.dequeQueued.clear();
+
+            for (Buffer& buffer : device.vecBuffers)
+                buffer.vecData.resize(c_nFrameSize);
+
+            return 0;
+        }
+
+        case VIDIOC_QUERYBUF:
+        {
+            v4l2_buffer* pBuffer = (v4l2_buffer*)pArg;
+
+            if (pBuffer->index >= device.vecBuffers.size())
+                return Fail(EINVAL);
+
+            pBuffer->length = c_nFrameSize;
+            pBuffer->m.offset = pBuffer->index * c_nFrameSize;
+            return 0;
+        }
+
+        case VIDIOC_QBUF:
+        {
+            v4l2_buffer* pBuffer = (v4l2_buffer*)pArg;
+
+            if (pBuffer->index >= device.vecBuffers.size() || device.vecBuffers[pBuffer->index].bQueued)
+            {
+                device.nErrors++;
+                return Fail(EINVAL);
+            }
+
+            device.vecBuffers[pBuffer->index].bQueued = true;
+            device.dequeQueued.push_back(pBuffer->index);
+            device.nQueued++;
+            return 0;
+        }
+
+        case VIDIOC_DQBUF:
+        {
+            v4l2_buffer* pBuffer = (v4l2_buffer*)pArg;
+
+            if (!device.bStreaming || device.dequeQueued.empty() || s_bHold)
+                return Fail(EAGAIN);
+
+            uint32_t nIndex = device.dequeQueued.front();
+            device.dequeQueued.pop_front();
+
+            Buffer& buffer = device.vecBuffers[nIndex];
+            buffer.bQueued = false;
+
+            // The "sensor" writes the frame into the buffer just before it's handed out
+            uint8_t nLuma = GetLuma(device.nSequence / device.nRepeat);
+
+            for (uint32_t i = 0; i < c_nFrameSize; i += 2)
+            {
+                buffer.vecData[i] = nLuma;
+                buffer.vecData[i + 1] = 128;
+            }
+
+            timespec time;
+            clock_gettime(CLOCK_MONOTONIC, &time);
+
+            pBuffer->index = nIndex;
+            pBuffer->bytesused = c_nFrameSize;
+            pBuffer->sequence = device.nSequence++;
+            pBuffer->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+            pBuffer->timestamp.tv_sec = time.tv_sec;
+            pBuffer->timestamp.tv_usec = time.tv_nsec / 1000;
+
+            device.nDequeued++;
+            return 0;
+        }
+
+        case VIDIOC_STREAMON:
+            device.bStreaming = true;
+            return 0;
+
+        case VIDIOC_STREAMOFF:
+            device.bStreaming = false;
+
+            for (Buffer& buffer : device.vecBuffers)
+                buffer.bQueued = false;
+
+            device.dequeQueued.clear();
+            return 0;
+
+        // No frame rate control
+        default:
+            return Fail(EINVAL);
+        }
+    }
+
+    void* Mmap(void*, size_t nLength, int, int, int nFd, off_t nOffset)
+    {
+        size_t nIndex = (size_t)nOffset / c_nFrameSize;
+
+        if (nFd != c_nFd || nLength != c_nFrameSize || nIndex >= s_Device.vecBuffers.size())
+            return MAP_FAILED;
+
+        s_Device.vecBuffers[nIndex].bMapped = true;
+        return s_Device.vecBuffers[nIndex].vecData.data();
+    }
+
+    int Munmap(void* pAddr, size_t)
+    {
+        for (Buffer& buffer : s_Device.vecBuffers)
+        {
+            if (buffer.vecData.data() == pAddr)
+            {
+                buffer.bMapped = false;
+                return 0;
+            }
+        }
+
+        return Fail(EINVAL);
+    }
+
+    // Readable while the driver has a buffer to fill, a real device would wait for the next frame
+    int Poll(pollfd* pFds, nfds_t nFds, int)
+    {
+        int nReady = 0;
+
+        for (nfds_t i = 0; i < nFds; i++)
+        {
+            pFds[i].revents = 0;
+
+            if (pFds[i].fd == c_nFd && s_Device.bStreaming && !s_Device.dequeQueued.empty() && !s_bHold)
+            {
+                pFds[i].revents = POLLIN;
+                nReady++;
+            }
+        }
+
+        return nReady;
+    }
+
+    const lwcc::IoOps s_Ops = { Open, Close, Ioctl, Mmap, Munmap, Poll };
+}
+
+// What BT.601 limited range makes of a gray YUYV pixel
+static int GetExpectedGray(uint8_t nLuma)
+{
+    int nValue = ((int)nLuma - 16) * 255 / 219;
+    return std::min(std::max(nValue, 0), 255);
+}
+
+static bool IsGray(const std::vector<uint32_t>& vecOutput, uint8_t nLuma)
+{
+    int nExpected = GetExpectedGray(nLuma);
+
+    for (uint32_t nPixel : vecOutput)
+    {
+        for (int nChannel = 0; nChannel < 3; nChannel++)
+        {
+            if (std::abs((int)((nPixel >> (nChannel * 8)) & 0xFF) - nExpected) > 2)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static void TestCapture()
+{
+    lwcc::Capturer capturer;
+
+    CHECK(lwcc::Capturer::EnumerateDevices().size() == 1);
+    CHECK(capturer.Init(0, 32, 24, 30));
+    CHECK(capturer.GetFrameWidth() == fake::c_nWidth && capturer.GetFrameHeight() == fake::c_nHeight);
+    CHECK(capturer.GetVideoFormat() == lwcc::VideoFormat::Yuy2);
+
+    size_t nBuffers = fake::s_Device.vecBuffers.size();
+
+    // Every buffer is mapped and given to the driver before the stream starts
+    CHECK(fake::s_Device.bStreaming);
+    CHECK(nBuffers >= 2);
+    CHECK(fake::s_Device.dequeQueued.size() == nBuffers);
+
+    for (const fake::Buffer& buffer : fake::s_Device.vecBuffers)
+        CHECK(buffer.bMapped);
+
+    std::vector<uint32_t> vecOutput(32 * 24);
+    capturer.SetBuffer(vecOutput.data());
+
+    // More frames than buffers, so every buffer has to come back to the driver
+    uint32_t nFrames = (uint32_t)nBuffers * 3;
+
+    for (uint32_t i = 0; i < nFrames; i++)
+    {
+        wcc::FrameInfo info = capturer.DoCapture();
+
+        CHECK(info.bValid);
+        CHECK(info.nSequence == i);
+        CHECK(info.nDropped == 0);
+        CHECK(info.nTimestamp > 0);
+        CHECK(IsGray(vecOutput, fake::GetLuma(i)));
+        CHECK(fake::s_Device.dequeQueued.size() == nBuffers);
+    }
+
+    CHECK(fake::s_Device.nDequeued == nFrames);
+    CHECK(fake::s_Device.nQueued == nBuffers + nFrames);
+
+    // A lease keeps its buffer until it's destroyed
+    {
+        wcc::FrameLease lease = capturer.LeaseFrame();
+
+        CHECK(lease);
+        CHECK(lease.GetInfo().nSequence == nFrames);
+        CHECK(fake::s_Device.dequeQueued.size() == nBuffers - 1);
+        CHECK(lease.GetData()[0] == fake::GetLuma(nFrames));
+    }
+
+    CHECK(fake::s_Device.dequeQueued.size() == nBuffers);
+}
+
+// Static frames are neither delivered nor dropped, both the infos and the stats count them apart
+static void TestSkippedFrames()
+{
+    fake::s_Device = {};
+    fake::s_Device.nRepeat = 3;
+
+    lwcc::Capturer capturer;
+    CHECK(capturer.Init(0, 32, 24, 30));
+
+    std::vector<uint32_t> vecOutput(32 * 24);
+    capturer.SetBuffer(vecOutput.data());
+
+    wcc::ChangeDetector::Settings settings;
+    settings.nThreshold = 1;
+    capturer.SetChangeDetection(settings);
+
+    // Frames 0, 3 and 6 change, the two after each of them are skipped
+    for (uint32_t i = 0; i < 9; i++)
+    {
+        wcc::FrameInfo info = capturer.DoCapture();
+        bool bChanged = i % 3 == 0;
+
+        CHECK(info.bValid == bChanged);
+        CHECK(info.bUnchanged == !bChanged);
+        CHECK(info.nSequence == i);
+        CHECK(info.nDropped == 0);
+        CHECK(info.nSkipped == (i > 0 && bChanged ? 2u : 0u));
+        CHECK(IsGray(vecOutput, fake::GetLuma(i / 3)));
+    }
+
+    // Frame 9 is lost, frame 10 has a new picture
+    fake::s_Device.nSequence++;
+
+    wcc::FrameInfo info = capturer.DoCapture();
+
+    CHECK(info.bValid);
+    CHECK(info.nSequence == 10);
+    CHECK(info.nDropped == 1);
+    CHECK(info.nSkipped == 2);
+
+    wcc::StatsSnapshot stats = capturer.GetStats();
+
+    CHECK(stats.nFrames == 4);
+    CHECK(stats.nSkipped == 6);
+    CHECK(stats.nDropped == 1);
+    CHECK(std::abs(stats.fDropRate - 1.0 / 11.0) < 1e-9);
+}
+
+static bool IsStopped()
+{
+    return !fake::s_Device.bStreaming && fake::s_Device.vecBuffers.empty() && fake::s_Device.nErrors == 0;
+}
+
+// A failed step of starting the stream gives back what the steps before it got, Init again starts from scratch
+static void TestReinit()
+{
+    fake::s_Device = {};
+
+    lwcc::Capturer capturer;
+
+    for (unsigned long nRequest : { VIDIOC_QUERYBUF, VIDIOC_QBUF, VIDIOC_STREAMON })
+    {
+        fake::s_Device.nFailRequest = nRequest;
+
+        CHECK(!capturer.Init(0, 32, 24, 30));
+        CHECK(IsStopped());
+        CHECK(fake::s_Device.nOpen == 1);
+    }
+
+    CHECK(capturer.Init(0, 32, 24, 30));
+    CHECK(capturer.Init(0, 32, 24, 30));
+    CHECK(fake::s_Device.nOpen == 1);
+    CHECK(fake::s_Device.bStreaming);
+    CHECK(fake::s_Device.nErrors == 0);
+
+    std::vector<uint32_t> vecOutput(32 * 24);
+    capturer.SetBuffer(vecOutput.data());
+
+    CHECK(capturer.DoCapture().bValid);
+}
+
+// A finished task leaves an open device, the next InitAsync closes it first
+static void TestInitAsync()
+{
+    fake::s_Device = {};
+
+    wcc::InitTask empty;
+    CHECK(!empty.Wait() && !empty.WaitFor(1000000) && !empty.IsDone());
+
+    lwcc::Capturer capturer;
+
+    for (int i = 0; i < 3; i++)
+    {
+        wcc::InitTask task = capturer.InitAsync(0, 32, 24, 30);
+
+        CHECK(task.Wait() && task.WaitFor(0) && task.IsDone());
+        CHECK(fake::s_Device.nOpen == 1);
+        CHECK(fake::s_Device.bStreaming);
+        CHECK(fake::s_Device.nErrors == 0);
+    }
+
+    std::vector<uint32_t> vecOutput(32 * 24);
+    capturer.SetBuffer(vecOutput.data());
+
+    CHECK(capturer.DoCapture().bValid);
+}
+
+// A region the driver crops restarts the stream, a failed restart goes back to the previous crop
+static void TestRegion()
+{
+    fake::s_Device = {};
+
+    lwcc::Capturer capturer;
+    CHECK(capturer.Init(0, 16, 12, 30));
+
+    std::vector<uint32_t> vecOutput(16 * 12);
+    capturer.SetBuffer(vecOutput.data());
+
+    CHECK(capturer.SetRegion({ 16, 8, 32, 24 }));
+    CHECK(capturer.GetFrameWidth() == 32 && capturer.GetFrameHeight() == 24);
+    CHECK(fake::s_Device.crop.left == 16 && fake::s_Device.crop.top == 8);
+    CHECK(capturer.DoCapture().bValid);
+
+    fake::s_Device.nFailRequest = VIDIOC_STREAMON;
+    CHECK(!capturer.SetRegion({ 0, 0, 32, 48 }));
+
+    wcc::Rect region = capturer.GetRegion();
+
+    CHECK(region.nX == 16 && region.nY == 8 && region.nWidth == 32 && region.nHeight == 24);
+    CHECK(capturer.GetFrameWidth() == 32 && capturer.GetFrameHeight() == 24);
+    CHECK(fake::s_Device.crop.left == 16 && fake::s_Device.crop.top == 8);
+    CHECK(fake::s_Device.bStreaming);
+    CHECK(capturer.DoCapture().bValid);
+    CHECK(fake::s_Device.nErrors == 0);
+}
+
+struct Request
+{
+    wcc::FrameInfo info;
+    std::atomic<bool> bDone{ false };
+};
+
+static void OnFrame(void* pContext, const wcc::FrameInfo& info)
+{
+    Request* pRequest = (Request*)pContext;
+
+    pRequest->info = info;
+    pRequest->bDone = true;
+}
+
+// The frame loop can't poll the fake descriptor, it must ask the fake Poll
+static void TestRequestFrame()
+{
+    fake::s_Device = {};
+
+    lwcc::Capturer capturer;
+    CHECK(capturer.Init(0, 32, 24, 30));
+
+    std::vector<uint32_t> vecOutput(32 * 24);
+    capturer.SetBuffer(vecOutput.data());
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        fake::s_bHold = true;
+
+        Request request;
+        CHECK(capturer.RequestFrame(&OnFrame, &request));
+
+        // No frame yet, the request waits
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        CHECK(!request.bDone);
+
+        // Well before the timeout of the request
+        fake::s_bHold = false;
+
+        for (int nWait = 0; nWait < 500 && !request.bDone; nWait++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        CHECK(request.bDone);
+        CHECK(request.info.bValid);
+        CHECK(request.info.nSequence == i);
+        CHECK(IsGray(vecOutput, fake::GetLuma(i)));
+    }
+}
+
+// Keys with line breaks and keys longer than any buffer survive a round trip through the file
+static void TestModeCache()
+{
+    std::string sPath = "fake_v4l2_modes.txt";
+    std::string sLongKey(3000, 'k');
+
+    wcc::CaptureMode mode;
+    mode.nFormat = wcc::VideoFormat::Yuy2;
+    mode.nWidth = 64;
+    mode.nHeight = 48;
+    mode.nFpsNumerator = 30;
+    mode.nFpsDenominator = 1;
+
+    remove(sPath.c_str());
+
+    wcc::ModeCache cache;
+    CHECK(cache.Open(sPath));
+    CHECK(cache.Store("usb\nfw 1", { mode }));
+    CHECK(cache.Store(sLongKey, { mode, mode }));
+
+    wcc::ModeCache other;
+    std::vector<wcc::CaptureMode> vecModes;
+    CHECK(other.Open(sPath));
+
+    CHECK(other.Find("usb\nfw 1", vecModes) && vecModes.size() == 1 && vecModes[0].nWidth == 64);
+    CHECK(other.Find(sLongKey, vecModes) && vecModes.size() == 2);
+
+    CHECK(other.Remove("usb\nfw 1"));
+    CHECK(!other.Find("usb\nfw 1", vecModes));
+
+    remove(sPath.c_str());
+}
+
+int main()
+{
+    lwcc::SetIoOps(&fake::s_Ops);
+
+    TestCapture();
+    TestSkippedFrames();
+    TestRequestFrame();
+    TestReinit();
+    TestInitAsync();
+    TestRegion();
+    TestModeCache();
+
+    // The capturer has stopped the stream, unmapped and freed the buffers and closed the device
+    CHECK(!fake::s_Device.bStreaming);
+    CHECK(fake::s_Device.nOpen == 0);
+    CHECK(fake::s_Device.vecBuffers.empty());
+    CHECK(fake::s_Device.nErrors == 0);
+
+    lwcc::SetIoOps(nullptr);
+
+    if (s_nFailed == 0)
+        std::printf("fake_v4l2: all checks passed\n");
+
+    return s_nFailed;
+}
@@ -0,0 +1,126 @@
+// Stress test of wcc::FrameExchange, the lock-free triple buffer between the capture thread and the application.
+// A producer publishes frames as fast as it can while a consumer takes them, and the consumer checks that
+// the sequence numbers (every word of a frame holds its own) never go backwards and that no frame is torn
+// (overwritten while it's being read).
+// Build it with ThreadSanitizer too, it must run without reports:
+//
+//     g++ -std=c++17 -O2 -Iinclude tests/frame_exchange.cpp -o frame_exchange -pthread
+//     g++ -std=c++17 -O1 -g -fsanitize=thread -Iinclude tests/frame_exchange.cpp -o frame_exchange_tsan -pthread
+//     ./frame_exchange [frames]
+//
+// Prints every failed check and returns the number of them
+
+#define WCCAPI_IMPL
+#include "../include/wccapi.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static int s_nFailed = 0;
+
+#define CHECK(x) do { if (!(x)) { std::printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); s_nFailed++; } } while (0)
+
+// Large enough that a torn frame has old and new words in it
+static constexpr size_t c_nFrameSize = 16 * 1024;
+
+// Every 64-bit word of frame n holds n
+static void WriteFrame(uint8_t* pFrame, uint64_t nSequence)
+{
+    uint64_t* pWords = (uint64_t*)pFrame;
+
+    for (size_t i = 0; i < c_nFrameSize / sizeof(uint64_t); i++)
+        pWords[i] = nSequence;
+}
+
+static bool IsFrame(const uint8_t* pFrame, uint64_t nSequence)
+{
+    const uint64_t* pWords = (const uint64_t*)pFrame;
+
+    for (size_t i = 0; i < c_nFrameSize / sizeof(uint64_t); i++)
+    {
+        if (pWords[i] != nSequence)
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t nFrames = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 100000;
+
+    wcc::FrameExchange exchange;
+    exchange.Resize(c_nFrameSize);
+
+    std::atomic<bool> bDone{ false };
+
+    // Sequence numbers start at 1, so the zeroed slots are never taken for a frame
+    std::thread producer([&]()
+    {
+        for (uint64_t n = 1; n <= nFrames; n++)
+        {
+            WriteFrame(exchange.GetBackBuffer(), n);
+            exchange.Publish();
+
+            // Without it the producer laps a slow consumer and they hardly ever race
+            if (n % 2 == 0)
+                std::this_thread::yield();
+        }
+
+        bDone = true;
+    });
+
+    uint64_t nLast = 0;
+    uint64_t nReceived = 0;
+    uint64_t nTorn = 0, nBackwards = 0, nMismatched = 0;
+
+    while (true)
+    {
+        bool bFinished = bDone.load();
+
+        const uint8_t* pFrame = exchange.Acquire();
+
+        if (!pFrame)
+        {
+            // The last frame was taken before the producer finished
+            if (bFinished)
+                break;
+
+            std::this_thread::yield();
+            continue;
+        }
+
+        nReceived++;
+
+        uint64_t nSequence = *(const uint64_t*)pFrame;
+
+        if (nSequence <= nLast)
+            nBackwards++;
+
+        // The frame must be whole and must stay untouched until the next Acquire,
+        // reading it twice gives the producer time to write into it if it could
+        if (!IsFrame(pFrame, nSequence))
+            nMismatched++;
+
+        if (!IsFrame(pFrame, nSequence))
+            nTorn++;
+
+        nLast = nSequence;
+    }
+
+    producer.join();
+
+    CHECK(nReceived > 0);
+    CHECK(nBackwards == 0);
+    CHECK(nMismatched == 0);
+    CHECK(nTorn == 0);
+
+    // The newest frame always gets through
+    CHECK(nLast == nFrames);
+
+    if (s_nFailed == 0)
+        std::printf("frame_exchange: all checks passed (%llu of %llu frames received)\n", (unsigned long long)nReceived, (unsigned long long)nFrames);
+
+    return s_nFailed;
+}
@@ -0,0 +1,225 @@
+// Checks wcc::FrameLoop: posted and timed tasks, watched descriptors (also ones with a poll function of their own)
+// and Cancel, also while the loop is sleeping in poll with the descriptors of the cancelled tasks.
+// Build it with the checked STL too:
+//
+//     g++ -std=c++17 -O2 -Iinclude tests/frame_loop.cpp -o frame_loop -pthread
+//     g++ -std=c++17 -O1 -g -D_GLIBCXX_ASSERTIONS -fsanitize=address,undefined -Iinclude tests/frame_loop.cpp -o frame_loop_checked -pthread
+//     ./frame_loop
+//
+// Prints every failed check and returns the number of them
+
+#define WCCAPI_IMPL
+#include "../include/wccapi.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static int s_nFailed = 0;
+
+#define CHECK(x) do { if (!(x)) { std::printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); s_nFailed++; } } while (0)
+
+// A task context that counts its runs
+struct Counter
+{
+    std::atomic<int> nRuns{ 0 };
+    std::atomic<int64_t> nTime{ 0 };
+};
+
+static void CountRun(void* pContext)
+{
+    Counter* pCounter = (Counter*)pContext;
+
+    pCounter->nTime = wcc::GetMonotonicTime();
+    pCounter->nRuns++;
+}
+
+// Waits until the condition holds, a second at most
+template <class Condition>
+static bool WaitFor(Condition condition)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        if (condition())
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return condition();
+}
+
+static void Sleep(int nMilliseconds)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(nMilliseconds));
+}
+
+static void TestTasks()
+{
+    wcc::FrameLoop loop;
+    Counter now, later, cancelled;
+
+    int64_t nStart = wcc::GetMonotonicTime();
+
+    loop.Post(&CountRun, &now);
+    loop.PostAt(nStart + 20000000, &CountRun, &later);
+    loop.PostAt(nStart + 20000000, &CountRun, &cancelled);
+    loop.Cancel(&cancelled);
+
+    CHECK(WaitFor([&]() { return later.nRuns > 0; }));
+    CHECK(now.nRuns == 1);
+    CHECK(later.nRuns == 1);
+    CHECK(later.nTime >= nStart + 20000000);
+
+    Sleep(30);
+    CHECK(cancelled.nRuns == 0);
+}
+
+static void TestWatch()
+{
+    wcc::FrameLoop loop;
+
+    int nFds[3][2];
+
+    for (auto& fds : nFds)
+        CHECK(pipe(fds) == 0);
+
+    Counter counters[3];
+
+    for (int i = 0; i < 3; i++)
+        loop.WatchOnce(nFds[i][0], 10000000000LL, &CountRun, &counters[i]);
+
+    // The loop is sleeping in poll with all three descriptors now. The first task is cancelled
+    // and the second descriptor becomes readable, only the second task may run
+    Sleep(50);
+
+    loop.Cancel(&counters[0]);
+    CHECK(write(nFds[1][1], "x", 1) == 1);
+
+    CHECK(WaitFor([&]() { return counters[1].nRuns > 0; }));
+    Sleep(30);
+
+    CHECK(counters[0].nRuns == 0);
+    CHECK(counters[1].nRuns == 1);
+    CHECK(counters[2].nRuns == 0);
+
+    // The third one is still watched
+    CHECK(write(nFds[2][1], "x", 1) == 1);
+    CHECK(WaitFor([&]() { return counters[2].nRuns > 0; }));
+
+    // A cancelled descriptor that becomes readable doesn't run anything either
+    CHECK(write(nFds[0][1], "x", 1) == 1);
+    Sleep(30);
+    CHECK(counters[0].nRuns == 0);
+
+    loop.Stop();
+
+    for (auto& fds : nFds)
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+// A descriptor only its own poll function knows about
+static std::atomic<bool> s_bFakeReadable{ false };
+static std::atomic<int> s_nFakePolls{ 0 };
+
+static int FakePoll(pollfd* pFds, nfds_t nFds, int)
+{
+    int nReady = 0;
+    s_nFakePolls++;
+
+    for (nfds_t i = 0; i < nFds; i++)
+    {
+        pFds[i].revents = (pFds[i].fd == 4242 && s_bFakeReadable) ? POLLIN : 0;
+        nReady += pFds[i].revents != 0;
+    }
+
+    return nReady;
+}
+
+static void TestPollFunc()
+{
+    wcc::FrameLoop loop;
+    Counter counter, other;
+
+    loop.WatchOnce(4242, 10000000000LL, &CountRun, &counter, &FakePoll);
+
+    Sleep(30);
+    CHECK(counter.nRuns == 0);
+    CHECK(s_nFakePolls > 1);
+
+    s_bFakeReadable = true;
+    CHECK(WaitFor([&]() { return counter.nRuns > 0; }));
+
+    // Once it has run the loop goes back to sleep for as long as it can
+    int nPolls = s_nFakePolls;
+    loop.PostAt(wcc::GetMonotonicTime() + 30000000, &CountRun, &other);
+
+    CHECK(WaitFor([&]() { return other.nRuns > 0; }));
+    CHECK(s_nFakePolls == nPolls);
+    CHECK(counter.nRuns == 1);
+}
+
+// Cancel from another thread over and over while the loop keeps rebuilding its descriptors
+static void TestCancelStorm()
+{
+    wcc::FrameLoop loop;
+
+    int nFds[8][2];
+    Counter counters[8];
+
+    for (auto& fds : nFds)
+        CHECK(pipe(fds) == 0);
+
+    // Every descriptor stays readable
+    for (auto& fds : nFds)
+        CHECK(write(fds[1], "x", 1) == 1);
+
+    for (int nRound = 0; nRound < 2000; nRound++)
+    {
+        int i = nRound % 8;
+
+        loop.WatchOnce(nFds[i][0], 10000000000LL, &CountRun, &counters[i]);
+
+        if (nRound % 3 == 0)
+            loop.Cancel(&counters[(i + 5) % 8]);
+    }
+
+    // The descriptors that weren't cancelled last get their turn
+    auto GetRuns = [&]()
+    {
+        int nRuns = 0;
+
+        for (const Counter& counter : counters)
+            nRuns += counter.nRuns;
+
+        return nRuns;
+    };
+
+    CHECK(WaitFor([&]() { return GetRuns() > 0; }));
+
+    loop.Stop();
+    CHECK(GetRuns() <= 2000);
+
+    for (auto& fds : nFds)
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+int main()
+{
+    TestTasks();
+    TestWatch();
+    TestPollFunc();
+    TestCancelStorm();
+
+    if (s_nFailed == 0)
+        std::printf("frame_loop: all checks passed\n");
+
+    return s_nFailed;
+}
@@ -0,0 +1,302 @@
+// Checks the DCT-domain downscaling of MJPEG frames against a full decode followed by an area downscale,
+// on the small baseline JPEGs in tests/jpeg (4:2:0 and 4:2:2, even and odd sizes):
+//
+//     g++ -std=c++17 -O2 -Iinclude tests/mjpeg.cpp -o mjpeg -pthread -ljpeg
+//     ./mjpeg [corpus directory, tests/jpeg by default]
+//
+// The frames are decoded by wcc::FrameProcessor at 1/2, 1/4 and 1/8 of their size (4:2:2 ones at least at twice that), which
+// makes libjpeg skip part of the inverse DCT, and every channel must be within c_fMaxMeanError of the reference on average.
+// `./mjpeg --write-corpus tests/jpeg` writes the corpus again. Prints every failed check and returns the number of them
+
+#define WCCAPI_USE_LIBJPEG
+#define WCCAPI_IMPL
+#include "../include/wccapi.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static int s_nFailed = 0;
+
+#define CHECK(x) do { if (!(x)) { std::printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); s_nFailed++; } } while (0)
+
+
+struct CorpusFile
+{
+    const char* sName;
+    uint32_t nWidth, nHeight;
+
+    // Sampling factors of luma, chroma is 1x1: 2x2 is 4:2:0, 2x1 is 4:2:2
+    int nLumaH, nLumaV;
+};
+
+static const CorpusFile c_Corpus[] = {
+    { "420_320x240.jpg", 320, 240, 2, 2 },
+    { "422_320x240.jpg", 320, 240, 2, 1 },
+    { "420_333x197.jpg", 333, 197, 2, 2 },
+    { "422_161x91.jpg", 161, 91, 2, 1 }
+};
+
+// Largest mean difference per channel. 4:2:0 chroma gets the same DCT scaling as the blocks of luma it covers.
+// libjpeg keeps 4:2:2 chroma at half the width of luma instead, so those frames are decoded at twice the size
+// and every channel of both stays within a level
+static const double c_fMaxMeanError = 1.0;
+
+static std::vector<uint8_t> ReadFile(const std::string& sPath)
+{
+    std::vector<uint8_t> vecData;
+
+    if (FILE* pFile = fopen(sPath.c_str(), "rb"))
+    {
+        uint8_t buffer[4096];
+        size_t nRead;
+
+        while ((nRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+            vecData.insert(vecData.end(), buffer, buffer + nRead);
+
+        fclose(pFile);
+    }
+
+    return vecData;
+}
+
+// Smooth gradients with soft rings, there's detail in every block but not much above the Nyquist limit of 1/8
+static void RenderPicture(uint32_t nWidth, uint32_t nHeight, std::vector<uint8_t>& vecRgb)
+{
+    vecRgb.resize((size_t)nWidth * nHeight * 3);
+
+    for (uint32_t y = 0; y < nHeight; y++)
+    {
+        for (uint32_t x = 0; x < nWidth; x++)
+        {
+            double dx = x - nWidth * 0.4, dy = y - nHeight * 0.6;
+            double fRing = std::sin(std::sqrt(dx * dx + dy * dy) / 9.0);
+
+            uint8_t* p = vecRgb.data() + ((size_t)y * nWidth + x) * 3;
+            p[0] = (uint8_t)(x * 255 / (nWidth - 1));
+            p[1] = (uint8_t)(y * 255 / (nHeight - 1));
+            p[2] = (uint8_t)(128 + 100 * fRing);
+        }
+    }
+}
+
+static bool WriteCorpusFile(const std::string& sPath, const CorpusFile& file)
+{
+    std::vector<uint8_t> vecRgb;
+    RenderPicture(file.nWidth, file.nHeight, vecRgb);
+
+    FILE* pFile = fopen(sPath.c_str(), "wb");
+
+    if (!pFile)
+        return false;
+
+    jpeg_compress_struct info;
+    jpeg_error_mgr error;
+
+    info.err = jpeg_std_error(&error);
+    jpeg_create_compress(&info);
+    jpeg_stdio_dest(&info, pFile);
+
+    info.image_width = file.nWidth;
+    info.image_height = file.nHeight;
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+
+    // Baseline (not progressive, Huffman coded) like the frames of a webcam
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, 90, TRUE);
+
+    info.comp_info[0].h_samp_factor = file.nLumaH;
+    info.comp_info[0].v_samp_factor = file.nLumaV;
+
+    for (int i = 1; i < 3; i++)
+        info.comp_info[i].h_samp_factor = info.comp_info[i].v_samp_factor = 1;
+
+    jpeg_start_compress(&info, TRUE);
+
+    while (info.next_scanline < info.image_height)
+    {
+        JSAMPROW pRow = vecRgb.data() + (size_t)info.next_scanline * file.nWidth * 3;
+        jpeg_write_scanlines(&info, &pRow, 1);
+    }
+
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+    fclose(pFile);
+
+    return true;
+}
+
+// Decodes the whole frame, averages every nDenominator x nDenominator block of it and scales that down to the output
+// size with the area scaler, like wcc::FrameProcessor scales the frames libjpeg decoded at 1 / nDenominator.
+// libjpeg pads the partial blocks at the right and bottom edges by repeating the last pixel, so do the averages
+static std::vector<uint8_t> DecodeAndDownscale(const std::vector<uint8_t>& vecJpeg, uint32_t nDenominator, uint32_t nDstWidth, uint32_t nDstHeight)
+{
+    wcc::internal::JpegDecoder decoder;
+    uint32_t nWidth, nHeight;
+
+    if (!decoder.ReadHeader(vecJpeg.data(), vecJpeg.size(), nWidth, nHeight) || !decoder.Decode(1, wcc::VideoFormat::Rgb32))
+        return {};
+
+    wcc::FrameView view = decoder.GetView();
+
+    uint32_t nBlockWidth = (nWidth + nDenominator - 1) / nDenominator;
+    uint32_t nBlockHeight = (nHeight + nDenominator - 1) / nDenominator;
+    size_t nBlockRow = (size_t)nBlockWidth * 4;
+    std::vector<uint8_t> vecBlocks(nBlockRow * nBlockHeight);
+
+    for (uint32_t y = 0; y < nBlockHeight; y++)
+    {
+        for (uint32_t x = 0; x < nBlockWidth; x++)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                uint32_t nTotal = 0;
+
+                for (uint32_t i = 0; i < nDenominator * nDenominator; i++)
+                {
+                    uint32_t nX = std::min(x * nDenominator + i % nDenominator, nWidth - 1);
+                    uint32_t nY = std::min(y * nDenominator + i / nDenominator, nHeight - 1);
+
+                    nTotal += view.pPlanes[0][(size_t)nY * view.nStrides[0] + nX * 4 + c];
+                }
+
+                vecBlocks[y * nBlockRow + x * 4 + c] = (uint8_t)((nTotal + nDenominator * nDenominator / 2) / (nDenominator * nDenominator));
+            }
+        }
+    }
+
+    if (nBlockWidth == nDstWidth && nBlockHeight == nDstHeight)
+        return vecBlocks;
+
+    wcc::Scaler scaler;
+    scaler.Configure(nBlockWidth, nBlockHeight, nDstWidth, nDstHeight, wcc::ScaleMode::Area, 4, wcc::Isa::Scalar);
+
+    size_t nDstRow = (size_t)nDstWidth * 4;
+    std::vector<uint8_t> vecDst(nDstRow * nDstHeight);
+    std::vector<uint8_t> vecRows(nDstRow * scaler.GetMaxRowCount());
+    std::vector<const uint8_t*> vecRowPtrs(std::max(scaler.GetMaxRowCount(), 4u));
+
+    for (uint32_t y = 0; y < nDstHeight; y++)
+    {
+        uint8_t* pDst = vecDst.data() + y * nDstRow;
+
+        if (uint32_t nFactor = scaler.GetIntegerFactor())
+        {
+            for (uint32_t i = 0; i < nFactor; i++)
+                vecRowPtrs[i] = vecBlocks.data() + (scaler.GetFirstRow(y) + i) * nBlockRow;
+
+            scaler.BoxRows(vecRowPtrs.data(), pDst);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < scaler.GetRowCount(y); i++)
+        {
+            uint8_t* pRow = vecRows.data() + i * nDstRow;
+            scaler.ScaleRow(vecBlocks.data() + (scaler.GetFirstRow(y) + i) * nBlockRow, pRow);
+            vecRowPtrs[i] = pRow;
+        }
+
+        scaler.BlendRows(y, vecRowPtrs.data(), pDst);
+    }
+
+    return vecDst;
+}
+
+static void TestFile(const std::string& sDirectory, const CorpusFile& file)
+{
+    std::vector<uint8_t> vecJpeg = ReadFile(sDirectory + "/" + file.sName);
+
+    if (vecJpeg.empty())
+    {
+        std::printf("%s: can't read it\n", file.sName);
+        s_nFailed++;
+        return;
+    }
+
+    for (uint32_t nDenominator : { 2u, 4u, 8u })
+    {
+        // libjpeg rounds the scaled size up
+        uint32_t nOutputWidth = (file.nWidth + nDenominator - 1) / nDenominator;
+        uint32_t nOutputHeight = (file.nHeight + nDenominator - 1) / nDenominator;
+
+        wcc::FrameProcessor processor;
+        processor.SetScaleMode(wcc::ScaleMode::Area);
+        CHECK(processor.Configure(wcc::VideoFormat::Mjpeg, file.nWidth, file.nHeight, nOutputWidth, nOutputHeight));
+
+        wcc::FrameView src = wcc::MakeFrameView(wcc::VideoFormat::Mjpeg, file.nWidth, file.nHeight, vecJpeg.data(), 0);
+        src.nDataSize = vecJpeg.size();
+
+        std::vector<uint8_t> vecOutput(processor.GetOutputSize(), 0);
+        processor.Process(src, vecOutput.data());
+
+        // 4:2:2 chroma needs a whole column for every output column, those frames are decoded at twice the size or more
+        uint32_t nDecoded = nDenominator;
+
+        if (file.nLumaV == 1)
+        {
+            while (nDecoded > 1 && file.nWidth / (nDecoded * 2) < nOutputWidth)
+                nDecoded /= 2;
+        }
+
+        std::vector<uint8_t> vecExpected = DecodeAndDownscale(vecJpeg, nDecoded, nOutputWidth, nOutputHeight);
+
+        if (vecExpected.size() != vecOutput.size() || vecOutput.size() != (size_t)nOutputWidth * nOutputHeight * 4)
+        {
+            std::printf("%s 1/%u: decoding failed\n", file.sName, nDenominator);
+            s_nFailed++;
+            continue;
+        }
+
+        // Alpha is always 255 on both sides
+        double fMean[3];
+        int nMax[3] = { 0, 0, 0 };
+        bool bPassed = true;
+
+        for (int c = 0; c < 3; c++)
+        {
+            uint64_t nTotal = 0;
+
+            for (size_t i = c; i < vecOutput.size(); i += 4)
+            {
+                {
+                    int nError = std::abs((int)vecOutput[i] - (int)vecExpected[i]);
+
+                    nTotal += nError;
+                    nMax[c] = std::max(nMax[c], nError);
+                }
+            }
+
+            fMean[c] = (double)nTotal / ((double)nOutputWidth * nOutputHeight);
+            bPassed &= fMean[c] <= c_fMaxMeanError;
+        }
+
+        std::printf("%-16s 1/%u %3ux%-3u mean error %.2f %.2f %.2f, max %d %d %d%s\n", file.sName, nDenominator, nOutputWidth, nOutputHeight,
+            fMean[0], fMean[1], fMean[2], nMax[0], nMax[1], nMax[2], bPassed ? "" : "  FAILED");
+
+        s_nFailed += !bPassed;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2 && std::string(argv[1]) == "--write-corpus")
+    {
+        for (const CorpusFile& file : c_Corpus)
+            CHECK(WriteCorpusFile(std::string(argv[2]) + "/" + file.sName, file));
+
+        return s_nFailed;
+    }
+
+    std::string sDirectory = (argc > 1) ? argv[1] : "tests/jpeg";
+
+    for (const CorpusFile& file : c_Corpus)
+        TestFile(sDirectory, file);
+
+    if (s_nFailed == 0)
+        std::printf("mjpeg: all checks passed\n");
+
+    return s_nFailed;
+}
@@ -0,0 +1,145 @@
+// Checks that the SIMD kernels of wcc::Scaler (bilinear and area rows, averaged rows and 2x/4x boxes)
+// give exactly the same output as the scalar ones, for every instruction set the CPU has:
+//
+//     g++ -std=c++17 -O2 -Iinclude tests/scaler.cpp -o scaler -pthread
+//     ./scaler
+//
+// Prints every failed check and returns the number of them
+
+#define WCCAPI_IMPL
+#include "../include/wccapi.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static int s_nFailed = 0;
+
+#define CHECK(x) do { if (!(x)) { std::printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); s_nFailed++; } } while (0)
+
+struct Case
+{
+    uint32_t nSrcWidth, nSrcHeight;
+    uint32_t nDstWidth, nDstHeight;
+};
+
+static const Case c_Cases[] = {
+    { 640, 480, 320, 240 }, // 2x boxes
+    { 640, 480, 160, 120 }, // 4x boxes
+    { 1280, 720, 333, 187 },
+    { 1920, 1080, 640, 360 },
+    { 67, 45, 31, 17 }, // Tails of every kernel
+    { 33, 9, 7, 3 },
+    { 100, 60, 250, 130 }, // Upscaling
+    { 3, 2, 17, 5 },
+    { 1800, 600, 6, 2 }, // 300 pixels per output pixel, more than the 16-bit sums can hold
+    { 20, 900, 10, 3 }
+};
+
+static const char* GetIsaName(wcc::Isa nIsa)
+{
+    switch (nIsa)
+    {
+    case wcc::Isa::Scalar: return "scalar";
+    case wcc::Isa::Sse2: return "sse2";
+    case wcc::Isa::Avx2: return "avx2";
+    case wcc::Isa::Neon: return "neon";
+    default: return "?";
+    }
+}
+
+static bool IsIsaSupported(wcc::Isa nIsa)
+{
+    wcc::Isa nBest = wcc::GetBestIsa();
+    return nIsa == nBest || (nIsa == wcc::Isa::Sse2 && nBest == wcc::Isa::Avx2);
+}
+
+// Runs both passes of the scaler over a whole frame like FrameProcessor does
+static std::vector<uint8_t> Scale(const wcc::Scaler& scaler, const Case& c, uint32_t nChannels, const std::vector<uint8_t>& vecSrc)
+{
+    size_t nSrcRow = (size_t)c.nSrcWidth * nChannels;
+    size_t nDstRow = (size_t)c.nDstWidth * nChannels;
+
+    std::vector<uint8_t> vecDst(nDstRow * c.nDstHeight);
+    std::vector<uint8_t> vecRows(nDstRow * scaler.GetMaxRowCount());
+    std::vector<const uint8_t*> vecRowPtrs(std::max(scaler.GetMaxRowCount(), 4u));
+
+    for (uint32_t y = 0; y < c.nDstHeight; y++)
+    {
+        uint8_t* pDst = vecDst.data() + y * nDstRow;
+
+        if (uint32_t nFactor = scaler.GetIntegerFactor())
+        {
+            for (uint32_t i = 0; i < nFactor; i++)
+                vecRowPtrs[i] = vecSrc.data() + (scaler.GetFirstRow(y) + i) * nSrcRow;
+
+            scaler.BoxRows(vecRowPtrs.data(), pDst);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < scaler.GetRowCount(y); i++)
+        {
+            uint8_t* pRow = vecRows.data() + i * nDstRow;
+            scaler.ScaleRow(vecSrc.data() + (scaler.GetFirstRow(y) + i) * nSrcRow, pRow);
+            vecRowPtrs[i] = pRow;
+        }
+
+        scaler.BlendRows(y, vecRowPtrs.data(), pDst);
+    }
+
+    return vecDst;
+}
+
+int main()
+{
+    std::mt19937 random(1234);
+    int nCompared = 0;
+
+    for (const Case& c : c_Cases)
+    {
+        for (uint32_t nChannels : { 4u, 1u })
+        {
+            std::vector<uint8_t> vecSrc((size_t)c.nSrcWidth * c.nSrcHeight * nChannels);
+
+            for (uint8_t& nByte : vecSrc)
+                nByte = (uint8_t)random();
+
+            // Extremes catch overflows of the 16-bit math
+            for (size_t i = 0; i < vecSrc.size() / 2; i++)
+                vecSrc[i] = 255;
+
+            for (wcc::ScaleMode nMode : { wcc::ScaleMode::Bilinear, wcc::ScaleMode::Area })
+            {
+                wcc::Scaler reference;
+                CHECK(reference.Configure(c.nSrcWidth, c.nSrcHeight, c.nDstWidth, c.nDstHeight, nMode, nChannels, wcc::Isa::Scalar));
+
+                std::vector<uint8_t> vecExpected = Scale(reference, c, nChannels, vecSrc);
+
+                for (wcc::Isa nIsa : { wcc::Isa::Sse2, wcc::Isa::Avx2, wcc::Isa::Neon })
+                {
+                    if (!IsIsaSupported(nIsa))
+                        continue;
+
+                    wcc::Scaler scaler;
+                    CHECK(scaler.Configure(c.nSrcWidth, c.nSrcHeight, c.nDstWidth, c.nDstHeight, nMode, nChannels, nIsa));
+
+                    if (Scale(scaler, c, nChannels, vecSrc) != vecExpected)
+                    {
+                        std::printf("%s differs from scalar: %ux%u -> %ux%u, %u channels, %s\n", GetIsaName(nIsa),
+                            c.nSrcWidth, c.nSrcHeight, c.nDstWidth, c.nDstHeight, nChannels, nMode == wcc::ScaleMode::Area ? "area" : "bilinear");
+                        s_nFailed++;
+                    }
+
+                    nCompared++;
+                }
+            }
+        }
+    }
+
+    if (s_nFailed == 0)
+        std::printf("scaler: all checks passed (%d comparisons, best isa %s)\n", nCompared, GetIsaName(wcc::GetBestIsa()));
+
+    return s_nFailed;
+}